@@ -0,0 +1,369 @@
+/*
+ * ardb - apply records with the stored procedure over several MySQL connections at
+ *        once, using the non-blocking calls of the MariaDB client library.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+/*
+ * Only the stored procedure can be used like this. The prepared statements look up a
+ * lease, decide what to do with it and then write, so every record needs the answer to
+ * one round trip before the next can be sent; a call to the procedure does all of that
+ * on the server. The records are split between the connections by a hash of the
+ * address, as the workers do with -w, and each connection is sent its share as
+ * multi-statement queries of up to RDB_MAXINSERT bytes, one after the other. With
+ * epoll, one thread waits for all of them, so the round trips overlap instead of
+ * adding up.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <mysql/mysql.h>
+
+#include "rdb.h"
+#include "ardb.h"
+
+#ifdef HAVE_MYSQL_NONBLOCKING
+
+#include <time.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+/* Where a connection is in sending a query and reading its results */
+#define AC_IDLE 0
+#define AC_QUERY 1		/* waiting for mysql_real_query() */
+#define AC_STORE 2		/* reading a result set, if the statement had one */
+#define AC_NEXT 3		/* waiting for the next statement's result */
+
+struct aconn {
+  rdb_conn rdb;
+  int state;
+  int wait;			/* what it waits for, as MYSQL_WAIT_* */
+  long long deadline;		/* with MYSQL_WAIT_TIMEOUT, when it gives up */
+  const char *q;		/* the query being sent */
+  size_t qlen;
+  int *idx;			/* the records it has, as indexes */
+  int nidx;
+  int next;			/* the first of them not sent yet */
+  int failed;
+  int broken;			/* a query failed, so it is pinged before it is used again */
+};
+
+struct ardb_s {
+  int nconns;
+  struct aconn *c;
+  int epfd;
+  int *idx;			/* room for the indexes of all the records */
+  int maxidx;
+};
+
+static long long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+ardb ardb_new(const char *host, const char *user, const char *password, const char *database,
+	      int schema, int nconns) {
+  ardb a;
+  int i;
+
+  if ((a = (ardb)calloc(1, sizeof(struct ardb_s))) == NULL ||
+      (a->c = (struct aconn *)calloc(nconns, sizeof(struct aconn))) == NULL) {
+    syslog(LOG_ERR, "Out of memory");
+    free(a);
+    return NULL;
+  }
+  a->nconns = nconns;
+  if ((a->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    syslog(LOG_ERR, "epoll_create1(): %s", strerror(errno));
+    free(a->c);
+    free(a);
+    return NULL;
+  }
+  for (i = 0; i < nconns; i++) {
+    if ((a->c[i].rdb = rdb_connect(host, user, password, database, schema, RDB_PROCEDURES | RDB_NONBLOCK)) == NULL) {
+      ardb_free(a);
+      return NULL;
+    }
+  }
+  return a;
+}
+
+void ardb_free(ardb a) {
+  int i;
+  if (a) {
+    for (i = 0; i < a->nconns; i++) rdb_close(a->c[i].rdb);
+    close(a->epfd);
+    free(a->idx);
+    free(a->c);
+    free(a);
+  }
+}
+
+/* Which connection writes the records for an address, going by the address as it is
+   written, since the procedure looks up its own ids */
+static int conn_of(ardb a, ldb_entry rec) {
+  const unsigned char *p;
+  unsigned int h = 2166136261u;
+
+  for (p = rec->ip; p && *p; p++) h = (h ^ *p) * 16777619u;
+  return h % a->nconns;
+}
+
+/* Put as many of the connection's records as fit into its next query. Returns the
+   length of the query, which is 0 if every record that was left has been skipped, as
+   rdb_put_call() does with what the compact schema can't hold. */
+static size_t fill(struct aconn *c, ldb_entry recs) {
+  rdb_conn r = c->rdb;
+  size_t len = 0;
+
+  r->calllen = 0;
+  while (c->next < c->nidx && len < RDB_MAXINSERT) {
+    ldb_entry rec = &(recs[c->idx[c->next++]]);
+    len = rdb_put_call(r, rec->rtype, rec->start, rec->end, rec->ip, rec->hw, rec->cid, rec->rid);
+  }
+  c->q = r->calls;
+  c->qlen = r->calllen;
+  r->calllen = 0;
+  return c->qlen;
+}
+
+static void failed(struct aconn *c, const char *what) {
+  syslog(LOG_ERR, "%s: %s", what, mysql_error(&(c->rdb->db)));
+  c->failed = 1;
+  c->broken = 1;
+}
+
+/* Take a connection as far as it gets without waiting. 'ready' is what it was waiting
+   for that has happened, or 0 to start on its next query. It ends up waiting, with
+   'wait' set, or idle. */
+static void advance(struct aconn *c, ldb_entry recs, int ready) {
+  MYSQL *db = &(c->rdb->db);
+  MYSQL_RES *res;
+  int ret;
+
+  while (1) {
+    switch (c->state) {
+    case AC_QUERY:
+      if (ready) c->wait = mysql_real_query_cont(&ret, db, ready);
+      else c->wait = mysql_real_query_start(&ret, db, c->q, c->qlen);
+      if (c->wait) return;
+      if (ret != 0) {
+	failed(c, "mysql_real_query()");
+	c->state = AC_IDLE;
+	return;
+      }
+      c->state = AC_STORE;
+      ready = 0;
+      break;
+
+    case AC_STORE:
+      if (!ready && mysql_field_count(db) == 0) {
+	c->state = AC_NEXT;
+	break;
+      }
+      if (ready) c->wait = mysql_store_result_cont(&res, db, ready);
+      else c->wait = mysql_store_result_start(&res, db);
+      if (c->wait) return;
+      if (res) mysql_free_result(res);
+      c->state = AC_NEXT;
+      ready = 0;
+      break;
+
+    case AC_NEXT:
+      /* The first statement that failed stops the rest */
+      if (ready) c->wait = mysql_next_result_cont(&ret, db, ready);
+      else c->wait = mysql_next_result_start(&ret, db);
+      if (c->wait) return;
+      ready = 0;
+      if (ret > 0) {
+	failed(c, "mysql_next_result()");
+	c->state = AC_IDLE;
+	return;
+      }
+      if (ret == 0) {
+	c->state = AC_STORE;
+	break;
+      }
+      /* That query is done. An empty one is never sent. */
+      if (c->next < c->nidx && fill(c, recs) > 0) {
+	c->state = AC_QUERY;
+	break;
+      }
+      c->state = AC_IDLE;
+      return;
+
+    default:
+      return;
+    }
+  }
+}
+
+/* Wait for a connection the way it asks to. If we can't, it is given up on, and has to
+   reconnect before it is used again. */
+static void watch(ardb a, struct aconn *c) {
+  struct epoll_event ev;
+  int fd = mysql_get_socket(&(c->rdb->db));
+
+  memset(&ev, 0, sizeof(ev));
+  if (c->wait & MYSQL_WAIT_READ) ev.events |= EPOLLIN;
+  if (c->wait & MYSQL_WAIT_WRITE) ev.events |= EPOLLOUT;
+  if (c->wait & MYSQL_WAIT_EXCEPT) ev.events |= EPOLLPRI;
+  ev.data.ptr = c;
+  if (epoll_ctl(a->epfd, EPOLL_CTL_MOD, fd, &ev) != 0 &&
+      (errno != ENOENT || epoll_ctl(a->epfd, EPOLL_CTL_ADD, fd, &ev) != 0)) {
+    syslog(LOG_ERR, "epoll_ctl(): %s", strerror(errno));
+    c->failed = 1;
+    c->broken = 1;
+    c->state = AC_IDLE;
+    return;
+  }
+  if (c->wait & MYSQL_WAIT_TIMEOUT) c->deadline = now_ms() + mysql_get_timeout_value_ms(&(c->rdb->db));
+}
+
+/* Start every connection that has a query, and drive them all until they are idle */
+static void run(ardb a, ldb_entry recs) {
+  struct epoll_event ev[ARDB_MAXCONNS];
+  struct aconn *c;
+  int i, n, busy, timeout;
+  long long now;
+
+  for (i = 0; i < a->nconns; i++) {
+    c = &(a->c[i]);
+    if (c->state != AC_QUERY) continue;
+    advance(c, recs, 0);
+    if (c->state != AC_IDLE) watch(a, c);
+  }
+
+  while (1) {
+    busy = 0;
+    timeout = -1;
+    now = now_ms();
+    for (i = 0; i < a->nconns; i++) {
+      c = &(a->c[i]);
+      if (c->state == AC_IDLE) continue;
+      busy++;
+      if ((c->wait & MYSQL_WAIT_TIMEOUT) && (timeout < 0 || c->deadline - now < timeout)) {
+	timeout = (c->deadline > now) ? (int)(c->deadline - now) : 0;
+      }
+    }
+    if (busy == 0) break;
+
+    if ((n = epoll_wait(a->epfd, ev, ARDB_MAXCONNS, timeout)) < 0) {
+      if (errno == EINTR) continue;
+      syslog(LOG_ERR, "epoll_wait(): %s", strerror(errno));
+      n = 0;
+    }
+    for (i = 0; i < n; i++) {
+      int ready = 0;
+      c = (struct aconn *)ev[i].data.ptr;
+      if (c->state == AC_IDLE) continue;
+      if (ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ready |= MYSQL_WAIT_READ;
+      if (ev[i].events & EPOLLOUT) ready |= MYSQL_WAIT_WRITE;
+      if (ev[i].events & EPOLLPRI) ready |= MYSQL_WAIT_EXCEPT;
+      advance(c, recs, ready);
+      if (c->state != AC_IDLE) watch(a, c);
+    }
+
+    /* Anything that has waited too long is told so, and gives up */
+    now = now_ms();
+    for (i = 0; i < a->nconns; i++) {
+      c = &(a->c[i]);
+      if (c->state == AC_IDLE || !(c->wait & MYSQL_WAIT_TIMEOUT) || c->deadline > now) continue;
+      advance(c, recs, MYSQL_WAIT_TIMEOUT);
+      if (c->state != AC_IDLE) watch(a, c);
+    }
+  }
+
+  /* A connection's socket can change when it reconnects, so none are kept */
+  for (i = 0; i < a->nconns; i++) {
+    epoll_ctl(a->epfd, EPOLL_CTL_DEL, mysql_get_socket(&(a->c[i].rdb->db)), NULL);
+  }
+}
+
+int ardb_apply(ardb a, ldb_entry recs, int n) {
+  int fill_at[ARDB_MAXCONNS];
+  struct aconn *c;
+  int i, r=0;
+
+  if (n > a->maxidx) {
+    int *p;
+    if ((p = (int *)realloc(a->idx, n * sizeof(int))) == NULL) {
+      syslog(LOG_ERR, "Out of memory");
+      return -1;
+    }
+    a->idx = p;
+    a->maxidx = n;
+  }
+
+  /* Split the records, keeping them in order for each connection */
+  for (i = 0; i < a->nconns; i++) a->c[i].nidx = 0;
+  for (i = 0; i < n; i++) a->c[conn_of(a, &(recs[i]))].nidx++;
+  for (i = 0; i < a->nconns; i++) {
+    c = &(a->c[i]);
+    fill_at[i] = (i == 0) ? 0 : fill_at[i - 1] + a->c[i - 1].nidx;
+    c->idx = a->idx + fill_at[i];
+    c->next = 0;
+    c->failed = 0;
+    c->state = AC_IDLE;
+  }
+  for (i = 0; i < n; i++) {
+    int k = conn_of(a, &(recs[i]));
+    a->idx[fill_at[k]++] = i;
+  }
+
+  for (i = 0; i < a->nconns; i++) {
+    c = &(a->c[i]);
+    if (c->nidx == 0) continue;
+    /* Let a connection that failed last time reconnect first */
+    if (c->broken) {
+      if (mysql_ping(&(c->rdb->db)) != 0) {
+	failed(c, "mysql_ping()");
+	continue;
+      }
+      c->broken = 0;
+    }
+    if (fill(c, recs) > 0) c->state = AC_QUERY;
+  }
+  run(a, recs);
+  for (i = 0; i < a->nconns; i++) {
+    if (a->c[i].failed) r = -1;
+  }
+  return r;
+}
+
+#else
+
+ardb ardb_new(const char *host, const char *user, const char *password, const char *database,
+	      int schema, int nconns) {
+  syslog(LOG_ERR, "Built without the non-blocking MySQL client calls");
+  return NULL;
+}
+
+void ardb_free(ardb a) {
+}
+
+int ardb_apply(ardb a, ldb_entry recs, int n) {
+  return -1;
+}
+
+#endif
@@ -0,0 +1,45 @@
+/*
+ * ardb - apply records with the stored procedure over several MySQL connections at
+ *        once, using the non-blocking calls of the MariaDB client library.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#ifndef ARDB_H
+#define ARDB_H
+
+#include "ldb.h"
+
+/* Most connections one ardb can have */
+#define ARDB_MAXCONNS 32
+
+typedef struct ardb_s *ardb;
+
+/* Connect 'nconns' times to the MySQL server, for the stored procedure. Returns NULL,
+   and logs why, on failure, or if gluff was built without the non-blocking calls. */
+ardb ardb_new(const char *host, const char *user, const char *password, const char *database,
+	      int schema, int nconns);
+void ardb_free(ardb a);
+
+/* Apply the first n records. The records for an address all go over the same
+   connection, in the order they are in, and the connections are kept busy at the same
+   time from one thread. Each call is committed as it goes; there is no batch mode, since
+   the connections can't all be committed at once, and a batch that was only committed
+   on some of them can't be applied again without making some leases twice. Returns 0,
+   or -1 if a call failed. */
+int ardb_apply(ardb a, ldb_entry recs, int n);
+
+#endif
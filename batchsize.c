@@ -0,0 +1,153 @@
+/*
+ * batchsize - sizes the claims on the queue from how long records take to write and
+ *             how far behind we are.
+
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+/*
+ * The time a batch takes is some fixed cost (a claim, a commit, a delete) plus a cost
+ * per record. We keep a moving average of the time per record, fixed cost included,
+ * and claim as many records as that says fit in the target time. A batch that is too
+ * small for the fixed cost to be shared out makes the time per record look long, and
+ * the next batch is made a bit smaller, so this settles where the batch takes just the
+ * target time. The size changes by at most a factor of two per batch, so that one
+ * batch that got stuck behind something else in MySQL doesn't throw it off.
+ */
+
+#include <stdlib.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include "batchsize.h"
+#include "metrics.h"
+
+/* How much of the moving average the latest batch makes up */
+#define WEIGHT 0.25
+
+struct batchsize_s {
+  pthread_mutex_t lock;
+  int size;
+  long long target_us;
+  int parallel;
+  long long catchup;
+  int catching_up;
+  double record_us;		/* 0 until we have seen a batch */
+};
+
+static int clamp(double n) {
+  if (n < BATCHSIZE_MIN) return BATCHSIZE_MIN;
+  if (n > BATCHSIZE_MAX) return BATCHSIZE_MAX;
+  return (int)n;
+}
+
+/* Work out the size again. Called with the lock held. */
+static void resize(batchsize s) {
+  double target = (double)s->target_us * s->parallel;
+  int size;
+
+  if (s->record_us <= 0) return;
+  if (s->catching_up) target *= BATCHSIZE_CATCHUP_FACTOR;
+  size = clamp(target / s->record_us);
+  if (size > s->size * 2) size = clamp(s->size * 2);
+  if (size < s->size / 2) size = clamp(s->size / 2);
+  s->size = size;
+  metrics_batchsize(s->size, s->catching_up);
+}
+
+batchsize batchsize_new(int initial, int target_ms, int parallel, long long catchup) {
+  batchsize s;
+
+  if ((s = (batchsize)calloc(1, sizeof(struct batchsize_s))) == NULL) return NULL;
+  pthread_mutex_init(&(s->lock), NULL);
+  s->size = clamp(initial);
+  s->target_us = (long long)target_ms * 1000;
+  s->parallel = (parallel > 0) ? parallel : 1;
+  s->catchup = catchup;
+  metrics_batchsize(s->size, 0);
+  return s;
+}
+
+void batchsize_free(batchsize s) {
+  pthread_mutex_destroy(&(s->lock));
+  free(s);
+}
+
+int batchsize_get(batchsize s) {
+  int size;
+  pthread_mutex_lock(&(s->lock));
+  size = s->size;
+  pthread_mutex_unlock(&(s->lock));
+  return size;
+}
+
+void batchsize_observe(batchsize s, int records, long long us) {
+  double record_us;
+
+  if (records <= 0) return;
+  record_us = (double)us / records;
+  pthread_mutex_lock(&(s->lock));
+  if (s->record_us <= 0) s->record_us = record_us;
+  else s->record_us += WEIGHT * (record_us - s->record_us);
+  resize(s);
+  pthread_mutex_unlock(&(s->lock));
+}
+
+/* Start or stop catching up. Called with the lock held. */
+static void catch_up(batchsize s, int on, long long backlog) {
+  if (on == s->catching_up) return;
+  s->catching_up = on;
+  if (on) {
+    syslog(LOG_INFO, "%lld records waiting, catching up", backlog);
+    /* Straight to the bigger batches, but no further than resize() would go */
+    s->size = clamp(s->size * 2);
+  } else {
+    syslog(LOG_INFO, "Caught up");
+  }
+  resize(s);
+  metrics_batchsize(s->size, s->catching_up);
+}
+
+void batchsize_backlog(batchsize s, long long backlog) {
+  if (s->catchup <= 0 || backlog < 0) return;
+  pthread_mutex_lock(&(s->lock));
+  if (!s->catching_up && backlog > s->catchup) catch_up(s, 1, backlog);
+  else if (s->catching_up && backlog < s->catchup / 2) catch_up(s, 0, backlog);
+  pthread_mutex_unlock(&(s->lock));
+}
+
+void batchsize_caught_up(batchsize s) {
+  pthread_mutex_lock(&(s->lock));
+  catch_up(s, 0, 0);
+  pthread_mutex_unlock(&(s->lock));
+}
+
+int batchsize_catching_up(batchsize s) {
+  int r;
+  pthread_mutex_lock(&(s->lock));
+  r = s->catching_up;
+  pthread_mutex_unlock(&(s->lock));
+  return r;
+}
+
+double batchsize_record_us(batchsize s) {
+  double r;
+  pthread_mutex_lock(&(s->lock));
+  r = s->record_us;
+  pthread_mutex_unlock(&(s->lock));
+  return r;
+}
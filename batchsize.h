@@ -0,0 +1,61 @@
+/*
+ * batchsize - sizes the claims on the queue from how long records take to write and
+ *             how far behind we are.
+
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#ifndef BATCHSIZE_H
+#define BATCHSIZE_H
+
+/* Never smaller or larger claims than this */
+#define BATCHSIZE_MIN 10
+#define BATCHSIZE_MAX 200000
+
+/* How much longer a batch may take while catching up */
+#define BATCHSIZE_CATCHUP_FACTOR 4
+
+typedef struct batchsize_s *batchsize;
+
+/* Start sizing claims at 'initial' records, aiming for batches that take at most
+   target_ms milliseconds to write. With more than one connection writing in parallel,
+   a batch takes about as long as its share on one of them. While the backlog is over
+   'catchup' records (never, if it is 0), batches may take BATCHSIZE_CATCHUP_FACTOR
+   times longer. Returns NULL on failure. */
+batchsize batchsize_new(int initial, int target_ms, int parallel, long long catchup);
+void batchsize_free(batchsize s);
+
+/* The number of records to claim next */
+int batchsize_get(batchsize s);
+
+/* Learn from 'records' records having taken 'us' microseconds to read and write, on
+   one connection */
+void batchsize_observe(batchsize s, int records, long long us);
+
+/* The backlog, as last counted. Catching up starts when it is over the threshold, and
+   stops when it is under half of it. */
+void batchsize_backlog(batchsize s, long long backlog);
+
+/* A round of claims came back less than full, so there is nothing to catch up with */
+void batchsize_caught_up(batchsize s);
+
+int batchsize_catching_up(batchsize s);
+
+/* The estimated time to write one record, in microseconds */
+double batchsize_record_us(batchsize s);
+
+#endif
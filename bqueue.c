@@ -0,0 +1,135 @@
+/*
+ * bqueue - bounded single-producer, single-consumer queue of pointers, for handing
+ *          batches from one thread to another.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+/*
+ * The ring itself is lock-free: the producer only ever moves 'tail' and the consumer
+ * only ever moves 'head'. The mutex and condition variable are only used to sleep
+ * when the queue is full or empty. A thread that is about to sleep bumps 'sleepers'
+ * before looking at the ring one last time, and the other side only signals when
+ * it sees sleepers, so wakeups can not get lost and the fast path never locks.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "bqueue.h"
+
+struct bqueue_s {
+  void **slots;
+  unsigned int size;		/* always a power of two */
+  unsigned int head;		/* next slot to pop, moved by the consumer */
+  unsigned int tail;		/* next slot to push, moved by the producer */
+  int sleepers;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+bqueue bqueue_new(unsigned int size) {
+  bqueue q;
+  pthread_condattr_t attr;
+  unsigned int n=1;
+
+  while (n < size) n <<= 1;
+  if ((q = (bqueue)calloc(1, sizeof(struct bqueue_s))) == NULL) return NULL;
+  if ((q->slots = (void **)calloc(n, sizeof(void *))) == NULL) {
+    free(q);
+    return NULL;
+  }
+  q->size = n;
+  pthread_mutex_init(&(q->lock), NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&(q->cond), &attr);
+  pthread_condattr_destroy(&attr);
+  return q;
+}
+
+void bqueue_free(bqueue q) {
+  if (q) {
+    pthread_cond_destroy(&(q->cond));
+    pthread_mutex_destroy(&(q->lock));
+    free(q->slots);
+    free(q);
+  }
+}
+
+/* Wake up the other side, if it is asleep */
+static void bq_wakeup(bqueue q) {
+  if (__atomic_load_n(&(q->sleepers), __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&(q->lock));
+    pthread_cond_broadcast(&(q->cond));
+    pthread_mutex_unlock(&(q->lock));
+  }
+}
+
+void bqueue_push(bqueue q, void *item) {
+  unsigned int tail = __atomic_load_n(&(q->tail), __ATOMIC_RELAXED);
+
+  if (tail - __atomic_load_n(&(q->head), __ATOMIC_ACQUIRE) == q->size) {
+    pthread_mutex_lock(&(q->lock));
+    __atomic_add_fetch(&(q->sleepers), 1, __ATOMIC_SEQ_CST);
+    while (tail - __atomic_load_n(&(q->head), __ATOMIC_SEQ_CST) == q->size) {
+      pthread_cond_wait(&(q->cond), &(q->lock));
+    }
+    __atomic_sub_fetch(&(q->sleepers), 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&(q->lock));
+  }
+
+  q->slots[tail & (q->size - 1)] = item;
+  __atomic_store_n(&(q->tail), tail + 1, __ATOMIC_SEQ_CST);
+  bq_wakeup(q);
+}
+
+void *bqueue_pop(bqueue q, int timeout_ms) {
+  unsigned int head = __atomic_load_n(&(q->head), __ATOMIC_RELAXED);
+  void *item;
+
+  if (__atomic_load_n(&(q->tail), __ATOMIC_ACQUIRE) == head) {
+    struct timespec ts;
+    int r=0;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&(q->lock));
+    __atomic_add_fetch(&(q->sleepers), 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&(q->tail), __ATOMIC_SEQ_CST) == head && r == 0) {
+      r = pthread_cond_timedwait(&(q->cond), &(q->lock), &ts);
+    }
+    __atomic_sub_fetch(&(q->sleepers), 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&(q->lock));
+    if (__atomic_load_n(&(q->tail), __ATOMIC_ACQUIRE) == head) return NULL;
+  }
+
+  item = q->slots[head & (q->size - 1)];
+  __atomic_store_n(&(q->head), head + 1, __ATOMIC_SEQ_CST);
+  bq_wakeup(q);
+  return item;
+}
+
+unsigned int bqueue_depth(bqueue q) {
+  return __atomic_load_n(&(q->tail), __ATOMIC_ACQUIRE) - __atomic_load_n(&(q->head), __ATOMIC_ACQUIRE);
+}
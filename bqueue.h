@@ -0,0 +1,41 @@
+/*
+ * bqueue - bounded single-producer, single-consumer queue of pointers, for handing
+ *          batches from one thread to another.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#ifndef BQUEUE_H
+#define BQUEUE_H
+
+typedef struct bqueue_s *bqueue;
+
+/* Create a queue with room for 'size' items, rounded up to a power of two.
+   Returns NULL on failure. */
+bqueue bqueue_new(unsigned int size);
+void bqueue_free(bqueue q);
+
+/* Add an item, waiting for room if the queue is full */
+void bqueue_push(bqueue q, void *item);
+
+/* Take the oldest item, waiting at most timeout_ms milliseconds for one to arrive.
+   Returns NULL on timeout. */
+void *bqueue_pop(bqueue q, int timeout_ms);
+
+/* The number of items in the queue right now */
+unsigned int bqueue_depth(bqueue q);
+
+#endif
@@ -0,0 +1,301 @@
+/*
+ * compaction - merge lease rows for the same address that overlap or follow on from
+ *              each other, with the same hw, cid and rid, into one.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+/*
+ * The rows for an address are taken in the order FIND_LEASE_RSQL would see them, by
+ * (lstart, lend, id). A row with the same hw, cid and rid as the one before it, that
+ * starts before or just as that one ends, is merged into it: the row of a run with the
+ * highest id gets the earliest start and the latest end of them all, and the others are
+ * deleted. Keeping the newest row means that gluffwho, which reads the rows from an id
+ * on, sees what has been merged as long as it may still change.
+ *
+ * The table is first read without locks, a chunk at a time, to find the addresses
+ * that have anything to merge. The rows for each of those are then read again with
+ * FOR UPDATE, and merged in a transaction of their own, so the only locks we hold are
+ * on one address at a time and gluff never waits long for us. gluff updates rows by
+ * their start and end, or by id with the old values in the WHERE clause, so a row we
+ * have changed or removed is looked up again rather than being written over.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <mysql/mysql.h>
+#include <mysql/mysqld_error.h>
+
+#include "rdb.h"
+#include "compaction.h"
+
+/* Longest time value as MySQL writes it, with its terminator */
+#define TIMESIZE 24
+
+/* Longest hw value, as hex */
+#define HWSIZE (2 * RDB_VALSIZE + 1)
+
+struct crow {
+  long long id;
+  long long ip;
+  char start[TIMESIZE];
+  char end[TIMESIZE];
+  char hw[HWSIZE];
+  long long cid;
+  long long rid;
+};
+
+struct cset {
+  struct crow *rows;
+  int n;
+  int max;
+};
+
+/* The columns of a struct crow. NULL and 0 are the same id to gluff. */
+#define CROW_COLUMNS "id, ip, lstart, lend, COALESCE(HEX(hw), ''), COALESCE(cid, 0), COALESCE(rid, 0)"
+
+int compaction_setup(MYSQL *db) {
+  char q[128];
+  snprintf(q, sizeof(q), "SET SESSION innodb_lock_wait_timeout=%d", COMPACTION_LOCK_WAIT);
+  if (mysql_query(db, q) != 0) {
+    syslog(LOG_ERR, "Failed to set the lock wait timeout: %s", mysql_error(db));
+    return -1;
+  }
+  return 0;
+}
+
+/* Compare two times, as MySQL gave them to us. In the lexical schema they are all
+   "YYYY-MM-DD HH:MM:SS", and in the compact schema they are numbers. */
+static int cmp_time(int schema, const char *a, const char *b) {
+  if (schema == RDB_SCHEMA_COMPACT) {
+    long long x = strtoll(a, NULL, 10), y = strtoll(b, NULL, 10);
+    return (x > y) - (x < y);
+  }
+  return strcmp(a, b);
+}
+
+static void copy_value(char *to, const char *from, size_t size) {
+  strncpy(to, from ? from : "", size - 1);
+  to[size - 1] = '\0';
+}
+
+/* Run a query and read what it returns into 's' */
+static int read_rows(MYSQL *db, const char *q, struct cset *s) {
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+
+  s->n = 0;
+  if (mysql_query(db, q) != 0 || (res = mysql_store_result(db)) == NULL) return -1;
+  while ((row = mysql_fetch_row(res)) != NULL) {
+    struct crow *r;
+    if (s->n == s->max) {
+      int n = s->max ? s->max * 2 : 1024;
+      struct crow *p;
+      if ((p = (struct crow *)realloc(s->rows, n * sizeof(struct crow))) == NULL) {
+	syslog(LOG_ERR, "Out of memory");
+	mysql_free_result(res);
+	return -1;
+      }
+      s->rows = p;
+      s->max = n;
+    }
+    r = &(s->rows[s->n++]);
+    r->id = row[0] ? strtoll(row[0], NULL, 10) : 0;
+    r->ip = row[1] ? strtoll(row[1], NULL, 10) : 0;
+    copy_value(r->start, row[2], sizeof(r->start));
+    copy_value(r->end, row[3], sizeof(r->end));
+    copy_value(r->hw, row[4], sizeof(r->hw));
+    r->cid = row[5] ? strtoll(row[5], NULL, 10) : 0;
+    r->rid = row[6] ? strtoll(row[6], NULL, 10) : 0;
+  }
+  mysql_free_result(res);
+  return 0;
+}
+
+/* Whether row 'r' can be merged into the run that started with 'first' and has got
+   as far as 'end' */
+static int mergeable(int schema, const struct crow *first, const char *end, const struct crow *r) {
+  return first->ip == r->ip && first->cid == r->cid && first->rid == r->rid &&
+    strcmp(first->hw, r->hw) == 0 && cmp_time(schema, r->start, end) <= 0;
+}
+
+/* The number of rows among rows[0..n-1], all for one address, that would be merged away */
+static int count_merges(int schema, const struct crow *rows, int n) {
+  const char *end;
+  int i, first=0, merges=0;
+
+  end = n ? rows[0].end : NULL;
+  for (i = 1; i < n; i++) {
+    if (mergeable(schema, &(rows[first]), end, &(rows[i]))) {
+      merges++;
+      if (cmp_time(schema, rows[i].end, end) > 0) end = rows[i].end;
+    } else {
+      first = i;
+      end = rows[i].end;
+    }
+  }
+  return merges;
+}
+
+/* Write a time value for a query */
+static const char *sql_time(int schema, const char *t, char *buf) {
+  if (schema == RDB_SCHEMA_COMPACT) snprintf(buf, TIMESIZE + 2, "%s", t);
+  else snprintf(buf, TIMESIZE + 2, "'%s'", t);
+  return buf;
+}
+
+/* Merge one run of rows: the one with the highest id gets the start of rows[0] and
+   'end', and the others go */
+static int merge_run(MYSQL *db, int schema, const struct crow *rows, int n, const char *end) {
+  char t1[TIMESIZE + 2], t2[TIMESIZE + 2], t3[TIMESIZE + 2], t4[TIMESIZE + 2];
+  const struct crow *keep = &(rows[0]);
+  char *q;
+  size_t len, size = 256 + n * 24;
+  int i, k;
+
+  if ((q = (char *)malloc(size)) == NULL) {
+    syslog(LOG_ERR, "Out of memory");
+    return -1;
+  }
+  for (i = 1; i < n; i++) {
+    if (rows[i].id > keep->id) keep = &(rows[i]);
+  }
+  if (cmp_time(schema, rows[0].start, keep->start) != 0 || cmp_time(schema, end, keep->end) != 0) {
+    snprintf(q, size, "UPDATE leases SET lstart=%s, lend=%s WHERE ip=%lld AND id=%lld AND lstart=%s AND lend=%s",
+	     sql_time(schema, rows[0].start, t1), sql_time(schema, end, t2), keep->ip, keep->id,
+	     sql_time(schema, keep->start, t3), sql_time(schema, keep->end, t4));
+    if (mysql_query(db, q) != 0 || mysql_affected_rows(db) != 1) goto failed;
+  }
+  len = snprintf(q, size, "DELETE FROM leases WHERE ip=%lld AND id IN (", keep->ip);
+  for (i = 0, k = 0; i < n; i++) {
+    if (&(rows[i]) == keep) continue;
+    len += snprintf(q + len, size - len, "%s%lld", (k++ > 0) ? "," : "", rows[i].id);
+  }
+  snprintf(q + len, size - len, ")");
+  if (mysql_query(db, q) != 0 || mysql_affected_rows(db) != n - 1) goto failed;
+  free(q);
+  return 0;
+
+ failed:
+  free(q);
+  return -1;
+}
+
+/* Merge the rows for one address, locked. Returns the number of rows merged away,
+   -2 if someone else had the rows locked for too long, or -1 on error. */
+static int compact_address(MYSQL *db, int schema, long long ip, struct cset *s) {
+  char q[256];
+  const char *end;
+  int i, first=0, merged=0;
+
+  if (mysql_query(db, "START TRANSACTION") != 0) return -1;
+  snprintf(q, sizeof(q), "SELECT " CROW_COLUMNS " FROM leases WHERE ip=%lld ORDER BY lstart, lend, id FOR UPDATE", ip);
+  if (read_rows(db, q, s) != 0) goto failed;
+
+  end = s->n ? s->rows[0].end : NULL;
+  for (i = 1; i <= s->n; i++) {
+    if (i < s->n && mergeable(schema, &(s->rows[first]), end, &(s->rows[i]))) {
+      if (cmp_time(schema, s->rows[i].end, end) > 0) end = s->rows[i].end;
+      continue;
+    }
+    if (i - first > 1) {
+      if (merge_run(db, schema, &(s->rows[first]), i - first, end) != 0) {
+	if (mysql_errno(db) == 0) {
+	  /* Can't happen with the rows locked, but if it does, leave them be */
+	  syslog(LOG_WARNING, "The leases for ip %lld changed while they were being merged", ip);
+	  mysql_query(db, "ROLLBACK");
+	  return -2;
+	}
+	goto failed;
+      }
+      merged += i - first - 1;
+    }
+    if (i < s->n) {
+      first = i;
+      end = s->rows[i].end;
+    }
+  }
+
+  if (mysql_query(db, "COMMIT") != 0) goto failed;
+  return merged;
+
+ failed:
+  if (mysql_errno(db) == ER_LOCK_WAIT_TIMEOUT || mysql_errno(db) == ER_LOCK_DEADLOCK) {
+    mysql_query(db, "ROLLBACK");
+    return -2;
+  }
+  syslog(LOG_ERR, "Failed to merge the leases for ip %lld: %s", ip, mysql_error(db));
+  mysql_query(db, "ROLLBACK");
+  return -1;
+}
+
+int compaction_pass(MYSQL *db, int schema, int chunk, int pause_ms, struct compaction_stats *st) {
+  struct cset scan = { NULL, 0, 0 }, locked = { NULL, 0, 0 };
+  char q[256];
+  long long last = -1;
+  int i, first, upto, r=-1;
+
+  while(1) {
+    snprintf(q, sizeof(q), "SELECT " CROW_COLUMNS " FROM leases WHERE ip>%lld ORDER BY ip, lstart, lend, id LIMIT %d",
+	     last, chunk);
+    if (read_rows(db, q, &scan) != 0) {
+      syslog(LOG_ERR, "Failed to read the leases: %s", mysql_error(db));
+      goto done;
+    }
+    if (scan.n == 0) break;
+
+    /* The last address in a full chunk may have more rows, and is left for the next one,
+       unless it is all there is */
+    upto = scan.n;
+    if (scan.n == chunk) {
+      while (upto > 0 && scan.rows[upto - 1].ip == scan.rows[scan.n - 1].ip) upto--;
+    }
+    st->rows += upto ? upto : scan.n;
+
+    for (first = 0; first < upto || (upto == 0 && first == 0); first = i) {
+      int merged;
+      for (i = first; i < scan.n && scan.rows[i].ip == scan.rows[first].ip; i++);
+      last = scan.rows[first].ip;
+      /* An address with more rows than fit in a chunk is looked at with all of them */
+      if (upto > 0 && count_merges(schema, &(scan.rows[first]), i - first) == 0) continue;
+
+      if ((merged = compact_address(db, schema, last, &locked)) == -2) {
+	st->skipped++;
+	continue;
+      }
+      if (merged < 0) goto done;
+      if (merged > 0) {
+	st->addresses++;
+	st->merged += merged;
+      }
+      if (upto == 0) break;
+    }
+
+    if (scan.n < chunk) break;
+    if (pause_ms > 0) usleep(pause_ms * 1000);
+  }
+  r = 0;
+
+ done:
+  free(scan.rows);
+  free(locked.rows);
+  return r;
+}
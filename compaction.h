@@ -0,0 +1,51 @@
+/*
+ * compaction - merge lease rows for the same address that overlap or follow on from
+ *              each other, with the same hw, cid and rid, into one.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#ifndef COMPACTION_H
+#define COMPACTION_H
+
+#include <mysql/mysql.h>
+
+/* How many lease rows to read at a time while looking for rows to merge */
+#define COMPACTION_CHUNK 10000
+
+/* How long to wait for a row gluff has locked before leaving the address for the next
+   pass, in seconds */
+#define COMPACTION_LOCK_WAIT 5
+
+struct compaction_stats {
+  unsigned long rows;		/* rows looked at */
+  unsigned long addresses;	/* addresses with rows to merge */
+  unsigned long merged;		/* rows merged into others and removed */
+  unsigned long skipped;	/* addresses left for later, since they were busy */
+};
+
+/* Prepare a connection for compaction: lock waits are kept short, so that gluff never
+   has to wait long for us. Returns 0, or -1 on error. */
+int compaction_setup(MYSQL *db);
+
+/* Go through the whole leases table, in order of address, 'chunk' rows at a time, and
+   merge what can be merged. The rows for each address are merged in a transaction of
+   their own, with the rows locked, so this can run while gluff is writing. Waits
+   'pause_ms' milliseconds between chunks. 'st' is added to. Returns 0, or -1 if there
+   was an error other than a busy row. */
+int compaction_pass(MYSQL *db, int schema, int chunk, int pause_ms, struct compaction_stats *st);
+
+#endif
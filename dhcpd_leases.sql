@@ -5,7 +5,8 @@
 CREATE TABLE `cids` (
   `id` int(11) NOT NULL auto_increment,
   `value` varchar(63) default NULL,
-  PRIMARY KEY  (`id`)
+  PRIMARY KEY  (`id`),
+  UNIQUE KEY `value` (`value`)
 );
 
 --
@@ -15,7 +16,8 @@ CREATE TABLE `cids` (
 CREATE TABLE `hws` (
   `id` int(11) NOT NULL auto_increment,
   `value` varchar(63) default NULL,
-  PRIMARY KEY  (`id`)
+  PRIMARY KEY  (`id`),
+  UNIQUE KEY `value` (`value`)
 );
 
 --
@@ -25,7 +27,8 @@ CREATE TABLE `hws` (
 CREATE TABLE `ips` (
   `id` int(11) NOT NULL auto_increment,
   `value` varchar(63) default NULL,
-  PRIMARY KEY  (`id`)
+  PRIMARY KEY  (`id`),
+  UNIQUE KEY `value` (`value`)
 );
 
 --
@@ -40,7 +43,9 @@ CREATE TABLE `leases` (
   `hw` int(11) default NULL,
   `cid` int(11) default NULL,
   `rid` int(11) default NULL,
-  PRIMARY KEY  (`id`)
+  PRIMARY KEY  (`id`),
+  KEY `ip_time` (`ip`,`lstart`,`lend`),
+  KEY `lend` (`lend`)
 );
 
 --
@@ -50,5 +55,6 @@ CREATE TABLE `leases` (
 CREATE TABLE `rids` (
   `id` int(11) NOT NULL auto_increment,
   `value` varchar(63) default NULL,
-  PRIMARY KEY  (`id`)
+  PRIMARY KEY  (`id`),
+  UNIQUE KEY `value` (`value`)
 );
@@ -0,0 +1,45 @@
+--
+-- The compact schema, for gluff -b. IP addresses are stored as INT UNSIGNED
+-- (INET_ATON()/INET_NTOA()), MAC addresses as BINARY(6) (HEX()/UNHEX()) and
+-- times as UTC seconds since the epoch (FROM_UNIXTIME()/UNIX_TIMESTAMP()).
+-- There are no ips or hws tables.
+--
+
+--
+-- Table structure for table `cids`
+--
+
+CREATE TABLE `cids` (
+  `id` int(11) NOT NULL auto_increment,
+  `value` varchar(63) default NULL,
+  PRIMARY KEY  (`id`),
+  UNIQUE KEY `value` (`value`)
+);
+
+--
+-- Table structure for table `leases`
+--
+
+CREATE TABLE `leases` (
+  `id` int(11) NOT NULL auto_increment,
+  `ip` int(10) unsigned NOT NULL default '0',
+  `lstart` int(10) unsigned NOT NULL default '0',
+  `lend` int(10) unsigned NOT NULL default '0',
+  `hw` binary(6) default NULL,
+  `cid` int(11) default NULL,
+  `rid` int(11) default NULL,
+  PRIMARY KEY  (`id`),
+  KEY `ip_time` (`ip`,`lstart`,`lend`),
+  KEY `lend` (`lend`)
+);
+
+--
+-- Table structure for table `rids`
+--
+
+CREATE TABLE `rids` (
+  `id` int(11) NOT NULL auto_increment,
+  `value` varchar(63) default NULL,
+  PRIMARY KEY  (`id`),
+  UNIQUE KEY `value` (`value`)
+);
@@ -0,0 +1,43 @@
+--
+-- Move an existing database from the schema in dhcpd_leases.sql to the one in
+-- dhcpd_leases_compact.sql. Stop gluff on all the DHCP servers first, and
+-- start it again with -b when this is done.
+--
+-- The old leases table is kept as `leases_lexical`, and the ips and hws tables
+-- are left alone. Drop them when you are happy with the result. Leases for
+-- anything but IPv4 addresses are not carried over. MAC addresses that are not
+-- six bytes long become NULL.
+--
+
+CREATE TABLE `leases_compact` (
+  `id` int(11) NOT NULL auto_increment,
+  `ip` int(10) unsigned NOT NULL default '0',
+  `lstart` int(10) unsigned NOT NULL default '0',
+  `lend` int(10) unsigned NOT NULL default '0',
+  `hw` binary(6) default NULL,
+  `cid` int(11) default NULL,
+  `rid` int(11) default NULL,
+  PRIMARY KEY  (`id`),
+  KEY `ip_time` (`ip`,`lstart`,`lend`),
+  KEY `lend` (`lend`)
+);
+
+-- dhcpd writes MAC addresses as "0:1a:2b:..." or "00:1a:2b:...", so each octet
+-- is padded to two digits before it is unhexed
+INSERT INTO `leases_compact` (`id`,`ip`,`lstart`,`lend`,`hw`,`cid`,`rid`)
+  SELECT l.id, INET_ATON(i.value), UNIX_TIMESTAMP(l.lstart), UNIX_TIMESTAMP(l.lend),
+         IF(h.value REGEXP '^[0-9a-fA-F]{1,2}(:[0-9a-fA-F]{1,2}){5}$',
+            UNHEX(CONCAT(LPAD(SUBSTRING_INDEX(h.value, ':', 1), 2, '0'),
+                         LPAD(SUBSTRING_INDEX(SUBSTRING_INDEX(h.value, ':', 2), ':', -1), 2, '0'),
+                         LPAD(SUBSTRING_INDEX(SUBSTRING_INDEX(h.value, ':', 3), ':', -1), 2, '0'),
+                         LPAD(SUBSTRING_INDEX(SUBSTRING_INDEX(h.value, ':', 4), ':', -1), 2, '0'),
+                         LPAD(SUBSTRING_INDEX(SUBSTRING_INDEX(h.value, ':', 5), ':', -1), 2, '0'),
+                         LPAD(SUBSTRING_INDEX(h.value, ':', -1), 2, '0'))),
+            NULL),
+         l.cid, l.rid
+  FROM `leases` l
+  JOIN `ips` i ON i.id = l.ip
+  LEFT JOIN `hws` h ON h.id = l.hw
+  WHERE i.value REGEXP '^[0-9]{1,3}(\\.[0-9]{1,3}){3}$';
+
+RENAME TABLE `leases` TO `leases_lexical`, `leases_compact` TO `leases`;
@@ -23,588 +23,1285 @@ OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <syslog.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 #include <sqlite3.h>
 #include <mysql/mysql.h>
 #include <netinet/in.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
-#define STR_HELPER(x) #x
-#define STR(x) STR_HELPER(x)
+#include "idcache.h"
+#include "ldb.h"
+#include "rdb.h"
+#include "bqueue.h"
+#include "schema.h"
+#include "journal.h"
+#include "stream.h"
+#include "metrics.h"
+#include "batchsize.h"
+#include "compaction.h"
+#include "ardb.h"
+#include "trace.h"
 
-#ifdef BATCH_LIMIT
-#define RECLIMIT " limit " STR(BATCH_LIMIT)
-#else
-#define RECLIMIT ""
-#endif
+/* Default memory cap for the id cache, in kilobytes */
+#define IDCACHE_DEFAULT_KB 4096
+
+/* Default number of active leases to remember, per MySQL connection */
+#define LSTATE_DEFAULT 65536
+
+/* How often to log cache statistics, in seconds */
+#define STATS_INTERVAL 3600
 
-/* Local SQL queries for sqlite3 */
+/* How often to count the records waiting in the queue while the metrics are being
+   served or the batches sized, in seconds */
+#define BACKLOG_INTERVAL 10
 
-#define RESET_LSQL "UPDATE lease_queue set claimed=0"
-#define CLAIM_LSQL "UPDATE lease_queue set claimed=? where claimed=0" RECLIMIT
-#define GET_LSQL "SELECT start,rtype,end,ip,hw,cid,rid FROM lease_queue where claimed=? order by start,idx"
-#define CLEAR_LSQL "DELETE FROM lease_queue where claimed=?"
+/* The backlog that makes us start catching up, if not set with -K */
+#define CATCHUP_DEFAULT 10000
 
-/* Remote SQL queries for the MySQL database */
-#define GETCID_RSQL "SELECT id from cids where value=?"
-#define GETRID_RSQL "SELECT id from rids where value=?"
-#define GETIP_RSQL "SELECT id from ips where value=?"
-#define GETHW_RSQL "SELECT id from hws where value=?"
+/* Polling intervals, in milliseconds. The interval is doubled for every idle cycle, up
+   to the maximum, and drops back to the minimum as soon as there is something to do.
+   With inotify we are woken up by dhcpd's writes, so polling is only a safety net. */
+#define POLL_MIN_MS 250
+#define POLL_MAX_MS 5000
+#define POLL_MAX_INOTIFY_MS 60000
 
-#define MAKECID_RSQL "INSERT INTO cids (value) values (?)"
-#define MAKERID_RSQL "INSERT INTO rids (value) values (?)"
-#define MAKEIP_RSQL "INSERT INTO ips (value) values (?)"
-#define MAKEHW_RSQL "INSERT INTO hws (value) values (?)"
+/* After a wakeup, wait this long so that a burst of ACKs ends up in one batch */
+#define WAKEUP_DELAY_MS 50
 
-#define FIND_LEASE_RSQL "SELECT lstart,lend,hw,cid,rid from leases where ip=? and lstart<=? and lend>=?"
-#define CUTOFF_LEASE_RSQL "UPDATE leases set lend=? where ip=? and lstart<=? and lend>=?"
-#define PROLONG_LEASE_RSQL "UPDATE leases set lend=? where ip=? and lstart<=? and lend<=? and lend>=?"
-#define REMOVE_LEASE_RSQL "DELETE from leases where ip=? and lstart<=? and lend>=?"
-#define MAKE_LEASE_RSQL "REPLACE INTO leases (ip,lstart,lend,hw,cid,rid) values (?,?,?,?,?,?)"
+/* How long to wait between attempts when the MySQL server is unreachable */
+#define RECONNECT_INTERVAL 5
+
+/* In pipelined mode, how many batches the reader may get ahead of the writer */
+#define PIPELINE_DEPTH 4
+
+/* With several MySQL connections, how many batches each one may be behind, and how
+   many connections we allow */
+#define WORKER_DEPTH 16
+#define MAX_WORKERS 64
+
+/* Between chunks, background compaction waits this long, in milliseconds, to stay out
+   of the way of the writers */
+#define COMPACTION_PAUSE_MS 100
+
+/* Queues one gluff can read from */
+#define MAX_SOURCES METRIC_SOURCES
 
 #define max(a,b) ((b)>(a)?(b):(a))
 #define min(a,b) ((b)<(a)?(b):(a))
 
-typedef struct ldb_entry_s {
-  time_t start;
-  time_t end;
-  int rtype;
-  unsigned char ip[INET_ADDRSTRLEN];
-  unsigned char hw[18];
-  unsigned char *cid;
-  unsigned char *rid;
-  struct ldb_entry_s *next;
-} *ldb_entry;
-
-void addrecord(ldb_entry *list, time_t start, time_t end, int rtype, const unsigned char *ip, const unsigned char *hw, const unsigned char *cid, const unsigned char *rid) {
-  if (*list) addrecord(&((*list)->next), start, end, rtype, ip, hw, cid, rid);
-  else {
-    ldb_entry tmp=(ldb_entry)malloc(sizeof(struct ldb_entry_s));
-    tmp->start = start;
-    tmp->end = end;
-    tmp->rtype = rtype;
-    strcpy((char *)(tmp->ip), (char *)ip);
-    strcpy((char *)(tmp->hw), (char *)hw);
-    if (cid != NULL) tmp->cid = (unsigned char *)strdup((char *)cid);
-    else tmp->cid = NULL;
-    if (rid != NULL) tmp->rid = (unsigned char *)strdup((char *)rid);
-    else tmp->rid = NULL;
-    tmp->next = NULL;
-    (*list) = tmp;
-  }
-}
-
-void freerecords(ldb_entry *list) {
-  if (*list) {
-    freerecords (&((*list)->next));
-    if ((*list)->cid) free((*list)->cid);
-    if ((*list)->rid) free((*list)->rid);
-    free(*list);
-    *list = NULL;
-  }
-}
-
 int gluffdebug=0;
+idcache gluffcache=NULL;
+unsigned int active_leases=LSTATE_DEFAULT;
+size_t batch_bytes=0;
+int coalesce=1;
+int schema=RDB_SCHEMA_LEXICAL;
+int partition_keep=-1;
+int queue_mode=LDB_MODE_CLAIM;
+stream push_stream=NULL;
+int serve_metrics=0;
+batchsize sizer=NULL;
+int procedures=0;
+ardb async_db=NULL;
+
+/* Set by SIGUSR1 */
+static volatile sig_atomic_t dump_requested=0;
+
+#ifdef BATCH_LIMIT
+int batch_limit=BATCH_LIMIT;
+#else
+int batch_limit=0;
+#endif
+
+/* A queue we read records from. Each one has connections of its own for the reader
+   thread and each worker, but the MySQL connections and the id cache are shared. */
+struct source {
+  int index;
+  const char *filename;		/* the queue database, or the journal directory */
+  int mode;			/* LDB_MODE_CLAIM, LDB_MODE_CURSOR or LDB_MODE_JOURNAL */
+  int weight;			/* claims in a row it gets while the others wait */
+  ldb_conn ldb;			/* the main thread's connection */
+  ldb_conn rldb;		/* the reader thread's */
+  char watch_path[PATH_MAX];	/* what inotify should tell us about */
+  const char *watch_name;	/* ... without the directory */
+  int wd;			/* its inotify watch, or -1 */
+  sqlite3_int64 tag;		/* the reader thread's current claim */
+  unsigned int seq;
+  struct ldb_key key;		/* ... which has been read up to here */
+  int reading;			/* in the middle of it */
+  int total;			/* records in it so far */
+};
+
+struct source sources[MAX_SOURCES];
+int nsources=0;
+
+/* A batch on its way from the reader thread to the writer. Batches are recycled, so
+   that their memory is allocated once and reused. */
+struct batch {
+  ldb_batch data;
+  struct source *src;		/* read from this queue */
+  int nread;			/* records read, before any were folded together */
+  int *shardidx;		/* with several workers, the records for each of them: */
+  int shardoff[MAX_WORKERS + 1];	/* worker i gets shardidx[shardoff[i]..shardoff[i + 1] - 1] */
+  int maxidx;
+  int remaining;		/* the number of shards not written yet */
+  int finished;			/* all shards are written */
+  struct batch *nextfree;
+  struct batch *nextout;	/* the batch dispatched after this one */
+};
+
+static struct batch *free_batches=NULL;
+static pthread_mutex_t free_batches_lock=PTHREAD_MUTEX_INITIALIZER;
+
+/* The batches handed out to the workers, oldest first. They are removed from the queue
+   in this order even if the workers finish them in another, which cursor mode needs. */
+static struct batch *out_head=NULL, *out_tail=NULL;
+static pthread_mutex_t out_lock=PTHREAD_MUTEX_INITIALIZER;
+
+/* One of the MySQL connections the records are spread over */
+struct worker {
+  int index;
+  pthread_t thread;
+  bqueue queue;
+  rdb_conn rdb;
+  ldb_conn ldb[MAX_SOURCES];	/* for removing batches from their queues */
+  int batchmode;
+  unsigned long batches;	/* counted by the worker */
+  unsigned long records;
+  unsigned long retries;
+  unsigned long pushes;		/* counted by the dispatcher */
+  unsigned long depthsum;
+  unsigned int maxdepth;
+};
+
+struct worker *workers=NULL;
+int nworkers=1;
+
+/* What the reader thread needs to know */
+struct reader_args {
+  int pid;
+  int watch_fd;
+  int poll_max_ms;
+  bqueue queue;
+};
+
+/* What the compaction thread needs to know */
+struct compactor_args {
+  const char *host;
+  const char *user;
+  const char *password;
+  const char *database;
+  int minutes;
+};
 
 /* Print usage text */
 void usage(char *progname) {
-  fprintf(stderr, "Usage: %s -l <local db file> -h <remote db host> -u <remote db user>\n", progname);
+  fprintf(stderr, "Usage: %s {-l <local db file>[@weight] | -j <journal directory>[@weight]}... -h <remote db host> -u <remote db user>\n", progname);
   fprintf(stderr, "\t-p <remote db password> -d <remote db database>\n");
-  fprintf(stderr, "\t[-R (reset claims)] [-F (do not fork)] [-Q (be quiet)] [-P <pidfilename>] [-D (debug)]\n");
+  fprintf(stderr, "\t[-R (reset claims)] [-F (do not fork)] [-Q (be quiet)] [-P <pidfilename>] [-D (debug: log each trace record)]\n");
+  fprintf(stderr, "\t[-c <id cache size in kB, 0 to disable (default %d)>] [-T (one transaction per batch)]\n", IDCACHE_DEFAULT_KB);
+  fprintf(stderr, "\t[-i <longest poll interval in seconds (default %d, or %d with inotify)>]\n", POLL_MAX_MS / 1000, POLL_MAX_INOTIFY_MS / 1000);
+  fprintf(stderr, "\t[-L (pipelined: read the next batch while the current one is written)]\n");
+  fprintf(stderr, "\t[-w <number of MySQL connections to write with, implies -L (default 1)>]\n");
+  fprintf(stderr, "\t[-a <active leases to remember per connection, 0 to disable (default %d)>]\n", LSTATE_DEFAULT);
+  fprintf(stderr, "\t[-C (apply every ACK, instead of folding repeated ones together)]\n");
+  fprintf(stderr, "\t[-m <most memory for one batch in kB, 0 for no limit (default 0)>]\n");
+  fprintf(stderr, "\t[-b (write to the compact schema in dhcpd_leases_compact.sql)]\n");
+  fprintf(stderr, "\t[-B (create missing tables and indexes, and partition the leases table with -M)]\n");
+  fprintf(stderr, "\t[-M <keep monthly partitions of the leases table for this many months, 0 for ever>]\n");
+  fprintf(stderr, "\t[-H (read the queue in rowid order past a saved cursor, instead of claiming records)]\n");
+  fprintf(stderr, "\t[-n <most records in one batch, 0 for no limit (default %d)>]\n", batch_limit);
+  fprintf(stderr, "\t[-S <socket to take events pushed by dhcpd on, not with -L or -w>]\n");
+  fprintf(stderr, "\t[-E <socket to serve metrics on, in Prometheus text format>]\n");
+  fprintf(stderr, "\t[-A <milliseconds: size batches to take about this long, starting at -n>]\n");
+  fprintf(stderr, "\t[-K <backlog to catch up on with larger batches, with -A, 0 for never (default %d)>]\n", CATCHUP_DEFAULT);
+  fprintf(stderr, "\t[-U (apply records with the stored procedure " RDB_PROCEDURE ", made with -B)]\n");
+  fprintf(stderr, "\t[-y <MySQL connections to keep calls in flight on at once, with -U, not with -w or -T>]\n");
+  fprintf(stderr, "\t[-O <file to write a binary trace of each record to, for glufftrace>]\n");
+  fprintf(stderr, "\t[-o (only write the trace, what is in memory of it, on SIGUSR2)]\n");
+  fprintf(stderr, "\t[-X (merge overlapping lease rows once and exit; no queue needed)]\n");
+  fprintf(stderr, "\t[-Z <minutes between merging overlapping lease rows in the background>]\n");
 }
 
-int do_make_lease(MYSQL *db, int ip, time_t start, time_t end, int hw, int cid, int rid);
+/* Get a numeric id through the id cache, falling back to get_id() on a miss */
+int cached_id(rdb_conn db, int table, const unsigned char *val, int getstmt, int setstmt) {
+  int id;
+  if (gluffcache && (id = idcache_get(gluffcache, table, val)) != 0) return id;
+  id = get_id(db, val, getstmt, setstmt);
+  if (gluffcache && id != 0) idcache_put(gluffcache, table, val, id, 1);
+  return id;
+}
 
-void mytime2tm(MYSQL_TIME *mtt, struct tm *tmt) {
-  tmt->tm_year = mtt->year - 1900;
-  tmt->tm_mon = mtt->month - 1;
-  tmt->tm_mday = mtt->day;
-  tmt->tm_hour = mtt->hour;
-  tmt->tm_min = mtt->minute;
-  tmt->tm_sec = mtt->second;
-  tmt->tm_isdst = -1;
+int rdb_cid_id(rdb_conn db, const unsigned char *val) {
+  return cached_id(db, IDC_CID, val, RS_GETCID, RS_MAKECID);
 }
 
-time_t mytime2timet(MYSQL_TIME *mtt) {
-  struct tm tm_tmp;
-  mytime2tm(mtt, &tm_tmp);
-  return mktime(&tm_tmp);
+int rdb_rid_id(rdb_conn db, const unsigned char *val) {
+  return cached_id(db, IDC_RID, val, RS_GETRID, RS_MAKERID);
 }
 
-void tm2mytime(struct tm *tmt, MYSQL_TIME *mtt) {
-  mtt->year = tmt->tm_year + 1900;
-  mtt->month = tmt->tm_mon + 1;
-  mtt->day = tmt->tm_mday;
-  mtt->hour = tmt->tm_hour;
-  mtt->minute = tmt->tm_min;
-  mtt->second = tmt->tm_sec;
-  mtt->second_part = 0;
-  mtt->neg = 0;
+int rdb_ip_id(rdb_conn db, const unsigned char *val) {
+  return cached_id(db, IDC_IP, val, RS_GETIP, RS_MAKEIP);
 }
 
-void timet2mytime(time_t t, MYSQL_TIME *mtt) {
-  struct tm *tm_tmp=localtime(&t);
-  tm2mytime(tm_tmp, mtt);
+int rdb_hw_id(rdb_conn db, const unsigned char *val) {
+  return cached_id(db, IDC_HW, val, RS_GETHW, RS_MAKEHW);
 }
 
-/* Get a numeric id from one of the lexical tables, creating a new record if none exists */
-int get_id(MYSQL *db, const unsigned char *val, char *getq, char *setq) {
-  MYSQL_STMT *stmt=NULL;
-  MYSQL_BIND param[1], result[1];
-  unsigned long blen;
-  int id;
-  if ((stmt = mysql_stmt_init(db)) == NULL) {
-    syslog(LOG_ERR, "mysql_stmt_init(): %s", mysql_error(db));
-    return 0;
+/* Fill the id cache from one of the lexical tables. Returns the number of ids loaded,
+   or -1 on error. Stops quietly when the cache is full. */
+int preload_ids(MYSQL *db, int table, char *q) {
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  int n=0;
+
+  if (mysql_query(db, q) != 0) {
+    syslog(LOG_ERR, "mysql_query(): %s", mysql_error(db));
+    return -1;
   }
 
-  if (mysql_stmt_prepare(stmt, getq, strlen(getq)) != 0) {
-    syslog(LOG_ERR, "mysql_stmt_prepare(): %s", mysql_error(db));
-    return 0;
+  if ((res = mysql_use_result(db)) == NULL) {
+    syslog(LOG_ERR, "mysql_use_result(): %s", mysql_error(db));
+    return -1;
   }
 
-  memset ((void *) param, 0, sizeof (param));
+  while ((row = mysql_fetch_row(res)) != NULL) {
+    if (row[0] && row[1] &&
+	idcache_put(gluffcache, table, (unsigned char *)row[1], atoi(row[0]), 0) == 0) {
+      n++;
+    }
+  }
 
-  param[0].buffer_type = MYSQL_TYPE_STRING;
-  param[0].buffer = (void *)val;
-  blen=strlen((char *)val);
-  param[0].buffer_length = blen+1;
-  param[0].length = &blen;
-  param[0].is_null = 0;
+  mysql_free_result(res);
+  return n;
+}
 
-  if (mysql_stmt_bind_param(stmt, param) != 0) {
-    syslog(LOG_ERR, "mysql_bind_param(): %s", mysql_error(db));
-    return 0;
+/* Warm up the id cache from all four lexical tables */
+void preload_cache(MYSQL *db) {
+  struct idcache_stats st;
+  int n=0, r;
+  if (!gluffcache) return;
+  if (schema == RDB_SCHEMA_LEXICAL) {
+    if ((r = preload_ids(db, IDC_IP, PRELOADIP_RSQL)) > 0) n += r;
+    if ((r = preload_ids(db, IDC_HW, PRELOADHW_RSQL)) > 0) n += r;
   }
+  if ((r = preload_ids(db, IDC_RID, PRELOADRID_RSQL)) > 0) n += r;
+  if ((r = preload_ids(db, IDC_CID, PRELOADCID_RSQL)) > 0) n += r;
+  idcache_getstats(gluffcache, &st);
+  syslog(LOG_INFO, "Preloaded %d ids into the id cache (%lu of %lu kB used)",
+	 n, (unsigned long)(st.bytes / 1024), (unsigned long)(st.maxbytes / 1024));
+}
 
-  memset ((void *) result, 0, sizeof (result));
-
-  result[0].buffer_type = MYSQL_TYPE_LONG;
-  result[0].buffer = (void *)&id;
-  result[0].is_unsigned = 0;
-  result[0].is_null = 0;
+/* Log id cache statistics */
+void log_cache_stats(void) {
+  struct idcache_stats st;
+  if (!gluffcache) return;
+  idcache_getstats(gluffcache, &st);
+  syslog(LOG_INFO, "id cache: %lu hits, %lu misses, %lu entries, %lu flushes, %lu of %lu kB used",
+	 st.hits, st.misses, st.entries, st.flushes,
+	 (unsigned long)(st.bytes / 1024), (unsigned long)(st.maxbytes / 1024));
+}
 
-  if (mysql_stmt_bind_result(stmt, result) != 0) {
-    syslog(LOG_ERR, "mysql_bind_result(): %s", mysql_error(db));
-    return 0;
-  }
+/* Log how many queue records we have read and folded away */
+void log_queue_stats(void) {
+  unsigned long n = metrics_counter(COUNTER_READ);
+  unsigned long c = metrics_counter(COUNTER_COLLAPSED);
+  syslog(LOG_INFO, "queue: %lu records read, %lu of them folded into earlier ACKs", n, c);
+}
 
-  if (mysql_stmt_execute(stmt) != 0) {
-    syslog(LOG_ERR, "mysql_execute(): %s", mysql_error(db));
-    return 0;
-  }
+/* Log active lease table statistics for one connection */
+void log_lease_stats(rdb_conn rdb, const char *who) {
+  struct lstate_stats st;
+  if (!rdb->active) return;
+  lstate_getstats(rdb->active, &st);
+  syslog(LOG_INFO, "%sactive leases: %lu hits, %lu misses, %lu stale, %lu of %lu entries, %lu flushes",
+	 who, rdb->lease_hits, rdb->lease_misses, rdb->lease_stale, st.entries, st.maxentries, st.flushes);
+}
 
-  if (mysql_stmt_store_result(stmt) != 0) {
-    syslog(LOG_ERR, "mysql_store_result(): %s", mysql_error(db));
-    return 0;
-  }
-  
-  if (mysql_stmt_num_rows(stmt) == 1) {
-    mysql_stmt_fetch(stmt);
-    mysql_stmt_free_result(stmt);
-    mysql_stmt_close(stmt);
-    return id;
+/* Start remembering active leases on a connection */
+int track_leases(rdb_conn rdb) {
+  /* The procedure looks at the leases table itself, so there is nothing to remember */
+  if (active_leases == 0 || procedures) return 0;
+  if ((rdb->active = lstate_new(active_leases)) == NULL) {
+    syslog(LOG_ERR, "Failed to create an active lease table for %u leases", active_leases);
+    return -1;
   }
-  
-  mysql_stmt_free_result(stmt);
-  mysql_stmt_close(stmt);
+  return 0;
+}
 
-  if ((stmt = mysql_stmt_init(db)) == NULL) {
-    syslog(LOG_ERR, "mysql_stmt_init(): %s", mysql_error(db));
-    return 0;
-  }
-  if (mysql_stmt_prepare(stmt, setq, strlen(setq)) != 0) {
-    syslog(LOG_ERR, "mysql_stmt_prepare(): %s", mysql_error(db));
-    return 0;
+/* Log how busy the workers have been */
+void log_worker_stats(void) {
+  int i;
+  for (i = 0; i < nworkers && workers; i++) {
+    struct worker *w = &(workers[i]);
+    unsigned long pushes = __atomic_load_n(&(w->pushes), __ATOMIC_RELAXED);
+    unsigned long depthsum = __atomic_load_n(&(w->depthsum), __ATOMIC_RELAXED);
+    syslog(LOG_INFO, "worker %d: %lu batches, %lu records, %lu retries, queue depth %lu.%02lu on average, %u at most, %u now",
+	   i,
+	   __atomic_load_n(&(w->batches), __ATOMIC_RELAXED),
+	   __atomic_load_n(&(w->records), __ATOMIC_RELAXED),
+	   __atomic_load_n(&(w->retries), __ATOMIC_RELAXED),
+	   pushes ? depthsum / pushes : 0, pushes ? (depthsum * 100 / pushes) % 100 : 0,
+	   __atomic_load_n(&(w->maxdepth), __ATOMIC_RELAXED),
+	   bqueue_depth(w->queue));
   }
+}
 
-  memset ((void *) param, 0, sizeof (param));
-  param[0].buffer_type = MYSQL_TYPE_STRING;
-  param[0].buffer = (void *)val;
-  blen=strlen((char *)val);
-  param[0].buffer_length = blen+1;
-  param[0].length = &blen;
-  param[0].is_null = 0;
+/* Log how the batches are being sized */
+void log_batch_stats(void) {
+  if (!sizer) return;
+  syslog(LOG_INFO, "batches: %d records at a time, %.1f us per record%s", batchsize_get(sizer),
+	 batchsize_record_us(sizer), batchsize_catching_up(sizer) ? ", catching up" : "");
+}
 
+/* Log how many trace records never made it to the trace file */
+void log_trace_stats(void) {
+  unsigned long lost = trace_lost();
+  if (lost > 0) syslog(LOG_WARNING, "trace: %lu records were overwritten before they could be written out", lost);
+}
 
-  if (mysql_stmt_bind_param(stmt, param) != 0) {
-    syslog(LOG_ERR, "mysql_bind_param(): %s", mysql_error(db));
+/* Look up the numeric ids for the lexical values of a queue record. In the compact
+   schema, the ip and hw values are the addresses themselves, and a record without an
+   IPv4 address is left with ipid 0 for apply_record() to skip. */
+int resolve_ids(rdb_conn rdb, ldb_entry rec) {
+  long long t = metrics_now();
+  rec->cidid = (rec->cid != NULL) ? rdb_cid_id(rdb, rec->cid) : 0;
+  rec->ridid = (rec->rid != NULL) ? rdb_rid_id(rdb, rec->rid) : 0;
+  if (schema == RDB_SCHEMA_COMPACT) {
+    if ((rec->ipid = compact_ip(rec->ip)) == 0) {
+      syslog(LOG_WARNING, "Skipping a record for %s, which is not an IPv4 address", rec->ip);
+    }
+    rec->hwid = compact_hw(rec->hw);
+    metrics_time(METRIC_RESOLVE, t);
     return 0;
   }
+  rec->ipid = rdb_ip_id(rdb, rec->ip);
+  rec->hwid = rdb_hw_id(rdb, rec->hw);
+  metrics_time(METRIC_RESOLVE, t);
+  if (!rec->ipid || !rec->hwid) return -15;
+  return 0;
+}
 
-  if (mysql_stmt_execute(stmt) != 0) {
-    syslog(LOG_ERR, "mysql_execute(): %s", mysql_error(db));
+/* Apply one queue record to the lease table: prolong or cut off the lease we find, or make a new one */
+int apply_record(rdb_conn rdb, ldb_entry rec) {
+  int r;
+  // start, end, ip, hw, cid, rid
+  time_t start = rec->start;
+  time_t end = rec->end;
+  int rtype = rec->rtype;
+  int ip = rec->ipid;
+  long long hw = rec->hwid;
+  int cid = rec->cidid;
+  int rid = rec->ridid;
+  time_t thatstart, thatend;
+  long long thathw=-1;
+  int thatcid=-1, thatrid=-1;
+  struct trace_record tr;
+  int makelease;
+  int tries;
+  long long t, t0;
+
+  memset(&tr, 0, sizeof(tr));
+  tr.event = TRACE_APPLY;
+  tr.decision = TRACE_SKIPPED;
+  tr.flags = ((rtype == 1) ? TRACE_RELEASE : 0) | ((schema == RDB_SCHEMA_COMPACT) ? TRACE_COMPACT : 0);
+  tr.ip = ip;
+  tr.hw = hw;
+  tr.u.ids.cid = cid;
+  tr.u.ids.rid = rid;
+  tr.start = (uint32_t)start;
+  tr.end = (uint32_t)end;
+
+  if (ip == 0) {
+    trace_add(&tr);
     return 0;
   }
 
-  id=mysql_stmt_insert_id(stmt);
-  mysql_stmt_close(stmt);
-  return id;
-}
-
-int rdb_cid_id(MYSQL *db, const unsigned char *val) {
-  return get_id(db, val, GETCID_RSQL, MAKECID_RSQL);
-}
-
-int rdb_rid_id(MYSQL *db, const unsigned char *val) {
-  return get_id(db, val, GETRID_RSQL, MAKERID_RSQL);
+  /* do_update_lease() tells us if the lease it was given had been changed behind our
+     back, and then we look again. Looking again goes to MySQL, so once is enough. */
+  t0 = metrics_now();
+  for (tries = 0; tries < 2; tries++) {
+    makelease=1;
+    tr.decision = TRACE_NEW;
+    if (tries > 0) tr.flags |= TRACE_RETRIED;
+    t = metrics_now();
+    r = do_find_lease(rdb, ip, start, &thatstart, &thatend, &thathw, &thatcid, &thatrid);
+    tr.usec[TRACE_FIND] += (uint32_t)(metrics_time(METRIC_FIND, t) - t);
+    t = metrics_now();
+    if (r > 0) {
+      if (hw != thathw || cid != thatcid || rid != thatrid) {
+	tr.decision = TRACE_REPLACED;
+	r = do_update_lease(rdb, ip, thatstart, thatend, start, 0); // cut off old lease
+      } else {
+	if (rtype == 1) {
+	  tr.decision = TRACE_RELEASED;
+	  r = do_update_lease(rdb, ip, thatstart, thatend, end, 0); // cut off old lease
+	} else {
+	  tr.decision = TRACE_PROLONGED;
+	  r = do_update_lease(rdb, ip, thatstart, thatend, end, 1); // prolong lease
+	}
+	makelease=0;
+      }
+      tr.usec[TRACE_UPDATE] += (uint32_t)(metrics_time(METRIC_UPDATE, t) - t);
+      if (r < 0) {
+	syslog(LOG_ERR, "do_update_lease(): %s", mysql_error(&(rdb->db)));
+	return -28;
+      }
+    } else if (r<0) {
+      syslog(LOG_ERR, "do_find_lease(): %s", mysql_error(&(rdb->db)));
+      return -16;
+    }
+    if (r <= 0) break;
+  }
+  if (makelease) {
+    t = metrics_now();
+    if (do_make_lease(rdb, ip, start, end, hw, cid, rid) != 0) return -17;
+    tr.usec[TRACE_MAKE] = (uint32_t)(metrics_time(METRIC_MAKE, t) - t);
+  }
+  tr.usec[TRACE_TOTAL] = (uint32_t)(metrics_now() - t0);
+  trace_add(&tr);
+  return 0;
 }
 
-int rdb_ip_id(MYSQL *db, const unsigned char *val) {
-  return get_id(db, val, GETIP_RSQL, MAKEIP_RSQL);
-}
+/* Record i of an array of records, or of a selection from one */
+#define SELECTED(recs, sel, i) ((sel) ? &((recs)[(sel)[i]]) : &((recs)[i]))
 
-int rdb_hw_id(MYSQL *db, const unsigned char *val) {
-  return get_id(db, val, GETHW_RSQL, MAKEHW_RSQL);
+/* Record the lag for records that have been committed */
+void committed(ldb_entry recs, const int *sel, int n) {
+  time_t now=time(NULL);
+  int i;
+  for (i = 0; i < n; i++) metrics_committed(now, SELECTED(recs, sel, i)->start);
 }
 
-/* Replace multiple overlapping leases with a single new one */
-int do_replace_leases(MYSQL *db, int ip, time_t searchtime, time_t start, time_t end, int hw, int cid, int rid) {
-  MYSQL_STMT *stmt=NULL;
-  MYSQL_BIND param[5];
-    
-  MYSQL_TIME my_searchtime;
+/* Apply records with resolved ids in one transaction. With 'sel', only the n records
+   it has the indexes of are applied, otherwise the first n. */
+int apply_transaction(rdb_conn rdb, ldb_entry recs, const int *sel, int n) {
+  long long t;
+  int i, r;
 
-  timet2mytime(searchtime, &my_searchtime);
+  if (rdb_begin(rdb) != 0) return -18;
 
-  if ((stmt = mysql_stmt_init(db)) == NULL) {
-    syslog(LOG_ERR, "mysql_stmt_init(): %s", mysql_error(db));
-    return -1;
+  for (i = 0; i < n; i++) {
+    if ((r = apply_record(rdb, SELECTED(recs, sel, i))) != 0) {
+      rdb_rollback(rdb);
+      metrics_count(COUNTER_ROLLBACKS, 1);
+      return r;
+    }
   }
 
-  if (mysql_stmt_prepare(stmt, REMOVE_LEASE_RSQL, strlen(REMOVE_LEASE_RSQL)) != 0) {
-    syslog(LOG_ERR, "mysql_stmt_prepare(): %s", mysql_error(db));
-    return -1;
+  t = metrics_now();
+  if (rdb_commit(rdb) != 0) {
+    rdb_rollback(rdb);
+    metrics_count(COUNTER_ROLLBACKS, 1);
+    return -19;
   }
+  metrics_time(METRIC_COMMIT, t);
+  committed(recs, sel, n);
+  return 0;
+}
 
-  memset ((void *) param, 0, sizeof (param));
+/* Trace n records applied with the stored procedure, since 'since' */
+void trace_calls(int n, long long since) {
+  struct trace_record tr;
 
-  param[0].buffer_type = MYSQL_TYPE_LONG;
-  param[0].buffer = (void *)&ip;
-  param[0].is_unsigned = 0;
-  param[0].is_null = 0;
+  memset(&tr, 0, sizeof(tr));
+  tr.event = TRACE_CALLS;
+  tr.u.batch.count = n;
+  tr.usec[TRACE_TOTAL] = (uint32_t)(metrics_now() - since);
+  trace_add(&tr);
+}
 
-  param[1].buffer_type = MYSQL_TYPE_TIMESTAMP;
-  param[1].buffer = (void *) &my_searchtime;
-  param[1].is_null = 0;
+/* Apply records with calls to the stored procedure, as many to a round trip as fit. In
+   batch mode they are all applied in one transaction, otherwise each call commits on
+   its own. With 'sel', only the n records it has the indexes of are applied. */
+int call_records(rdb_conn rdb, ldb_entry recs, const int *sel, int n, int batchmode) {
+  long long t0 = metrics_now(), t = t0;
+  int i;
 
-  param[2].buffer_type = MYSQL_TYPE_TIMESTAMP;
-  param[2].buffer = (void *) &my_searchtime;
-  param[2].is_null = 0;
+  if (batchmode && rdb_begin(rdb) != 0) return -18;
 
-  if (mysql_stmt_bind_param(stmt, param) != 0) {
-    syslog(LOG_ERR, "mysql_bind_param(): %s", mysql_error(db));
-    return -1;
+  for (i = 0; i < n; i++) {
+    ldb_entry rec = SELECTED(recs, sel, i);
+    if (rdb_add_call(rdb, rec->rtype, rec->start, rec->end, rec->ip, rec->hw, rec->cid, rec->rid) != 0) break;
   }
+  if (i < n || rdb_flush_calls(rdb) != 0) {
+    if (batchmode) {
+      rdb_rollback(rdb);
+      metrics_count(COUNTER_ROLLBACKS, 1);
+    }
+    return -25;
+  }
+  t = metrics_time(METRIC_CALL, t);
 
-  if (mysql_stmt_execute(stmt) != 0) {
-    syslog(LOG_ERR, "mysql_execute(): %s", mysql_error(db));
-    return -1;
+  if (batchmode) {
+    if (rdb_commit(rdb) != 0) {
+      rdb_rollback(rdb);
+      metrics_count(COUNTER_ROLLBACKS, 1);
+      return -19;
+    }
+    metrics_time(METRIC_COMMIT, t);
   }
- 
-  mysql_stmt_close(stmt);
+  committed(recs, sel, n);
+  trace_calls(n, t0);
+  return 0;
+}
 
-  return do_make_lease(db, ip, start, end, hw, cid, rid);
+/* Apply records with calls to the stored procedure over the connections in async_db,
+   all in flight at the same time */
+int call_async(ldb_entry recs, int n) {
+  long long t = metrics_now();
+
+  if (ardb_apply(async_db, recs, n) != 0) return -25;
+  metrics_time(METRIC_CALL, t);
+  committed(recs, NULL, n);
+  trace_calls(n, t);
+  return 0;
 }
 
+/* Apply a whole batch in one transaction. The ids are looked up first, outside the
+   transaction, so that a rollback never takes away ids the id cache already knows. */
+int apply_batch(rdb_conn rdb, ldb_batch b) {
+  int i, r;
 
-/* Try to find an active lease for the IP address in question, and return all the data */
-int do_find_lease(MYSQL *db, int ip, time_t start, time_t *thatstart, time_t *thatend,
-		  int *thathw, int *thatcid, int *thatrid) {
-  MYSQL_STMT *stmt=NULL;
-  MYSQL_BIND param[3], result[5];
-    
-  MYSQL_TIME my_start;
-  MYSQL_TIME my_thatstart, my_thatend;
+  for (i = 0; i < b->nrecs; i++) {
+    if ((r = resolve_ids(rdb, &(b->recs[i]))) != 0) return r;
+  }
+  return apply_transaction(rdb, b->recs, NULL, b->nrecs);
+}
 
-  timet2mytime(start, &my_start);
+/* Apply the records of a batch, in one transaction if we are in batch mode */
+int apply_records(rdb_conn rdb, ldb_batch b, int batchmode) {
+  int i, r;
 
-  if ((stmt = mysql_stmt_init(db)) == NULL) {
-    syslog(LOG_ERR, "mysql_stmt_init(): %s", mysql_error(db));
-    return -1;
+  if (async_db) return call_async(b->recs, b->nrecs);
+  if (procedures) return call_records(rdb, b->recs, NULL, b->nrecs, batchmode);
+  if (batchmode) return apply_batch(rdb, b);
+  for (i = 0; i < b->nrecs; i++) {
+    if ((r = resolve_ids(rdb, &(b->recs[i]))) != 0 || (r = apply_record(rdb, &(b->recs[i]))) != 0) return r;
+    committed(&(b->recs[i]), NULL, 1);
   }
+  return 0;
+}
 
-  if (mysql_stmt_prepare(stmt, FIND_LEASE_RSQL, strlen(FIND_LEASE_RSQL)) != 0) {
-    syslog(LOG_ERR, "mysql_stmt_prepare(): %s", mysql_error(db));
-    return -1;
+/* Make sure the MySQL server is there before we write to it, and log statistics now
+   and then. Returns 0 if we can go ahead, 1 if the server is unreachable right now,
+   or a negative error code. */
+int rdb_ready(rdb_conn rdb) {
+  static int rdb_connected=1;
+  static int laststats=0;
+  int now;
+
+  if (mysql_ping(&(rdb->db))) {
+    if (rdb_connected) {
+      syslog(LOG_WARNING, "MySQL server unreachable");
+      rdb_connected=0;
+    }
+    return 1;
   }
 
-  memset ((void *) param, 0, sizeof (param));
+  if (!rdb_connected) {
+    syslog(LOG_INFO, "Re-connected to MySQL server");
+    rdb_connected=1;
+  }
 
-  param[0].buffer_type = MYSQL_TYPE_LONG;
-  param[0].buffer = (void *)&ip;
-  param[0].is_unsigned = 0;
-  param[0].is_null = 0;
+  now=time(NULL);
+  if (now - laststats >= STATS_INTERVAL) {
+    if (laststats) {
+      log_cache_stats();
+      log_queue_stats();
+      log_lease_stats(rdb, "");
+      log_worker_stats();
+      log_batch_stats();
+      log_trace_stats();
+      metrics_log();
+      if (partition_keep >= 0) schema_partition(&(rdb->db), schema, partition_keep, 0);
+    }
+    laststats = now;
+  }
 
-  param[1].buffer_type = MYSQL_TYPE_TIMESTAMP;
-  param[1].buffer = (void *) &my_start;
-  param[1].is_null = 0;
+  if (rdb_check_statements(rdb) != 0) {
+    syslog(LOG_ERR, "Failed to prepare MySQL statements");
+    return -14;
+  }
+  return 0;
+}
 
-  param[2].buffer_type = MYSQL_TYPE_TIMESTAMP;
-  param[2].buffer = (void *) &my_start;
-  param[2].is_null = 0;
+/* SIGUSR1 asks for the statistics */
+void request_dump(int sig) {
+  dump_requested = 1;
+}
 
-  if (mysql_stmt_bind_param(stmt, param) != 0) {
-    syslog(LOG_ERR, "mysql_bind_param(): %s", mysql_error(db));
-    return -1;
+/* SIGUSR2 asks for the trace records in memory to be written out */
+void request_trace(int sig) {
+  trace_request_dump();
+}
+
+/* Count the records waiting in the queues now and then, if anyone is looking, and log
+   the statistics if we have been asked to */
+void update_metrics(rdb_conn rdb) {
+  static time_t lastcount=0;
+  time_t now=time(NULL);
+  long long n, total=0;
+  int i;
+
+  if (dump_requested || ((serve_metrics || sizer) && now - lastcount >= BACKLOG_INTERVAL)) {
+    for (i = 0; i < nsources; i++) {
+      metrics_backlog(i, (n = ldb_backlog(sources[i].ldb)));
+      if (n > 0) total += n;
+    }
+    if (sizer) batchsize_backlog(sizer, total);
+    lastcount = now;
+  }
+  if (dump_requested) {
+    dump_requested = 0;
+    log_cache_stats();
+    log_queue_stats();
+    log_lease_stats(rdb, "");
+    log_worker_stats();
+    log_batch_stats();
+    log_trace_stats();
+    metrics_log();
   }
+}
 
-  memset ((void *) result, 0, sizeof (result));
+/* Merge overlapping lease rows throughout the leases table, and log how it went */
+int compact_leases(MYSQL *db, int pause_ms) {
+  struct compaction_stats st;
+  time_t t0 = time(NULL);
+  int r;
 
-  result[0].buffer_type = MYSQL_TYPE_TIMESTAMP;
-  result[0].buffer = (void *)&my_thatstart;
-  result[0].is_null = 0;
+  memset((void *)&st, 0, sizeof(st));
+  if (compaction_setup(db) != 0) return -1;
+  r = compaction_pass(db, schema, COMPACTION_CHUNK, pause_ms, &st);
+  metrics_count(COUNTER_COMPACTED, st.merged);
+  syslog(LOG_INFO, "Compaction %s: %lu lease rows looked at, %lu merged into others for %lu addresses, %lu addresses busy, in %ld seconds",
+	 r ? "stopped" : "done", st.rows, st.merged, st.addresses, st.skipped, (long)(time(NULL) - t0));
+  return r;
+}
 
-  result[1].buffer_type = MYSQL_TYPE_TIMESTAMP;
-  result[1].buffer = (void *)&my_thatend;
-  result[1].is_null = 0;
+/* Compact the leases table now and then, on a connection of our own. Addresses that
+   are busy are left for the next time. */
+void *compaction_thread(void *arg) {
+  struct compactor_args *c = (struct compactor_args *)arg;
+  MYSQL db;
+  my_bool bool_true=1;
+  int connected=0;
 
-  result[2].buffer_type = MYSQL_TYPE_LONG;
-  result[2].buffer = (void *)thathw;
-  result[2].is_unsigned = 0;
-  result[2].is_null = 0;
+  mysql_thread_init();
+  while(1) {
+    sleep(c->minutes * 60);
+    if (!connected) {
+      if (!(mysql_init(&db))) {
+	syslog(LOG_ERR, "compaction: mysql_init(): %s", mysql_error(&db));
+	continue;
+      }
+      if (!(mysql_real_connect(&db, c->host, c->user, c->password, c->database, 0, NULL, 0))) {
+	syslog(LOG_WARNING, "compaction: mysql_real_connect(): %s", mysql_error(&db));
+	mysql_close(&db);
+	continue;
+      }
+      mysql_options(&db, MYSQL_OPT_RECONNECT, &bool_true);
+      connected = 1;
+    }
+    if (mysql_ping(&db)) continue;
+    compact_leases(&db, COMPACTION_PAUSE_MS);
+  }
+  return NULL;
+}
 
-  result[3].buffer_type = MYSQL_TYPE_LONG;
-  result[3].buffer = (void *)thatcid;
-  result[3].is_unsigned = 0;
-  result[3].is_null = 0;
+/* Create whatever is missing of the tables, indexes, (with -M) partitions and (with -U)
+   the stored procedure, over a connection of its own */
+int bootstrap_schema(const char *host, const char *user, const char *password, const char *database) {
+  MYSQL db;
+  int r=0;
 
-  result[4].buffer_type = MYSQL_TYPE_LONG;
-  result[4].buffer = (void *)thatrid;
-  result[4].is_unsigned = 0;
-  result[4].is_null = 0;
+  if (!(mysql_init(&db))) {
+    syslog(LOG_ERR, "mysql_init(): %s", mysql_error(&db));
+    return -12;
+  }
+  if (!(mysql_real_connect(&db, host, user, password, database, 0, NULL, 0))) {
+    syslog(LOG_ERR, "mysql_real_connect(): %s", mysql_error(&db));
+    mysql_close(&db);
+    return -12;
+  }
+  if (schema_bootstrap(&db, schema) != 0 ||
+      (partition_keep >= 0 && schema_partition(&db, schema, partition_keep, 1) != 0)) {
+    syslog(LOG_ERR, "Failed to set up the MySQL tables");
+    r = -22;
+  } else if (procedures && schema_procedures(&db, schema) != 0) {
+    syslog(LOG_ERR, "Failed to create the stored procedure");
+    r = -22;
+  }
+  mysql_close(&db);
+  return r;
+}
 
-  if (mysql_stmt_bind_result(stmt, result) != 0) {
-    syslog(LOG_ERR, "mysql_bind_result(): %s", mysql_error(db));
-    return -1;
+int writePidFile(char *filename) {
+  int result=1;
+  FILE *pidfile=fopen(filename,"w");
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%ld\n", (long) getpid());
+  if (fwrite(buf, 1, strlen(buf), pidfile) != strlen(buf)) {
+    perror("Writing to PID file");
+    result=0;
   }
+  fclose(pidfile);
+  return result;
+}
 
-  if (mysql_stmt_execute(stmt) != 0) {
-    syslog(LOG_ERR, "mysql_execute(): %s", mysql_error(db));
-    return -1;
+
+/* Start watching the directory a queue lives in, so that we see writes to the database
+   itself as well as to its -journal and -wal files. All the queues are watched through
+   the one inotify instance in *fd, which is created with the first watch. Returns 0, or
+   -1 if we have to fall back on plain polling for this queue. */
+int watch_queue(int *fd, struct source *src) {
+#ifdef HAVE_SYS_INOTIFY_H
+  char dir[PATH_MAX];
+  const char *filename = src->watch_path;
+  const char *slash = strrchr(filename, '/');
+
+  if (slash) {
+    if (slash - filename >= sizeof(dir)) return -1;
+    memcpy(dir, filename, slash - filename);
+    dir[slash - filename] = '\0';
+    if (!dir[0]) strcpy(dir, "/");
+    src->watch_name = slash + 1;
+  } else {
+    strcpy(dir, ".");
+    src->watch_name = filename;
   }
 
-  if (mysql_stmt_store_result(stmt) != 0) {
-    syslog(LOG_ERR, "mysql_store_result(): %s", mysql_error(db));
+  if (*fd < 0 && (*fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+    syslog(LOG_WARNING, "inotify_init1(): %m. Falling back on polling");
+    return -1;
+  }
+  /* Queues in the same directory get the same watch */
+  if ((src->wd = inotify_add_watch(*fd, dir, IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO)) < 0) {
+    syslog(LOG_WARNING, "inotify_add_watch(%s): %m. Falling back on polling", dir);
     return -1;
   }
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+/* Read all pending inotify events. Returns 1 if any of them concerned a queue */
+int drain_watch(int fd) {
+  int found=0;
+#ifdef HAVE_SYS_INOTIFY_H
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+  size_t nlen;
+  char *p;
+  int i;
+
+  if (fd < 0) return 0;
+  while ((len = read(fd, buf, sizeof(buf))) > 0) {
+    for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      if (!ev->len) continue;
+      for (i = 0; i < nsources; i++) {
+	if (sources[i].wd != ev->wd) continue;
+	nlen = strlen(sources[i].watch_name);
+	/* The database, its -journal or its -wal, but not the -shm index which readers touch too */
+	if (!strncmp(ev->name, sources[i].watch_name, nlen) &&
+	    (ev->name[nlen] == '\0' || (ev->name[nlen] == '-' && strcmp(ev->name + nlen, "-shm")))) {
+	  found = 1;
+	}
+      }
+    }
+  }
+#endif
+  return found;
+}
 
-  if (mysql_stmt_num_rows(stmt) >= 1) {
-    mysql_stmt_fetch(stmt);
+/* Milliseconds from some fixed point in the past */
+long long monotonic_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    *thatstart = mytime2timet(&my_thatstart);
-    *thatend = mytime2timet(&my_thatend);
+/* Sleep until the queue database is written to, or something is pushed to us on the
+   stream, or for at most timeout_ms milliseconds */
+void wait_for_queue(int fd, int timeout_ms) {
+  struct pollfd pfd[3];
+  long long deadline = monotonic_ms() + timeout_ms;
+  int i, nfds=0, streamfds;
+
+  if (fd >= 0) {
+    pfd[0].fd = fd;
+    pfd[0].events = POLLIN;
+    nfds = 1;
+  }
+  streamfds = nfds;
+  if (push_stream) nfds += stream_fds(push_stream, pfd + nfds);
+  if (nfds == 0) {
+    usleep(timeout_ms * 1000);
+    return;
+  }
 
-    if (mysql_stmt_num_rows(stmt) > 1) {
-      if (gluffdebug) {
-	syslog(LOG_DEBUG,"Multiple rows exist. Compacting...");
+  while (timeout_ms > 0) {
+    int r = poll(pfd, nfds, timeout_ms);
+    if (r > 0) {
+      /* Pushed records are taken right away */
+      for (i = streamfds; i < nfds; i++) {
+	if (pfd[i].revents) return;
       }
-      while (mysql_stmt_fetch(stmt)) {
-	*thatstart = min(*thatstart, mytime2timet(&my_thatstart));
-	*thatend = max(*thatstart, mytime2timet(&my_thatend));
+      if (fd >= 0 && pfd[0].revents && drain_watch(fd)) {
+	usleep(WAKEUP_DELAY_MS * 1000);
+	drain_watch(fd);
+	return;
       }
-      mysql_stmt_free_result(stmt);
-      mysql_stmt_close(stmt);
-      //      if (do_replace_leases(db, ip, start, *thatstart, *thatend, *thathw, *thatcid, *thatrid) != 0) return -17;
-    } else {
-      mysql_stmt_free_result(stmt);
-      mysql_stmt_close(stmt);
+    } else if (r == 0 || (r < 0 && (errno != EINTR || dump_requested))) {
+      return;
     }
-
-    return 1;
+    timeout_ms = deadline - monotonic_ms();
   }
+}
 
-  mysql_stmt_free_result(stmt);
-  mysql_stmt_close(stmt);
-  return 0;
+/* Read the next records claimed with the tag after the key into a batch, and fold
+   repeated ACKs together unless told not to. Returns the number of records read from
+   the queue, or -1 on error. */
+int read_batch(ldb_conn ldb, sqlite3_int64 tag, const struct ldb_key *after, struct batch *b) {
+  long long t = metrics_now();
+  struct trace_record tr;
+  int n, c=0;
+
+  n = ldb_read(ldb, tag, after, b->data, batch_bytes);
+  metrics_time(METRIC_FETCH, t);
+  b->nread = (n > 0) ? n : 0;
+  if (n <= 0) return n;
+  if (coalesce) c = ldb_coalesce(b->data);
+  metrics_count(COUNTER_READ, n);
+  metrics_count(COUNTER_COLLAPSED, c);
+  memset(&tr, 0, sizeof(tr));
+  tr.event = TRACE_READ;
+  tr.u.batch.count = n;
+  tr.u.batch.folded = c;
+  tr.usec[TRACE_TOTAL] = (uint32_t)(metrics_now() - t);
+  trace_add(&tr);
+  return n;
 }
 
-/* Change the 'end time' for a lease */
-int do_update_lease(MYSQL *db, int ip, time_t thatstart, time_t thatend, time_t newend, int prolong) {
-  MYSQL_STMT *stmt=NULL;
-  MYSQL_BIND param[5];
-    
-  MYSQL_TIME my_thatstart, my_thatend;
-  MYSQL_TIME my_newend;
+/* Claim new records with the tag, as many as the batches are sized for right now */
+int claim_records(ldb_conn ldb, sqlite3_int64 tag) {
+  long long t = metrics_now();
+  int r;
+  if (sizer) ldb->limit = batchsize_get(sizer);
+  r = ldb_claim(ldb, tag);
+  metrics_time(METRIC_CLAIM, t);
+  return r;
+}
 
-  timet2mytime(thatstart, &my_thatstart);
-  timet2mytime(thatend, &my_thatend);
-  timet2mytime(newend, &my_newend);
+/* Remove the records of a batch from the queue */
+int clear_records(ldb_conn ldb, ldb_batch d) {
+  long long t = metrics_now();
+  int r = ldb_clear(ldb, d);
+  metrics_time(METRIC_CLEAR, t);
+  return r;
+}
 
-  if ((stmt = mysql_stmt_init(db)) == NULL) {
-    syslog(LOG_ERR, "mysql_stmt_init(): %s", mysql_error(db));
-    return -1;
+/* Get an empty batch, recycled if possible */
+struct batch *get_batch(void) {
+  struct batch *b;
+
+  pthread_mutex_lock(&free_batches_lock);
+  if ((b = free_batches) != NULL) free_batches = b->nextfree;
+  pthread_mutex_unlock(&free_batches_lock);
+
+  if (b == NULL) {
+    if ((b = (struct batch *)calloc(1, sizeof(struct batch))) == NULL ||
+	(b->data = ldb_batch_new()) == NULL) {
+      syslog(LOG_ERR, "get_batch(): Out of memory");
+      exit(-21);
+    }
+  }
+  b->remaining = 0;
+  b->finished = 0;
+  b->nextout = NULL;
+  return b;
+}
+
+/* Hand back a batch we are done with */
+void put_batch(struct batch *b) {
+  ldb_batch_reset(b->data);
+  pthread_mutex_lock(&free_batches_lock);
+  b->nextfree = free_batches;
+  free_batches = b;
+  pthread_mutex_unlock(&free_batches_lock);
+}
+
+/* Claim the next records in a queue, or carry on with a claim we could not read all of
+   last time, and hand them to the writer in batches. Returns the number of records in
+   the claim, or -1 if it has to be tried again later. */
+int read_claim(struct source *src, int pid, bqueue queue) {
+  struct ldb_key first = LDB_KEY_FIRST;
+  struct batch *b;
+  int n;
+
+  if (!src->reading) {
+    /* Our pid in the high half keeps the tags apart from those of an earlier run */
+    src->tag = ((sqlite3_int64)pid << 32) | src->seq;
+    if (claim_records(src->rldb, src->tag) != 0) return -1;
+    src->key = first;
+    src->total = 0;
+    src->reading = 1;
   }
 
-  if (prolong) {
-    if (mysql_stmt_prepare(stmt, PROLONG_LEASE_RSQL, strlen(PROLONG_LEASE_RSQL)) != 0) {
-      syslog(LOG_ERR, "mysql_stmt_prepare(): %s", mysql_error(db));
+  /* What we have already handed over will be removed from the queue by the writer, so
+     after an error we go on from where we were rather than from the beginning */
+  while(1) {
+    b = get_batch();
+    b->src = src;
+    if ((n = read_batch(src->rldb, src->tag, &(src->key), b)) < 0) {
+      put_batch(b);
       return -1;
     }
-  } else {
-    if (mysql_stmt_prepare(stmt, CUTOFF_LEASE_RSQL, strlen(CUTOFF_LEASE_RSQL)) != 0) {
-      syslog(LOG_ERR, "mysql_stmt_prepare(): %s", mysql_error(db));
-      return -1;
+    if (n == 0) {
+      put_batch(b);
+      break;
     }
+    src->total += n;
+    src->key = b->data->to;
+    if (!b->data->more) {
+      bqueue_push(queue, b);
+      break;
+    }
+    bqueue_push(queue, b);
   }
+  src->reading = 0;
 
-  memset ((void *) param, 0, sizeof (param));
-  param[0].buffer_type = MYSQL_TYPE_TIMESTAMP;
-  param[0].buffer = (void *) &my_newend;
-  param[0].is_null = 0;
-
-  param[1].buffer_type = MYSQL_TYPE_LONG;
-  param[1].buffer = (void *)&ip;
-  param[1].is_unsigned = 0;
-  param[1].is_null = 0;
-
-  param[2].buffer_type = MYSQL_TYPE_TIMESTAMP;
-  param[2].buffer = (void *) &my_thatstart;
-  param[2].is_null = 0;
+  if (src->total > 0 && ++(src->seq) == 0) src->seq = 1;
+  return src->total;
+}
 
-  if (prolong) {
-    param[3].buffer_type = MYSQL_TYPE_TIMESTAMP;
-    param[3].buffer = (void *) &my_newend;
-    param[3].is_null = 0;
-    
-    param[4].buffer_type = MYSQL_TYPE_TIMESTAMP;
-    param[4].buffer = (void *) &my_thatend;
-    param[4].is_null = 0;
-  } else {
-    param[3].buffer_type = MYSQL_TYPE_TIMESTAMP;
-    param[3].buffer = (void *) &my_thatend;
-    param[3].is_null = 0;
+/* The reader side of the pipeline. Claims and reads batches from each queue on sqlite3
+   connections of its own, each batch with its own tag, and hands them to the writer.
+   The queues take turns, each getting up to its weight in full claims in a row. When
+   the writer is PIPELINE_DEPTH batches behind, bqueue_push() holds us back. */
+void *reader_thread(void *arg) {
+  struct reader_args *args = (struct reader_args *)arg;
+  struct source *src;
+  int poll_ms=POLL_MIN_MS;
+  int i, k, n, busy, got, failed;
+
+  for (i = 0; i < nsources; i++) {
+    src = &(sources[i]);
+    if ((src->rldb = ldb_open(src->filename, src->mode, batch_limit)) == NULL) exit(-10);
+    src->seq = 1;
+    src->reading = 0;
   }
 
-  if (mysql_stmt_bind_param(stmt, param) != 0) {
-    syslog(LOG_ERR, "mysql_bind_param(): %s", mysql_error(db));
-    return -1;
-  }
+  while(1) {
+    busy = got = failed = 0;
+    for (i = 0; i < nsources; i++) {
+      src = &(sources[i]);
+      for (k = 0; k < src->weight; k++) {
+	if ((n = read_claim(src, args->pid, args->queue)) < 0) {
+	  failed = 1;
+	  break;
+	}
+	if (n > 0) got = 1;
+	if (n == 0 || n != src->rldb->limit) break;
+	if (k == src->weight - 1) busy = 1;
+      }
+    }
+    if (sizer && !busy && !failed) batchsize_caught_up(sizer);
 
-  if (mysql_stmt_execute(stmt) != 0) {
-    syslog(LOG_ERR, "mysql_execute(): %s", mysql_error(db));
-    return -1;
+    /* A full claim means there is more waiting, so go again right away */
+    if (busy && !failed) continue;
+    if (got && !failed) poll_ms = POLL_MIN_MS;
+    else poll_ms = min(poll_ms * 2, args->poll_max_ms);
+    wait_for_queue(args->watch_fd, poll_ms);
   }
+  return NULL;
+}
 
-  if (mysql_stmt_affected_rows(stmt) <= 0) {
-    syslog(LOG_WARNING, "do_update_lease(): No rows were updated!");
+/* Mark a batch as written, and remove it and any later ones that are written too
+   from their queues, unless an earlier one is still being written. 'ldb' has the
+   caller's connection to each queue. */
+void finish_batch(ldb_conn *ldb, struct batch *b) {
+  pthread_mutex_lock(&out_lock);
+  b->finished = 1;
+  while (out_head && out_head->finished) {
+    b = out_head;
+    if ((out_head = b->nextout) == NULL) out_tail = NULL;
+    clear_records(ldb[b->src->index], b->data);
+    put_batch(b);
   }
- 
-  mysql_stmt_close(stmt);
-  return 0;
+  pthread_mutex_unlock(&out_lock);
 }
 
-/* Insert a new lease into the database */
-int do_make_lease(MYSQL *db, int ip, time_t start, time_t end, int hw, int cid, int rid) {
-  MYSQL_STMT *stmt=NULL;
-  MYSQL_BIND param[6];
-    
-  MYSQL_TIME my_start, my_end;
+/* A worker writes its share of each batch on its own MySQL connection. The ids have
+   already been looked up by the dispatcher. Whoever finishes the last share of a batch
+   sees to it that the batch is removed from the queue. */
+void *worker_thread(void *arg) {
+  struct worker *w = (struct worker *)arg;
+  struct batch *b;
+  ldb_batch d;
+  const int *sel;
+  int i, r, n;
+  long long t;
+  time_t laststats=time(NULL);
+  char who[32];
+
+  mysql_thread_init();
+  snprintf(who, sizeof(who), "worker %d: ", w->index);
 
-  timet2mytime(start, &my_start);
-  timet2mytime(end, &my_end);
+  while(1) {
+    if (time(NULL) - laststats >= STATS_INTERVAL) {
+      log_lease_stats(w->rdb, who);
+      laststats = time(NULL);
+    }
+    if ((b = (struct batch *)bqueue_pop(w->queue, RECONNECT_INTERVAL * 1000)) == NULL) continue;
+    d = b->data;
+    sel = b->shardidx + b->shardoff[w->index];
+    n = b->shardoff[w->index + 1] - b->shardoff[w->index];
+    t = metrics_now();
+
+    while(1) {
+      if (mysql_ping(&(w->rdb->db))) {
+	sleep(RECONNECT_INTERVAL);
+	continue;
+      }
+      if (rdb_check_statements(w->rdb) != 0) {
+	syslog(LOG_ERR, "worker %d: Failed to prepare MySQL statements", w->index);
+	exit(-14);
+      }
+      if (procedures) {
+	if ((r = call_records(w->rdb, d->recs, sel, n, w->batchmode)) == 0) break;
+	if (!w->batchmode) exit(r);
+	syslog(LOG_WARNING, "worker %d: Batch was rolled back, retrying it", w->index);
+	__atomic_add_fetch(&(w->retries), 1, __ATOMIC_RELAXED);
+	sleep(RECONNECT_INTERVAL);
+      } else if (w->batchmode) {
+	if (apply_transaction(w->rdb, d->recs, sel, n) == 0) break;
+	syslog(LOG_WARNING, "worker %d: Batch was rolled back, retrying it", w->index);
+	__atomic_add_fetch(&(w->retries), 1, __ATOMIC_RELAXED);
+	sleep(RECONNECT_INTERVAL);
+      } else {
+	for (i = 0; i < n; i++) {
+	  if ((r = apply_record(w->rdb, SELECTED(d->recs, sel, i))) != 0) exit(r);
+	  committed(d->recs, sel + i, 1);
+	}
+	break;
+      }
+    }
 
-  if ((stmt = mysql_stmt_init(db)) == NULL) {
-    syslog(LOG_ERR, "mysql_stmt_init(): %s", mysql_error(db));
-    return -1;
-  }
+    __atomic_add_fetch(&(w->batches), 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(w->records), n, __ATOMIC_RELAXED);
+    /* Our share of what was read, before it was folded together */
+    if (sizer) batchsize_observe(sizer, (int)((long long)n * b->nread / d->nrecs), metrics_now() - t);
 
-  if (mysql_stmt_prepare(stmt, MAKE_LEASE_RSQL, strlen(MAKE_LEASE_RSQL)) != 0) {
-    syslog(LOG_ERR, "mysql_stmt_prepare(): %s", mysql_error(db));
-    return -1;
+    if (__atomic_sub_fetch(&(b->remaining), 1, __ATOMIC_ACQ_REL) == 0) {
+      finish_batch(w->ldb, b);
+    }
   }
+  return NULL;
+}
 
-  memset ((void *) param, 0, sizeof (param));
-  param[0].buffer_type = MYSQL_TYPE_LONG;
-  param[0].buffer = (void *)&ip;
-  param[0].is_unsigned = 0;
-  param[0].is_null = 0;
-
-  param[1].buffer_type = MYSQL_TYPE_TIMESTAMP;
-  param[1].buffer = (void *) &my_start;
-  param[1].is_null = 0;
-
-  param[2].buffer_type = MYSQL_TYPE_TIMESTAMP;
-  param[2].buffer = (void *) &my_end;
-  param[2].is_null = 0;
-
-  param[3].buffer_type = MYSQL_TYPE_LONG;
-  param[3].buffer = (void *)&hw;
-  param[3].is_unsigned = 0;
-  param[3].is_null = 0;
+/* Which worker writes the records for an address. The procedure looks up its own ids, so
+   then we go by the address as it is written. */
+static unsigned int shard_of(ldb_entry rec) {
+  const unsigned char *p;
+  unsigned int h = 2166136261u;
 
-  param[4].buffer_type = MYSQL_TYPE_LONG;
-  param[4].buffer = (void *)&cid;
-  param[4].is_unsigned = 0;
-  param[4].is_null = 0;
+  if (!procedures) return (unsigned int)rec->ipid % nworkers;
+  for (p = rec->ip; p && *p; p++) h = (h ^ *p) * 16777619u;
+  return h % nworkers;
+}
 
-  param[5].buffer_type = MYSQL_TYPE_LONG;
-  param[5].buffer = (void *)&rid;
-  param[5].is_unsigned = 0;
-  param[5].is_null = 0;
+/* Look up the ids for a batch and split it between the workers by IP address, so that
+   the records for any one address are all written by the same worker, in queue order.
+   Returns 0, or an error code if the ids could not be looked up. */
+int dispatch_batch(rdb_conn rdb, struct batch *b) {
+  ldb_batch d = b->data;
+  int targets[MAX_WORKERS];
+  int fill[MAX_WORKERS];
+  int i, r, ntargets=0;
+
+  for (i = 0; i < d->nrecs && !procedures; i++) {
+    if ((r = resolve_ids(rdb, &(d->recs[i]))) != 0) return r;
+  }
 
-  if (mysql_stmt_bind_param(stmt, param) != 0) {
-    syslog(LOG_ERR, "mysql_bind_param(): %s", mysql_error(db));
-    return -1;
+  if (b->maxidx < d->nrecs) {
+    if ((b->shardidx = (int *)realloc(b->shardidx, d->nrecs * sizeof(int))) == NULL) {
+      syslog(LOG_ERR, "dispatch_batch(): Out of memory");
+      exit(-21);
+    }
+    b->maxidx = d->nrecs;
   }
 
-  if (mysql_stmt_execute(stmt) != 0) {
-    syslog(LOG_ERR, "mysql_execute(): %s", mysql_error(db));
-    return -1;
+  /* Count the records for each worker, then put their indexes in place, in order */
+  memset((void *)fill, 0, sizeof(fill));
+  for (i = 0; i < d->nrecs; i++) fill[shard_of(&(d->recs[i]))]++;
+  b->shardoff[0] = 0;
+  for (i = 0; i < nworkers; i++) {
+    b->shardoff[i + 1] = b->shardoff[i] + fill[i];
+    if (fill[i]) targets[ntargets++] = i;
+    fill[i] = b->shardoff[i];
+  }
+  for (i = 0; i < d->nrecs; i++) b->shardidx[fill[shard_of(&(d->recs[i]))]++] = i;
+  b->remaining = ntargets;
+
+  pthread_mutex_lock(&out_lock);
+  if (out_tail) out_tail->nextout = b;
+  else out_head = b;
+  out_tail = b;
+  pthread_mutex_unlock(&out_lock);
+
+  /* The batch may be gone as soon as the last share has been handed out */
+  for (i = 0; i < ntargets; i++) {
+    struct worker *w = &(workers[targets[i]]);
+    unsigned int depth = bqueue_depth(w->queue);
+    __atomic_add_fetch(&(w->pushes), 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(w->depthsum), depth, __ATOMIC_RELAXED);
+    if (depth > __atomic_load_n(&(w->maxdepth), __ATOMIC_RELAXED)) {
+      __atomic_store_n(&(w->maxdepth), depth, __ATOMIC_RELAXED);
+    }
+    bqueue_push(w->queue, b);
   }
- 
-  mysql_stmt_close(stmt);
   return 0;
 }
 
-int writePidFile(char *filename) {
-  int result=1;
-  FILE *pidfile=fopen(filename,"w");
-  char buf[32];
-  snprintf(buf, sizeof(buf), "%ld\n", (long) getpid());
-  if (fwrite(buf, 1, strlen(buf), pidfile) != strlen(buf)) {
-    perror("Writing to PID file");
-    result=0;
+/* Claim what is waiting in a queue and write it, a part at a time with a memory limit.
+   'total' is set to the number of records read. Returns 0, 1 if what was claimed has to
+   be tried again in the next cycle, or an error code. */
+int write_claim(struct source *src, rdb_conn rdb, struct batch *batch, int batchmode, sqlite3_int64 tag, int *total) {
+  struct ldb_key key = LDB_KEY_FIRST;
+  long long t = metrics_now();
+  int nrecords, r, failed=0;
+
+  *total = 0;
+  /* A claim that failed is tried again in the next cycle, like in read_claim() */
+  if (claim_records(src->ldb, tag) != 0) {
+    ldb_rewind(src->ldb);
+    return 1;
   }
-  fclose(pidfile);
-  return result;
+  do {
+    if ((nrecords = read_batch(src->ldb, tag, &key, batch)) <= 0) {
+      failed = (nrecords < 0);
+      break;
+    }
+    *total += nrecords;
+    if ((r = apply_records(rdb, batch->data, batchmode)) != 0) {
+      if (!batchmode) return r;
+      syslog(LOG_WARNING, "Batch from %s was rolled back, will retry it in the next cycle", src->filename);
+      failed = 1;
+      break;
+    }
+    /* A rolled back batch, or one we could not read completely, stays claimed and is read
+       again next time (in cursor mode, ldb_rewind() below sees to that) */
+    clear_records(src->ldb, batch->data);
+    if (sizer) batchsize_observe(sizer, nrecords, metrics_now() - t);
+    t = metrics_now();
+    key = batch->data->to;
+  } while (batch->data->more);
+  ldb_batch_reset(batch->data);
+  if (failed) ldb_rewind(src->ldb);
+  return failed;
 }
 
+/* Add a queue to read from. A weight can be given after an '@' at the end of the name. */
+int add_source(char *name, int journal) {
+  struct source *src;
+  char *at, *end;
+  long weight=1;
+
+  if (nsources == MAX_SOURCES) {
+    fprintf(stderr, "At most %d queues\n", MAX_SOURCES);
+    return -1;
+  }
+  if ((at = strrchr(name, '@')) != NULL && at[1]) {
+    weight = strtol(at + 1, &end, 10);
+    if (*end || weight < 1) {
+      fprintf(stderr, "Bad weight for %s\n", name);
+      return -1;
+    }
+    *at = '\0';
+  }
+  src = &(sources[nsources]);
+  memset(src, 0, sizeof(struct source));
+  src->index = nsources++;
+  src->filename = name;
+  src->mode = journal ? LDB_MODE_JOURNAL : LDB_MODE_CLAIM;
+  src->weight = (int)weight;
+  src->wd = -1;
+  return 0;
+}
 
 /* Main program - parse arguments, fork and start running */
 int main(int argc, char** argv)
 {
-  sqlite3 *ldb;
-  MYSQL rdb;
-  ldb_entry reclist = NULL, tmprec;
+  sqlite3 *qdb;
+  MYSQL tmpdb;
+  rdb_conn rdb;
+  struct batch *batch;
+  struct source *src;
 
-  struct sqlite3_stmt* ldb_query;
   int r;
   int reset=0;
   int do_fork=1;
   int be_quiet=0;
-  int lasttime=0;
+  long cache_kb=IDCACHE_DEFAULT_KB;
   struct stat stbuf;
-  my_bool bool_true=1;
 
   int pid=getpid();
   int syslog_opts=LOG_PID;
 
   int o;
-  char *ldb_filename=NULL;
+  char *stream_path=NULL;
+  ldb_batch pushed=NULL;
+  struct ldb_key *pushed_keys=NULL;
+  int stream_max;
+  int streamed;
   char *rdb_host=NULL;
   char *rdb_user=NULL;
   char *rdb_password=NULL;
   char *rdb_db=NULL;
   char *pidfile=NULL;
-  int rdb_connected=0;
-
-  while ((o=getopt(argc, argv, "l:h:u:p:d:RFQP:D")) != -1) {
+  int batchmode=0;
+  int pipelined=0;
+  int bootstrap=0;
+  int watch_fd=-1;
+  int poll_ms=POLL_MIN_MS;
+  int poll_max_ms=0;
+  int nrecords;
+  int total;
+  int failed;
+  int busy;
+  int watched=0;
+  int i, k;
+  char *metrics_path=NULL;
+  int adapt_ms=0;
+  long long catchup=CATCHUP_DEFAULT;
+  int compact_once=0;
+  int nasync=0;
+  char *trace_path=NULL;
+  int trace_on_signal=0;
+  struct compactor_args compactor;
+  pthread_t compactor_thread;
+  struct sigaction sa;
+
+  memset((void *)&compactor, 0, sizeof(compactor));
+
+  while ((o=getopt(argc, argv, "l:j:h:u:p:d:RFQP:Dc:Ti:Lw:a:Cm:bBM:Hn:S:E:A:K:UXZ:y:O:o")) != -1) {
     switch (o) {
-    case 'l': ldb_filename = optarg;
+    case 'l':
+    case 'j':
+      if (add_source(optarg, (o == 'j')) != 0) return -1;
       break;
     case 'h': rdb_host = optarg;
       break;
@@ -624,6 +1321,53 @@ int main(int argc, char** argv)
       break;
     case 'D': gluffdebug = 1;
       break;
+    case 'c': cache_kb = atol(optarg);
+      break;
+    case 'T': batchmode = 1;
+      break;
+    case 'i': poll_max_ms = atoi(optarg) * 1000;
+      break;
+    case 'L': pipelined = 1;
+      break;
+    case 'w': nworkers = atoi(optarg);
+      pipelined = 1;
+      break;
+    case 'a': active_leases = atoi(optarg);
+      break;
+    case 'C': coalesce = 0;
+      break;
+    case 'm': batch_bytes = (size_t)atol(optarg) * 1024;
+      break;
+    case 'b': schema = RDB_SCHEMA_COMPACT;
+      break;
+    case 'B': bootstrap = 1;
+      break;
+    case 'M': partition_keep = atoi(optarg);
+      break;
+    case 'H': queue_mode = LDB_MODE_CURSOR;
+      break;
+    case 'n': batch_limit = atoi(optarg);
+      break;
+    case 'S': stream_path = optarg;
+      break;
+    case 'E': metrics_path = optarg;
+      break;
+    case 'A': adapt_ms = atoi(optarg);
+      break;
+    case 'K': catchup = atoll(optarg);
+      break;
+    case 'U': procedures = 1;
+      break;
+    case 'X': compact_once = 1;
+      break;
+    case 'Z': compactor.minutes = atoi(optarg);
+      break;
+    case 'y': nasync = atoi(optarg);
+      break;
+    case 'O': trace_path = optarg;
+      break;
+    case 'o': trace_on_signal = 1;
+      break;
     default:
       usage(argv[0]);
       return -1;
@@ -631,47 +1375,81 @@ int main(int argc, char** argv)
     }
   }
 
-  if (!ldb_filename || !rdb_host || !rdb_user || !rdb_password || !rdb_db) {
+  if ((nsources == 0 && !compact_once) || !rdb_host || !rdb_user || !rdb_password || !rdb_db ||
+      nworkers < 1 || nworkers > MAX_WORKERS || (stream_path && pipelined) || compactor.minutes < 0 ||
+      nasync < 0 || nasync > ARDB_MAXCONNS || (nasync > 0 && (!procedures || nworkers > 1 || batchmode)) ||
+      (trace_on_signal && !trace_path)) {
     usage(argv[0]);
     return -1;
   }
 
+  /* A journal takes the place of a queue database, and is read like one is in cursor mode */
+  for (i = 0; i < nsources; i++) {
+    if (sources[i].mode != LDB_MODE_JOURNAL) sources[i].mode = queue_mode;
+  }
+
   if (!be_quiet) syslog_opts |= LOG_PERROR;
 
   openlog("gluff", syslog_opts, LOG_LOCAL2);
 
-  if (stat(ldb_filename, &stbuf) != 0) {
-    syslog(LOG_INFO, "Creating sqlite3 database %s", ldb_filename);
-    if (sqlite3_open(ldb_filename, &ldb) == SQLITE_OK) {
-      sqlite3_extended_result_codes(ldb, 1);
-      sqlite3_busy_timeout(ldb, 600);
-      
-      if (sqlite3_exec(ldb, "CREATE TABLE IF NOT EXISTS lease_queue (start integer, rtype integer, idx integer, claimed integer, end integer, ip text, hw text, cid text, rid text, primary key(start, idx))", NULL, NULL, NULL) == SQLITE_OK) {
-	syslog(LOG_ERR, "Failed to create table lease_queue: %s", sqlite3_errmsg(ldb));
-	sqlite3_close(ldb);
-	ldb = NULL;
+  /* Compaction on its own needs nothing but the MySQL server */
+  if (compact_once) {
+    if (!(mysql_init(&tmpdb))) {
+      syslog(LOG_ERR, "mysql_init(): %s", mysql_error(&tmpdb));
+      return -11;
+    }
+    if (!(mysql_real_connect(&tmpdb, rdb_host, rdb_user, rdb_password, rdb_db, 0, NULL, 0))) {
+      syslog(LOG_ERR, "mysql_real_connect(): %s", mysql_error(&tmpdb));
+      return -12;
+    }
+    r = compact_leases(&tmpdb, 0);
+    mysql_close(&tmpdb);
+    return r ? -26 : 0;
+  }
+
+  for (i = 0; i < nsources; i++) {
+    src = &(sources[i]);
+    if (src->mode == LDB_MODE_JOURNAL) {
+      if (stat(src->filename, &stbuf) != 0) {
+	syslog(LOG_INFO, "Creating journal directory %s", src->filename);
+	if (mkdir(src->filename, 0755) != 0) {
+	  syslog(LOG_ERR, "Failed to create journal directory %s: %m", src->filename);
+	  return -2;
+	}
+      }
+    } else if (stat(src->filename, &stbuf) != 0) {
+      syslog(LOG_INFO, "Creating sqlite3 database %s", src->filename);
+      if (sqlite3_open(src->filename, &qdb) == SQLITE_OK) {
+	sqlite3_extended_result_codes(qdb, 1);
+	sqlite3_busy_timeout(qdb, 600);
+	
+	if (sqlite3_exec(qdb, "CREATE TABLE IF NOT EXISTS lease_queue (start integer, rtype integer, idx integer, claimed integer, end integer, ip text, hw text, cid text, rid text, primary key(start, idx))", NULL, NULL, NULL) == SQLITE_OK) {
+	  syslog(LOG_ERR, "Failed to create table lease_queue: %s", sqlite3_errmsg(qdb));
+	  sqlite3_close(qdb);
+	  qdb = NULL;
+	  return -2;
+	}
+	sqlite3_close(qdb);
+      } else {
+	syslog(LOG_ERR, "Failed to create database %s: %s", src->filename, sqlite3_errmsg(qdb));
 	return -2;
       }
-      sqlite3_close(ldb);
-    } else {
-      syslog(LOG_ERR, "Failed to create database %s: %s", ldb_filename, sqlite3_errmsg(ldb));
-      return -2;
     }
   }
 
     
   if (do_fork) {
-    if (!(mysql_init(&rdb))) {
-      syslog(LOG_ERR, "mysql_init(): %s", mysql_error(&rdb));
+    if (!(mysql_init(&tmpdb))) {
+      syslog(LOG_ERR, "mysql_init(): %s", mysql_error(&tmpdb));
       return -11;
     }
 
-    if (!(mysql_real_connect(&rdb, rdb_host, rdb_user, rdb_password, rdb_db, 0, NULL, 0))) {
-      syslog(LOG_ERR, "mysql_real_connect(): %s", mysql_error(&rdb));
+    if (!(mysql_real_connect(&tmpdb, rdb_host, rdb_user, rdb_password, rdb_db, 0, NULL, 0))) {
+      syslog(LOG_ERR, "mysql_real_connect(): %s", mysql_error(&tmpdb));
       return -12;
     }
 
-    mysql_close(&rdb);
+    mysql_close(&tmpdb);
 
     closelog();
 
@@ -691,221 +1469,295 @@ int main(int argc, char** argv)
     if (!writePidFile(pidfile))
       exit(-2);
 
-  if (sqlite3_open(ldb_filename, &ldb) != SQLITE_OK) {
-    syslog(LOG_ERR, "Failed to open sqlite3 database %s: %s", ldb_filename, sqlite3_errmsg(ldb));
-    return -10;
+  for (i = 0; i < nsources; i++) {
+    if ((sources[i].ldb = ldb_open(sources[i].filename, sources[i].mode, batch_limit)) == NULL) {
+      return -10;
+    }
   }
 
-  sqlite3_extended_result_codes(ldb, 1);
-  sqlite3_busy_timeout(ldb, 6000);
-      
-  if (!(mysql_init(&rdb))) {
-    syslog(LOG_ERR, "mysql_init(): %s", mysql_error(&rdb));
-    return -11;
+  /* This has to happen before rdb_connect(), which needs the tables to be there */
+  if (bootstrap) {
+    if ((r = bootstrap_schema(rdb_host, rdb_user, rdb_password, rdb_db)) != 0) {
+      return r;
+    }
   }
 
-  if (!(mysql_real_connect(&rdb, rdb_host, rdb_user, rdb_password, rdb_db, 0, NULL, 0))) {
-    syslog(LOG_ERR, "mysql_real_connect(): %s", mysql_error(&rdb));
+  if ((rdb = rdb_connect(rdb_host, rdb_user, rdb_password, rdb_db, schema, procedures ? RDB_PROCEDURES : 0)) == NULL) {
     return -12;
   }
+  if (track_leases(rdb) != 0) {
+    return -13;
+  }
+  if (!bootstrap) {
+    schema_check(&(rdb->db), schema);
+    if (partition_keep >= 0) schema_partition(&(rdb->db), schema, partition_keep, 0);
+    if (procedures && schema_has_procedures(&(rdb->db)) != 1) {
+      syslog(LOG_ERR, "The stored procedure " RDB_PROCEDURE " is missing. Run with -B to create it");
+      return -22;
+    }
+  }
 
-  rdb_connected=1;
+  syslog(LOG_INFO, "%s v%s starting, using MySQL database mysql://%s@%s/%s", PRODUCT, VERSION,
+	 rdb_user, rdb_host, rdb_db);
+  for (i = 0; i < nsources; i++) {
+    src = &(sources[i]);
+    syslog(LOG_INFO, "Reading from %s %s, weight %d", (src->mode == LDB_MODE_JOURNAL) ? "journal" : "Sqlite3 database",
+	   src->filename, src->weight);
+    metrics_source(i, src->filename);
+  }
 
-  // For versions before 5.1.6, this has to be called *after* mysql_real_connect(); for
-  // versions before 5.0.3, it doesn't have to be called at all, since it's the default.
-  // Setting the option here seems like the safest solution.
-  mysql_options(&rdb, MYSQL_OPT_RECONNECT, &bool_true);
+  if (nasync > 0) {
+#ifdef HAVE_MYSQL_NONBLOCKING
+    if ((async_db = ardb_new(rdb_host, rdb_user, rdb_password, rdb_db, schema, nasync)) == NULL) {
+      return -12;
+    }
+    syslog(LOG_INFO, "Calling " RDB_PROCEDURE " on %d MySQL connections at once", nasync);
+#else
+    syslog(LOG_WARNING, "Built without the non-blocking MySQL client calls, so -y is ignored");
+#endif
+  }
 
-  syslog(LOG_INFO, "%s v%s starting, using Sqlite3 database %s and MySQL database mysql://%s@%s/%s", PRODUCT, VERSION, ldb_filename, rdb_user, rdb_host, rdb_db);
+  if (cache_kb > 0) {
+    if ((gluffcache = idcache_new((size_t)cache_kb * 1024)) == NULL) {
+      syslog(LOG_ERR, "Failed to create an id cache of %ld kB", cache_kb);
+      return -13;
+    }
+    preload_cache(&(rdb->db));
+  }
+
+  /* dhcpd's writes to the journal are made through a memory map, which inotify doesn't
+     see, so it rewrites the head file to tell us about them */
+  for (i = 0; i < nsources; i++) {
+    src = &(sources[i]);
+    if (src->mode == LDB_MODE_JOURNAL) snprintf(src->watch_path, sizeof(src->watch_path), "%s/%s", src->filename, JOURNAL_HEAD);
+    else snprintf(src->watch_path, sizeof(src->watch_path), "%s", src->filename);
+    if (watch_queue(&watch_fd, src) == 0) {
+      syslog(LOG_INFO, "Watching %s for changes", src->watch_path);
+      watched++;
+    }
+  }
+  /* Only if all of them are watched can we wait long between polls */
+  if (poll_max_ms <= 0) poll_max_ms = (watched == nsources) ? POLL_MAX_INOTIFY_MS : POLL_MAX_MS;
+
+  stream_max = (batch_limit > 0) ? batch_limit : STREAM_BATCH_MAX;
+  if (stream_path) {
+    if ((push_stream = stream_open(stream_path)) == NULL ||
+	(pushed = ldb_batch_new()) == NULL ||
+	(pushed_keys = (struct ldb_key *)calloc(stream_max, sizeof(struct ldb_key))) == NULL) {
+      return -23;
+    }
+    syslog(LOG_INFO, "Taking events pushed by dhcpd on %s for %s", stream_path, sources[0].filename);
+  }
+
+  /* Without a starting point, start small */
+  if (adapt_ms > 0) {
+    if ((sizer = batchsize_new((batch_limit > 0) ? batch_limit : BATCHSIZE_MIN, adapt_ms, nworkers, catchup)) == NULL) {
+      syslog(LOG_ERR, "Out of memory");
+      return -21;
+    }
+    syslog(LOG_INFO, "Sizing batches to take about %d ms, starting at %d records", adapt_ms, batchsize_get(sizer));
+  } else {
+    metrics_batchsize(batch_limit, 0);
+  }
+
+  if (metrics_path) {
+    if (metrics_serve(metrics_path) != 0) {
+      return -24;
+    }
+    serve_metrics = 1;
+    syslog(LOG_INFO, "Serving metrics on %s", metrics_path);
+  }
+
+  if (trace_path || gluffdebug) {
+    if (trace_start(trace_path, trace_on_signal, gluffdebug) != 0) {
+      return -27;
+    }
+    if (trace_path) syslog(LOG_INFO, "Tracing to %s%s", trace_path, trace_on_signal ? " on SIGUSR2" : "");
+  }
+
+  if (compactor.minutes > 0) {
+    compactor.host = rdb_host;
+    compactor.user = rdb_user;
+    compactor.password = rdb_password;
+    compactor.database = rdb_db;
+    if ((r = pthread_create(&compactor_thread, NULL, compaction_thread, &compactor)) != 0) {
+      syslog(LOG_ERR, "pthread_create(): %s", strerror(r));
+      return -21;
+    }
+    pthread_detach(compactor_thread);
+    syslog(LOG_INFO, "Merging overlapping lease rows every %d minutes", compactor.minutes);
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = request_dump;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+  sa.sa_handler = request_trace;
+  sigaction(SIGUSR2, &sa, NULL);
+  if (poll_max_ms < POLL_MIN_MS) poll_max_ms = POLL_MIN_MS;
 
   /* Resetting means that we change back the 'claimed' column for all records in the queue to "0"
      before we start. This is safe if you are running only one "consumer" on any given sqlite3
      database, i.e. practically always. */
-  if (reset && sqlite3_exec(ldb, RESET_LSQL, NULL, NULL, NULL) != SQLITE_OK) {
-    syslog(LOG_ERR, "Failed to reset queue entries: %s", sqlite3_errmsg(ldb));
-    return -20;
+  for (i = 0; i < nsources && reset; i++) {
+    if (ldb_reset(sources[i].ldb) != 0) return -20;
   }
-  
-  /* Loop forever, first "claiming" any new records by changing the "claimed" column to our own PID,
-     then reading them one at a time in chronological order, and updating the MySQL database. 
-     If something fails along the way, generally an error will be logged and the application exits.
-  */
-  while(1) {
-    if (!mysql_ping(&rdb)) {
-      int now=time(NULL);
 
-      if (!rdb_connected) {
-	syslog(LOG_INFO, "Re-connected to MySQL server");
-	rdb_connected=1;
-      }
-      
-      if (now != lasttime) {
-	lasttime = now;
-      }
+  if (pipelined) {
+    struct reader_args args;
+    pthread_t reader;
+    bqueue pipeline;
 
-      if (sqlite3_prepare_v2(ldb, CLAIM_LSQL, strlen(CLAIM_LSQL), &ldb_query, NULL) != SQLITE_OK ||
-	  sqlite3_bind_int(ldb_query,1,pid) != SQLITE_OK) {
-	syslog(LOG_ERR, "Failed to claim queue entries: %s", sqlite3_errmsg(ldb));
-	return -20;
-      }
+    if (!sqlite3_threadsafe()) {
+      syslog(LOG_ERR, "Pipelined mode needs a thread-safe sqlite3 library");
+      return -21;
+    }
+    if ((pipeline = bqueue_new(PIPELINE_DEPTH)) == NULL) {
+      syslog(LOG_ERR, "Failed to create the batch queue");
+      return -21;
+    }
 
-      if (sqlite3_step(ldb_query) != SQLITE_DONE) {
-	syslog(LOG_ERR, "sqlite3_step(): %s", sqlite3_errmsg(ldb));
+    /* With more than one connection, we only look up ids and hand out the records */
+    if (nworkers > 1) {
+      if ((workers = (struct worker *)calloc(nworkers, sizeof(struct worker))) == NULL) {
+	syslog(LOG_ERR, "Failed to create the workers");
+	return -21;
       }
-      
-      if (sqlite3_finalize(ldb_query) != SQLITE_OK) {
-	syslog(LOG_ERR, "sqlite3_finalize(): %s", sqlite3_errmsg(ldb));
-      }
-      
-      if (sqlite3_prepare_v2(ldb, GET_LSQL, strlen(GET_LSQL), &ldb_query, NULL) != SQLITE_OK ||
-	  sqlite3_bind_int(ldb_query,1,pid) != SQLITE_OK) {
-	syslog(LOG_ERR, "Failed to retrieve queue entries: %s", sqlite3_errmsg(ldb));
-	return -20;
-      }
-      
-      while ((r=sqlite3_step(ldb_query)) == SQLITE_BUSY || (r == SQLITE_ROW)) {
-	if (r == SQLITE_BUSY) usleep(300000);
-	else {
-	  const unsigned char *cidstr;
-	  const unsigned char *ridstr;
-	  if (sqlite3_column_type(ldb_query, 5) != SQLITE_NULL) {
-	    cidstr = sqlite3_column_text(ldb_query, 5);
-	  } else {
-	    cidstr = NULL;
-	  }
-	  if (sqlite3_column_type(ldb_query, 6) != SQLITE_NULL) {
-	    ridstr = sqlite3_column_text(ldb_query, 6);	
-	  } else {
-	    ridstr = NULL;
-	  }
-	  // resultset = start, rtype, end, ip, hw, cid, rid
-	  // addrecord(list, start, end, rtype, ip, hw, cid, rid)
-	  addrecord(&reclist,
-		    sqlite3_column_int(ldb_query, 0),
-		    sqlite3_column_int(ldb_query, 2),
-		    sqlite3_column_int(ldb_query, 1),
-		    sqlite3_column_text(ldb_query, 3),
-		    sqlite3_column_text(ldb_query, 4),
-		    cidstr,
-		    ridstr);
+      for (i = 0; i < nworkers; i++) {
+	struct worker *w = &(workers[i]);
+	w->index = i;
+	w->batchmode = batchmode;
+	if ((w->queue = bqueue_new(WORKER_DEPTH)) == NULL) {
+	  syslog(LOG_ERR, "Failed to create the worker queues");
+	  return -21;
 	}
-      }
-
-      if (r != SQLITE_DONE) {
-	syslog(LOG_ERR, "sqlite3_step(): %s", sqlite3_errmsg(ldb));
-      }
-      
-      if (sqlite3_finalize(ldb_query) != SQLITE_OK) {
-	syslog(LOG_ERR, "sqlite3_finalize(): %s", sqlite3_errmsg(ldb));
-      }
-      
-      for (tmprec = reclist; tmprec; tmprec = tmprec->next) {
-	unsigned char *cidstr = NULL;
-	unsigned char *ridstr = NULL;
-	int cid, rid;
-	// start, end, ip, hw, cid, rid
-	time_t start = tmprec->start;
-	time_t end = tmprec->end;
-	int rtype = tmprec->rtype;
-	unsigned char *ipstr = tmprec->ip;
-	unsigned char *hwstr = tmprec->hw;
-	if (tmprec->cid != NULL) {
-	  cidstr = tmprec->cid;
-	  cid = rdb_cid_id(&rdb,cidstr);
-	} else {
-	  cidstr = (unsigned char *)"<NULL>";
-	  cid = 0;
+	if ((w->rdb = rdb_connect(rdb_host, rdb_user, rdb_password, rdb_db, schema, procedures ? RDB_PROCEDURES : 0)) == NULL) {
+	  return -12;
 	}
-
-	if (tmprec->rid != NULL) {
-	  ridstr = tmprec->rid;
-	  rid = rdb_rid_id(&rdb,ridstr);
-	} else {
-	  ridstr = (unsigned char *)"<NULL>";
-	  rid = 0;
+	if (track_leases(w->rdb) != 0) {
+	  return -13;
 	}
-
-	int ip = rdb_ip_id(&rdb,ipstr);
-	int hw = rdb_hw_id(&rdb,hwstr);
-	time_t thatstart, thatend;
-	int thathw=-1, thatcid=-1, thatrid=-1;
-	
-	if (!(ip * hw)) return -15;
-	
-	char tbuf1[64], tbuf2[64];
-	
-	ctime_r(&start, tbuf1);
-	ctime_r(&end, tbuf2);
-	
-	if (tbuf1[strlen(tbuf1) - 1] == '\n') tbuf1[strlen(tbuf1) - 1] = '\0';
-	if (tbuf2[strlen(tbuf2) - 1] == '\n') tbuf2[strlen(tbuf2) - 1] = '\0';
-	
-	syslog(LOG_DEBUG, "%s on ip: %s, hw: %s, cid: %s, rid: %s, start: %s, end: %s",
-	       (rtype==1)?"RELEASE":"ACK",
-	       ipstr, hwstr, cidstr, ridstr, tbuf1, tbuf2);
-	
-	int makelease=1;
-	if ((r=do_find_lease(&rdb, ip, start, &thatstart, &thatend, &thathw, &thatcid, &thatrid)) > 0) {
-	  if (gluffdebug) {
-	    char buf1[64], buf2[64];
-	    syslog(LOG_DEBUG, "Found lease in rdb. hw(%d,%d), cid(%d,%d), rid(%d,%d) [%s..%s]", hw, thathw, cid, thatcid, rid, thatrid, ctime_r(&thatstart, buf1), ctime_r(&thatend, buf2));
-	  }
-	  if (hw != thathw || cid != thatcid || rid != thatrid) {
-	    if (gluffdebug) {
-	      syslog(LOG_DEBUG, "Different hw, cid or rid. Cutting off and making a new one");
-	    }
-	    do_update_lease(&rdb, ip, thatstart, thatend, start, 0); // cut off old lease
-	  } else {
-	    if (rtype == 1) {
-	      if (gluffdebug) {
-		syslog(LOG_DEBUG, "Release. Cutting off the lease I found");
-	      }
-	      do_update_lease(&rdb, ip, thatstart, thatend, end, 0); // cut off old lease
-	    } else {
-	      if (gluffdebug) {
-		syslog(LOG_DEBUG, "Prolonging identical lease");
-	      }
-	      do_update_lease(&rdb, ip, thatstart, thatend, end, 1); // prolong lease
-	    }
-	    makelease=0;
+	for (k = 0; k < nsources; k++) {
+	  if ((w->ldb[k] = ldb_open(sources[k].filename, sources[k].mode, batch_limit)) == NULL) {
+	    return -10;
 	  }
-	} else if (r<0) {
-	  syslog(LOG_ERR, "do_find_lease(): %s", mysql_error(&rdb));
-	  return -16;
 	}
-	if (makelease) {
-	  if (gluffdebug) {
-	    syslog(LOG_DEBUG, "Making new lease entry");
-	  }
-	  if (do_make_lease(&rdb, ip, start, end, hw, cid, rid) != 0) return -17;
+	if ((r = pthread_create(&(w->thread), NULL, worker_thread, w)) != 0) {
+	  syslog(LOG_ERR, "pthread_create(): %s", strerror(r));
+	  return -21;
 	}
       }
+      syslog(LOG_INFO, "Writing with %d MySQL connections", nworkers);
+    }
+
+    args.pid = pid;
+    args.watch_fd = watch_fd;
+    args.poll_max_ms = poll_max_ms;
+    args.queue = pipeline;
+    if ((r = pthread_create(&reader, NULL, reader_thread, &args)) != 0) {
+      syslog(LOG_ERR, "pthread_create(): %s", strerror(r));
+      return -21;
+    }
 
-      freerecords(&reclist);
-      
-      if (sqlite3_prepare_v2(ldb, CLEAR_LSQL, strlen(CLEAR_LSQL), &ldb_query, NULL) != SQLITE_OK ||
-	  sqlite3_bind_int(ldb_query,1,pid) != SQLITE_OK) {
-	syslog(LOG_ERR, "Failed to clear queue entries: %s", sqlite3_errmsg(ldb));
-	return -20;
+    /* We are the writer. A batch is only removed from the queue after it has been written,
+       and a rolled back batch is retried until it goes through, so nothing is ever written
+       out of order. Waking up now and then without a batch keeps the connection alive. */
+    while(1) {
+      struct batch *b = (struct batch *)bqueue_pop(pipeline, RECONNECT_INTERVAL * 1000);
+      long long t = metrics_now();
+
+      while(1) {
+	update_metrics(rdb);
+	if ((r = rdb_ready(rdb)) < 0) return r;
+	if (r > 0) {
+	  sleep(RECONNECT_INTERVAL);
+	  continue;
+	}
+	if (!b) break;
+	if (nworkers > 1) r = dispatch_batch(rdb, b);
+	else r = apply_records(rdb, b->data, batchmode);
+	if (r == 0) break;
+	if (!batchmode) return r;
+	syslog(LOG_WARNING, "Batch was rolled back, retrying it");
+	sleep(RECONNECT_INTERVAL);
       }
-      while ((r=sqlite3_step(ldb_query)) == SQLITE_BUSY) {
-	usleep(1000);
+
+      /* With several workers, the last one to finish does this */
+      if (b && nworkers == 1) {
+	clear_records(b->src->ldb, b->data);
+	if (sizer) batchsize_observe(sizer, b->nread, metrics_now() - t);
+	put_batch(b);
       }
-      
-      if (r != SQLITE_DONE) {
-	syslog(LOG_ERR, "sqlite3_step(): %s", sqlite3_errmsg(ldb));
+    }
+  }
+
+  batch = get_batch();
+
+  /* Loop forever, first "claiming" any new records by changing the "claimed" column to our own PID,
+     then reading them one at a time in chronological order, and updating the MySQL database. 
+     If something fails along the way, generally an error will be logged and the application exits.
+  */
+  while(1) {
+    update_metrics(rdb);
+    if ((r = rdb_ready(rdb)) < 0) return r;
+    if (r > 0) {
+      sleep(RECONNECT_INTERVAL);
+      continue;
+    }
+
+    /* What dhcpd pushes is a copy of what it has just put in the first queue. The records
+       that come right after what has been written from there are applied and removed from
+       the queue as if they had been claimed, without reading them back; the rest are
+       dropped, and claimed from the queue as usual. */
+    streamed = 0;
+    if (push_stream) {
+      ldb_batch_reset(pushed);
+      if (stream_receive(push_stream, pushed, pushed_keys, stream_max) < 0) return -21;
+      if (pushed->nrecs > 0 && (streamed = ldb_pushed(sources[0].ldb, pid, pushed, pushed_keys)) < 0) {
+	streamed = 0;
       }
-      
-      if (sqlite3_finalize(ldb_query) != SQLITE_OK) {
-	syslog(LOG_ERR, "sqlite3_finalize(): %s", sqlite3_errmsg(ldb));
+      if (streamed > 0) {
+	i = coalesce ? ldb_coalesce(pushed) : 0;
+	if ((r = apply_records(rdb, pushed, batchmode)) != 0) {
+	  if (!batchmode) return r;
+	  /* They are still in the queue, and claimed from there next time */
+	  syslog(LOG_WARNING, "Pushed records were rolled back, will read them from %s in the next cycle",
+		 sources[0].filename);
+	  ldb_rewind(sources[0].ldb);
+	} else {
+	  clear_records(sources[0].ldb, pushed);
+	  metrics_count(COUNTER_READ, streamed);
+	  metrics_count(COUNTER_COLLAPSED, i);
+	}
       }
-    } else {
-      if (rdb_connected) {
-	syslog(LOG_WARNING, "MySQL server unreachable");
-	rdb_connected=0;
+    }
+
+    /* The queues take turns, each getting up to its weight in full claims in a row. With a
+       memory limit, what we claimed is read and applied a part at a time. */
+    total = 0;
+    busy = 0;
+    failed = 0;
+    for (i = 0; !failed && i < nsources; i++) {
+      src = &(sources[i]);
+      for (k = 0; k < src->weight; k++) {
+	if ((r = write_claim(src, rdb, batch, batchmode, pid, &nrecords)) < 0) return r;
+	total += nrecords;
+	if (r > 0) {
+	  failed = 1;
+	  break;
+	}
+	if (nrecords == 0 || nrecords != src->ldb->limit) break;
+	if (k == src->weight - 1) busy = 1;
       }
     }
-    sleep(5);
+    if (sizer && !busy && !failed) batchsize_caught_up(sizer);
+
+    /* A full claim means there is more waiting, so go again right away. Otherwise
+       wait for dhcpd to write something, polling less often the longer we are idle. */
+    if (!failed && busy) continue;
+    if (total > 0 || streamed > 0) poll_ms = POLL_MIN_MS;
+    else poll_ms = min(poll_ms * 2, poll_max_ms);
+    wait_for_queue(watch_fd, poll_ms);
   }
 
   return 1;
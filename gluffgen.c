@@ -0,0 +1,340 @@
+/*
+ * gluffgen - make up DHCP traffic in a lease_queue database, for benchmarking gluff, and
+ *            write out the lease records gluff should end up with.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sqlite3.h>
+
+/* The pool is a number of addresses from here on */
+#define POOL_BASE 0x0a000001	/* 10.0.0.1 */
+
+/* How many addresses we look at to find one to use, before we give up on that kind of
+   event */
+#define SCAN_MAX 4096
+
+/* The chance of a burst starting, in tenths of a percent per event */
+#define BURST_PERMILLE 10
+
+/* A device. A client that has been let go of may come back later, on another address. */
+struct client {
+  char hw[18];
+  char cid[32];			/* empty for none */
+  char rid[32];
+  int bound;
+};
+
+/* An address in the pool */
+struct address {
+  int client;			/* -1 when free */
+  time_t start;			/* of the last ACK */
+  time_t end;
+  time_t last;			/* the last event of any kind */
+  int row;			/* the lease record it is in */
+};
+
+/* A lease record, as it should come out in the leases table */
+struct row {
+  int addr;
+  int client;
+  time_t lstart;
+  time_t lend;
+};
+
+struct client *clients=NULL;
+int nclients=0, maxclients=0;
+struct address *pool=NULL;
+int poolsize=1024;
+struct row *rows=NULL;
+int nrows=0, maxrows=0;
+
+sqlite3 *db=NULL;
+sqlite3_stmt *insert=NULL;
+long long idx=0;
+
+/* Print usage text */
+void usage(char *progname) {
+  fprintf(stderr, "Usage: %s -o <queue file> [-e <file to write the expected leases to>]\n", progname);
+  fprintf(stderr, "\t[-n <number of events (default 100000)>] [-p <pool size (default 1024)>]\n");
+  fprintf(stderr, "\t[-r <percentage of renewals (default 70)>] [-x <percentage of RELEASEs (default 5)>]\n");
+  fprintf(stderr, "\t[-c <percentage of new clients among new leases (default 20)>]\n");
+  fprintf(stderr, "\t[-a <percentage of clients with relay agent information (default 80)>]\n");
+  fprintf(stderr, "\t[-b <size of bursts of new leases at once, 0 for none (default 0)>]\n");
+  fprintf(stderr, "\t[-l <lease time in seconds (default 3600)>] [-R <events per second (default 50)>]\n");
+  fprintf(stderr, "\t[-t <time of the first event (default so that the last one is now)>] [-s <seed>]\n");
+}
+
+/* Make up a new client */
+int new_client(int agents) {
+  struct client *c;
+  int n = nclients;
+
+  if (nclients == maxclients) {
+    maxclients = maxclients ? maxclients * 2 : 1024;
+    if ((clients = (struct client *)realloc(clients, maxclients * sizeof(struct client))) == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(-1);
+    }
+  }
+  c = &(clients[nclients++]);
+  snprintf(c->hw, sizeof(c->hw), "%02x:%02x:%02x:%02x:%02x:%02x",
+	   (unsigned int)(lrand48() & 0xfe), (unsigned int)((n >> 24) & 0xff), (unsigned int)((n >> 16) & 0xff),
+	   (unsigned int)((n >> 8) & 0xff), (unsigned int)(n & 0xff), (unsigned int)(lrand48() & 0xff));
+  if (lrand48() % 100 < agents) {
+    snprintf(c->cid, sizeof(c->cid), "\"ge-%ld/0/%ld:%d\"", lrand48() % 4, lrand48() % 48, 100 + (int)(lrand48() % 8));
+    snprintf(c->rid, sizeof(c->rid), "\"sw%04ld\"", lrand48() % 200);
+  } else {
+    c->cid[0] = c->rid[0] = '\0';
+  }
+  c->bound = 0;
+  return n;
+}
+
+/* Someone to give a new lease to: a new client, or with some luck one we have seen
+   before that isn't bound right now */
+int pick_client(int churn, int agents) {
+  int i, c;
+  if (nclients == 0 || lrand48() % 100 < churn) return new_client(agents);
+  for (i = 0; i < 16; i++) {
+    c = lrand48() % nclients;
+    if (!clients[c].bound) return c;
+  }
+  return new_client(agents);
+}
+
+/* Find an address an event can be for at time t, looking from a random one */
+int pick_address(time_t t, int bound) {
+  int i, a = lrand48() % poolsize;
+  int n = (poolsize < SCAN_MAX) ? poolsize : SCAN_MAX;
+
+  for (i = 0; i < n; i++, a = (a + 1) % poolsize) {
+    struct address *p = &(pool[a]);
+    /* Never two events for an address in the same second, which would make it up to
+       the queue order which one comes first */
+    if (p->last >= t) continue;
+    if (bound && p->client >= 0 && p->end >= t) return a;
+    if (!bound && (p->client < 0 || p->end < t)) return a;
+  }
+  return -1;
+}
+
+/* Put an event in the queue */
+void queue_event(int addr, int client, int rtype, time_t start, time_t end) {
+  struct client *c = &(clients[client]);
+  char ip[16];
+  unsigned int a = POOL_BASE + addr;
+
+  snprintf(ip, sizeof(ip), "%u.%u.%u.%u", (a >> 24) & 0xff, (a >> 16) & 0xff, (a >> 8) & 0xff, a & 0xff);
+  /* dhcpd numbers the events for each start time from 1, but a RELEASE has the start
+     time of the lease it ends, so that would not always keep the keys apart */
+  sqlite3_bind_int64(insert, 1, start);
+  sqlite3_bind_int(insert, 2, rtype);
+  sqlite3_bind_int64(insert, 3, ++idx);
+  sqlite3_bind_int64(insert, 4, end);
+  sqlite3_bind_text(insert, 5, ip, -1, SQLITE_TRANSIENT);
+  sqlite3_bind_text(insert, 6, c->hw, -1, SQLITE_STATIC);
+  if (c->cid[0]) sqlite3_bind_text(insert, 7, c->cid, -1, SQLITE_STATIC);
+  else sqlite3_bind_null(insert, 7);
+  if (c->rid[0]) sqlite3_bind_text(insert, 8, c->rid, -1, SQLITE_STATIC);
+  else sqlite3_bind_null(insert, 8);
+  if (sqlite3_step(insert) != SQLITE_DONE) {
+    fprintf(stderr, "sqlite3_step(): %s\n", sqlite3_errmsg(db));
+    exit(-2);
+  }
+  sqlite3_reset(insert);
+}
+
+/* A new lease, which is a new lease record */
+void bind_address(int addr, int client, time_t t, int leasetime) {
+  struct address *p = &(pool[addr]);
+  struct row *r;
+
+  if (p->client >= 0) clients[p->client].bound = 0;
+  if (nrows == maxrows) {
+    maxrows = maxrows ? maxrows * 2 : 4096;
+    if ((rows = (struct row *)realloc(rows, maxrows * sizeof(struct row))) == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(-1);
+    }
+  }
+  r = &(rows[nrows]);
+  r->addr = addr;
+  r->client = client;
+  r->lstart = t;
+  r->lend = t + leasetime;
+  p->client = client;
+  p->start = t;
+  p->end = t + leasetime;
+  p->row = nrows++;
+  clients[client].bound = 1;
+  queue_event(addr, client, 0, t, t + leasetime);
+}
+
+/* Write the lease records, one per line: ip, hw, cid, rid, start and end, separated by
+   tabs, with NULL where there is no cid or rid */
+int write_rows(const char *filename) {
+  FILE *f;
+  int i;
+
+  if ((f = fopen(filename, "w")) == NULL) {
+    perror(filename);
+    return -1;
+  }
+  for (i = 0; i < nrows; i++) {
+    struct client *c = &(clients[rows[i].client]);
+    unsigned int a = POOL_BASE + rows[i].addr;
+    fprintf(f, "%u.%u.%u.%u\t%s\t%s\t%s\t%lld\t%lld\n",
+	    (a >> 24) & 0xff, (a >> 16) & 0xff, (a >> 8) & 0xff, a & 0xff,
+	    c->hw, c->cid[0] ? c->cid : "NULL", c->rid[0] ? c->rid : "NULL",
+	    (long long)rows[i].lstart, (long long)rows[i].lend);
+  }
+  if (fclose(f) != 0) {
+    perror(filename);
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  char *queue_file=NULL;
+  char *expected_file=NULL;
+  long nevents=100000;
+  int renewals=70, releases=5, churn=20, agents=80, burst=0, leasetime=3600;
+  double rate=50;
+  time_t t0=0, t;
+  long seed=1;
+  double elapsed=0;
+  long e=0, counts[3]={0, 0, 0};
+  int o, a, kind, inburst=0;
+
+  while ((o=getopt(argc, argv, "o:e:n:p:r:x:c:a:b:l:R:t:s:")) != -1) {
+    switch (o) {
+    case 'o': queue_file = optarg;
+      break;
+    case 'e': expected_file = optarg;
+      break;
+    case 'n': nevents = atol(optarg);
+      break;
+    case 'p': poolsize = atoi(optarg);
+      break;
+    case 'r': renewals = atoi(optarg);
+      break;
+    case 'x': releases = atoi(optarg);
+      break;
+    case 'c': churn = atoi(optarg);
+      break;
+    case 'a': agents = atoi(optarg);
+      break;
+    case 'b': burst = atoi(optarg);
+      break;
+    case 'l': leasetime = atoi(optarg);
+      break;
+    case 'R': rate = atof(optarg);
+      break;
+    case 't': t0 = (time_t)atoll(optarg);
+      break;
+    case 's': seed = atol(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return -1;
+      break;
+    }
+  }
+
+  if (!queue_file || nevents < 1 || poolsize < 1 || rate <= 0 || leasetime < 1 ||
+      renewals < 0 || releases < 0 || renewals + releases > 100) {
+    usage(argv[0]);
+    return -1;
+  }
+  if (t0 == 0) t0 = time(NULL) - (time_t)(nevents / rate);
+  srand48(seed);
+
+  if ((pool = (struct address *)calloc(poolsize, sizeof(struct address))) == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+  for (a = 0; a < poolsize; a++) pool[a].client = -1;
+
+  unlink(queue_file);
+  if (sqlite3_open(queue_file, &db) != SQLITE_OK ||
+      sqlite3_exec(db, "CREATE TABLE lease_queue (start integer, rtype integer, idx integer, claimed integer, end integer, ip text, hw text, cid text, rid text, primary key(start, idx))", NULL, NULL, NULL) != SQLITE_OK ||
+      sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(db, "INSERT INTO lease_queue (start,rtype,idx,claimed,end,ip,hw,cid,rid) values (?,?,?,0,?,?,?,?,?)",
+			 -1, &insert, NULL) != SQLITE_OK) {
+    fprintf(stderr, "%s: %s\n", queue_file, sqlite3_errmsg(db));
+    return -2;
+  }
+
+  /* Events arrive at random, at the given rate on average. Once in a while, a number of
+     clients come back at once, as they do after a power cut. */
+  while (e < nevents) {
+    if (inburst > 0) {
+      inburst--;
+    } else {
+      elapsed += -log(1.0 - drand48()) / rate;
+      if (burst > 0 && lrand48() % 1000 < BURST_PERMILLE) inburst = burst - 1;
+    }
+    t = t0 + (time_t)elapsed;
+
+    kind = lrand48() % 100;
+    kind = inburst ? 2 : (kind < renewals) ? 0 : (kind < renewals + releases) ? 1 : 2;
+    if (kind < 2 && (a = pick_address(t, 1)) < 0) kind = 2;
+    if (kind == 2 && (a = pick_address(t, 0)) < 0 && (a = pick_address(t, 1)) >= 0) kind = 0;
+    /* Nothing to be done right now, so wait for a while */
+    if (a < 0) continue;
+
+    if (kind == 0) {
+      /* A renewal starts the lease over, from now */
+      pool[a].start = t;
+      pool[a].end = t + leasetime;
+      rows[pool[a].row].lend = t + leasetime;
+      queue_event(a, pool[a].client, 0, t, t + leasetime);
+    } else if (kind == 1) {
+      /* dhcpd gives a RELEASE the start of the lease, and the time it was released as the end */
+      rows[pool[a].row].lend = t;
+      queue_event(a, pool[a].client, 1, pool[a].start, t);
+      clients[pool[a].client].bound = 0;
+      pool[a].client = -1;
+    } else {
+      bind_address(a, pick_client(churn, agents), t, leasetime);
+    }
+    pool[a].last = t;
+    counts[kind]++;
+    e++;
+  }
+
+  if (sqlite3_finalize(insert) != SQLITE_OK || sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+    fprintf(stderr, "%s: %s\n", queue_file, sqlite3_errmsg(db));
+    return -2;
+  }
+  sqlite3_close(db);
+
+  if (expected_file && write_rows(expected_file) != 0) return -3;
+
+  fprintf(stderr, "%ld events (%ld new leases, %ld renewals, %ld RELEASEs) over %ld seconds, %d clients, %d lease records\n",
+	  e, counts[2], counts[0], counts[1], (long)elapsed, nclients, nrows);
+  return 0;
+}
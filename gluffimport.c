@@ -0,0 +1,853 @@
+/*
+ * gluffimport - write a whole lease_queue backlog or dhcpd.leases file to MySQL at once,
+ *               with the same results as gluff would get one record at a time.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sqlite3.h>
+#include <mysql/mysql.h>
+
+#include "ldb.h"
+#include "rdb.h"
+#include "schema.h"
+
+/* A lease in a dhcpd.leases file that isn't active. Whether it was released depends on
+   what came before it for the same address, so that is decided in apply_leases(). */
+#define RTYPE_INACTIVE 2
+
+/* The fields of a record that have ids */
+#define FIELD_IP 0
+#define FIELD_HW 1
+#define FIELD_CID 2
+#define FIELD_RID 3
+
+/* New lease records come after all the old ones, in the order they were made */
+#define NEW_KEY (1LL << 40)
+
+int schema=RDB_SCHEMA_LEXICAL;
+int dry_run=0;
+
+/* A lease record, one that is in MySQL already or one we make. MySQL returns the
+   records for an address in (lstart, lend, id) order, and 'key' stands in for the id. */
+struct lrow {
+  long long key;
+  int id;			/* 0 for a new record */
+  int ip;
+  time_t lstart;
+  time_t lend;
+  time_t oldend;		/* what lend is in MySQL */
+  long long hw;
+  int cid;
+  int rid;
+};
+
+struct rowset {
+  struct lrow *rows;
+  int n;
+  int max;
+};
+
+/* A statement under construction. Values are cut off at RDB_VALSIZE, as get_id() does,
+   so one more always fits once the statement is RDB_MAXINSERT long. */
+struct sqlbuf {
+  char q[RDB_MAXINSERT + 2 * RDB_VALSIZE + 1024];
+  size_t len;
+};
+
+static struct sqlbuf sql;
+static ldb_entry sort_recs;
+
+/* Print usage text */
+void usage(char *progname) {
+  fprintf(stderr, "Usage: %s {-l <local db file> | -f <dhcpd.leases file>} -h <remote db host> -u <remote db user>\n", progname);
+  fprintf(stderr, "\t-p <remote db password> -d <remote db database>\n");
+  fprintf(stderr, "\t[-b (write to the compact schema in dhcpd_leases_compact.sql)]\n");
+  fprintf(stderr, "\t[-B (create missing tables and indexes first)]\n");
+  fprintf(stderr, "\t[-x (remove what was imported from the queue)] [-n (dry run: work it all out, but write nothing)]\n");
+}
+
+static void sql_add(struct sqlbuf *b, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  b->len += vsnprintf(b->q + b->len, sizeof(b->q) - b->len, fmt, ap);
+  va_end(ap);
+}
+
+/* Add a quoted and escaped string */
+static void sql_add_value(MYSQL *db, struct sqlbuf *b, const unsigned char *val) {
+  size_t len = strlen((const char *)val);
+  if (len >= RDB_VALSIZE) len = RDB_VALSIZE - 1;
+  b->q[b->len++] = '\'';
+  b->len += mysql_real_escape_string(db, b->q + b->len, (const char *)val, len);
+  b->q[b->len++] = '\'';
+  b->q[b->len] = '\0';
+}
+
+static int sql_run(MYSQL *db, struct sqlbuf *b) {
+  int r = mysql_real_query(db, b->q, b->len);
+  b->len = 0;
+  if (r != 0) {
+    syslog(LOG_ERR, "mysql_real_query(): %s", mysql_error(db));
+    return -1;
+  }
+  return 0;
+}
+
+/* Add a record to a set */
+static int add_row(struct rowset *s, const struct lrow *r) {
+  if (s->n == s->max) {
+    int n = s->max ? s->max * 2 : 1024;
+    struct lrow *p;
+    if ((p = (struct lrow *)realloc(s->rows, n * sizeof(struct lrow))) == NULL) {
+      syslog(LOG_ERR, "Out of memory");
+      return -1;
+    }
+    s->rows = p;
+    s->max = n;
+  }
+  s->rows[s->n++] = *r;
+  return 0;
+}
+
+/* Read the queue, in the order gluff would. If gluff has been reading it in cursor mode,
+   only what comes after the cursor is read, in rowid order. '*last' is set to the rowid
+   of the last record read, and 'lastkey' to its (start, idx). Returns the number of
+   records read, or -1 on error. */
+int read_queue(const char *filename, ldb_batch b, int *cursor_mode, struct ldb_key *lastkey) {
+  sqlite3 *db;
+  sqlite3_stmt *stmt=NULL;
+  sqlite3_int64 pos=0;
+  int r, n=-1;
+
+  if (sqlite3_open_v2(filename, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+    syslog(LOG_ERR, "Failed to open %s: %s", filename, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return -1;
+  }
+  sqlite3_busy_timeout(db, 5000);
+
+  *cursor_mode = 0;
+  if (sqlite3_prepare_v2(db, CURSOR_LOAD_LSQL, -1, &stmt, NULL) == SQLITE_OK) {
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      pos = sqlite3_column_int64(stmt, 0);
+      *cursor_mode = 1;
+    }
+    sqlite3_finalize(stmt);
+  }
+
+  if (sqlite3_prepare_v2(db, *cursor_mode ?
+			 "SELECT start,rtype,end,ip,hw,cid,rid,idx,rowid FROM lease_queue where rowid>? order by rowid" :
+			 "SELECT start,rtype,end,ip,hw,cid,rid,idx,rowid FROM lease_queue order by start,idx",
+			 -1, &stmt, NULL) != SQLITE_OK) {
+    syslog(LOG_ERR, "Failed to read the queue: %s", sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return -1;
+  }
+  if (*cursor_mode) sqlite3_bind_int64(stmt, 1, pos);
+
+  while ((r = sqlite3_step(stmt)) == SQLITE_ROW) {
+    if (ldb_batch_add(b, (time_t)sqlite3_column_int64(stmt, 0), (time_t)sqlite3_column_int64(stmt, 2),
+		      sqlite3_column_int(stmt, 1), sqlite3_column_text(stmt, 3), sqlite3_column_text(stmt, 4),
+		      sqlite3_column_text(stmt, 5), sqlite3_column_text(stmt, 6)) != 0) {
+      syslog(LOG_ERR, "Out of memory");
+      goto done;
+    }
+    /* Claim mode reads in (start, idx) order, so the last rowid isn't the one read last */
+    if (sqlite3_column_int64(stmt, 8) > lastkey->rowid) {
+      lastkey->start = sqlite3_column_int64(stmt, 0);
+      lastkey->idx = sqlite3_column_int64(stmt, 7);
+      lastkey->rowid = sqlite3_column_int64(stmt, 8);
+    }
+  }
+  if (r != SQLITE_DONE) {
+    syslog(LOG_ERR, "Failed to read the queue: %s", sqlite3_errmsg(db));
+    goto done;
+  }
+  n = b->nrecs;
+
+ done:
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  return n;
+}
+
+/* Remove what we have imported from the queue. In cursor mode, the cursor is moved past
+   it instead, and the record at the cursor is kept, as gluff does. */
+int clear_queue(const char *filename, int cursor_mode, const struct ldb_key *lastkey) {
+  sqlite3 *db;
+  sqlite3_stmt *stmt=NULL;
+  int r=-1;
+
+  if (sqlite3_open(filename, &db) != SQLITE_OK) {
+    syslog(LOG_ERR, "Failed to open %s: %s", filename, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return -1;
+  }
+  sqlite3_busy_timeout(db, 5000);
+
+  if (cursor_mode) {
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK ||
+	sqlite3_prepare_v2(db, CURSOR_SAVE_LSQL, -1, &stmt, NULL) != SQLITE_OK) goto done;
+    sqlite3_bind_int64(stmt, 1, lastkey->rowid);
+    sqlite3_bind_int64(stmt, 2, lastkey->start);
+    sqlite3_bind_int64(stmt, 3, lastkey->idx);
+    if (sqlite3_step(stmt) != SQLITE_DONE) goto done;
+    sqlite3_finalize(stmt);
+    if (sqlite3_prepare_v2(db, CURSOR_CLEAR_LSQL, -1, &stmt, NULL) != SQLITE_OK) goto done;
+    sqlite3_bind_int64(stmt, 1, 0);
+    sqlite3_bind_int64(stmt, 2, lastkey->rowid);
+    if (sqlite3_step(stmt) != SQLITE_DONE || sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) goto done;
+  } else {
+    if (sqlite3_prepare_v2(db, "DELETE FROM lease_queue where rowid<=?", -1, &stmt, NULL) != SQLITE_OK) goto done;
+    sqlite3_bind_int64(stmt, 1, lastkey->rowid);
+    if (sqlite3_step(stmt) != SQLITE_DONE) goto done;
+  }
+  r = 0;
+
+ done:
+  if (r != 0) syslog(LOG_ERR, "Failed to clear the queue: %s", sqlite3_errmsg(db));
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  return r;
+}
+
+/* A time from a dhcpd.leases file: "3 2019/01/02 10:00:00" in UTC, "epoch 1546423200",
+   or "never", which is 0 */
+static time_t lease_time(const char *s) {
+  struct tm tm;
+  int wday;
+
+  if (!strncmp(s, "epoch ", 6)) return (time_t)atoll(s + 6);
+  memset(&tm, 0, sizeof(tm));
+  if (sscanf(s, "%d %d/%d/%d %d:%d:%d", &wday, &(tm.tm_year), &(tm.tm_mon), &(tm.tm_mday),
+	     &(tm.tm_hour), &(tm.tm_min), &(tm.tm_sec)) != 7) return 0;
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  return timegm(&tm);
+}
+
+/* Copy the value of a statement, up to the ';' at the end of the line */
+static void lease_value(const char *s, char *buf, size_t size) {
+  const char *end = strrchr(s, ';');
+  size_t len = end ? (size_t)(end - s) : strlen(s);
+  if (len >= size) len = size - 1;
+  memcpy(buf, s, len);
+  buf[len] = '\0';
+}
+
+/* Read a dhcpd.leases file. Each lease declaration with a hardware address becomes an
+   ACK if the lease is active, and a record of type RTYPE_INACTIVE if it isn't. The
+   relay agent options are taken as dhcpd writes them, which is the way it writes them to
+   the queue as well. Returns the number of records, or -1 on error. */
+int read_leases(const char *filename, ldb_batch b) {
+  char line[4096], ip[64], hw[128], cid[RDB_VALSIZE], rid[RDB_VALSIZE];
+  time_t starts=0, ends=0;
+  int inlease=0, active=0;
+  FILE *f;
+  char *p;
+
+  if ((f = fopen(filename, "r")) == NULL) {
+    syslog(LOG_ERR, "Failed to open %s: %m", filename);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    for (p = line; isspace((unsigned char)*p); p++);
+    if (!inlease) {
+      if (sscanf(p, "lease %63s {", ip) == 1 && strchr(p, '{')) {
+	inlease = 1;
+	active = 0;
+	starts = ends = 0;
+	hw[0] = cid[0] = rid[0] = '\0';
+      }
+    } else if (*p == '}') {
+      if (hw[0] && starts && ends &&
+	  ldb_batch_add(b, starts, ends, active ? 0 : RTYPE_INACTIVE, (unsigned char *)ip, (unsigned char *)hw,
+			cid[0] ? (unsigned char *)cid : NULL, rid[0] ? (unsigned char *)rid : NULL) != 0) {
+	syslog(LOG_ERR, "Out of memory");
+	fclose(f);
+	return -1;
+      }
+      inlease = 0;
+    } else if (!strncmp(p, "starts ", 7)) {
+      starts = lease_time(p + 7);
+    } else if (!strncmp(p, "ends ", 5)) {
+      ends = lease_time(p + 5);
+    } else if (!strncmp(p, "binding state ", 14)) {
+      active = !strncmp(p + 14, "active;", 7);
+    } else if (!strncmp(p, "hardware ", 9) && (p = strchr(p + 9, ' ')) != NULL) {
+      lease_value(p + 1, hw, sizeof(hw));
+    } else if (!strncmp(p, "option agent.circuit-id ", 24)) {
+      lease_value(p + 24, cid, sizeof(cid));
+    } else if (!strncmp(p, "option agent.remote-id ", 23)) {
+      lease_value(p + 23, rid, sizeof(rid));
+    }
+  }
+  fclose(f);
+  return b->nrecs;
+}
+
+static const unsigned char *field_value(ldb_entry e, int field) {
+  switch (field) {
+  case FIELD_IP: return e->ip;
+  case FIELD_HW: return e->hw;
+  case FIELD_CID: return e->cid;
+  default: return e->rid;
+  }
+}
+
+static void set_field_id(ldb_entry e, int field, int id) {
+  switch (field) {
+  case FIELD_IP: e->ipid = id; break;
+  case FIELD_HW: e->hwid = id; break;
+  case FIELD_CID: e->cidid = id; break;
+  default: e->ridid = id; break;
+  }
+}
+
+static int cmp_pointer(const void *a, const void *b) {
+  const unsigned char *x = *(const unsigned char * const *)a, *y = *(const unsigned char * const *)b;
+  return (x < y) ? -1 : (x > y);
+}
+
+/* Run a lookup built by lookup_ids() and take the ids it finds */
+static int run_lookup(MYSQL *db, const char *table, int *ids, int n) {
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  int k;
+
+  sql_add(&sql, ") v JOIN %s t ON t.value=v.v", table);
+  if (sql_run(db, &sql) != 0) return -1;
+  if ((res = mysql_use_result(db)) == NULL) {
+    syslog(LOG_ERR, "mysql_use_result(): %s", mysql_error(db));
+    return -1;
+  }
+  while ((row = mysql_fetch_row(res)) != NULL) {
+    if (row[0] && row[1] && (k = atoi(row[0])) >= 0 && k < n) ids[k] = atoi(row[1]);
+  }
+  mysql_free_result(res);
+  return 0;
+}
+
+/* Look up the ids of values[i] for the i where ids[i] is 0. The values are matched the
+   way MySQL compares them to the column, which is how get_id() matches them. */
+static int lookup_ids(MYSQL *db, const char *table, const unsigned char **values, int *ids, int n) {
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (ids[i]) continue;
+    if (sql.len == 0) sql_add(&sql, "SELECT v.k,t.id FROM (");
+    else sql_add(&sql, " UNION ALL ");
+    sql_add(&sql, "SELECT %d AS k,", i);
+    sql_add_value(db, &sql, values[i]);
+    sql_add(&sql, " AS v");
+    if (sql.len >= RDB_MAXINSERT && run_lookup(db, table, ids, n) != 0) return -1;
+  }
+  if (sql.len > 0 && run_lookup(db, table, ids, n) != 0) return -1;
+  return 0;
+}
+
+/* Add the values[i] where ids[i] is 0 to a table */
+static int insert_values(MYSQL *db, const char *table, const unsigned char **values, int *ids, int n) {
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (ids[i]) continue;
+    if (sql.len == 0) sql_add(&sql, "INSERT IGNORE INTO %s (value) values ", table);
+    else sql.q[sql.len++] = ',';
+    sql.q[sql.len++] = '(';
+    sql_add_value(db, &sql, values[i]);
+    sql.q[sql.len++] = ')';
+    sql.q[sql.len] = '\0';
+    if (sql.len >= RDB_MAXINSERT && sql_run(db, &sql) != 0) return -1;
+  }
+  if (sql.len > 0 && sql_run(db, &sql) != 0) return -1;
+  return 0;
+}
+
+/* Give each record the id of one of its values, looking up all the different values in
+   bulk and adding the ones that aren't in the table yet. Records without a value get 0.
+   In a dry run, new values get made-up ids below 0 instead. */
+int resolve_field(MYSQL *db, const char *table, ldb_batch b, int field) {
+  const unsigned char **values;
+  const unsigned char *v, **found;
+  int *ids;
+  int i, n=0, r=-1;
+
+  if ((values = (const unsigned char **)malloc((b->nrecs + 1) * sizeof(unsigned char *))) == NULL ||
+      (ids = (int *)calloc(b->nrecs + 1, sizeof(int))) == NULL) {
+    syslog(LOG_ERR, "Out of memory");
+    free(values);
+    return -1;
+  }
+
+  /* The values are interned, so equal values are the same pointer */
+  for (i = 0; i < b->nrecs; i++) {
+    if ((v = field_value(&(b->recs[i]), field)) != NULL) values[n++] = v;
+  }
+  qsort(values, n, sizeof(unsigned char *), cmp_pointer);
+  for (i = 0, r = 0; i < n; i++) {
+    if (r == 0 || values[i] != values[r - 1]) values[r++] = values[i];
+  }
+  n = r;
+  r = -1;
+
+  if (lookup_ids(db, table, values, ids, n) != 0) goto done;
+  if (dry_run) {
+    for (i = 0; i < n; i++) {
+      if (!ids[i]) ids[i] = -1 - i;
+    }
+  } else if (insert_values(db, table, values, ids, n) != 0 || lookup_ids(db, table, values, ids, n) != 0) {
+    goto done;
+  }
+
+  for (i = 0; i < b->nrecs; i++) {
+    if ((v = field_value(&(b->recs[i]), field)) == NULL) {
+      set_field_id(&(b->recs[i]), field, 0);
+      continue;
+    }
+    found = (const unsigned char **)bsearch(&v, values, n, sizeof(unsigned char *), cmp_pointer);
+    if (!ids[found - values]) {
+      syslog(LOG_ERR, "Failed to get an id for %s in %s", v, table);
+      goto done;
+    }
+    set_field_id(&(b->recs[i]), field, ids[found - values]);
+  }
+  r = 0;
+
+ done:
+  free(values);
+  free(ids);
+  return r;
+}
+
+static int cmp_ip(int a, int b) {
+  return ((unsigned int)a < (unsigned int)b) ? -1 : ((unsigned int)a > (unsigned int)b);
+}
+
+static int cmp_ips(const void *a, const void *b) {
+  return cmp_ip(*(const int *)a, *(const int *)b);
+}
+
+/* Records by address, and then in the order they were read */
+static int cmp_event(const void *a, const void *b) {
+  int i = *(const int *)a, j = *(const int *)b;
+  int c = cmp_ip(sort_recs[i].ipid, sort_recs[j].ipid);
+  return c ? c : (i - j);
+}
+
+/* Lease records by address, and then in the order MySQL finds them in */
+static int cmp_row(const void *a, const void *b) {
+  const struct lrow *x = (const struct lrow *)a, *y = (const struct lrow *)b;
+  int c = cmp_ip(x->ip, y->ip);
+  if (c) return c;
+  if (x->lstart != y->lstart) return (x->lstart < y->lstart) ? -1 : 1;
+  if (x->lend != y->lend) return (x->lend < y->lend) ? -1 : 1;
+  return (x->key < y->key) ? -1 : (x->key > y->key);
+}
+
+/* Parse a timestamp as MySQL returns it in text */
+static time_t text_time(const char *s) {
+  MYSQL_TIME mt;
+  memset(&mt, 0, sizeof(mt));
+  if (!s || sscanf(s, "%u-%u-%u %u:%u:%u", &(mt.year), &(mt.month), &(mt.day),
+		   &(mt.hour), &(mt.minute), &(mt.second)) != 6) return 0;
+  return mytime2timet(&mt);
+}
+
+/* Load the lease records the records for the addresses ips[0..n-1] may find, which are
+   the ones that end at 'since' or later */
+int load_rows(MYSQL *db, const int *ips, int n, time_t since, struct rowset *s) {
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  struct lrow r;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (sql.len == 0) {
+      if (schema == RDB_SCHEMA_COMPACT) {
+	sql_add(&sql, "SELECT id,ip,lstart,lend,hex(hw),cid,rid FROM leases where lend>=%lld and ip in (", (long long)since);
+      } else {
+	sql_add(&sql, "SELECT id,ip,lstart,lend,hw,cid,rid FROM leases where lend>=");
+	sql.len += add_mytime(sql.q + sql.len, sizeof(sql.q) - sql.len, since);
+	sql_add(&sql, " and ip in (");
+      }
+    } else {
+      sql.q[sql.len++] = ',';
+    }
+    sql_add(&sql, "%u", (unsigned int)ips[i]);
+
+    if (sql.len >= RDB_MAXINSERT || i == n - 1) {
+      sql_add(&sql, ")");
+      if (sql_run(db, &sql) != 0) return -1;
+      if ((res = mysql_use_result(db)) == NULL) {
+	syslog(LOG_ERR, "mysql_use_result(): %s", mysql_error(db));
+	return -1;
+      }
+      while ((row = mysql_fetch_row(res)) != NULL) {
+	memset(&r, 0, sizeof(r));
+	r.id = row[0] ? atoi(row[0]) : 0;
+	r.key = r.id;
+	r.ip = row[1] ? (int)strtoul(row[1], NULL, 10) : 0;
+	if (schema == RDB_SCHEMA_COMPACT) {
+	  r.lstart = row[2] ? (time_t)atoll(row[2]) : 0;
+	  r.lend = row[3] ? (time_t)atoll(row[3]) : 0;
+	  r.hw = row[4] ? strtoll(row[4], NULL, 16) : 0;
+	} else {
+	  r.lstart = text_time(row[2]);
+	  r.lend = text_time(row[3]);
+	  r.hw = row[4] ? atoll(row[4]) : 0;
+	}
+	r.oldend = r.lend;
+	r.cid = row[5] ? atoi(row[5]) : 0;
+	r.rid = row[6] ? atoi(row[6]) : 0;
+	if (add_row(s, &r) != 0) {
+	  mysql_free_result(res);
+	  return -1;
+	}
+      }
+      mysql_free_result(res);
+    }
+  }
+  qsort(s->rows, s->n, sizeof(struct lrow), cmp_row);
+  return 0;
+}
+
+/* UPDATE leases set lend=? where ip=? and lstart<=? and lend>=? (CUTOFF_LEASE_RSQL), or
+   with "and lend<=?" for the new end as well (PROLONG_LEASE_RSQL) */
+static void update_rows(struct rowset *w, time_t thatstart, time_t thatend, time_t newend, int prolong) {
+  int k;
+  for (k = 0; k < w->n; k++) {
+    struct lrow *r = &(w->rows[k]);
+    if (r->lstart <= thatstart && r->lend >= thatend && (!prolong || r->lend <= newend)) r->lend = newend;
+  }
+}
+
+/* Apply one record to the lease records for its address, as apply_record() does */
+static int apply_event(struct rowset *w, ldb_entry e, long long key) {
+  struct lrow n, *first=NULL, *second=NULL, *that;
+  int k;
+
+  /* do_find_lease() takes the times from the first record MySQL returns, and when there
+     are more, the rest from the second */
+  for (k = 0; k < w->n; k++) {
+    struct lrow *r = &(w->rows[k]);
+    if (r->lstart > e->start || r->lend < e->start) continue;
+    if (!first || cmp_row(r, first) < 0) {
+      second = first;
+      first = r;
+    } else if (!second || cmp_row(r, second) < 0) {
+      second = r;
+    }
+  }
+
+  if (first) {
+    that = second ? second : first;
+    if (e->hwid != that->hw || e->cidid != that->cid || e->ridid != that->rid) {
+      update_rows(w, first->lstart, first->lend, e->start, 0);
+    } else {
+      update_rows(w, first->lstart, first->lend, e->end, (e->rtype != 1));
+      return 0;
+    }
+  }
+
+  memset(&n, 0, sizeof(n));
+  n.key = NEW_KEY + key;
+  n.ip = e->ipid;
+  n.lstart = e->start;
+  n.lend = n.oldend = e->end;
+  n.hw = e->hwid;
+  n.cid = e->cidid;
+  n.rid = e->ridid;
+  return add_row(w, &n);
+}
+
+/* Work out the lease records for all the records, one address at a time. The old
+   records that change are added to 'changed', and the new ones to 'made'. Returns the
+   number of records applied, or -1 on error. */
+int apply_leases(ldb_batch b, struct rowset *old, struct rowset *changed, struct rowset *made) {
+  struct rowset w = { NULL, 0, 0 };
+  ldb_entry lastack=NULL;
+  int *order;
+  int i, j, k, o=0, applied=0, r=-1;
+
+  if ((order = (int *)malloc((b->nrecs + 1) * sizeof(int))) == NULL) {
+    syslog(LOG_ERR, "Out of memory");
+    return -1;
+  }
+  for (i = 0; i < b->nrecs; i++) order[i] = i;
+  sort_recs = b->recs;
+  qsort(order, b->nrecs, sizeof(int), cmp_event);
+
+  for (i = 0; i < b->nrecs; i = j) {
+    int ip = b->recs[order[i]].ipid;
+    for (j = i + 1; j < b->nrecs && b->recs[order[j]].ipid == ip; j++);
+    /* Not an IPv4 address, in the compact schema */
+    if (ip == 0) continue;
+
+    /* The old records for the address, which are in the same order */
+    while (o < old->n && cmp_ip(old->rows[o].ip, ip) < 0) o++;
+    w.n = 0;
+    for (k = o; k < old->n && old->rows[k].ip == ip; k++) {
+      if (add_row(&w, &(old->rows[k])) != 0) goto done;
+    }
+
+    lastack = NULL;
+    for (k = i; k < j; k++) {
+      ldb_entry e = &(b->recs[order[k]]);
+      if (e->rtype == RTYPE_INACTIVE) {
+	/* dhcpd ends a released lease early. An expired one ends when it always would. */
+	if (!lastack || e->hwid != lastack->hwid || e->cidid != lastack->cidid ||
+	    e->ridid != lastack->ridid || e->end >= lastack->end) continue;
+	e->rtype = 1;
+	e->start = lastack->start;
+	lastack = NULL;
+      } else if (e->rtype == 0) {
+	lastack = e;
+      } else {
+	lastack = NULL;
+      }
+      if (apply_event(&w, e, order[k]) != 0) goto done;
+      applied++;
+    }
+
+    for (k = 0; k < w.n; k++) {
+      struct lrow *row = &(w.rows[k]);
+      if (row->id == 0) {
+	if (add_row(made, row) != 0) goto done;
+      } else if (row->lend != row->oldend) {
+	if (add_row(changed, row) != 0) goto done;
+      }
+    }
+  }
+  r = applied;
+
+ done:
+  free(order);
+  free(w.rows);
+  return r;
+}
+
+static int cmp_key(const void *a, const void *b) {
+  const struct lrow *x = (const struct lrow *)a, *y = (const struct lrow *)b;
+  return (x->key < y->key) ? -1 : (x->key > y->key);
+}
+
+static void add_time(struct sqlbuf *b, time_t t) {
+  if (schema == RDB_SCHEMA_COMPACT) sql_add(b, "%lld", (long long)t);
+  else b->len += add_mytime(b->q + b->len, sizeof(b->q) - b->len, t);
+}
+
+/* Write the changed and the new lease records in one transaction. The new ones are
+   written in the order gluff would have made them. */
+int write_leases(MYSQL *db, struct rowset *changed, struct rowset *made) {
+  int i;
+
+  if (mysql_autocommit(db, 0) != 0) {
+    syslog(LOG_ERR, "mysql_autocommit(): %s", mysql_error(db));
+    return -1;
+  }
+
+  /* Only if nobody else has changed them meanwhile */
+  for (i = 0; i < changed->n; i++) {
+    struct lrow *r = &(changed->rows[i]);
+    sql_add(&sql, "UPDATE leases set lend=");
+    add_time(&sql, r->lend);
+    sql_add(&sql, " where id=%d and lend=", r->id);
+    add_time(&sql, r->oldend);
+    if (sql_run(db, &sql) != 0) goto fail;
+    if (mysql_affected_rows(db) != 1) {
+      syslog(LOG_ERR, "Lease %d was changed while it was being imported, nothing was written", r->id);
+      goto fail;
+    }
+  }
+
+  qsort(made->rows, made->n, sizeof(struct lrow), cmp_key);
+  for (i = 0; i < made->n; i++) {
+    struct lrow *r = &(made->rows[i]);
+    if (sql.len == 0) sql_add(&sql, "REPLACE INTO leases (ip,lstart,lend,hw,cid,rid) values ");
+    else sql.q[sql.len++] = ',';
+    sql_add(&sql, "(%u,", (unsigned int)r->ip);
+    add_time(&sql, r->lstart);
+    sql.q[sql.len++] = ',';
+    add_time(&sql, r->lend);
+    if (schema == RDB_SCHEMA_COMPACT) {
+      if (r->hw) sql_add(&sql, ",X'%012llx'", r->hw);
+      else sql_add(&sql, ",NULL");
+    } else {
+      sql_add(&sql, ",%lld", r->hw);
+    }
+    sql_add(&sql, ",%d,%d)", r->cid, r->rid);
+    if ((sql.len >= RDB_MAXINSERT || i == made->n - 1) && sql_run(db, &sql) != 0) goto fail;
+  }
+
+  if (mysql_commit(db) != 0) {
+    syslog(LOG_ERR, "mysql_commit(): %s", mysql_error(db));
+    goto fail;
+  }
+  return 0;
+
+ fail:
+  sql.len = 0;
+  if (mysql_rollback(db) != 0) syslog(LOG_WARNING, "mysql_rollback(): %s", mysql_error(db));
+  return -1;
+}
+
+/* The addresses of the records, each once, and the earliest start among them */
+static int *distinct_ips(ldb_batch b, int *n, time_t *since) {
+  int *ips;
+  int i, k=0;
+
+  if ((ips = (int *)malloc((b->nrecs + 1) * sizeof(int))) == NULL) {
+    syslog(LOG_ERR, "Out of memory");
+    return NULL;
+  }
+  *since = b->recs[0].start;
+  for (i = 0; i < b->nrecs; i++) {
+    if (b->recs[i].ipid) ips[k++] = b->recs[i].ipid;
+    if (b->recs[i].start < *since) *since = b->recs[i].start;
+  }
+  qsort(ips, k, sizeof(int), cmp_ips);
+  for (i = 0, *n = 0; i < k; i++) {
+    if (*n == 0 || ips[i] != ips[*n - 1]) ips[(*n)++] = ips[i];
+  }
+  return ips;
+}
+
+int main(int argc, char **argv) {
+  MYSQL db;
+  ldb_batch b;
+  struct rowset old = { NULL, 0, 0 }, changed = { NULL, 0, 0 }, made = { NULL, 0, 0 };
+  struct ldb_key lastkey = LDB_KEY_FIRST;
+  time_t since;
+  long long t0;
+  int *ips;
+  int o, i, n, nips, applied;
+  int cursor_mode=0;
+  int bootstrap=0;
+  int clear=0;
+  char *ldb_filename=NULL;
+  char *leases_filename=NULL;
+  char *rdb_host=NULL;
+  char *rdb_user=NULL;
+  char *rdb_password=NULL;
+  char *rdb_db=NULL;
+
+  while ((o=getopt(argc, argv, "l:f:h:u:p:d:bBxn")) != -1) {
+    switch (o) {
+    case 'l': ldb_filename = optarg;
+      break;
+    case 'f': leases_filename = optarg;
+      break;
+    case 'h': rdb_host = optarg;
+      break;
+    case 'u': rdb_user = optarg;
+      break;
+    case 'p': rdb_password = optarg;
+      break;
+    case 'd': rdb_db = optarg;
+      break;
+    case 'b': schema = RDB_SCHEMA_COMPACT;
+      break;
+    case 'B': bootstrap = 1;
+      break;
+    case 'x': clear = 1;
+      break;
+    case 'n': dry_run = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return -1;
+      break;
+    }
+  }
+
+  if (!ldb_filename == !leases_filename || !rdb_host || !rdb_user || !rdb_password || !rdb_db ||
+      (clear && !ldb_filename)) {
+    usage(argv[0]);
+    return -1;
+  }
+
+  openlog("gluffimport", LOG_PID | LOG_PERROR, LOG_LOCAL2);
+  t0 = time(NULL);
+
+  if ((b = ldb_batch_new()) == NULL) return -21;
+  if (ldb_filename) n = read_queue(ldb_filename, b, &cursor_mode, &lastkey);
+  else n = read_leases(leases_filename, b);
+  if (n < 0) return -10;
+  syslog(LOG_INFO, "Read %d records from %s", n, ldb_filename ? ldb_filename : leases_filename);
+  if (n == 0) return 0;
+
+  if (!(mysql_init(&db))) {
+    syslog(LOG_ERR, "mysql_init(): %s", mysql_error(&db));
+    return -11;
+  }
+  if (!(mysql_real_connect(&db, rdb_host, rdb_user, rdb_password, rdb_db, 0, NULL, 0))) {
+    syslog(LOG_ERR, "mysql_real_connect(): %s", mysql_error(&db));
+    return -12;
+  }
+  if (bootstrap && !dry_run && schema_bootstrap(&db, schema) != 0) {
+    syslog(LOG_ERR, "Failed to set up the MySQL tables");
+    return -22;
+  }
+
+  if (schema == RDB_SCHEMA_COMPACT) {
+    for (i = 0; i < b->nrecs; i++) {
+      ldb_entry e = &(b->recs[i]);
+      e->ipid = compact_ip(e->ip);
+      e->hwid = compact_hw(e->hw);
+    }
+  } else if (resolve_field(&db, "ips", b, FIELD_IP) != 0 || resolve_field(&db, "hws", b, FIELD_HW) != 0) {
+    return -15;
+  }
+  if (resolve_field(&db, "cids", b, FIELD_CID) != 0 || resolve_field(&db, "rids", b, FIELD_RID) != 0) {
+    return -15;
+  }
+
+  if ((ips = distinct_ips(b, &nips, &since)) == NULL) return -21;
+  if (nips > 0 && load_rows(&db, ips, nips, since, &old) != 0) return -16;
+  free(ips);
+
+  if ((applied = apply_leases(b, &old, &changed, &made)) < 0) return -21;
+  syslog(LOG_INFO, "%d records for %d addresses: %d new lease records, %d of %d earlier ones changed",
+	 applied, nips, made.n, changed.n, old.n);
+  if (applied < b->nrecs) {
+    syslog(LOG_INFO, "%d records were left out, being for addresses that aren't IPv4 or for leases that expired",
+	   b->nrecs - applied);
+  }
+
+  if (dry_run) {
+    syslog(LOG_INFO, "Dry run, nothing written");
+    return 0;
+  }
+  if (write_leases(&db, &changed, &made) != 0) return -19;
+  mysql_close(&db);
+
+  if (clear && clear_queue(ldb_filename, cursor_mode, &lastkey) != 0) return -20;
+  syslog(LOG_INFO, "Done in %lld seconds", (long long)(time(NULL) - t0));
+  return 0;
+}
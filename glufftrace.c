@@ -0,0 +1,153 @@
+/*
+ * glufftrace - show the binary trace gluff writes with -O as text.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/* Event names for -e, in the order of their numbers */
+static const char *events[] = { NULL, "apply", "multiple", "stale", "read", "calls" };
+#define NEVENTS (sizeof(events) / sizeof(events[0]))
+
+/* Decisions, for the summary */
+#define NDECISIONS 5
+static const char *decisions[NDECISIONS] = { "skipped", "prolonged", "released", "replaced", "new" };
+
+struct summary {
+  unsigned long records[NEVENTS];
+  unsigned long applied[NDECISIONS];
+  unsigned long long usec[TRACE_TIMINGS];
+  unsigned long lost;
+};
+
+void usage(char *progname) {
+  fprintf(stderr, "Usage: %s [-e <event>] [-s (only a summary)] <trace file>...\n", progname);
+  fprintf(stderr, "\tEvents are apply, multiple, stale, read and calls. Give the files oldest first,\n");
+  fprintf(stderr, "\tas in \"%s /var/log/gluff.trace.1 /var/log/gluff.trace\".\n", progname);
+}
+
+/* Show the records in one file. 'last' is the sequence number of the record before,
+   for seeing gaps, and is updated. Returns 0, or -1 if the file can't be read. */
+int show_file(const char *path, int event, int quiet, uint32_t *pid, uint64_t *last, struct summary *sum) {
+  struct trace_header h;
+  struct trace_record r;
+  char line[TRACE_LINESIZE];
+  FILE *f;
+  int i;
+
+  if ((f = fopen(path, "r")) == NULL) {
+    perror(path);
+    return -1;
+  }
+  if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0) {
+    fprintf(stderr, "%s is not a gluff trace file\n", path);
+    fclose(f);
+    return -1;
+  }
+  if (h.recsize != sizeof(struct trace_record)) {
+    fprintf(stderr, "%s has records of %u bytes, which this glufftrace can't read\n", path, h.recsize);
+    fclose(f);
+    return -1;
+  }
+  /* Sequence numbers start again with each gluff */
+  if (h.pid != *pid) {
+    *pid = h.pid;
+    *last = 0;
+    if (!quiet) printf("-- gluff %u --\n", (unsigned int)h.pid);
+  }
+
+  while (fread(&r, sizeof(r), 1, f) == 1) {
+    if (r.seq <= *last) continue;
+    if (r.seq > *last + 1 && *last > 0) {
+      sum->lost += r.seq - *last - 1;
+      if (!quiet) printf("-- %llu records lost --\n", (unsigned long long)(r.seq - *last - 1));
+    }
+    *last = r.seq;
+    if (event > 0 && r.event != event) continue;
+
+    if (r.event < NEVENTS) sum->records[r.event]++;
+    if (r.event == TRACE_APPLY && r.decision < NDECISIONS) sum->applied[r.decision]++;
+    if (r.event == TRACE_APPLY) {
+      for (i = 0; i < TRACE_TIMINGS; i++) sum->usec[i] += r.usec[i];
+    }
+    if (quiet) continue;
+    trace_format(&r, line, sizeof(line));
+    printf("%s\n", line);
+  }
+  fclose(f);
+  return 0;
+}
+
+void show_summary(const struct summary *sum) {
+  unsigned long n = sum->records[TRACE_APPLY];
+  unsigned int i;
+
+  for (i = 1; i < NEVENTS; i++) printf("%s: %lu\n", events[i], sum->records[i]);
+  for (i = 0; i < NDECISIONS; i++) printf("  %s: %lu\n", decisions[i], sum->applied[i]);
+  if (n > 0) {
+    printf("per record: find %.1f us, update %.1f us, make %.1f us, total %.1f us\n",
+	   (double)sum->usec[TRACE_FIND] / n, (double)sum->usec[TRACE_UPDATE] / n,
+	   (double)sum->usec[TRACE_MAKE] / n, (double)sum->usec[TRACE_TOTAL] / n);
+  }
+  printf("lost: %lu\n", sum->lost);
+}
+
+int main(int argc, char **argv) {
+  struct summary sum;
+  uint64_t last=0;
+  uint32_t pid=0;
+  unsigned int i;
+  int o, event=0, quiet=0;
+
+  while ((o=getopt(argc, argv, "e:s")) != -1) {
+    switch (o) {
+    case 'e':
+      for (i = 1; i < NEVENTS && strcmp(optarg, events[i]) != 0; i++);
+      if (i == NEVENTS) {
+	usage(argv[0]);
+	return -1;
+      }
+      event = i;
+      break;
+    case 's': quiet = 1;
+      break;
+    default:
+      usage(argv[0]);
+      return -1;
+      break;
+    }
+  }
+  if (optind >= argc) {
+    usage(argv[0]);
+    return -1;
+  }
+
+  memset(&sum, 0, sizeof(sum));
+  for (; optind < argc; optind++) {
+    if (show_file(argv[optind], event, quiet, &pid, &last, &sum) != 0) return -2;
+  }
+  if (quiet) show_summary(&sum);
+  return 0;
+}
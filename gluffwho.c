@@ -0,0 +1,413 @@
+/*
+ * gluffwho - answer "who had this address at this time", and the same for MAC
+ *            addresses, circuit ids and remote ids, from an index of the leases
+ *            table that is kept up to date from MySQL.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+/* For strptime() */
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <mysql/mysql.h>
+
+#include "lindex.h"
+
+/* How long after a lease has ended gluff may still change it, in hours, if not set
+   with -k. Leases are only read again from MySQL if they may have changed. */
+#define SETTLE_DEFAULT 48
+
+/* How often to refresh the index while serving queries, in seconds */
+#define REFRESH_DEFAULT 60
+
+/* How long a client may take to send a query, in seconds */
+#define CLIENT_TIMEOUT 10
+
+/* The longest query line */
+#define QUERY_MAX 512
+
+#define SCHEMA_LEXICAL 0
+#define SCHEMA_COMPACT 1
+
+int schema=SCHEMA_LEXICAL;
+
+static const char *field_names[LINDEX_FIELDS] = { "ip", "hw", "cid", "rid" };
+
+/* Print usage text */
+void usage(char *progname) {
+  fprintf(stderr, "Usage: %s -x <index file> [-h <remote db host> -u <remote db user> -p <remote db password> -d <remote db database>]\n", progname);
+  fprintf(stderr, "\t[-b (read the compact schema in dhcpd_leases_compact.sql)]\n");
+  fprintf(stderr, "\t[-N (make the index again from scratch)]\n");
+  fprintf(stderr, "\t[-k <hours after its end that a lease may still change (default %d)>]\n", SETTLE_DEFAULT);
+  fprintf(stderr, "\t[-i <ip address> | -m <MAC address> | -c <circuit id> | -r <remote id>]\n");
+  fprintf(stderr, "\t[-t <time>[,<time>] (what was there at that time, or in that period)]\n");
+  fprintf(stderr, "\t[-S <socket to answer queries on>] [-I <seconds between refreshes with -S (default %d)>]\n", REFRESH_DEFAULT);
+  fprintf(stderr, "\tWith MySQL options, the index is brought up to date first. Times are seconds since\n");
+  fprintf(stderr, "\tthe epoch, or \"YYYY-MM-DD[ HH:MM[:SS]]\" in local time, with a 'T' instead of the space\n");
+  fprintf(stderr, "\tif you like.\n");
+}
+
+/* Parse a time. Returns 0, or -1 if it isn't one. */
+static int parse_time(const char *s, time_t *t) {
+  static const char *formats[] = {
+    "%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%dT%H:%M", "%Y-%m-%d", NULL
+  };
+  struct tm tm;
+  const char *end;
+  int i;
+
+  if (*s && strspn(s, "0123456789") == strlen(s)) {
+    *t = (time_t)strtoll(s, NULL, 10);
+    return 0;
+  }
+  for (i = 0; formats[i]; i++) {
+    memset((void *)&tm, 0, sizeof(tm));
+    if ((end = strptime(s, formats[i], &tm)) != NULL && *end == '\0') {
+      tm.tm_isdst = -1;
+      *t = mktime(&tm);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/* Parse "<time>" or "<from>,<to>" */
+static int parse_span(const char *s, time_t *from, time_t *to) {
+  char buf[QUERY_MAX];
+  char *comma;
+
+  if (strlen(s) >= sizeof(buf)) return -1;
+  strcpy(buf, s);
+  if ((comma = strchr(buf, ',')) == NULL) {
+    if (parse_time(buf, from) != 0) return -1;
+    *to = *from;
+    return 0;
+  }
+  *comma = '\0';
+  if (parse_time(buf, from) != 0 || parse_time(comma + 1, to) != 0 || *to < *from) return -1;
+  return 0;
+}
+
+static void print_time(FILE *f, time_t t) {
+  struct tm tm;
+  char buf[64];
+  localtime_r(&t, &tm);
+  strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+  fputs(buf, f);
+}
+
+/* One line for each lease: ip, hw, cid, rid, start and end, separated by tabs */
+static void print_lease(const struct lindex_lease *l, void *arg) {
+  FILE *f = (FILE *)arg;
+  int i;
+  for (i = 0; i < LINDEX_FIELDS; i++) fprintf(f, "%s\t", l->val[i] ? l->val[i] : "NULL");
+  print_time(f, l->start);
+  fputc('\t', f);
+  print_time(f, l->end);
+  fputc('\n', f);
+}
+
+/* Read the leases from 'from' on into the index, and the ones that ended at 'settled' or
+   later whatever their id. An id is handed out when a row is inserted, not when it is
+   committed, so a row with an id below 'from' may have turned up since the last time.
+   Both parts are index ranges, on the primary key and on lend (see schema.c). */
+static int read_leases(MYSQL *db, lindex_builder b, int from, time_t settled, unsigned long *n) {
+  char q[1024];
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  int i;
+
+  if (schema == SCHEMA_COMPACT) {
+    snprintf(q, sizeof(q), "SELECT l.id, INET_NTOA(l.ip), HEX(l.hw), c.value, r.value, l.lstart, l.lend "
+	     "FROM leases l LEFT JOIN cids c ON c.id=l.cid LEFT JOIN rids r ON r.id=l.rid WHERE l.id>=%d OR l.lend>=%lld",
+	     from, (long long)settled);
+  } else {
+    snprintf(q, sizeof(q), "SELECT l.id, i.value, h.value, c.value, r.value, UNIX_TIMESTAMP(l.lstart), UNIX_TIMESTAMP(l.lend) "
+	     "FROM leases l JOIN ips i ON i.id=l.ip LEFT JOIN hws h ON h.id=l.hw "
+	     "LEFT JOIN cids c ON c.id=l.cid LEFT JOIN rids r ON r.id=l.rid WHERE l.id>=%d OR l.lend>=FROM_UNIXTIME(%lld)",
+	     from, (long long)settled);
+  }
+  if (mysql_query(db, q) != 0 || (res = mysql_use_result(db)) == NULL) {
+    syslog(LOG_ERR, "Failed to read the leases: %s", mysql_error(db));
+    return -1;
+  }
+  while ((row = mysql_fetch_row(res)) != NULL) {
+    struct lindex_lease l;
+    if (!row[0] || !row[5] || !row[6]) continue;
+    l.id = atoi(row[0]);
+    for (i = 0; i < LINDEX_FIELDS; i++) l.val[i] = row[i + 1];
+    l.start = (time_t)strtoll(row[5], NULL, 10);
+    l.end = (time_t)strtoll(row[6], NULL, 10);
+    if (lindex_builder_add(b, &l) != 0) {
+      syslog(LOG_ERR, "Out of memory");
+      mysql_free_result(res);
+      return -1;
+    }
+    (*n)++;
+  }
+  if (mysql_errno(db) != 0) {
+    syslog(LOG_ERR, "Failed to read the leases: %s", mysql_error(db));
+    mysql_free_result(res);
+    return -1;
+  }
+  mysql_free_result(res);
+  return 0;
+}
+
+/* Bring the index in 'path' up to date, and open it again. Only the leases that may
+   have changed since the last time, and the ones that are new, are read from MySQL. */
+static int refresh(MYSQL *db, const char *path, int rebuild, int settle_hours, lindex *x) {
+  struct lindex_info info;
+  lindex_builder b;
+  lindex nx;
+  struct timeval t0, t1;
+  unsigned long n=0;
+  time_t settled = time(NULL) - (time_t)settle_hours * 3600;
+  int from=0;
+
+  gettimeofday(&t0, NULL);
+  if ((b = lindex_builder_new()) == NULL) {
+    syslog(LOG_ERR, "Out of memory");
+    return -1;
+  }
+  if (*x && !rebuild) {
+    lindex_getinfo(*x, &info);
+    from = info.lowid;
+    if (lindex_builder_keep(b, *x, from, settled) != 0) {
+      syslog(LOG_ERR, "Out of memory");
+      lindex_builder_free(b);
+      return -1;
+    }
+  }
+  if (read_leases(db, b, from, settled, &n) != 0 ||
+      lindex_builder_write(b, path, settled) != 0) {
+    lindex_builder_free(b);
+    return -1;
+  }
+  lindex_builder_free(b);
+
+  if ((nx = lindex_open(path)) == NULL) return -1;
+  lindex_close(*x);
+  *x = nx;
+
+  gettimeofday(&t1, NULL);
+  lindex_getinfo(nx, &info);
+  syslog(LOG_INFO, "Read %lu leases from id %d on, now %lu leases for %lu addresses, %lu kB, in %ld ms",
+	 n, from, info.leases, info.addresses, (unsigned long)(info.bytes / 1024),
+	 (long)((t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_usec - t0.tv_usec) / 1000));
+  return 0;
+}
+
+/* Answer one query line, "<ip|hw|cid|rid> <value> [<time>[,<time>]]", with a line for
+   each lease and an empty line at the end */
+static void answer(lindex x, char *line, FILE *out) {
+  char *field, *value, *span, *save;
+  time_t from=0, to=LONG_MAX;
+  int i;
+
+  field = strtok_r(line, " \t\r\n", &save);
+  value = strtok_r(NULL, " \t\r\n", &save);
+  span = strtok_r(NULL, " \t\r\n", &save);
+  for (i = 0; field && i < LINDEX_FIELDS; i++) {
+    if (strcmp(field, field_names[i]) == 0) break;
+  }
+  if (!field || !value || i == LINDEX_FIELDS || (span && parse_span(span, &from, &to) != 0)) {
+    fprintf(out, "ERROR expected <ip|hw|cid|rid> <value> [<time>[,<time>]]\n\n");
+    return;
+  }
+  lindex_find(x, i, value, from, to, print_lease, out);
+  fputc('\n', out);
+}
+
+/* Take queries on a Unix socket, one client at a time, and refresh the index now and
+   then if we know where the MySQL server is */
+static int serve(const char *sockpath, MYSQL *db, const char *path, int settle_hours, int interval, lindex *x) {
+  struct sockaddr_un addr;
+  struct timeval tv = { CLIENT_TIMEOUT, 0 };
+  struct pollfd pfd;
+  time_t last = time(NULL);
+  char line[QUERY_MAX];
+  int lfd, fd;
+
+  if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+    syslog(LOG_ERR, "Socket name %s is too long", sockpath);
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, sockpath);
+  unlink(sockpath);
+
+  if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    syslog(LOG_ERR, "socket(): %m");
+    return -1;
+  }
+  if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(lfd, 16) != 0) {
+    syslog(LOG_ERR, "Failed to listen on %s: %m", sockpath);
+    close(lfd);
+    return -1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  syslog(LOG_INFO, "Answering queries on %s", sockpath);
+
+  while(1) {
+    FILE *in, *out;
+
+    if (db && time(NULL) - last >= interval) {
+      /* A failed refresh leaves the index we have, which is still good to answer from */
+      if (mysql_ping(db) == 0) refresh(db, path, 0, settle_hours, x);
+      last = time(NULL);
+    }
+
+    pfd.fd = lfd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, db ? interval * 1000 : -1) <= 0) continue;
+    if ((fd = accept(lfd, NULL, NULL)) < 0) continue;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if ((in = fdopen(fd, "r")) == NULL) {
+      close(fd);
+      continue;
+    }
+    if ((fd = dup(fd)) < 0 || (out = fdopen(fd, "w")) == NULL) {
+      if (fd >= 0) close(fd);
+      fclose(in);
+      continue;
+    }
+    while (fgets(line, sizeof(line), in) != NULL) {
+      answer(*x, line, out);
+      if (fflush(out) != 0) break;
+    }
+    fclose(in);
+    fclose(out);
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  MYSQL db;
+  MYSQL *dbp=NULL;
+  lindex x=NULL;
+  my_bool bool_true=1;
+  time_t from=0, to=LONG_MAX;
+  int o, field=-1;
+  int rebuild=0;
+  int settle_hours=SETTLE_DEFAULT;
+  int interval=REFRESH_DEFAULT;
+  char *value=NULL;
+  char *path=NULL;
+  char *sockpath=NULL;
+  char *rdb_host=NULL;
+  char *rdb_user=NULL;
+  char *rdb_password=NULL;
+  char *rdb_db=NULL;
+
+  while ((o=getopt(argc, argv, "x:h:u:p:d:bNk:i:m:c:r:t:S:I:")) != -1) {
+    switch (o) {
+    case 'x': path = optarg;
+      break;
+    case 'h': rdb_host = optarg;
+      break;
+    case 'u': rdb_user = optarg;
+      break;
+    case 'p': rdb_password = optarg;
+      break;
+    case 'd': rdb_db = optarg;
+      break;
+    case 'b': schema = SCHEMA_COMPACT;
+      break;
+    case 'N': rebuild = 1;
+      break;
+    case 'k': settle_hours = atoi(optarg);
+      break;
+    case 'i': field = LINDEX_IP; value = optarg;
+      break;
+    case 'm': field = LINDEX_HW; value = optarg;
+      break;
+    case 'c': field = LINDEX_CID; value = optarg;
+      break;
+    case 'r': field = LINDEX_RID; value = optarg;
+      break;
+    case 't':
+      if (parse_span(optarg, &from, &to) != 0) {
+	fprintf(stderr, "%s: can't make out the time %s\n", argv[0], optarg);
+	return -1;
+      }
+      break;
+    case 'S': sockpath = optarg;
+      break;
+    case 'I': interval = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return -1;
+      break;
+    }
+  }
+
+  if (!path || (!rdb_host != !rdb_user || !rdb_host != !rdb_password || !rdb_host != !rdb_db) ||
+      settle_hours < 0 || interval < 1 || (rebuild && !rdb_host)) {
+    usage(argv[0]);
+    return -1;
+  }
+
+  openlog("gluffwho", LOG_PID | LOG_PERROR, LOG_LOCAL2);
+
+  x = lindex_open(path);
+
+  if (rdb_host) {
+    if (!(mysql_init(&db))) {
+      syslog(LOG_ERR, "mysql_init(): %s", mysql_error(&db));
+      return -11;
+    }
+    if (!(mysql_real_connect(&db, rdb_host, rdb_user, rdb_password, rdb_db, 0, NULL, 0))) {
+      syslog(LOG_ERR, "mysql_real_connect(): %s", mysql_error(&db));
+      return -12;
+    }
+    mysql_options(&db, MYSQL_OPT_RECONNECT, &bool_true);
+    dbp = &db;
+    if (refresh(dbp, path, rebuild, settle_hours, &x) != 0) return -16;
+  }
+  if (!x) {
+    fprintf(stderr, "%s: no index in %s, make one with the MySQL options\n", argv[0], path);
+    return -10;
+  }
+
+  if (value && lindex_find(x, field, value, from, to, print_lease, stdout) == 0) {
+    fprintf(stderr, "%s: %s %s not found\n", argv[0], field_names[field], value);
+  }
+
+  if (sockpath && serve(sockpath, dbp, path, settle_hours, interval, &x) != 0) return -24;
+  lindex_close(x);
+  if (dbp) mysql_close(dbp);
+  return 0;
+}
@@ -0,0 +1,200 @@
+/*
+ * idcache - bounded in-process cache of lexical value -> numeric id mappings
+ *           for the cids, rids, ips and hws tables.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+/*
+ * All values are interned in one string arena as [entry header][bytes], and the
+ * hash table is just an array of arena offsets, so an entry costs its own length
+ * plus about 20 bytes. When the memory cap is reached the whole cache is flushed
+ * rather than evicted piecemeal - the working set refills within a few batches.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "idcache.h"
+
+#define IDC_MINSLOTS 1024
+#define IDC_MINARENA 16384
+#define IDC_MAXLEN 255
+
+struct idc_entry {
+  unsigned int hash;
+  int id;
+  unsigned short len;
+  unsigned char table;
+  unsigned char pad;
+};
+
+#define ENTRYSIZE(len) ((sizeof(struct idc_entry) + (len) + 3) & ~((size_t)3))
+
+struct idcache_s {
+  unsigned int *slots;		/* arena offset + 1, 0 means empty */
+  unsigned int nslots;		/* always a power of two */
+  unsigned char *arena;
+  size_t used;
+  size_t alloc;
+  size_t maxbytes;
+  unsigned long entries;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long flushes;
+};
+
+/* 32-bit FNV-1a over the table number and the value */
+static unsigned int idc_hash(int table, const unsigned char *val, size_t len) {
+  unsigned int h = 2166136261U;
+  size_t i;
+  h = (h ^ (unsigned char)table) * 16777619U;
+  for (i = 0; i < len; i++) h = (h ^ val[i]) * 16777619U;
+  return h;
+}
+
+idcache idcache_new(size_t maxbytes) {
+  idcache c;
+  if (maxbytes < IDC_MINSLOTS * sizeof(unsigned int) + IDC_MINARENA) return NULL;
+  if ((c = (idcache)calloc(1, sizeof(struct idcache_s))) == NULL) return NULL;
+  c->maxbytes = maxbytes;
+  c->nslots = IDC_MINSLOTS;
+  c->slots = (unsigned int *)calloc(c->nslots, sizeof(unsigned int));
+  c->alloc = IDC_MINARENA;
+  c->arena = (unsigned char *)malloc(c->alloc);
+  if (!c->slots || !c->arena) {
+    idcache_free(c);
+    return NULL;
+  }
+  return c;
+}
+
+void idcache_free(idcache c) {
+  if (c) {
+    if (c->slots) free(c->slots);
+    if (c->arena) free(c->arena);
+    free(c);
+  }
+}
+
+void idcache_clear(idcache c) {
+  memset((void *)c->slots, 0, c->nslots * sizeof(unsigned int));
+  c->used = 0;
+  c->entries = 0;
+}
+
+/* Find the entry for a value, or return NULL */
+static struct idc_entry *idc_find(idcache c, int table, const unsigned char *val, size_t len) {
+  unsigned int h = idc_hash(table, val, len), i;
+  for (i = h & (c->nslots - 1); c->slots[i]; i = (i + 1) & (c->nslots - 1)) {
+    struct idc_entry *e = (struct idc_entry *)(c->arena + c->slots[i] - 1);
+    if (e->hash == h && e->table == table && e->len == len &&
+	!memcmp((void *)(e + 1), (const void *)val, len)) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+int idcache_get(idcache c, int table, const unsigned char *val) {
+  size_t len = strlen((const char *)val);
+  struct idc_entry *e;
+  if (len <= IDC_MAXLEN && (e = idc_find(c, table, val, len)) != NULL) {
+    c->hits++;
+    return e->id;
+  }
+  c->misses++;
+  return 0;
+}
+
+/* Double the hash table, if that fits within the memory cap */
+static int idc_grow_slots(idcache c) {
+  unsigned int n = c->nslots * 2, i, j;
+  unsigned int *slots;
+  if (n * sizeof(unsigned int) + c->alloc > c->maxbytes) return -1;
+  if ((slots = (unsigned int *)calloc(n, sizeof(unsigned int))) == NULL) return -1;
+  for (i = 0; i < c->nslots; i++) {
+    if (c->slots[i]) {
+      struct idc_entry *e = (struct idc_entry *)(c->arena + c->slots[i] - 1);
+      for (j = e->hash & (n - 1); slots[j]; j = (j + 1) & (n - 1));
+      slots[j] = c->slots[i];
+    }
+  }
+  free(c->slots);
+  c->slots = slots;
+  c->nslots = n;
+  return 0;
+}
+
+/* Make room for 'need' more bytes in the arena, if that fits within the memory cap */
+static int idc_grow_arena(idcache c, size_t need) {
+  size_t limit = c->maxbytes - c->nslots * sizeof(unsigned int);
+  size_t n = c->alloc * 2;
+  unsigned char *arena;
+  if (c->used + need > limit) return -1;
+  if (n < c->used + need) n = c->used + need;
+  if (n > limit) n = limit;
+  if ((arena = (unsigned char *)realloc(c->arena, n)) == NULL) return -1;
+  c->arena = arena;
+  c->alloc = n;
+  return 0;
+}
+
+int idcache_put(idcache c, int table, const unsigned char *val, int id, int flush) {
+  size_t len = strlen((const char *)val);
+  size_t need = ENTRYSIZE(len);
+  struct idc_entry *e;
+  unsigned int h, i;
+
+  if (len > IDC_MAXLEN || id == 0) return -1;
+
+  if ((e = idc_find(c, table, val, len)) != NULL) {
+    e->id = id;
+    return 0;
+  }
+
+  if (((c->entries + 1) * 4 > c->nslots * 3 && idc_grow_slots(c) != 0) ||
+      (c->used + need > c->alloc && idc_grow_arena(c, need) != 0)) {
+    if (!flush) return -1;
+    idcache_clear(c);
+    c->flushes++;
+    if (c->used + need > c->alloc && idc_grow_arena(c, need) != 0) return -1;
+  }
+
+  h = idc_hash(table, val, len);
+  e = (struct idc_entry *)(c->arena + c->used);
+  e->hash = h;
+  e->id = id;
+  e->len = (unsigned short)len;
+  e->table = (unsigned char)table;
+  e->pad = 0;
+  memcpy((void *)(e + 1), (const void *)val, len);
+
+  for (i = h & (c->nslots - 1); c->slots[i]; i = (i + 1) & (c->nslots - 1));
+  c->slots[i] = c->used + 1;
+  c->used += need;
+  c->entries++;
+  return 0;
+}
+
+void idcache_getstats(idcache c, struct idcache_stats *st) {
+  st->hits = c->hits;
+  st->misses = c->misses;
+  st->flushes = c->flushes;
+  st->entries = c->entries;
+  st->bytes = c->nslots * sizeof(unsigned int) + c->alloc;
+  st->maxbytes = c->maxbytes;
+}
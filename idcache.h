@@ -0,0 +1,61 @@
+/*
+ * idcache - bounded in-process cache of lexical value -> numeric id mappings
+ *           for the cids, rids, ips and hws tables.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#ifndef IDCACHE_H
+#define IDCACHE_H
+
+#include <stddef.h>
+
+/* The lexical tables we cache ids for */
+#define IDC_CID 0
+#define IDC_RID 1
+#define IDC_IP 2
+#define IDC_HW 3
+#define IDC_NTABLES 4
+
+typedef struct idcache_s *idcache;
+
+/* Create a cache that will never use more than 'maxbytes' bytes for its
+   table and string storage. Returns NULL if maxbytes is too small to be useful. */
+idcache idcache_new(size_t maxbytes);
+void idcache_free(idcache c);
+
+/* Look up a value. Returns the id, or 0 on a miss */
+int idcache_get(idcache c, int table, const unsigned char *val);
+
+/* Add a value. Returns 0 if stored, -1 if the cache is full. When 'flush' is set,
+   a full cache is emptied and the value is stored in the fresh cache instead. */
+int idcache_put(idcache c, int table, const unsigned char *val, int id, int flush);
+
+/* Drop all entries, keeping the counters */
+void idcache_clear(idcache c);
+
+struct idcache_stats {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long flushes;
+  unsigned long entries;
+  size_t bytes;
+  size_t maxbytes;
+};
+
+void idcache_getstats(idcache c, struct idcache_stats *st);
+
+#endif
@@ -0,0 +1,346 @@
+/*
+ * journal - the memory-mapped journal dhcpd can write lease events to instead of the
+ *           sqlite3 queue, and how we read it.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "journal.h"
+
+struct journal_s {
+  int dirfd;
+  long long pos;		/* the last record written to MySQL */
+  long long low;		/* the lowest segment there was last time we looked */
+  long long segno;		/* the segment we have mapped, or -1 */
+  const struct journal_record *map;
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once=PTHREAD_ONCE_INIT;
+
+/* Built once, before the first record is checked, whichever thread gets there first */
+static void crc_init(void) {
+  uint32_t c, k, b;
+
+  for (k = 0; k < 256; k++) {
+    for (c = k, b = 0; b < 8; b++) c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+    crc_table[k] = c;
+  }
+}
+
+static uint32_t journal_crc(const struct journal_record *rec) {
+  const unsigned char *p = (const unsigned char *)rec;
+  uint32_t c = 0xffffffffU;
+  size_t i;
+
+  for (i = 0; i < sizeof(struct journal_record); i++) c = crc_table[(c ^ p[i]) & 0xff] ^ (c >> 8);
+  return c ^ 0xffffffffU;
+}
+
+int journal_valid(struct journal_record *rec) {
+  uint32_t crc = rec->crc;
+  int r;
+
+  if (rec->magic != JOURNAL_MAGIC) return 0;
+  pthread_once(&crc_once, crc_init);
+  rec->crc = 0;
+  r = (journal_crc(rec) == crc);
+  rec->crc = crc;
+  return r;
+}
+
+void journal_strings(const struct journal_record *rec, unsigned char *buf, const unsigned char *str[4]) {
+  size_t off=0;
+  int k;
+
+  for (k = 0; k < 4; k++) {
+    if (rec->len[k] == JOURNAL_NULL || off + rec->len[k] > sizeof(rec->data)) {
+      str[k] = NULL;
+    } else {
+      memcpy(buf, rec->data + off, rec->len[k]);
+      buf[rec->len[k]] = '\0';
+      str[k] = buf;
+      off += rec->len[k];
+      buf += rec->len[k] + 1;
+    }
+  }
+}
+
+/* Find the lowest and highest segment numbers in the directory. Returns the number of
+   segments, or -1 on error */
+static int segment_range(journal j, long long *lo, long long *hi) {
+  DIR *d;
+  struct dirent *e;
+  unsigned long long n;
+  int fd, count=0;
+
+  if ((fd = dup(j->dirfd)) < 0 || (d = fdopendir(fd)) == NULL) {
+    syslog(LOG_ERR, "Failed to read the journal directory: %m");
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  rewinddir(d);
+  while ((e = readdir(d)) != NULL) {
+    if (sscanf(e->d_name, JOURNAL_SEGMENT_FMT, &n) == 1 && strlen(e->d_name) == 20) {
+      if (count == 0 || (long long)n < *lo) *lo = n;
+      if (count == 0 || (long long)n > *hi) *hi = n;
+      count++;
+    }
+  }
+  closedir(d);
+  return count;
+}
+
+static void unmap_segment(journal j) {
+  if (j->map) munmap((void *)j->map, JOURNAL_SEGMENT_SIZE);
+  j->map = NULL;
+  j->segno = -1;
+}
+
+/* Map a segment, if it is there. Returns NULL if it isn't, or isn't complete yet */
+static const struct journal_record *map_segment(journal j, long long n) {
+  char name[32];
+  struct stat st;
+  void *m;
+  int fd;
+
+  if (j->segno == n) return j->map;
+  unmap_segment(j);
+
+  snprintf(name, sizeof(name), JOURNAL_SEGMENT_FMT, (unsigned long long)n);
+  if ((fd = openat(j->dirfd, name, O_RDONLY)) < 0) {
+    if (errno != ENOENT) syslog(LOG_ERR, "Failed to open journal segment %s: %m", name);
+    return NULL;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size < JOURNAL_SEGMENT_SIZE) {
+    close(fd);
+    return NULL;
+  }
+  m = mmap(NULL, JOURNAL_SEGMENT_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) {
+    syslog(LOG_ERR, "Failed to map journal segment %s: %m", name);
+    return NULL;
+  }
+  j->map = (const struct journal_record *)m;
+  j->segno = n;
+  return j->map;
+}
+
+/* Copy a record out of its slot. Returns 1 if it is valid, 0 if not, and -1 if its
+   segment isn't there */
+static int get_record(journal j, long long seq, struct journal_record *rec) {
+  const struct journal_record *m;
+
+  if ((m = map_segment(j, (seq - 1) / JOURNAL_SEGMENT_RECORDS)) == NULL) return -1;
+  m += (seq - 1) % JOURNAL_SEGMENT_RECORDS;
+  if (m->magic != JOURNAL_MAGIC) return 0;
+  /* dhcpd writes 'magic' after the rest */
+  __sync_synchronize();
+  memcpy((void *)rec, (const void *)m, sizeof(struct journal_record));
+  return (rec->seq == (uint64_t)seq && journal_valid(rec));
+}
+
+/* Read the position saved in JOURNAL_POS. Returns 0, or -1 if there is none */
+static int read_position(journal j, long long *pos) {
+  char buf[32];
+  int fd, r=-1;
+
+  if ((fd = openat(j->dirfd, JOURNAL_POS, O_RDONLY)) < 0) return -1;
+  memset(buf, 0, sizeof(buf));
+  if (read(fd, buf, sizeof(buf) - 1) > 0) {
+    *pos = strtoll(buf, NULL, 10);
+    r = 0;
+  }
+  close(fd);
+  return r;
+}
+
+journal journal_open(const char *dir) {
+  journal j;
+  long long lo=0, hi=0;
+  int n;
+
+  if (sizeof(struct journal_record) != JOURNAL_RECORD_SIZE) {
+    syslog(LOG_ERR, "journal_open(): Journal records are %d bytes instead of %d",
+	   (int)sizeof(struct journal_record), JOURNAL_RECORD_SIZE);
+    return NULL;
+  }
+  pthread_once(&crc_once, crc_init);
+  if ((j = (journal)calloc(1, sizeof(struct journal_s))) == NULL) {
+    syslog(LOG_ERR, "journal_open(): Out of memory");
+    return NULL;
+  }
+  j->segno = -1;
+  if ((j->dirfd = open(dir, O_RDONLY | O_DIRECTORY)) < 0) {
+    syslog(LOG_ERR, "Failed to open journal directory %s: %m", dir);
+    free(j);
+    return NULL;
+  }
+  if ((n = segment_range(j, &lo, &hi)) < 0) {
+    journal_close(j);
+    return NULL;
+  }
+
+  if (read_position(j, &(j->pos)) < 0 && n > 0) {
+    /* Never been here before, so start with the oldest record there is */
+    j->pos = lo * JOURNAL_SEGMENT_RECORDS;
+  }
+  j->low = (n > 0) ? lo : j->pos / JOURNAL_SEGMENT_RECORDS;
+  return j;
+}
+
+void journal_close(journal j) {
+  if (j) {
+    unmap_segment(j);
+    if (j->dirfd >= 0) close(j->dirfd);
+    free(j);
+  }
+}
+
+long long journal_position(journal j) {
+  return j->pos;
+}
+
+long long journal_backlog(journal j) {
+  uint64_t head;
+  long long pos=0;
+  int fd;
+
+  if ((fd = openat(j->dirfd, JOURNAL_HEAD, O_RDONLY)) < 0) return 0;
+  if (pread(fd, &head, sizeof(head), 0) != sizeof(head)) head = 0;
+  close(fd);
+  if (read_position(j, &pos) < 0) pos = j->pos;
+  return ((long long)head > pos) ? (long long)head - pos : 0;
+}
+
+/* The segment the record after *pos should be in isn't there. If there are later
+   segments, the records in between are gone, and if all segments are before the one
+   *pos is in, dhcpd has started over in an empty directory. Either way, move *pos to
+   the first record there is. Returns 1 if *pos was moved. */
+static int skip_gap(journal j, long long *pos) {
+  long long lo=0, hi=0, want = *pos / JOURNAL_SEGMENT_RECORDS;
+
+  if (segment_range(j, &lo, &hi) <= 0) return 0;
+  if (lo > want) {
+    syslog(LOG_WARNING, "Journal records %lld to %lld are gone, carrying on from there",
+	   *pos + 1, lo * JOURNAL_SEGMENT_RECORDS);
+  } else if (*pos > 0 && hi < (*pos - 1) / JOURNAL_SEGMENT_RECORDS) {
+    syslog(LOG_WARNING, "The journal has been started over, reading it from record %lld",
+	   lo * JOURNAL_SEGMENT_RECORDS + 1);
+  } else {
+    return 0;
+  }
+  *pos = lo * JOURNAL_SEGMENT_RECORDS;
+  return 1;
+}
+
+long long journal_last(journal j, long long *pos, int limit) {
+  struct journal_record rec;
+  long long seq = *pos;
+  int r;
+
+  while (limit <= 0 || seq - *pos < limit) {
+    if ((r = get_record(j, seq + 1, &rec)) > 0) {
+      seq++;
+    } else if (r == 0) {
+      /* Not written yet, unless dhcpd has gone on after it. Then it is damaged, and is
+	 skipped when it is read. */
+      if (get_record(j, seq + 2, &rec) <= 0) break;
+      syslog(LOG_WARNING, "Journal record %lld is damaged", seq + 1);
+      seq++;
+    } else {
+      if (seq == *pos && skip_gap(j, pos)) seq = *pos;
+      else break;
+    }
+  }
+  return seq;
+}
+
+int journal_get(journal j, long long seq, struct journal_record *rec) {
+  return (get_record(j, seq, rec) > 0) ? 1 : 0;
+}
+
+/* Keep a segment we are done with as a spare, unless we have enough of them */
+static void recycle_segment(journal j, long long n) {
+  char name[32], spare[32];
+  unsigned long long k;
+  DIR *d;
+  struct dirent *e;
+  int fd, spares=0;
+
+  if (j->segno == n) unmap_segment(j);
+  if ((fd = dup(j->dirfd)) >= 0 && (d = fdopendir(fd)) != NULL) {
+    rewinddir(d);
+    while ((e = readdir(d)) != NULL) {
+      if (sscanf(e->d_name, JOURNAL_SPARE_FMT, &k) == 1) spares++;
+    }
+    closedir(d);
+  } else if (fd >= 0) {
+    close(fd);
+  }
+
+  snprintf(name, sizeof(name), JOURNAL_SEGMENT_FMT, (unsigned long long)n);
+  snprintf(spare, sizeof(spare), JOURNAL_SPARE_FMT, (unsigned long long)n);
+  if (spares < JOURNAL_SPARES) {
+    if (renameat(j->dirfd, name, j->dirfd, spare) != 0 && errno != ENOENT) {
+      syslog(LOG_WARNING, "Failed to recycle journal segment %s: %m", name);
+    }
+  } else if (unlinkat(j->dirfd, name, 0) != 0 && errno != ENOENT) {
+    syslog(LOG_WARNING, "Failed to remove journal segment %s: %m", name);
+  }
+}
+
+int journal_save(journal j, long long pos) {
+  char buf[32];
+  long long lo=0, hi=0, n;
+  int fd, len;
+
+  len = snprintf(buf, sizeof(buf), "%lld\n", pos);
+  if ((fd = openat(j->dirfd, JOURNAL_POS ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 ||
+      write(fd, buf, len) != len || fsync(fd) != 0 ||
+      renameat(j->dirfd, JOURNAL_POS ".tmp", j->dirfd, JOURNAL_POS) != 0) {
+    syslog(LOG_ERR, "Failed to save the journal position: %m");
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  close(fd);
+  fsync(j->dirfd);
+  j->pos = pos;
+
+  /* A segment is done with when we are past it, and dhcpd has started on the next one */
+  if ((j->low + 1) * JOURNAL_SEGMENT_RECORDS > pos) return 0;
+  if (segment_range(j, &lo, &hi) <= 0) return 0;
+  for (n = lo; n < hi && (n + 1) * JOURNAL_SEGMENT_RECORDS <= pos; n++) recycle_segment(j, n);
+  j->low = n;
+  return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * journal - the memory-mapped journal dhcpd can write lease events to instead of the
+ *           sqlite3 queue, and how we read it.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+/* The journal is a directory of segment files, each JOURNAL_SEGMENT_RECORDS records of
+   JOURNAL_RECORD_SIZE bytes, created at full size. Records are numbered from 1, and
+   segment n holds records n * JOURNAL_SEGMENT_RECORDS + 1 and on. dhcpd appends records
+   in order and rewrites JOURNAL_HEAD with the number of the last one after each group,
+   which is what wakes us up. We keep the number of the last record written to MySQL in
+   JOURNAL_POS, and recycle the segments we are done with as spares for dhcpd to use
+   again.
+
+   The layout below is repeated in hl_ldb.c in the dhcp patch, and has to be kept the
+   same in both. */
+#define JOURNAL_MAGIC 0x314a4c47	/* "GLJ1" */
+#define JOURNAL_RECORD_SIZE 1024
+#define JOURNAL_SEGMENT_RECORDS 8192
+#define JOURNAL_SEGMENT_SIZE ((long)JOURNAL_RECORD_SIZE * JOURNAL_SEGMENT_RECORDS)
+#define JOURNAL_SEGMENT_FMT "seg.%016llx"
+#define JOURNAL_SPARE_FMT "spare.%016llx"
+#define JOURNAL_HEAD "head"
+#define JOURNAL_POS "gluff.pos"
+
+/* How many used segments we keep around for dhcpd to reuse */
+#define JOURNAL_SPARES 2
+
+/* The length of a cid or rid that is NULL */
+#define JOURNAL_NULL 0xffff
+
+/* A record is only valid if 'magic' is set, 'seq' is the number of the slot it is in,
+   and 'crc' is the CRC-32 of the whole record with 'crc' itself set to 0. 'magic' is
+   written last. The strings follow each other in 'data', without terminators. */
+struct journal_record {
+  uint32_t magic;
+  uint32_t crc;
+  uint64_t seq;
+  int64_t start;
+  int64_t end;
+  int32_t rtype;
+  uint16_t len[4];		/* ip, hw, cid, rid */
+  unsigned char data[JOURNAL_RECORD_SIZE - 44];
+};
+
+/* Room for the strings of a record, with terminators */
+#define JOURNAL_STRINGS_SIZE (JOURNAL_RECORD_SIZE - 44 + 4)
+
+/* Check the magic and the CRC of a record. Returns 1 if they are right */
+int journal_valid(struct journal_record *rec);
+
+/* Copy the strings of a record into buf, which has room for JOURNAL_STRINGS_SIZE bytes,
+   and point str[0..3] at the ip, hw, cid and rid, or NULL where there is none */
+void journal_strings(const struct journal_record *rec, unsigned char *buf, const unsigned char *str[4]);
+
+typedef struct journal_s *journal;
+
+/* Open the journal in a directory, and find out where the last run left off. Returns
+   NULL on failure. */
+journal journal_open(const char *dir);
+void journal_close(journal j);
+
+/* The number of the last record written to MySQL, as saved in JOURNAL_POS */
+long long journal_position(journal j);
+
+/* How many records dhcpd has written that are not in MySQL yet. This goes by the files,
+   so it doesn't matter which connection saved the position. */
+long long journal_backlog(journal j);
+
+/* Find the last record dhcpd has written, at most 'limit' records (0 for no limit)
+   after *pos. If the records after *pos are gone for good, *pos is moved up to the
+   first one there is. Returns the number of the last record, *pos if there is nothing
+   new, or -1 on error. */
+long long journal_last(journal j, long long *pos, int limit);
+
+/* Copy a record out of the journal. Returns 1, 0 if the record is damaged, or -1 on
+   error. */
+int journal_get(journal j, long long seq, struct journal_record *rec);
+
+/* Save the number of the last record written to MySQL, and recycle the segments that
+   are done with. Returns 0 on success, -1 on error. */
+int journal_save(journal j, long long pos);
+
+#endif
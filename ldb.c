@@ -0,0 +1,726 @@
+/*
+ * ldb - the local (sqlite3) side of gluff: the lease_queue table dhcpd writes to,
+ *       and the records we read from it.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sqlite3.h>
+
+#include "ldb.h"
+
+struct ldb_block {
+  struct ldb_block *next;
+  size_t size;
+  size_t used;
+  unsigned char data[];
+};
+
+ldb_batch ldb_batch_new(void) {
+  return (ldb_batch)calloc(1, sizeof(struct ldb_batch_s));
+}
+
+void ldb_batch_free(ldb_batch b) {
+  struct ldb_block *k, *next;
+  if (b) {
+    for (k = b->blocks; k; k = next) {
+      next = k->next;
+      free(k);
+    }
+    if (b->recs) free(b->recs);
+    if (b->strs) free((void *)b->strs);
+    free(b);
+  }
+}
+
+void ldb_batch_reset(ldb_batch b) {
+  struct ldb_block *k;
+  for (k = b->blocks; k; k = k->next) k->used = 0;
+  b->cur = b->blocks;
+  if (b->strs) memset((void *)b->strs, 0, b->nslots * sizeof(const unsigned char *));
+  b->nstrs = 0;
+  b->nrecs = 0;
+  b->more = 0;
+  b->bytes = 0;
+}
+
+static unsigned int str_hash(const unsigned char *s) {
+  unsigned int h = 2166136261U;
+  for (; *s; s++) h = (h ^ *s) * 16777619U;
+  return h;
+}
+
+/* Make the string table twice as big */
+static int grow_strs(ldb_batch b) {
+  unsigned int n = b->nslots ? b->nslots * 2 : 1024, i, j;
+  const unsigned char **strs;
+  if ((strs = (const unsigned char **)calloc(n, sizeof(const unsigned char *))) == NULL) return -1;
+  for (i = 0; i < b->nslots; i++) {
+    if (b->strs[i]) {
+      for (j = str_hash(b->strs[i]) & (n - 1); strs[j]; j = (j + 1) & (n - 1));
+      strs[j] = b->strs[i];
+    }
+  }
+  if (b->strs) free((void *)b->strs);
+  b->strs = strs;
+  b->nslots = n;
+  return 0;
+}
+
+/* Return the batch's own copy of a string, adding it if it is new. NULL stays NULL */
+static const unsigned char *intern(ldb_batch b, const unsigned char *s) {
+  size_t len;
+  unsigned int i;
+  unsigned char *p;
+
+  if (s == NULL) return NULL;
+  if ((b->nstrs + 1) * 2 > b->nslots && grow_strs(b) != 0) return NULL;
+
+  for (i = str_hash(s) & (b->nslots - 1); b->strs[i]; i = (i + 1) & (b->nslots - 1)) {
+    if (!strcmp((const char *)(b->strs[i]), (const char *)s)) return b->strs[i];
+  }
+
+  len = strlen((const char *)s) + 1;
+  while (b->cur && b->cur->size - b->cur->used < len) b->cur = b->cur->next;
+  if (b->cur == NULL) {
+    struct ldb_block *k;
+    size_t size = (len > LDB_BLOCKSIZE) ? len : LDB_BLOCKSIZE;
+    if ((k = (struct ldb_block *)malloc(sizeof(struct ldb_block) + size)) == NULL) return NULL;
+    k->size = size;
+    k->used = 0;
+    k->next = b->blocks;
+    b->blocks = k;
+    b->cur = k;
+  }
+  p = b->cur->data + b->cur->used;
+  memcpy(p, s, len);
+  b->cur->used += len;
+  b->strs[i] = p;
+  b->nstrs++;
+  b->bytes += len + 2 * sizeof(const unsigned char *);
+  return p;
+}
+
+/* The most a record with these strings can add to a batch */
+static size_t record_size(const unsigned char *ip, const unsigned char *hw, const unsigned char *cid, const unsigned char *rid) {
+  size_t n = sizeof(struct ldb_entry_s) + 4 * (1 + 2 * sizeof(const unsigned char *));
+  if (ip) n += strlen((const char *)ip);
+  if (hw) n += strlen((const char *)hw);
+  if (cid) n += strlen((const char *)cid);
+  if (rid) n += strlen((const char *)rid);
+  return n;
+}
+
+int ldb_batch_add(ldb_batch b, time_t start, time_t end, int rtype, const unsigned char *ip, const unsigned char *hw, const unsigned char *cid, const unsigned char *rid) {
+  ldb_entry rec;
+
+  if (b->nrecs == b->maxrecs) {
+    int n = b->maxrecs ? b->maxrecs * 2 : 256;
+    if ((rec = (ldb_entry)realloc(b->recs, n * sizeof(struct ldb_entry_s))) == NULL) return -1;
+    b->recs = rec;
+    b->maxrecs = n;
+  }
+
+  rec = &(b->recs[b->nrecs]);
+  memset((void *)rec, 0, sizeof(struct ldb_entry_s));
+  rec->start = start;
+  rec->end = end;
+  rec->rtype = rtype;
+  if ((rec->ip = intern(b, ip ? ip : (const unsigned char *)"")) == NULL ||
+      (rec->hw = intern(b, hw ? hw : (const unsigned char *)"")) == NULL ||
+      (cid != NULL && (rec->cid = intern(b, cid)) == NULL) ||
+      (rid != NULL && (rec->rid = intern(b, rid)) == NULL)) {
+    return -1;
+  }
+  b->nrecs++;
+  b->bytes += sizeof(struct ldb_entry_s);
+  return 0;
+}
+
+int ldb_coalesce(ldb_batch b) {
+  int *last;			/* the latest record for each address, hashed on the interned address */
+  unsigned int nslots=16, h, j;
+  int i, w;
+
+  if (b->nrecs < 2) return 0;
+  while (nslots < (unsigned int)b->nrecs * 2) nslots <<= 1;
+  if ((last = (int *)malloc(nslots * sizeof(int))) == NULL) return 0;
+  memset((void *)last, 0xff, nslots * sizeof(int));
+
+  for (i = 0, w = 0; i < b->nrecs; i++) {
+    ldb_entry rec = &(b->recs[i]), prev;
+    h = (unsigned int)(((unsigned long)rec->ip >> 2) * 2654435761U);
+    for (j = h & (nslots - 1); last[j] >= 0 && b->recs[last[j]].ip != rec->ip; j = (j + 1) & (nslots - 1));
+
+    /* Interned strings are equal when their pointers are */
+    prev = (last[j] >= 0) ? &(b->recs[last[j]]) : NULL;
+    if (prev && prev->rtype == 0 && rec->rtype == 0 && prev->hw == rec->hw &&
+	prev->cid == rec->cid && prev->rid == rec->rid && rec->start <= prev->end) {
+      if (rec->end > prev->end) prev->end = rec->end;
+    } else {
+      if (w != i) b->recs[w] = *rec;
+      last[j] = w++;
+    }
+  }
+
+  free(last);
+  i = b->nrecs - w;
+  b->nrecs = w;
+  return i;
+}
+
+/* Step a statement that returns at most one row and get the integer in its first column.
+   Returns 1 if there was a row that wasn't NULL, 0 if not, and -1 on error. */
+static int step_int64(ldb_conn c, sqlite3_stmt *stmt, sqlite3_int64 *value) {
+  int r;
+  while ((r=sqlite3_step(stmt)) == SQLITE_BUSY) usleep(1000);
+  if (r == SQLITE_ROW) {
+    r = (sqlite3_column_type(stmt, 0) != SQLITE_NULL);
+    if (r) *value = sqlite3_column_int64(stmt, 0);
+  } else if (r == SQLITE_DONE) {
+    r = 0;
+  } else {
+    syslog(LOG_ERR, "sqlite3_step(): %s", sqlite3_errmsg(c->db));
+    r = -1;
+  }
+  sqlite3_reset(stmt);
+  return r;
+}
+
+/* Find out where the last run left off. The saved rowid is only trusted if the record
+   there is still the one we saved it for. */
+static int load_cursor(ldb_conn c) {
+  sqlite3_stmt *load=NULL, *check=NULL, *find=NULL;
+  sqlite3_int64 pos, start, idx, rowid;
+  int r=-1, n;
+
+  c->cursor = 0;
+  if (sqlite3_exec(c->db, CURSOR_TABLE_LSQL, NULL, NULL, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(c->db, CURSOR_LOAD_LSQL, -1, &load, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(c->db, CURSOR_CHECK_LSQL, -1, &check, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(c->db, CURSOR_FIND_LSQL, -1, &find, NULL) != SQLITE_OK) {
+    syslog(LOG_ERR, "Failed to load the queue cursor: %s", sqlite3_errmsg(c->db));
+    goto done;
+  }
+
+  if ((n = sqlite3_step(load)) != SQLITE_ROW) {
+    if (n != SQLITE_DONE) {
+      syslog(LOG_ERR, "sqlite3_step(): %s", sqlite3_errmsg(c->db));
+      goto done;
+    }
+    r = 0;
+    goto done;
+  }
+  pos = sqlite3_column_int64(load, 0);
+  start = sqlite3_column_int64(load, 1);
+  idx = sqlite3_column_int64(load, 2);
+
+  sqlite3_bind_int64(check, 1, pos);
+  sqlite3_bind_int64(check, 2, start);
+  sqlite3_bind_int64(check, 3, idx);
+  if ((n = step_int64(c, check, &rowid)) < 0) goto done;
+  if (n == 0) {
+    sqlite3_bind_int64(find, 1, start);
+    sqlite3_bind_int64(find, 2, idx);
+    if ((n = step_int64(c, find, &rowid)) < 0) goto done;
+    if (n) {
+      syslog(LOG_WARNING, "The queue has been renumbered. Carrying on from rowid %lld instead of %lld",
+	     (long long)rowid, (long long)pos);
+    } else {
+      syslog(LOG_WARNING, "The last record written is gone from the queue. Reading the whole queue");
+      rowid = 0;
+    }
+  }
+  c->cursor = rowid;
+  r = 0;
+
+ done:
+  if (load) sqlite3_finalize(load);
+  if (check) sqlite3_finalize(check);
+  if (find) sqlite3_finalize(find);
+  return r;
+}
+
+ldb_conn ldb_open(const char *filename, int mode, int limit) {
+  ldb_conn c;
+  int r;
+
+  if ((c = (ldb_conn)calloc(1, sizeof(struct ldb_conn_s))) == NULL) {
+    syslog(LOG_ERR, "ldb_open(): Out of memory");
+    return NULL;
+  }
+  c->mode = mode;
+  c->limit = limit;
+
+  if (mode == LDB_MODE_JOURNAL) {
+    if ((c->jnl = journal_open(filename)) == NULL) {
+      ldb_close(c);
+      return NULL;
+    }
+    c->cursor = c->readpos = c->claimfrom = c->claimto = journal_position(c->jnl);
+    return c;
+  }
+
+  if (sqlite3_open(filename, &(c->db)) != SQLITE_OK) {
+    syslog(LOG_ERR, "Failed to open sqlite3 database %s: %s", filename, sqlite3_errmsg(c->db));
+    ldb_close(c);
+    return NULL;
+  }
+
+  sqlite3_extended_result_codes(c->db, 1);
+  sqlite3_busy_timeout(c->db, 6000);
+
+  if (mode == LDB_MODE_CURSOR) {
+    /* With WAL, dhcpd can go on writing while we read */
+    if (sqlite3_exec(c->db, "PRAGMA journal_mode=WAL", NULL, NULL, NULL) != SQLITE_OK) {
+      syslog(LOG_WARNING, "Failed to switch %s to WAL journaling: %s", filename, sqlite3_errmsg(c->db));
+    }
+    r = (load_cursor(c) != 0 ||
+	 sqlite3_prepare_v2(c->db, CURSOR_NTH_LSQL, -1, &(c->claim), NULL) != SQLITE_OK ||
+	 sqlite3_prepare_v2(c->db, CURSOR_GET_LSQL, -1, &(c->get), NULL) != SQLITE_OK ||
+	 sqlite3_prepare_v2(c->db, CURSOR_CLEAR_LSQL, -1, &(c->clear), NULL) != SQLITE_OK ||
+	 sqlite3_prepare_v2(c->db, CURSOR_MAX_LSQL, -1, &(c->last), NULL) != SQLITE_OK ||
+	 sqlite3_prepare_v2(c->db, CURSOR_SAVE_LSQL, -1, &(c->save), NULL) != SQLITE_OK ||
+	 sqlite3_prepare_v2(c->db, PUSHED_FIND_LSQL, -1, &(c->find), NULL) != SQLITE_OK ||
+	 sqlite3_prepare_v2(c->db, CURSOR_PUSHED_COUNT_LSQL, -1, &(c->count), NULL) != SQLITE_OK);
+    c->readpos = c->claimfrom = c->claimto = c->cursor;
+  } else {
+    r = (sqlite3_prepare_v2(c->db, CLAIM_LSQL, strlen(CLAIM_LSQL), &(c->claim), NULL) != SQLITE_OK ||
+	 sqlite3_prepare_v2(c->db, GET_LSQL, strlen(GET_LSQL), &(c->get), NULL) != SQLITE_OK ||
+	 sqlite3_prepare_v2(c->db, CLEAR_LSQL, strlen(CLEAR_LSQL), &(c->clear), NULL) != SQLITE_OK ||
+	 sqlite3_prepare_v2(c->db, PUSHED_FIND_LSQL, -1, &(c->find), NULL) != SQLITE_OK ||
+	 sqlite3_prepare_v2(c->db, PUSHED_COUNT_LSQL, -1, &(c->count), NULL) != SQLITE_OK ||
+	 sqlite3_prepare_v2(c->db, PUSHED_CLAIM_LSQL, -1, &(c->take), NULL) != SQLITE_OK);
+  }
+  if (r) {
+    syslog(LOG_ERR, "Failed to prepare queue statements: %s", sqlite3_errmsg(c->db));
+    ldb_close(c);
+    return NULL;
+  }
+  return c;
+}
+
+void ldb_close(ldb_conn c) {
+  if (c) {
+    if (c->claim) sqlite3_finalize(c->claim);
+    if (c->get) sqlite3_finalize(c->get);
+    if (c->clear) sqlite3_finalize(c->clear);
+    if (c->last) sqlite3_finalize(c->last);
+    if (c->save) sqlite3_finalize(c->save);
+    if (c->find) sqlite3_finalize(c->find);
+    if (c->count) sqlite3_finalize(c->count);
+    if (c->take) sqlite3_finalize(c->take);
+    if (c->db) sqlite3_close(c->db);
+    if (c->jnl) journal_close(c->jnl);
+    free(c);
+  }
+}
+
+int ldb_reset(ldb_conn c) {
+  if (c->mode != LDB_MODE_CLAIM) return 0;
+  if (sqlite3_exec(c->db, RESET_LSQL, NULL, NULL, NULL) != SQLITE_OK) {
+    syslog(LOG_ERR, "Failed to reset queue entries: %s", sqlite3_errmsg(c->db));
+    return -1;
+  }
+  return 0;
+}
+
+/* In cursor mode, a claim is just the range of rowids we are going to read next */
+static int cursor_claim(ldb_conn c) {
+  sqlite3_int64 to = c->readpos;
+  int n;
+
+  if (c->limit > 0) {
+    sqlite3_bind_int64(c->claim, 1, c->readpos);
+    sqlite3_bind_int(c->claim, 2, c->limit - 1);
+    if ((n = step_int64(c, c->claim, &to)) < 0) return -1;
+  } else {
+    n = 0;
+  }
+  /* Fewer than 'limit' records, so take them all */
+  if (n == 0 && step_int64(c, c->last, &to) < 0) return -1;
+
+  c->claimfrom = c->readpos;
+  c->claimto = (to > c->readpos) ? to : c->readpos;
+  c->readpos = c->claimto;
+  return 0;
+}
+
+/* In journal mode, the same thing, with record numbers */
+static int journal_claim(ldb_conn c) {
+  long long from = c->readpos, to;
+
+  if ((to = journal_last(c->jnl, &from, c->limit)) < 0) return -1;
+  c->claimfrom = from;
+  c->claimto = to;
+  c->readpos = to;
+  return 0;
+}
+
+int ldb_claim(ldb_conn c, sqlite3_int64 tag) {
+  int r=0;
+  if (c->mode == LDB_MODE_CURSOR) return cursor_claim(c);
+  if (c->mode == LDB_MODE_JOURNAL) return journal_claim(c);
+  sqlite3_bind_int64(c->claim, 1, tag);
+  sqlite3_bind_int(c->claim, 2, (c->limit > 0) ? c->limit : -1);
+  if (sqlite3_step(c->claim) != SQLITE_DONE) {
+    syslog(LOG_ERR, "sqlite3_step(): %s", sqlite3_errmsg(c->db));
+    r = -1;
+  }
+  sqlite3_reset(c->claim);
+  return r;
+}
+
+void ldb_rewind(ldb_conn c) {
+  if (c->mode != LDB_MODE_CLAIM) c->readpos = c->claimfrom = c->claimto = c->cursor;
+}
+
+/* Read the claimed journal records after b->from. A damaged record is left out, but
+   still counts as read, so that it is not read again. */
+static int journal_read(ldb_conn c, ldb_batch b, size_t maxbytes) {
+  struct journal_record rec;
+  unsigned char buf[JOURNAL_STRINGS_SIZE];
+  const unsigned char *str[4];
+  long long seq;
+
+  for (seq = b->from.rowid + 1; seq <= c->claimto; seq++) {
+    if (!journal_get(c->jnl, seq, &rec)) {
+      b->to.rowid = b->to.idx = seq;
+      continue;
+    }
+    journal_strings(&rec, buf, str);
+    if (maxbytes && b->nrecs > 0 && b->bytes + record_size(str[0], str[1], str[2], str[3]) > maxbytes) {
+      b->more = 1;
+      break;
+    }
+    if (ldb_batch_add(b, rec.start, rec.end, rec.rtype, str[0], str[1], str[2], str[3]) != 0) {
+      syslog(LOG_ERR, "ldb_read(): Out of memory");
+      return -1;
+    }
+    b->to.start = rec.start;
+    b->to.rowid = b->to.idx = seq;
+  }
+  return b->nrecs;
+}
+
+int ldb_read(ldb_conn c, sqlite3_int64 tag, const struct ldb_key *after, ldb_batch b, size_t maxbytes) {
+  int r;
+
+  ldb_batch_reset(b);
+  b->tag = tag;
+  b->from = *after;
+
+  if (c->mode == LDB_MODE_JOURNAL) {
+    if (b->from.rowid < c->claimfrom) b->from.rowid = c->claimfrom;
+    b->to = b->from;
+    return journal_read(c, b, maxbytes);
+  } else if (c->mode == LDB_MODE_CURSOR) {
+    /* The first batch of a claim comes right after the previous claim */
+    if (b->from.rowid < c->claimfrom) b->from.rowid = c->claimfrom;
+    sqlite3_bind_int64(c->get, 1, b->from.rowid);
+    sqlite3_bind_int64(c->get, 2, c->claimto);
+  } else {
+    sqlite3_bind_int64(c->get, 1, tag);
+    sqlite3_bind_int64(c->get, 2, after->start);
+    sqlite3_bind_int64(c->get, 3, after->start);
+    sqlite3_bind_int64(c->get, 4, after->idx);
+  }
+  b->to = b->from;
+  while ((r=sqlite3_step(c->get)) == SQLITE_BUSY || (r == SQLITE_ROW)) {
+    if (r == SQLITE_BUSY) usleep(300000);
+    else {
+      const unsigned char *ipstr = sqlite3_column_text(c->get, 3);
+      const unsigned char *hwstr = sqlite3_column_text(c->get, 4);
+      const unsigned char *cidstr;
+      const unsigned char *ridstr;
+      if (sqlite3_column_type(c->get, 5) != SQLITE_NULL) {
+	cidstr = sqlite3_column_text(c->get, 5);
+      } else {
+	cidstr = NULL;
+      }
+      if (sqlite3_column_type(c->get, 6) != SQLITE_NULL) {
+	ridstr = sqlite3_column_text(c->get, 6);
+      } else {
+	ridstr = NULL;
+      }
+      /* Always take at least one record, or we would never get anywhere */
+      if (maxbytes && b->nrecs > 0 && b->bytes + record_size(ipstr, hwstr, cidstr, ridstr) > maxbytes) {
+	b->more = 1;
+	break;
+      }
+      // resultset = start, rtype, end, ip, hw, cid, rid, idx, rowid
+      if (ldb_batch_add(b,
+		     sqlite3_column_int(c->get, 0),
+		     sqlite3_column_int(c->get, 2),
+		     sqlite3_column_int(c->get, 1),
+		     ipstr, hwstr, cidstr, ridstr) != 0) {
+	syslog(LOG_ERR, "ldb_read(): Out of memory");
+	sqlite3_reset(c->get);
+	return -1;
+      }
+      b->to.start = sqlite3_column_int64(c->get, 0);
+      b->to.idx = sqlite3_column_int64(c->get, 7);
+      b->to.rowid = sqlite3_column_int64(c->get, 8);
+    }
+  }
+
+  if (!b->more && r != SQLITE_DONE) {
+    syslog(LOG_ERR, "sqlite3_step(): %s", sqlite3_errmsg(c->db));
+    sqlite3_reset(c->get);
+    return -1;
+  }
+
+  sqlite3_reset(c->get);
+  return b->nrecs;
+}
+
+/* Run one of the transaction statements, waiting for the lock if need be */
+static int exec_wait(ldb_conn c, const char *q) {
+  int r;
+  while ((r=sqlite3_exec(c->db, q, NULL, NULL, NULL)) == SQLITE_BUSY) {
+    usleep(1000);
+  }
+  if (r != SQLITE_OK) {
+    syslog(LOG_ERR, "sqlite3_exec(): %s", sqlite3_errmsg(c->db));
+    return -1;
+  }
+  return 0;
+}
+
+/* Delete everything up to the last record of the batch and move the cursor there, in
+   one transaction. The last record itself goes with the next batch. */
+static int cursor_clear(ldb_conn c, ldb_batch b) {
+  int r;
+
+  if (b->to.rowid <= b->from.rowid) return 0;
+  if (exec_wait(c, "BEGIN IMMEDIATE") != 0) return -1;
+
+  sqlite3_bind_int64(c->clear, 1, b->from.rowid);
+  sqlite3_bind_int64(c->clear, 2, b->to.rowid);
+  r = sqlite3_step(c->clear);
+  sqlite3_reset(c->clear);
+  if (r == SQLITE_DONE) {
+    sqlite3_bind_int64(c->save, 1, b->to.rowid);
+    sqlite3_bind_int64(c->save, 2, b->to.start);
+    sqlite3_bind_int64(c->save, 3, b->to.idx);
+    r = sqlite3_step(c->save);
+    sqlite3_reset(c->save);
+  }
+  if (r != SQLITE_DONE) {
+    syslog(LOG_ERR, "sqlite3_step(): %s", sqlite3_errmsg(c->db));
+    sqlite3_exec(c->db, "ROLLBACK", NULL, NULL, NULL);
+    return -1;
+  }
+  if (exec_wait(c, "COMMIT") != 0) {
+    sqlite3_exec(c->db, "ROLLBACK", NULL, NULL, NULL);
+    return -1;
+  }
+  c->cursor = b->to.rowid;
+  /* Pushed records are written without being claimed first */
+  if (c->readpos < c->cursor) c->readpos = c->claimfrom = c->claimto = c->cursor;
+  return 0;
+}
+
+int ldb_clear(ldb_conn c, ldb_batch b) {
+  int r;
+
+  if (c->mode == LDB_MODE_CURSOR) return cursor_clear(c, b);
+  if (c->mode == LDB_MODE_JOURNAL) {
+    if (b->to.rowid <= b->from.rowid) return 0;
+    if (journal_save(c->jnl, b->to.rowid) != 0) return -1;
+    c->cursor = b->to.rowid;
+    if (c->readpos < c->cursor) c->readpos = c->claimfrom = c->claimto = c->cursor;
+    return 0;
+  }
+
+  sqlite3_bind_int64(c->clear, 1, b->tag);
+  sqlite3_bind_int64(c->clear, 2, b->from.start);
+  sqlite3_bind_int64(c->clear, 3, b->from.start);
+  sqlite3_bind_int64(c->clear, 4, b->from.idx);
+  sqlite3_bind_int64(c->clear, 5, b->to.start);
+  sqlite3_bind_int64(c->clear, 6, b->to.start);
+  sqlite3_bind_int64(c->clear, 7, b->to.idx);
+  while ((r=sqlite3_step(c->clear)) == SQLITE_BUSY) {
+    usleep(1000);
+  }
+  sqlite3_reset(c->clear);
+
+  if (r != SQLITE_DONE) {
+    syslog(LOG_ERR, "sqlite3_step(): %s", sqlite3_errmsg(c->db));
+    return -1;
+  }
+  return 0;
+}
+
+/* Look up a pushed record in the queue. Returns 1 if it is there, with its rowid and
+   claim, 0 if not, or -1 on error. */
+static int find_pushed(ldb_conn c, const struct ldb_key *key, sqlite3_int64 *rowid, sqlite3_int64 *claimed) {
+  int r;
+
+  sqlite3_bind_int64(c->find, 1, key->start);
+  sqlite3_bind_int64(c->find, 2, key->idx);
+  while ((r=sqlite3_step(c->find)) == SQLITE_BUSY) usleep(1000);
+  if (r == SQLITE_ROW) {
+    *rowid = sqlite3_column_int64(c->find, 0);
+    *claimed = sqlite3_column_int64(c->find, 1);
+    r = 1;
+  } else if (r == SQLITE_DONE) {
+    r = 0;
+  } else {
+    syslog(LOG_ERR, "sqlite3_step(): %s", sqlite3_errmsg(c->db));
+    r = -1;
+  }
+  sqlite3_reset(c->find);
+  return r;
+}
+
+/* Claim mode: the pushed records that come first in (start, idx) order among the
+   unclaimed ones, claimed with the tag, all in one transaction so that no other
+   claim gets in between. 'first' is set to the first of them. */
+static int claim_pushed(ldb_conn c, sqlite3_int64 tag, ldb_batch b, const struct ldb_key *keys, int *first) {
+  struct ldb_key none = LDB_KEY_FIRST, last = LDB_KEY_FIRST;
+  sqlite3_int64 rowid, claimed, n=0;
+  int i, k=0, r;
+
+  if (exec_wait(c, "BEGIN IMMEDIATE") != 0) return -1;
+  for (i = 0; i < b->nrecs; i++) {
+    if ((r = find_pushed(c, &keys[i], &rowid, &claimed)) < 0) goto fail;
+    /* Gone from the queue, so written already */
+    if (k == 0 && r == 0) {
+      *first = i + 1;
+      continue;
+    }
+    if (r == 0 || claimed != 0 ||
+	(k > 0 && (keys[i].start < last.start || (keys[i].start == last.start && keys[i].idx <= last.idx)))) {
+      break;
+    }
+    last = keys[i];
+    k++;
+  }
+
+  if (k > 0) {
+    sqlite3_bind_int64(c->count, 1, last.start);
+    sqlite3_bind_int64(c->count, 2, last.start);
+    sqlite3_bind_int64(c->count, 3, last.idx);
+    sqlite3_bind_int(c->count, 4, k + 1);
+    if (step_int64(c, c->count, &n) < 0) goto fail;
+    if (n != k) k = 0;
+  }
+  for (i = *first; i < *first + k; i++) {
+    sqlite3_bind_int64(c->take, 1, tag);
+    sqlite3_bind_int64(c->take, 2, keys[i].start);
+    sqlite3_bind_int64(c->take, 3, keys[i].idx);
+    r = sqlite3_step(c->take);
+    sqlite3_reset(c->take);
+    if (r != SQLITE_DONE) {
+      syslog(LOG_ERR, "sqlite3_step(): %s", sqlite3_errmsg(c->db));
+      goto fail;
+    }
+  }
+  if (exec_wait(c, "COMMIT") != 0) goto fail;
+
+  b->from = none;
+  b->to = last;
+  return k;
+
+ fail:
+  sqlite3_exec(c->db, "ROLLBACK", NULL, NULL, NULL);
+  return -1;
+}
+
+/* Cursor mode: the pushed records with the rowids right after the cursor. Nothing else
+   writes to the queue but dhcpd, which only ever adds records after the ones there. */
+static int cursor_pushed(ldb_conn c, ldb_batch b, const struct ldb_key *keys, int *first) {
+  sqlite3_int64 rowid, claimed, pos = c->cursor, n=0;
+  int i, k=0, r;
+
+  for (i = 0; i < b->nrecs; i++) {
+    if ((r = find_pushed(c, &keys[i], &rowid, &claimed)) < 0) return -1;
+    /* Gone from the queue, or not after the cursor, so written already */
+    if (k == 0 && (r == 0 || rowid <= c->cursor)) {
+      *first = i + 1;
+      continue;
+    }
+    if (r == 0 || rowid <= pos) break;
+    pos = rowid;
+    k++;
+  }
+
+  if (k > 0) {
+    sqlite3_bind_int64(c->count, 1, c->cursor);
+    sqlite3_bind_int64(c->count, 2, pos);
+    sqlite3_bind_int(c->count, 3, k + 1);
+    if (step_int64(c, c->count, &n) < 0) return -1;
+    if (n != k) k = 0;
+  }
+  if (k > 0) {
+    b->from.rowid = c->cursor;
+    b->to = keys[*first + k - 1];
+    b->to.rowid = pos;
+  }
+  return k;
+}
+
+int ldb_pushed(ldb_conn c, sqlite3_int64 tag, ldb_batch b, const struct ldb_key *keys) {
+  int first=0, k=0;
+
+  b->tag = tag;
+  b->more = 0;
+  if (c->mode == LDB_MODE_CLAIM) {
+    if ((k = claim_pushed(c, tag, b, keys, &first)) < 0) return -1;
+  } else if (c->readpos != c->cursor) {
+    /* Something has been claimed and not written, and that goes first */
+    k = 0;
+  } else if (c->mode == LDB_MODE_CURSOR) {
+    if ((k = cursor_pushed(c, b, keys, &first)) < 0) return -1;
+  } else {
+    /* Record numbers follow on from each other */
+    while (first < b->nrecs && keys[first].rowid <= c->cursor) first++;
+    while (first + k < b->nrecs && keys[first + k].rowid == c->cursor + k + 1) k++;
+    if (k > 0) {
+      b->from.rowid = b->from.idx = c->cursor;
+      b->to = keys[first + k - 1];
+    }
+  }
+
+  if (k > 0 && first > 0) memmove(b->recs, b->recs + first, k * sizeof(struct ldb_entry_s));
+  b->nrecs = k;
+  return k;
+}
+
+long long ldb_backlog(ldb_conn c) {
+  sqlite3_stmt *stmt;
+  sqlite3_int64 n=0;
+
+  if (c->mode == LDB_MODE_JOURNAL) return journal_backlog(c->jnl);
+  if (sqlite3_prepare_v2(c->db, (c->mode == LDB_MODE_CURSOR) ? CURSOR_BACKLOG_LSQL : BACKLOG_LSQL,
+			 -1, &stmt, NULL) != SQLITE_OK) {
+    syslog(LOG_ERR, "Failed to count the queue: %s", sqlite3_errmsg(c->db));
+    return -1;
+  }
+  if (step_int64(c, stmt, &n) < 0) n = -1;
+  sqlite3_finalize(stmt);
+  return n;
+}
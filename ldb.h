@@ -0,0 +1,202 @@
+/*
+ * ldb - the local (sqlite3) side of gluff: the lease_queue table dhcpd writes to,
+ *       and the records we read from it.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#ifndef LDB_H
+#define LDB_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sqlite3.h>
+
+#include "journal.h"
+
+/* How the queue is consumed. In claim mode, records are claimed by setting their
+   'claimed' column, read in (start, idx) order and deleted when they have been written.
+   In cursor mode, records are read in rowid order past the last one we have written,
+   and nothing but the DELETE writes to the queue. In journal mode, there is no sqlite3
+   queue; records are read from the journal in the same way as in cursor mode, with
+   record numbers for rowids. */
+#define LDB_MODE_CLAIM 0
+#define LDB_MODE_CURSOR 1
+#define LDB_MODE_JOURNAL 2
+
+/* Local SQL queries for sqlite3 */
+
+#define RESET_LSQL "UPDATE lease_queue set claimed=0"
+/* A subselect rather than UPDATE ... LIMIT, which needs SQLITE_ENABLE_UPDATE_DELETE_LIMIT. A limit of -1 is none */
+#define CLAIM_LSQL "UPDATE lease_queue set claimed=? where rowid in (SELECT rowid FROM lease_queue where claimed=0 order by start,idx limit ?)"
+#define GET_LSQL "SELECT start,rtype,end,ip,hw,cid,rid,idx,rowid FROM lease_queue where claimed=? and (start>? or (start=? and idx>?)) order by start,idx"
+#define CLEAR_LSQL "DELETE FROM lease_queue where claimed=? and (start>? or (start=? and idx>?)) and (start<? or (start=? and idx<=?))"
+
+/* Cursor mode. The rowid of the last record we have written is kept in gluff_cursor,
+   along with its (start, idx) in case the rowids have been changed by a VACUUM. That
+   record itself stays in the queue until the next one is written, so that sqlite3
+   never hands out its rowid, or any lower one, again. */
+#define CURSOR_TABLE_LSQL "CREATE TABLE IF NOT EXISTS gluff_cursor (id integer primary key, pos integer, start integer, idx integer)"
+#define CURSOR_LOAD_LSQL "SELECT pos,start,idx FROM gluff_cursor where id=1"
+#define CURSOR_SAVE_LSQL "INSERT OR REPLACE INTO gluff_cursor (id,pos,start,idx) values (1,?,?,?)"
+#define CURSOR_CHECK_LSQL "SELECT rowid FROM lease_queue where rowid=? and start=? and idx=?"
+#define CURSOR_FIND_LSQL "SELECT rowid FROM lease_queue where start=? and idx=?"
+#define CURSOR_NTH_LSQL "SELECT rowid FROM lease_queue where rowid>? order by rowid limit 1 offset ?"
+#define CURSOR_MAX_LSQL "SELECT max(rowid) FROM lease_queue"
+#define CURSOR_GET_LSQL "SELECT start,rtype,end,ip,hw,cid,rid,idx,rowid FROM lease_queue where rowid>? and rowid<=? order by rowid"
+#define CURSOR_CLEAR_LSQL "DELETE FROM lease_queue where rowid>=? and rowid<?"
+
+/* Records dhcpd has pushed to us as well (see stream.h) are found in the queue by their
+   (start, idx), and only taken if nothing else in the queue comes before them. The count
+   stops at the limit, so that it never goes through more than the records pushed. */
+#define PUSHED_FIND_LSQL "SELECT rowid,claimed FROM lease_queue where start=? and idx=?"
+#define PUSHED_COUNT_LSQL "SELECT count(*) FROM (SELECT 1 FROM lease_queue where start<? or (start=? and idx<=?) limit ?)"
+#define PUSHED_CLAIM_LSQL "UPDATE lease_queue set claimed=? where start=? and idx=?"
+#define CURSOR_PUSHED_COUNT_LSQL "SELECT count(*) FROM (SELECT 1 FROM lease_queue where rowid>? and rowid<=? limit ?)"
+
+/* How much is waiting to be written to MySQL. In cursor mode, the record at the cursor
+   has been written already. */
+#define BACKLOG_LSQL "SELECT count(*) FROM lease_queue"
+#define CURSOR_BACKLOG_LSQL "SELECT count(*) FROM lease_queue where rowid>(SELECT coalesce(max(pos),0) FROM gluff_cursor)"
+
+/* Strings are interned in blocks of this size */
+#define LDB_BLOCKSIZE 65536
+
+/* Position in the queue: (start, idx) in claim mode, rowid in cursor mode, and the record
+   number in journal mode */
+struct ldb_key {
+  sqlite3_int64 start;
+  sqlite3_int64 idx;
+  sqlite3_int64 rowid;
+};
+
+/* The key before any record of a claim */
+#define LDB_KEY_FIRST { -9223372036854775807LL - 1, 0, 0 }
+
+typedef struct ldb_entry_s {
+  time_t start;
+  time_t end;
+  int rtype;
+  const unsigned char *ip;	/* all four point into the batch's string blocks */
+  const unsigned char *hw;
+  const unsigned char *cid;
+  const unsigned char *rid;
+  int ipid;
+  long long hwid;		/* an id, or the MAC address itself in the compact schema */
+  int cidid;
+  int ridid;
+} *ldb_entry;
+
+struct ldb_block;
+
+/* A batch of records, read in queue order. The records live in one array and their
+   strings are interned in a chain of blocks. Resetting a batch keeps all of its memory
+   for the next one. */
+typedef struct ldb_batch_s {
+  sqlite3_int64 tag;		/* the records were claimed with this */
+  struct ldb_key from;		/* they come after this key */
+  struct ldb_key to;		/* and up to and including this one */
+  int more;			/* there are more claimed records after 'to' */
+  struct ldb_entry_s *recs;
+  int nrecs;
+  int maxrecs;
+  struct ldb_block *blocks;
+  struct ldb_block *cur;	/* the block we are filling */
+  const unsigned char **strs;	/* hash table of the interned strings */
+  unsigned int nslots;
+  unsigned int nstrs;
+  size_t bytes;			/* what the records and strings take up */
+} *ldb_batch;
+
+ldb_batch ldb_batch_new(void);
+void ldb_batch_free(ldb_batch b);
+void ldb_batch_reset(ldb_batch b);
+
+/* Add a record at the end of a batch. Returns 0, or -1 if we are out of memory */
+int ldb_batch_add(ldb_batch b, time_t start, time_t end, int rtype, const unsigned char *ip, const unsigned char *hw, const unsigned char *cid, const unsigned char *rid);
+
+/* Fold runs of identical ACKs for an address into one. An ACK is folded into the
+   previous record for the same address when that is an ACK too, with the same hw,
+   cid and rid, and still running when the new one starts. The earlier record keeps
+   its start and gets the later end. RELEASEs and changes of hw, cid or rid are never
+   folded across. Returns the number of records removed from the batch. */
+int ldb_coalesce(ldb_batch b);
+
+/* One connection to the queue database, with its statements prepared once */
+typedef struct ldb_conn_s {
+  sqlite3 *db;
+  journal jnl;			/* journal mode, instead of 'db' */
+  int mode;			/* LDB_MODE_CLAIM, LDB_MODE_CURSOR or LDB_MODE_JOURNAL */
+  int limit;			/* most records in one claim, 0 for no limit */
+  sqlite3_stmt *claim;		/* CLAIM_LSQL, or CURSOR_NTH_LSQL */
+  sqlite3_stmt *get;
+  sqlite3_stmt *clear;
+  sqlite3_stmt *last;		/* CURSOR_MAX_LSQL */
+  sqlite3_stmt *save;		/* CURSOR_SAVE_LSQL */
+  sqlite3_stmt *find;		/* PUSHED_FIND_LSQL */
+  sqlite3_stmt *count;		/* PUSHED_COUNT_LSQL, or CURSOR_PUSHED_COUNT_LSQL */
+  sqlite3_stmt *take;		/* PUSHED_CLAIM_LSQL */
+  sqlite3_int64 cursor;		/* cursor and journal mode: the last record written through this connection */
+  sqlite3_int64 readpos;	/* ... the last record claimed */
+  sqlite3_int64 claimfrom;	/* ... and the current claim, after this */
+  sqlite3_int64 claimto;	/* up to and including this */
+} *ldb_conn;
+
+/* Open the queue database. In cursor mode, this also switches the database to WAL
+   journaling and picks up where the last run left off. In journal mode, 'filename'
+   is the journal directory. Returns NULL on failure */
+ldb_conn ldb_open(const char *filename, int mode, int limit);
+void ldb_close(ldb_conn c);
+
+/* Put all claimed records back in the queue. Does nothing in cursor or journal mode */
+int ldb_reset(ldb_conn c);
+
+/* Claim a batch of at most 'limit' new records by setting 'claimed' to the tag. A tag is
+   anything non-zero that no other batch in the queue is claimed with. In cursor mode, the
+   tag is not used, and the claim is the records after the previous claim on this
+   connection, which are not written to. The same goes for journal mode. */
+int ldb_claim(ldb_conn c, sqlite3_int64 tag);
+
+/* Cursor and journal mode: forget about what has been claimed but not written, so that the next
+   claim starts after the last record written */
+void ldb_rewind(ldb_conn c);
+
+/* Read the records claimed with the tag that come after the key into an empty batch,
+   in queue order. With maxbytes set, stop before the batch grows past that many bytes
+   and set b->more, so that the rest can be read into the next batch starting at b->to.
+   Returns the number of records read, or -1 on error. */
+int ldb_read(ldb_conn c, sqlite3_int64 tag, const struct ldb_key *after, ldb_batch b, size_t maxbytes);
+
+/* Remove the records of a batch from the queue. In cursor mode, the batches must be
+   removed in the order they were read, and this also saves the cursor. In journal mode,
+   only the position is saved, and the segments that are done with are recycled. */
+int ldb_clear(ldb_conn c, ldb_batch b);
+
+/* Make a batch of records dhcpd has pushed to us, with the keys the stream gave them,
+   into one that can be written and removed like one read from the queue. Only the
+   records that come right after what has been written or claimed before are kept, in
+   claim mode by claiming them with the tag; the ones that have been written already
+   are dropped, and so is anything after a record that is missing or out of place,
+   which is left to be claimed from the queue as usual. Returns the number of records
+   kept, or -1 on error. */
+int ldb_pushed(ldb_conn c, sqlite3_int64 tag, ldb_batch b, const struct ldb_key *keys);
+
+/* The number of records in the queue that have not been written to MySQL yet, claimed
+   or not, or -1 on error. This counts them, so it is not something to do for every
+   batch. */
+long long ldb_backlog(ldb_conn c);
+
+#endif
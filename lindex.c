@@ -0,0 +1,681 @@
+/*
+ * lindex - an index of the leases table, for finding who had an address, or where
+ *          a MAC address, circuit id or remote id was, at a given time. It is kept
+ *          in a snapshot file that is mapped into memory as it is.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+/*
+ * The snapshot is a header followed by arrays that are used where they are in the map:
+ *
+ *  - every value, of all kinds, once, sorted with strcmp(), so that a value is found by
+ *    binary search and is known by its place in the order from then on
+ *  - the leases, sorted by (ip, start, end, id), with their values as such numbers
+ *  - one entry for each address, with where its leases are and the longest of them
+ *  - for each of hw, cid and rid, the numbers of the leases that have one, sorted by
+ *    (value, start, id)
+ *
+ * The leases for a value that overlap from..to all start after from minus the longest
+ * lease there is for it, and no later than to, so they are found with a binary search
+ * and a short scan. Everything is written in the byte order and alignment of the host
+ * that made it, which is checked when it is opened.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "lindex.h"
+
+#define LX_MAGIC "GLUFFLX1"
+#define LX_BYTEORDER 0x01020304
+
+/* A field without a value */
+#define LX_NONE 0xffffffffU
+
+struct lx_header {
+  char magic[8];
+  uint32_t byteorder;
+  uint32_t recsize;
+  int64_t built;
+  int32_t maxid;
+  int32_t lowid;
+  int64_t maxdur;		/* the longest lease */
+  uint64_t nrecs;
+  uint64_t nstrings;
+  uint64_t nips;
+  uint64_t npost[LINDEX_FIELDS];	/* the first one, for ip, isn't used */
+  /* Where things are, from the start of the file */
+  uint64_t strings;
+  uint64_t strdata;
+  uint64_t recs;
+  uint64_t ips;
+  uint64_t post[LINDEX_FIELDS];
+  uint64_t size;
+};
+
+struct lx_rec {
+  int64_t start;
+  int64_t end;
+  int32_t id;
+  uint32_t val[LINDEX_FIELDS];
+  uint32_t pad;
+};
+
+struct lx_ip {
+  uint32_t str;
+  uint32_t pad;
+  uint64_t first;
+  uint64_t n;
+  int64_t maxdur;
+};
+
+struct lindex_s {
+  void *map;
+  size_t size;
+  const struct lx_header *h;
+  const uint64_t *stroff;
+  const char *strdata;
+  const struct lx_rec *recs;
+  const struct lx_ip *ips;
+  const uint32_t *post[LINDEX_FIELDS];
+};
+
+struct lindex_builder_s {
+  char *blob;			/* the values, one after the other with terminators */
+  size_t bloblen;
+  size_t blobmax;
+  uint64_t *stroff;
+  uint32_t nstrings;
+  uint32_t maxstrings;
+  uint32_t *hash;		/* string numbers + 1, 0 for an empty slot */
+  uint32_t hashsize;		/* always a power of two */
+  struct lx_rec *recs;
+  size_t nrecs;
+  size_t maxrecs;
+  int maxid;
+};
+
+void lindex_hw(const char *in, char *out) {
+  char digits[13];
+  int ndigits=0, groups=0, glen=0, padded=1, i;
+  const char *p;
+
+  for (p = in; ; p++) {
+    if (*p == ':' || *p == '-' || *p == '.' || *p == '\0') {
+      if (glen == 0) break;
+      if (glen > 2) padded = 0;
+      else if (glen == 1 && ndigits < 12) {
+	/* "1:2:a:..." as some versions of dhcpd write it */
+	digits[ndigits] = digits[ndigits - 1];
+	digits[ndigits - 1] = '0';
+	ndigits++;
+      }
+      groups++;
+      glen = 0;
+      if (*p == '\0') break;
+      continue;
+    }
+    if (!isxdigit((unsigned char)*p) || ndigits == 12) break;
+    digits[ndigits++] = tolower((unsigned char)*p);
+    glen++;
+  }
+
+  /* Six groups of one or two digits, or twelve digits in one, three or six groups */
+  if (*p == '\0' && ndigits == 12 && ((groups == 6 && padded) || groups == 1 || groups == 3)) {
+    for (i = 0; i < 6; i++) {
+      out[i * 3] = digits[i * 2];
+      out[i * 3 + 1] = digits[i * 2 + 1];
+      out[i * 3 + 2] = (i < 5) ? ':' : '\0';
+    }
+    return;
+  }
+  strncpy(out, in, LINDEX_HWSIZE - 1);
+  out[LINDEX_HWSIZE - 1] = '\0';
+}
+
+/* Reading */
+
+lindex lindex_open(const char *path) {
+  struct stat st;
+  const struct lx_header *h;
+  lindex x;
+  void *map;
+  int fd, i;
+
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    if (errno != ENOENT) syslog(LOG_ERR, "Failed to open %s: %m", path);
+    return NULL;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size < sizeof(struct lx_header)) {
+    syslog(LOG_ERR, "%s is not a lease index", path);
+    close(fd);
+    return NULL;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    syslog(LOG_ERR, "Failed to map %s: %m", path);
+    return NULL;
+  }
+
+  h = (const struct lx_header *)map;
+  if (memcmp(h->magic, LX_MAGIC, sizeof(h->magic)) != 0 || h->size != st.st_size) {
+    syslog(LOG_ERR, "%s is not a lease index", path);
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  if (h->byteorder != LX_BYTEORDER || h->recsize != sizeof(struct lx_rec)) {
+    syslog(LOG_ERR, "%s was made on a different kind of host, and has to be made again", path);
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  if (h->strings + h->nstrings * sizeof(uint64_t) > h->size || h->strdata > h->size ||
+      h->recs + h->nrecs * sizeof(struct lx_rec) > h->size ||
+      h->ips + h->nips * sizeof(struct lx_ip) > h->size ||
+      h->post[LINDEX_HW] + h->npost[LINDEX_HW] * sizeof(uint32_t) > h->size ||
+      h->post[LINDEX_CID] + h->npost[LINDEX_CID] * sizeof(uint32_t) > h->size ||
+      h->post[LINDEX_RID] + h->npost[LINDEX_RID] * sizeof(uint32_t) > h->size) {
+    syslog(LOG_ERR, "%s is damaged", path);
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  if ((x = (lindex)calloc(1, sizeof(struct lindex_s))) == NULL) {
+    syslog(LOG_ERR, "Out of memory");
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  x->map = map;
+  x->size = st.st_size;
+  x->h = h;
+  x->stroff = (const uint64_t *)((const char *)map + h->strings);
+  x->strdata = (const char *)map + h->strdata;
+  x->recs = (const struct lx_rec *)((const char *)map + h->recs);
+  x->ips = (const struct lx_ip *)((const char *)map + h->ips);
+  for (i = LINDEX_HW; i < LINDEX_FIELDS; i++) x->post[i] = (const uint32_t *)((const char *)map + h->post[i]);
+  return x;
+}
+
+void lindex_close(lindex x) {
+  if (x) {
+    munmap(x->map, x->size);
+    free(x);
+  }
+}
+
+void lindex_getinfo(lindex x, struct lindex_info *info) {
+  info->built = x->h->built;
+  info->maxid = x->h->maxid;
+  info->lowid = x->h->lowid;
+  info->leases = x->h->nrecs;
+  info->addresses = x->h->nips;
+  info->values = x->h->nstrings;
+  info->bytes = x->size;
+}
+
+/* The number of a value, or LX_NONE if it isn't there */
+static uint32_t find_string(lindex x, const char *s) {
+  uint64_t lo=0, hi=x->h->nstrings;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    int c = strcmp(x->strdata + x->stroff[mid], s);
+    if (c == 0) return (uint32_t)mid;
+    if (c < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return LX_NONE;
+}
+
+static void found_lease(lindex x, const struct lx_rec *r, lindex_found found, void *arg) {
+  struct lindex_lease l;
+  int i;
+  l.id = r->id;
+  l.start = r->start;
+  l.end = r->end;
+  for (i = 0; i < LINDEX_FIELDS; i++) {
+    l.val[i] = (r->val[i] == LX_NONE) ? NULL : x->strdata + x->stroff[r->val[i]];
+  }
+  found(&l, arg);
+}
+
+int lindex_find(lindex x, int field, const char *value, time_t from, time_t to, lindex_found found, void *arg) {
+  char hw[LINDEX_HWSIZE];
+  int64_t earliest;
+  uint32_t v;
+  uint64_t lo, hi;
+  int n=0;
+
+  if (field == LINDEX_HW) {
+    lindex_hw(value, hw);
+    value = hw;
+  }
+  if ((v = find_string(x, value)) == LX_NONE) return 0;
+
+  if (field == LINDEX_IP) {
+    const struct lx_ip *ip;
+    /* The addresses are in the order of their values */
+    lo = 0;
+    hi = x->h->nips;
+    while (lo < hi) {
+      uint64_t mid = lo + (hi - lo) / 2;
+      if (x->ips[mid].str < v) lo = mid + 1;
+      else hi = mid;
+    }
+    if (lo == x->h->nips || x->ips[lo].str != v) return 0;
+    ip = &(x->ips[lo]);
+    earliest = (int64_t)from - ip->maxdur;
+
+    /* The first lease that starts late enough to overlap */
+    lo = ip->first;
+    hi = ip->first + ip->n;
+    while (lo < hi) {
+      uint64_t mid = lo + (hi - lo) / 2;
+      if (x->recs[mid].start < earliest) lo = mid + 1;
+      else hi = mid;
+    }
+    for (; lo < ip->first + ip->n && x->recs[lo].start <= to; lo++) {
+      if (x->recs[lo].end >= from) {
+	found_lease(x, &(x->recs[lo]), found, arg);
+	n++;
+      }
+    }
+  } else if (field > LINDEX_IP && field < LINDEX_FIELDS) {
+    const uint32_t *post = x->post[field];
+    uint64_t npost = x->h->npost[field];
+    earliest = (int64_t)from - x->h->maxdur;
+
+    lo = 0;
+    hi = npost;
+    while (lo < hi) {
+      uint64_t mid = lo + (hi - lo) / 2;
+      const struct lx_rec *r = &(x->recs[post[mid]]);
+      if (r->val[field] < v || (r->val[field] == v && r->start < earliest)) lo = mid + 1;
+      else hi = mid;
+    }
+    for (; lo < npost; lo++) {
+      const struct lx_rec *r = &(x->recs[post[lo]]);
+      if (r->val[field] != v || r->start > to) break;
+      if (r->end >= from) {
+	found_lease(x, r, found, arg);
+	n++;
+      }
+    }
+  }
+  return n;
+}
+
+/* Building */
+
+lindex_builder lindex_builder_new(void) {
+  lindex_builder b;
+  if ((b = (lindex_builder)calloc(1, sizeof(struct lindex_builder_s))) == NULL) return NULL;
+  b->hashsize = 1024;
+  if ((b->hash = (uint32_t *)calloc(b->hashsize, sizeof(uint32_t))) == NULL) {
+    free(b);
+    return NULL;
+  }
+  return b;
+}
+
+void lindex_builder_free(lindex_builder b) {
+  if (b) {
+    free(b->blob);
+    free(b->stroff);
+    free(b->hash);
+    free(b->recs);
+    free(b);
+  }
+}
+
+static uint32_t hash_string(const char *s) {
+  uint32_t h = 2166136261U;
+  for (; *s; s++) h = (h ^ (unsigned char)*s) * 16777619U;
+  return h;
+}
+
+static int grow_hash(lindex_builder b) {
+  uint32_t n = b->hashsize * 2;
+  uint32_t *hash, i, j;
+  if ((hash = (uint32_t *)calloc(n, sizeof(uint32_t))) == NULL) return -1;
+  for (i = 0; i < b->nstrings; i++) {
+    for (j = hash_string(b->blob + b->stroff[i]) & (n - 1); hash[j]; j = (j + 1) & (n - 1));
+    hash[j] = i + 1;
+  }
+  free(b->hash);
+  b->hash = hash;
+  b->hashsize = n;
+  return 0;
+}
+
+/* The number of a value, which is added if it is new. Returns LX_NONE if we run out
+   of memory. */
+static uint32_t intern(lindex_builder b, const char *s) {
+  size_t len = strlen(s) + 1;
+  uint32_t i;
+
+  for (i = hash_string(s) & (b->hashsize - 1); b->hash[i]; i = (i + 1) & (b->hashsize - 1)) {
+    if (strcmp(b->blob + b->stroff[b->hash[i] - 1], s) == 0) return b->hash[i] - 1;
+  }
+
+  if (b->nstrings == b->maxstrings) {
+    uint32_t n = b->maxstrings ? b->maxstrings * 2 : 1024;
+    uint64_t *p;
+    if ((p = (uint64_t *)realloc(b->stroff, n * sizeof(uint64_t))) == NULL) return LX_NONE;
+    b->stroff = p;
+    b->maxstrings = n;
+  }
+  if (b->bloblen + len > b->blobmax) {
+    size_t n = b->blobmax ? b->blobmax * 2 : 65536;
+    char *p;
+    while (n < b->bloblen + len) n *= 2;
+    if ((p = (char *)realloc(b->blob, n)) == NULL) return LX_NONE;
+    b->blob = p;
+    b->blobmax = n;
+  }
+  memcpy(b->blob + b->bloblen, s, len);
+  b->stroff[b->nstrings] = b->bloblen;
+  b->bloblen += len;
+  b->hash[i] = ++b->nstrings;
+
+  if (b->nstrings * 2 >= b->hashsize && grow_hash(b) != 0) return LX_NONE;
+  return b->nstrings - 1;
+}
+
+static int add_rec(lindex_builder b, const struct lx_rec *r) {
+  if (b->nrecs == b->maxrecs) {
+    size_t n = b->maxrecs ? b->maxrecs * 2 : 65536;
+    struct lx_rec *p;
+    if ((p = (struct lx_rec *)realloc(b->recs, n * sizeof(struct lx_rec))) == NULL) return -1;
+    b->recs = p;
+    b->maxrecs = n;
+  }
+  b->recs[b->nrecs++] = *r;
+  if (r->id > b->maxid) b->maxid = r->id;
+  return 0;
+}
+
+int lindex_builder_keep(lindex_builder b, lindex x, int below, time_t settled) {
+  uint32_t *map;
+  uint64_t i;
+  int f;
+
+  /* Only the values of the leases we keep end up in the new snapshot */
+  if ((map = (uint32_t *)malloc((x->h->nstrings + 1) * sizeof(uint32_t))) == NULL) return -1;
+  for (i = 0; i < x->h->nstrings; i++) {
+    if ((map[i] = intern(b, x->strdata + x->stroff[i])) == LX_NONE) {
+      free(map);
+      return -1;
+    }
+  }
+  for (i = 0; i < x->h->nrecs; i++) {
+    struct lx_rec r = x->recs[i];
+    if (r.id >= below || r.end >= settled) continue;
+    for (f = 0; f < LINDEX_FIELDS; f++) {
+      if (r.val[f] != LX_NONE) r.val[f] = map[r.val[f]];
+    }
+    if (add_rec(b, &r) != 0) {
+      free(map);
+      return -1;
+    }
+  }
+  free(map);
+  if (x->h->maxid > b->maxid) b->maxid = x->h->maxid;
+  return 0;
+}
+
+int lindex_builder_add(lindex_builder b, const struct lindex_lease *l) {
+  struct lx_rec r;
+  char hw[LINDEX_HWSIZE];
+  int f;
+
+  if (l->val[LINDEX_IP] == NULL) return 0;
+  memset((void *)&r, 0, sizeof(r));
+  r.start = l->start;
+  r.end = l->end;
+  r.id = l->id;
+  for (f = 0; f < LINDEX_FIELDS; f++) {
+    const char *v = l->val[f];
+    if (v == NULL) {
+      r.val[f] = LX_NONE;
+      continue;
+    }
+    if (f == LINDEX_HW) {
+      lindex_hw(v, hw);
+      v = hw;
+    }
+    if ((r.val[f] = intern(b, v)) == LX_NONE) return -1;
+  }
+  return add_rec(b, &r);
+}
+
+/* qsort() has no argument to pass these in */
+static const char *sort_blob;
+static const uint64_t *sort_stroff;
+static const struct lx_rec *sort_recs;
+static int sort_field;
+
+static int cmp_strings(const void *a, const void *b) {
+  return strcmp(sort_blob + sort_stroff[*(const uint32_t *)a], sort_blob + sort_stroff[*(const uint32_t *)b]);
+}
+
+static int cmp_recs(const void *a, const void *b) {
+  const struct lx_rec *x = (const struct lx_rec *)a;
+  const struct lx_rec *y = (const struct lx_rec *)b;
+  if (x->val[LINDEX_IP] != y->val[LINDEX_IP]) return (x->val[LINDEX_IP] < y->val[LINDEX_IP]) ? -1 : 1;
+  if (x->start != y->start) return (x->start < y->start) ? -1 : 1;
+  if (x->end != y->end) return (x->end < y->end) ? -1 : 1;
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+static int cmp_post(const void *a, const void *b) {
+  const struct lx_rec *x = &(sort_recs[*(const uint32_t *)a]);
+  const struct lx_rec *y = &(sort_recs[*(const uint32_t *)b]);
+  if (x->val[sort_field] != y->val[sort_field]) return (x->val[sort_field] < y->val[sort_field]) ? -1 : 1;
+  if (x->start != y->start) return (x->start < y->start) ? -1 : 1;
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+static int cmp_ids(const void *a, const void *b) {
+  const struct lx_rec *x = &(sort_recs[*(const uint32_t *)a]);
+  const struct lx_rec *y = &(sort_recs[*(const uint32_t *)b]);
+  if (x->id != y->id) return (x->id < y->id) ? -1 : 1;
+  return (*(const uint32_t *)a > *(const uint32_t *)b) - (*(const uint32_t *)a < *(const uint32_t *)b);
+}
+
+/* A lease that was kept from the last snapshot and read again is only there once, as it
+   was read, which is after what was kept. Returns 0, or -1 if we run out of memory. */
+static int drop_duplicates(lindex_builder b) {
+  uint32_t *order;
+  uint64_t i, n;
+
+  if (b->nrecs < 2) return 0;
+  if ((order = (uint32_t *)malloc(b->nrecs * sizeof(uint32_t))) == NULL) return -1;
+  for (i = 0; i < b->nrecs; i++) order[i] = i;
+  sort_recs = b->recs;
+  qsort(order, b->nrecs, sizeof(uint32_t), cmp_ids);
+  for (i = 0; i + 1 < b->nrecs; i++) {
+    if (b->recs[order[i]].id == b->recs[order[i + 1]].id) b->recs[order[i]].val[LINDEX_IP] = LX_NONE;
+  }
+  free(order);
+  for (i = 0, n = 0; i < b->nrecs; i++) {
+    if (b->recs[i].val[LINDEX_IP] != LX_NONE) b->recs[n++] = b->recs[i];
+  }
+  b->nrecs = n;
+  return 0;
+}
+
+static uint64_t align8(uint64_t n) {
+  return (n + 7) & ~(uint64_t)7;
+}
+
+/* Pad what has been written, 'len' bytes, to a multiple of eight */
+static int pad(FILE *f, size_t len) {
+  static const char zero[8];
+  size_t n = align8(len) - len;
+  return (n > 0 && fwrite(zero, 1, n, f) != n) ? -1 : 0;
+}
+
+/* Write 'len' bytes, padded */
+static int put(FILE *f, const void *p, size_t len) {
+  if (len > 0 && fwrite(p, 1, len, f) != len) return -1;
+  return pad(f, len);
+}
+
+int lindex_builder_write(lindex_builder b, const char *path, time_t settled) {
+  struct lx_header h;
+  struct lx_ip *ips=NULL;
+  uint32_t *order=NULL, *rank=NULL, *post[LINDEX_FIELDS]={ NULL };
+  uint64_t *stroff=NULL;
+  uint64_t i, n, strbytes=0;
+  char tmp[4096];
+  FILE *f=NULL;
+  int fd, k, r=-1;
+
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp)) {
+    syslog(LOG_ERR, "Index file name %s is too long", path);
+    return -1;
+  }
+  if (drop_duplicates(b) != 0) goto nomem;
+  memset((void *)&h, 0, sizeof(h));
+  memcpy(h.magic, LX_MAGIC, sizeof(h.magic));
+  h.byteorder = LX_BYTEORDER;
+  h.recsize = sizeof(struct lx_rec);
+  h.built = time(NULL);
+  h.maxid = b->maxid;
+  h.lowid = b->maxid + 1;
+  h.nrecs = b->nrecs;
+
+  /* Number the values that are used in strcmp() order, and drop the others */
+  if ((rank = (uint32_t *)malloc((b->nstrings + 1) * sizeof(uint32_t))) == NULL ||
+      (order = (uint32_t *)malloc((b->nstrings + 1) * sizeof(uint32_t))) == NULL) goto nomem;
+  for (i = 0; i < b->nstrings; i++) rank[i] = LX_NONE;
+  for (i = 0; i < b->nrecs; i++) {
+    for (k = 0; k < LINDEX_FIELDS; k++) {
+      if (b->recs[i].val[k] != LX_NONE) rank[b->recs[i].val[k]] = 0;
+    }
+  }
+  for (i = 0, n = 0; i < b->nstrings; i++) {
+    if (rank[i] == 0) order[n++] = i;
+  }
+  sort_blob = b->blob;
+  sort_stroff = b->stroff;
+  qsort(order, n, sizeof(uint32_t), cmp_strings);
+  h.nstrings = n;
+  if ((stroff = (uint64_t *)malloc((n + 1) * sizeof(uint64_t))) == NULL) goto nomem;
+  for (i = 0; i < n; i++) {
+    rank[order[i]] = i;
+    stroff[i] = strbytes;
+    strbytes += strlen(b->blob + b->stroff[order[i]]) + 1;
+  }
+
+  for (i = 0; i < b->nrecs; i++) {
+    struct lx_rec *rec = &(b->recs[i]);
+    for (k = 0; k < LINDEX_FIELDS; k++) {
+      if (rec->val[k] != LX_NONE) rec->val[k] = rank[rec->val[k]];
+    }
+    if (rec->end - rec->start > h.maxdur) h.maxdur = rec->end - rec->start;
+    if (rec->end >= settled && rec->id < h.lowid) h.lowid = rec->id;
+  }
+  qsort(b->recs, b->nrecs, sizeof(struct lx_rec), cmp_recs);
+
+  /* One entry for each address */
+  if ((ips = (struct lx_ip *)malloc((b->nrecs + 1) * sizeof(struct lx_ip))) == NULL) goto nomem;
+  for (i = 0; i < b->nrecs; i++) {
+    struct lx_rec *rec = &(b->recs[i]);
+    if (h.nips == 0 || ips[h.nips - 1].str != rec->val[LINDEX_IP]) {
+      memset((void *)&(ips[h.nips]), 0, sizeof(struct lx_ip));
+      ips[h.nips].str = rec->val[LINDEX_IP];
+      ips[h.nips++].first = i;
+    }
+    ips[h.nips - 1].n++;
+    if (rec->end - rec->start > ips[h.nips - 1].maxdur) ips[h.nips - 1].maxdur = rec->end - rec->start;
+  }
+
+  sort_recs = b->recs;
+  for (k = LINDEX_HW; k < LINDEX_FIELDS; k++) {
+    if ((post[k] = (uint32_t *)malloc((b->nrecs + 1) * sizeof(uint32_t))) == NULL) goto nomem;
+    for (i = 0; i < b->nrecs; i++) {
+      if (b->recs[i].val[k] != LX_NONE) post[k][h.npost[k]++] = i;
+    }
+    sort_field = k;
+    qsort(post[k], h.npost[k], sizeof(uint32_t), cmp_post);
+  }
+
+  h.strings = align8(sizeof(h));
+  h.strdata = h.strings + align8(h.nstrings * sizeof(uint64_t));
+  h.recs = h.strdata + align8(strbytes);
+  h.ips = h.recs + align8(h.nrecs * sizeof(struct lx_rec));
+  h.post[LINDEX_HW] = h.ips + align8(h.nips * sizeof(struct lx_ip));
+  for (k = LINDEX_CID; k < LINDEX_FIELDS; k++) h.post[k] = h.post[k - 1] + align8(h.npost[k - 1] * sizeof(uint32_t));
+  h.size = h.post[LINDEX_RID] + align8(h.npost[LINDEX_RID] * sizeof(uint32_t));
+
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 || (f = fdopen(fd, "w")) == NULL) {
+    syslog(LOG_ERR, "Failed to create %s: %m", tmp);
+    if (fd >= 0) close(fd);
+    goto out;
+  }
+  if (put(f, &h, sizeof(h)) != 0 || put(f, stroff, h.nstrings * sizeof(uint64_t)) != 0) goto failed;
+  for (i = 0; i < h.nstrings; i++) {
+    const char *s = b->blob + b->stroff[order[i]];
+    if (fwrite(s, 1, strlen(s) + 1, f) != strlen(s) + 1) goto failed;
+  }
+  if (pad(f, strbytes) != 0 ||
+      put(f, b->recs, h.nrecs * sizeof(struct lx_rec)) != 0 ||
+      put(f, ips, h.nips * sizeof(struct lx_ip)) != 0) goto failed;
+  for (k = LINDEX_HW; k < LINDEX_FIELDS; k++) {
+    if (put(f, post[k], h.npost[k] * sizeof(uint32_t)) != 0) goto failed;
+  }
+  if (fflush(f) != 0 || fsync(fileno(f)) != 0) goto failed;
+  fclose(f);
+  f = NULL;
+  if (rename(tmp, path) != 0) {
+    syslog(LOG_ERR, "Failed to replace %s: %m", path);
+    unlink(tmp);
+    goto out;
+  }
+  r = 0;
+  goto out;
+
+ nomem:
+  syslog(LOG_ERR, "Out of memory");
+  goto out;
+
+ failed:
+  syslog(LOG_ERR, "Failed to write %s: %m", tmp);
+  fclose(f);
+  unlink(tmp);
+
+ out:
+  free(rank);
+  free(order);
+  free(stroff);
+  free(ips);
+  for (k = 0; k < LINDEX_FIELDS; k++) free(post[k]);
+  return r;
+}
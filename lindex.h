@@ -0,0 +1,95 @@
+/*
+ * lindex - an index of the leases table, for finding who had an address, or where
+ *          a MAC address, circuit id or remote id was, at a given time. It is kept
+ *          in a snapshot file that is mapped into memory as it is.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#ifndef LINDEX_H
+#define LINDEX_H
+
+#include <stddef.h>
+#include <time.h>
+
+/* The values a lease can be looked up by */
+#define LINDEX_IP 0
+#define LINDEX_HW 1
+#define LINDEX_CID 2
+#define LINDEX_RID 3
+#define LINDEX_FIELDS 4
+
+/* The longest MAC address lindex_hw() writes, with its terminator */
+#define LINDEX_HWSIZE 18
+
+/* A lease record. The values are NULL where the record has none. */
+struct lindex_lease {
+  int id;			/* the 'id' column of the row */
+  time_t start;
+  time_t end;
+  const char *val[LINDEX_FIELDS];
+};
+
+typedef struct lindex_s *lindex;
+typedef struct lindex_builder_s *lindex_builder;
+
+/* Called for each lease found. The lease, and the strings in it, are only good until
+   the call returns. */
+typedef void (*lindex_found)(const struct lindex_lease *l, void *arg);
+
+/* Map a snapshot file. Returns NULL, and logs why, if it can't be used. */
+lindex lindex_open(const char *path);
+void lindex_close(lindex x);
+
+/* Call 'found' for each lease with 'value' in 'field' that overlaps from..to, in the
+   order the leases started. Returns the number of leases found. */
+int lindex_find(lindex x, int field, const char *value, time_t from, time_t to, lindex_found found, void *arg);
+
+struct lindex_info {
+  time_t built;			/* when the snapshot was written */
+  int maxid;			/* the highest 'id' in it */
+  int lowid;			/* the lowest 'id' of a lease that may still change */
+  unsigned long leases;
+  unsigned long addresses;
+  unsigned long values;		/* distinct values of all kinds */
+  size_t bytes;
+};
+
+void lindex_getinfo(lindex x, struct lindex_info *info);
+
+/* Write a MAC address the way the index keeps them, "00:1a:2b:3c:4d:5e", if it looks
+   like one, with or without separators. Anything else is copied as it is, cut off at
+   LINDEX_HWSIZE - 1 characters. */
+void lindex_hw(const char *in, char *out);
+
+/* Start a new snapshot */
+lindex_builder lindex_builder_new(void);
+void lindex_builder_free(lindex_builder b);
+
+/* Add the leases of an earlier snapshot whose id is under 'below' and that ended before
+   'settled', the ones that aren't read again. Returns 0, or -1 if we run out of memory. */
+int lindex_builder_keep(lindex_builder b, lindex x, int below, time_t settled);
+
+/* Add a lease. Returns 0, or -1 if we run out of memory. */
+int lindex_builder_add(lindex_builder b, const struct lindex_lease *l);
+
+/* Write the snapshot to 'path', by way of a temporary file that takes its place when it
+   is complete. Leases that ended before 'settled' are taken not to change any more, and
+   the lowest id of the others is remembered, to start the next refresh from. The builder
+   is used up by this, and can only be freed afterwards. Returns 0, or -1 on failure. */
+int lindex_builder_write(lindex_builder b, const char *path, time_t settled);
+
+#endif
@@ -0,0 +1,124 @@
+/*
+ * lstate - in-memory table of the currently active lease for each IP address id,
+ *          so that renewals can be decided without asking MySQL first.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+/*
+ * A linear probing hash table of entries, kept at most half full. IP address ids
+ * come from an auto_increment column and are never 0, so ip == 0 marks an empty
+ * slot. Deleting shifts the following entries back instead of leaving tombstones.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lstate.h"
+
+struct lstate_s {
+  struct lstate_entry *slots;
+  unsigned int nslots;		/* always a power of two */
+  unsigned int entries;
+  unsigned int maxentries;
+  unsigned long flushes;
+};
+
+static unsigned int ls_slot(lstate s, int ip) {
+  return ((unsigned int)ip * 2654435761U) & (s->nslots - 1);
+}
+
+lstate lstate_new(unsigned int maxentries) {
+  lstate s;
+  unsigned int n=16;
+
+  if (maxentries == 0) return NULL;
+  while (n < maxentries * 2) n <<= 1;
+  if ((s = (lstate)calloc(1, sizeof(struct lstate_s))) == NULL) return NULL;
+  if ((s->slots = (struct lstate_entry *)calloc(n, sizeof(struct lstate_entry))) == NULL) {
+    free(s);
+    return NULL;
+  }
+  s->nslots = n;
+  s->maxentries = maxentries;
+  return s;
+}
+
+void lstate_free(lstate s) {
+  if (s) {
+    free(s->slots);
+    free(s);
+  }
+}
+
+struct lstate_entry *lstate_get(lstate s, int ip) {
+  unsigned int i;
+  for (i = ls_slot(s, ip); s->slots[i].ip; i = (i + 1) & (s->nslots - 1)) {
+    if (s->slots[i].ip == ip) return &(s->slots[i]);
+  }
+  return NULL;
+}
+
+void lstate_set(lstate s, const struct lstate_entry *e) {
+  unsigned int i;
+
+  if (e->ip == 0) return;
+  for (i = ls_slot(s, e->ip); s->slots[i].ip; i = (i + 1) & (s->nslots - 1)) {
+    if (s->slots[i].ip == e->ip) {
+      s->slots[i] = *e;
+      return;
+    }
+  }
+
+  if (s->entries >= s->maxentries) {
+    lstate_clear(s);
+    s->flushes++;
+    i = ls_slot(s, e->ip);
+  }
+  s->slots[i] = *e;
+  s->entries++;
+}
+
+void lstate_drop(lstate s, int ip) {
+  unsigned int i, j, k;
+
+  for (i = ls_slot(s, ip); s->slots[i].ip; i = (i + 1) & (s->nslots - 1)) {
+    if (s->slots[i].ip == ip) break;
+  }
+  if (!s->slots[i].ip) return;
+
+  /* Move back any entry further down the chain that would not be found past the hole */
+  for (j = (i + 1) & (s->nslots - 1); s->slots[j].ip; j = (j + 1) & (s->nslots - 1)) {
+    k = ls_slot(s, s->slots[j].ip);
+    if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+      s->slots[i] = s->slots[j];
+      i = j;
+    }
+  }
+  memset((void *)&(s->slots[i]), 0, sizeof(struct lstate_entry));
+  s->entries--;
+}
+
+void lstate_clear(lstate s) {
+  memset((void *)s->slots, 0, s->nslots * sizeof(struct lstate_entry));
+  s->entries = 0;
+}
+
+void lstate_getstats(lstate s, struct lstate_stats *st) {
+  st->entries = s->entries;
+  st->maxentries = s->maxentries;
+  st->flushes = s->flushes;
+}
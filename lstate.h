@@ -0,0 +1,68 @@
+/*
+ * lstate - in-memory table of the currently active lease for each IP address id,
+ *          so that renewals can be decided without asking MySQL first.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#ifndef LSTATE_H
+#define LSTATE_H
+
+#include <time.h>
+
+/* An entry that has not been read from or written to MySQL for this many seconds
+   is looked up again, in case someone else has been changing the leases table */
+#define LSTATE_MAXAGE 3600
+
+/* What we know about the lease row for one IP address id */
+struct lstate_entry {
+  int ip;
+  int id;			/* the 'id' column of the row */
+  time_t start;
+  time_t end;
+  long long hw;
+  int cid;
+  int rid;
+  time_t verified;		/* when the row last looked like this in MySQL */
+};
+
+typedef struct lstate_s *lstate;
+
+/* Create a table for at most 'maxentries' leases. Returns NULL on failure */
+lstate lstate_new(unsigned int maxentries);
+void lstate_free(lstate s);
+
+/* Look up the lease for an IP address id. Returns NULL if we don't know it */
+struct lstate_entry *lstate_get(lstate s, int ip);
+
+/* Add or replace the lease for e->ip. A full table is emptied first */
+void lstate_set(lstate s, const struct lstate_entry *e);
+
+/* Forget the lease for an IP address id */
+void lstate_drop(lstate s, int ip);
+
+/* Forget everything */
+void lstate_clear(lstate s);
+
+struct lstate_stats {
+  unsigned long entries;
+  unsigned long maxentries;
+  unsigned long flushes;
+};
+
+void lstate_getstats(lstate s, struct lstate_stats *st);
+
+#endif
@@ -0,0 +1,334 @@
+/*
+ * metrics - counters and latency histograms for the stages records go through on
+ *           their way to MySQL, served in Prometheus text format on a Unix socket.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+/* How long a client gets to send its request, in milliseconds, and how long we wait for
+   it to take the response, in seconds */
+#define REQUEST_TIMEOUT_MS 100
+#define RESPONSE_TIMEOUT 1
+
+/* The last bucket is for anything longer than the others */
+struct histogram {
+  unsigned long buckets[METRIC_BUCKETS + 1];
+  unsigned long count;
+  unsigned long long sum;
+};
+
+static struct histogram histograms[METRIC_HISTOGRAMS];
+static unsigned long counters[METRIC_COUNTERS];
+static long long backlog[METRIC_SOURCES];
+static const char *source_names[METRIC_SOURCES];
+static int nsources=0;
+static int batch_size=0;
+static int catching_up=0;
+
+static const char *stage_names[METRIC_LAG] = {
+  "claim", "fetch", "resolve", "find", "update", "make", "commit", "clear", "call"
+};
+
+static const char *counter_names[METRIC_COUNTERS] = {
+  "records_read", "records_collapsed", "records_committed", "rollbacks", "lease_rows_merged"
+};
+
+static const char *counter_help[METRIC_COUNTERS] = {
+  "Records read from the queue or the stream",
+  "Records folded into earlier ACKs for the same lease",
+  "Records written to MySQL",
+  "Transactions rolled back",
+  "Lease rows merged into others by compaction"
+};
+
+static int lfd=-1;
+
+long long metrics_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Put a value in the first bucket it is no bigger than the upper bound of */
+static void observe(struct histogram *h, long long v) {
+  int i=0;
+  if (v > 1) {
+    i = 64 - __builtin_clzll((unsigned long long)(v - 1));
+    if (i > METRIC_BUCKETS) i = METRIC_BUCKETS;
+  }
+  if (v < 0) v = 0;
+  __atomic_add_fetch(&(h->buckets[i]), 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&(h->count), 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&(h->sum), (unsigned long long)v, __ATOMIC_RELAXED);
+}
+
+long long metrics_time(int stage, long long since) {
+  long long now = metrics_now();
+  observe(&(histograms[stage]), now - since);
+  return now;
+}
+
+void metrics_committed(time_t now, time_t start) {
+  observe(&(histograms[METRIC_LAG]), (long long)(now - start));
+  __atomic_add_fetch(&(counters[COUNTER_COMMITTED]), 1, __ATOMIC_RELAXED);
+}
+
+void metrics_count(int counter, unsigned long n) {
+  __atomic_add_fetch(&(counters[counter]), n, __ATOMIC_RELAXED);
+}
+
+unsigned long metrics_counter(int counter) {
+  return __atomic_load_n(&(counters[counter]), __ATOMIC_RELAXED);
+}
+
+void metrics_source(int source, const char *name) {
+  if (source < 0 || source >= METRIC_SOURCES) return;
+  source_names[source] = name;
+  backlog[source] = -1;
+  if (source >= nsources) nsources = source + 1;
+}
+
+void metrics_backlog(int source, long long n) {
+  if (source < 0 || source >= nsources) return;
+  __atomic_store_n(&(backlog[source]), n, __ATOMIC_RELAXED);
+}
+
+void metrics_batchsize(int size, int catchup) {
+  __atomic_store_n(&batch_size, size, __ATOMIC_RELAXED);
+  __atomic_store_n(&catching_up, catchup, __ATOMIC_RELAXED);
+}
+
+/* Take a copy of a histogram. The copy may be a few records out of step with itself,
+   since we don't stop anyone from adding to it meanwhile, but never by much. */
+static void snapshot(int stage, struct histogram *h) {
+  int i;
+  for (i = 0; i <= METRIC_BUCKETS; i++) {
+    h->buckets[i] = __atomic_load_n(&(histograms[stage].buckets[i]), __ATOMIC_RELAXED);
+  }
+  h->count = __atomic_load_n(&(histograms[stage].count), __ATOMIC_RELAXED);
+  h->sum = __atomic_load_n(&(histograms[stage].sum), __ATOMIC_RELAXED);
+}
+
+/* Print one histogram, with cumulative buckets, in Prometheus text format. 'scale' is
+   what its values have to be divided by to make seconds. */
+static void print_histogram(FILE *f, const char *name, const char *label, int stage, double scale) {
+  struct histogram h;
+  unsigned long n=0;
+  int i;
+
+  snapshot(stage, &h);
+  for (i = 0; i < METRIC_BUCKETS; i++) {
+    n += h.buckets[i];
+    fprintf(f, "%s_bucket{%sle=\"%.9g\"} %lu\n", name, label, (double)(1LL << i) / scale, n);
+  }
+  fprintf(f, "%s_bucket{%sle=\"+Inf\"} %lu\n", name, label, n + h.buckets[METRIC_BUCKETS]);
+  if (*label) {
+    /* Without the trailing comma */
+    fprintf(f, "%s_sum{%.*s} %.6f\n", name, (int)strlen(label) - 1, label, (double)h.sum / scale);
+    fprintf(f, "%s_count{%.*s} %lu\n", name, (int)strlen(label) - 1, label, h.count);
+  } else {
+    fprintf(f, "%s_sum %.6f\n", name, (double)h.sum / scale);
+    fprintf(f, "%s_count %lu\n", name, h.count);
+  }
+}
+
+/* Print a label value, with backslashes, quotes and newlines escaped */
+static void print_label(FILE *f, const char *s) {
+  for (; *s; s++) {
+    if (*s == '\\' || *s == '"') fputc('\\', f);
+    if (*s == '\n') fputs("\\n", f);
+    else fputc(*s, f);
+  }
+}
+
+static void print_metrics(FILE *f) {
+  char label[32];
+  int i;
+
+  fprintf(f, "# HELP gluff_stage_seconds Time taken by each stage of writing queue records to MySQL\n");
+  fprintf(f, "# TYPE gluff_stage_seconds histogram\n");
+  for (i = 0; i < METRIC_LAG; i++) {
+    snprintf(label, sizeof(label), "stage=\"%s\",", stage_names[i]);
+    print_histogram(f, "gluff_stage_seconds", label, i, 1e6);
+  }
+
+  fprintf(f, "# HELP gluff_lag_seconds Time from the start of a lease to when its record was committed to MySQL\n");
+  fprintf(f, "# TYPE gluff_lag_seconds histogram\n");
+  print_histogram(f, "gluff_lag_seconds", "", METRIC_LAG, 1);
+
+  for (i = 0; i < METRIC_COUNTERS; i++) {
+    fprintf(f, "# HELP gluff_%s_total %s\n", counter_names[i], counter_help[i]);
+    fprintf(f, "# TYPE gluff_%s_total counter\n", counter_names[i]);
+    fprintf(f, "gluff_%s_total %lu\n", counter_names[i], metrics_counter(i));
+  }
+
+  fprintf(f, "# HELP gluff_queue_backlog Records waiting in each queue, as last counted\n");
+  fprintf(f, "# TYPE gluff_queue_backlog gauge\n");
+  for (i = 0; i < nsources; i++) {
+    fprintf(f, "gluff_queue_backlog{source=\"");
+    print_label(f, source_names[i]);
+    fprintf(f, "\"} %lld\n", __atomic_load_n(&(backlog[i]), __ATOMIC_RELAXED));
+  }
+
+  fprintf(f, "# HELP gluff_batch_size Records claimed at a time, 0 for no limit\n");
+  fprintf(f, "# TYPE gluff_batch_size gauge\n");
+  fprintf(f, "gluff_batch_size %d\n", __atomic_load_n(&batch_size, __ATOMIC_RELAXED));
+  fprintf(f, "# HELP gluff_catching_up Whether larger batches are being claimed to catch up with a backlog\n");
+  fprintf(f, "# TYPE gluff_catching_up gauge\n");
+  fprintf(f, "gluff_catching_up %d\n", __atomic_load_n(&catching_up, __ATOMIC_RELAXED));
+}
+
+/* Read what the client sends, if anything, up to the end of the request headers. Returns
+   1 if it is an HTTP request. Whatever is left unread when we close the connection
+   would make the client lose the response, so we keep at it for a while. */
+static int read_request(int fd) {
+  char buf[1024];
+  struct pollfd pfd;
+  size_t len=0;
+  ssize_t r;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  while (len < sizeof(buf) - 1 && poll(&pfd, 1, REQUEST_TIMEOUT_MS) > 0) {
+    if ((r = read(fd, buf + len, sizeof(buf) - 1 - len)) <= 0) break;
+    len += r;
+    buf[len] = '\0';
+    if (strstr(buf, "\r\n\r\n") || strstr(buf, "\n\n")) break;
+  }
+  return (len >= 4 && !strncmp(buf, "GET ", 4));
+}
+
+static void *serve_thread(void *arg) {
+  struct timeval tv;
+  sigset_t set;
+  FILE *f;
+  int fd;
+
+  /* Signals are for the threads that do the work */
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  while(1) {
+    if ((fd = accept(lfd, NULL, NULL)) < 0) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+	syslog(LOG_ERR, "accept(): %m");
+	sleep(1);
+      }
+      continue;
+    }
+    tv.tv_sec = RESPONSE_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if ((f = fdopen(fd, "w")) == NULL) {
+      close(fd);
+      continue;
+    }
+    if (read_request(fd)) {
+      fprintf(f, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+    }
+    print_metrics(f);
+    fclose(f);
+  }
+  return NULL;
+}
+
+int metrics_serve(const char *path) {
+  struct sockaddr_un addr;
+  pthread_t thread;
+  int r;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    syslog(LOG_ERR, "Metrics socket name %s is too long", path);
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+
+  if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    syslog(LOG_ERR, "socket(): %m");
+    return -1;
+  }
+  if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(lfd, 8) != 0) {
+    syslog(LOG_ERR, "Failed to listen on %s: %m", path);
+    close(lfd);
+    lfd = -1;
+    return -1;
+  }
+  if ((r = pthread_create(&thread, NULL, serve_thread, NULL)) != 0) {
+    syslog(LOG_ERR, "pthread_create(): %s", strerror(r));
+    close(lfd);
+    lfd = -1;
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+/* The upper bound of the bucket the q:th quantile is in */
+static long long quantile(const struct histogram *h, double q) {
+  unsigned long n=0;
+  int i;
+  for (i = 0; i < METRIC_BUCKETS; i++) {
+    n += h->buckets[i];
+    if (n >= q * h->count) return 1LL << i;
+  }
+  return 1LL << METRIC_BUCKETS;
+}
+
+void metrics_log(void) {
+  struct histogram h;
+  int i;
+
+  for (i = 0; i < METRIC_LAG; i++) {
+    snapshot(i, &h);
+    if (h.count == 0) continue;
+    syslog(LOG_INFO, "metrics: %s: %lu times, %.3f ms on average, half under %.3f ms, 99%% under %.3f ms",
+	   stage_names[i], h.count, (double)h.sum / h.count / 1000,
+	   quantile(&h, 0.5) / 1000.0, quantile(&h, 0.99) / 1000.0);
+  }
+  snapshot(METRIC_LAG, &h);
+  if (h.count > 0) {
+    syslog(LOG_INFO, "metrics: lag: %lu records, %.1f s on average, half under %lld s, 99%% under %lld s",
+	   h.count, (double)h.sum / h.count, quantile(&h, 0.5), quantile(&h, 0.99));
+  }
+  syslog(LOG_INFO, "metrics: %lu records read, %lu folded, %lu committed, %lu rollbacks",
+	 metrics_counter(COUNTER_READ), metrics_counter(COUNTER_COLLAPSED),
+	 metrics_counter(COUNTER_COMMITTED), metrics_counter(COUNTER_ROLLBACKS));
+  for (i = 0; i < nsources; i++) {
+    syslog(LOG_INFO, "metrics: backlog %lld in %s", __atomic_load_n(&(backlog[i]), __ATOMIC_RELAXED), source_names[i]);
+  }
+}
@@ -0,0 +1,88 @@
+/*
+ * metrics - counters and latency histograms for the stages records go through on
+ *           their way to MySQL, served in Prometheus text format on a Unix socket.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <time.h>
+
+/* Everything is recorded all the time, from any thread, with relaxed atomic adds and
+   no locks. A stage is timed with the monotonic clock, and each time goes into a
+   histogram of power-of-two buckets, the first of which is for a microsecond or less. */
+
+/* The stages. METRIC_LAG is not a stage, but the time from the start of a lease to when
+   its record was committed to MySQL, in seconds. */
+#define METRIC_CLAIM 0
+#define METRIC_FETCH 1		/* reading claimed records from the queue */
+#define METRIC_RESOLVE 2	/* looking up the ids for a record */
+#define METRIC_FIND 3
+#define METRIC_UPDATE 4
+#define METRIC_MAKE 5
+#define METRIC_COMMIT 6
+#define METRIC_CLEAR 7		/* removing written records from the queue */
+#define METRIC_CALL 8		/* calling the stored procedure, with -U */
+#define METRIC_LAG 9
+#define METRIC_HISTOGRAMS 10
+
+#define METRIC_BUCKETS 24
+
+/* Counters */
+#define COUNTER_READ 0		/* records read from the queue or the stream */
+#define COUNTER_COLLAPSED 1	/* ... and folded into earlier ACKs */
+#define COUNTER_COMMITTED 2	/* records written to MySQL */
+#define COUNTER_ROLLBACKS 3
+#define COUNTER_COMPACTED 4	/* lease rows merged into others */
+#define METRIC_COUNTERS 5
+
+/* Queues we keep a backlog for */
+#define METRIC_SOURCES 16
+
+/* Microseconds from some fixed point in the past */
+long long metrics_now(void);
+
+/* Record the time a stage has taken since 'since', as returned by metrics_now().
+   Returns the time now, for timing the next stage from. */
+long long metrics_time(int stage, long long since);
+
+/* Record that records for leases that started at 'start' have been committed */
+void metrics_committed(time_t now, time_t start);
+
+void metrics_count(int counter, unsigned long n);
+unsigned long metrics_counter(int counter);
+
+/* Name a queue, numbered from 0, for its backlog to be reported under */
+void metrics_source(int source, const char *name);
+
+/* The number of records waiting in a queue, as last counted */
+void metrics_backlog(int source, long long n);
+
+/* The number of records claimed at a time, 0 for no limit, and whether we are catching
+   up with a backlog */
+void metrics_batchsize(int size, int catchup);
+
+/* Start serving the metrics on a Unix socket, from a thread of its own. Anyone who
+   connects gets them, as an HTTP response if they sent a GET. Returns 0, or -1 on
+   failure. */
+int metrics_serve(const char *path);
+
+/* Log a summary of the metrics */
+void metrics_log(void);
+
+#endif
@@ -0,0 +1,826 @@
+/*
+ * rdb - the remote (MySQL) side of gluff: connections, prepared statements and
+ *       the lease table operations.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+#include <arpa/inet.h>
+#include <mysql/mysql.h>
+#include <mysql/errmsg.h>
+#include <mysql/mysqld_error.h>
+
+#include "rdb.h"
+#include "trace.h"
+
+#define max(a,b) ((b)>(a)?(b):(a))
+#define min(a,b) ((b)<(a)?(b):(a))
+
+/* The buffer fields a statement parameter or result can be bound to */
+#define F_END 0
+#define F_VAL 1
+#define F_IP 2
+#define F_HW 3
+#define F_CID 4
+#define F_RID 5
+#define F_T1 6
+#define F_T2 7
+#define F_T3 8
+#define F_R_ID 9
+#define F_R_HW 10
+#define F_R_CID 11
+#define F_R_RID 12
+#define F_R_START 13
+#define F_R_END 14
+#define F_LID 15
+
+static const struct rstmt_def {
+  const char *sql;
+  int params[RS_MAXPARAMS + 1];
+  int results[RS_MAXRESULTS + 1];
+} rstmt_defs[RS_COUNT] = {
+  /* RS_GETCID */ { GETCID_RSQL, { F_VAL }, { F_R_ID } },
+  /* RS_GETRID */ { GETRID_RSQL, { F_VAL }, { F_R_ID } },
+  /* RS_GETIP */ { GETIP_RSQL, { F_VAL }, { F_R_ID } },
+  /* RS_GETHW */ { GETHW_RSQL, { F_VAL }, { F_R_ID } },
+  /* RS_MAKECID */ { MAKECID_RSQL, { F_VAL }, { F_END } },
+  /* RS_MAKERID */ { MAKERID_RSQL, { F_VAL }, { F_END } },
+  /* RS_MAKEIP */ { MAKEIP_RSQL, { F_VAL }, { F_END } },
+  /* RS_MAKEHW */ { MAKEHW_RSQL, { F_VAL }, { F_END } },
+  /* RS_FIND_LEASE: ip, start, start */
+  { FIND_LEASE_RSQL, { F_IP, F_T1, F_T1 }, { F_R_START, F_R_END, F_R_HW, F_R_CID, F_R_RID, F_R_ID } },
+  /* RS_CUTOFF_LEASE: newend, ip, thatstart, thatend */
+  { CUTOFF_LEASE_RSQL, { F_T3, F_IP, F_T1, F_T2 }, { F_END } },
+  /* RS_PROLONG_LEASE: newend, ip, thatstart, newend, thatend */
+  { PROLONG_LEASE_RSQL, { F_T3, F_IP, F_T1, F_T3, F_T2 }, { F_END } },
+  /* RS_REMOVE_LEASE: ip, searchtime, searchtime */
+  { REMOVE_LEASE_RSQL, { F_IP, F_T1, F_T1 }, { F_END } },
+  /* RS_MAKE_LEASE: ip, start, end, hw, cid, rid */
+  { MAKE_LEASE_RSQL, { F_IP, F_T1, F_T2, F_HW, F_CID, F_RID }, { F_END } },
+  /* RS_SETEND_LEASE: newend, id, ip, thatstart, thatend */
+  { SETEND_LEASE_RSQL, { F_T3, F_LID, F_IP, F_T1, F_T2 }, { F_END } }
+};
+
+void mytime2tm(MYSQL_TIME *mtt, struct tm *tmt) {
+  tmt->tm_year = mtt->year - 1900;
+  tmt->tm_mon = mtt->month - 1;
+  tmt->tm_mday = mtt->day;
+  tmt->tm_hour = mtt->hour;
+  tmt->tm_min = mtt->minute;
+  tmt->tm_sec = mtt->second;
+  tmt->tm_isdst = -1;
+}
+
+time_t mytime2timet(MYSQL_TIME *mtt) {
+  struct tm tm_tmp;
+  mytime2tm(mtt, &tm_tmp);
+  return mktime(&tm_tmp);
+}
+
+void tm2mytime(struct tm *tmt, MYSQL_TIME *mtt) {
+  mtt->year = tmt->tm_year + 1900;
+  mtt->month = tmt->tm_mon + 1;
+  mtt->day = tmt->tm_mday;
+  mtt->hour = tmt->tm_hour;
+  mtt->minute = tmt->tm_min;
+  mtt->second = tmt->tm_sec;
+  mtt->second_part = 0;
+  mtt->neg = 0;
+}
+
+void timet2mytime(time_t t, MYSQL_TIME *mtt) {
+  struct tm tm_tmp;
+  localtime_r(&t, &tm_tmp);
+  tm2mytime(&tm_tmp, mtt);
+}
+
+/* The ips and hws tables are only there in the lexical schema */
+static int stmt_in_schema(int s, int schema) {
+  if (schema == RDB_SCHEMA_COMPACT) {
+    return !(s == RS_GETIP || s == RS_GETHW || s == RS_MAKEIP || s == RS_MAKEHW);
+  }
+  return 1;
+}
+
+static void bind_time(rdb_conn c, MYSQL_BIND *b, struct rdb_time *t) {
+  if (c->schema == RDB_SCHEMA_COMPACT) {
+    b->buffer_type = MYSQL_TYPE_LONGLONG;
+    b->buffer = (void *)&(t->epoch);
+  } else {
+    b->buffer_type = MYSQL_TYPE_TIMESTAMP;
+    b->buffer = (void *)&(t->mt);
+  }
+}
+
+static void bind_hw(rdb_conn c, MYSQL_BIND *b, struct rdb_hw *h) {
+  if (c->schema == RDB_SCHEMA_COMPACT) {
+    b->buffer_type = MYSQL_TYPE_STRING;
+    b->buffer = (void *)h->bin;
+    b->buffer_length = sizeof(h->bin);
+    b->length = &(h->binlen);
+  } else {
+    b->buffer_type = MYSQL_TYPE_LONGLONG;
+    b->buffer = (void *)&(h->id);
+  }
+  b->is_null = &(h->is_null);
+}
+
+static void put_time(rdb_conn c, struct rdb_time *t, time_t v) {
+  if (c->schema == RDB_SCHEMA_COMPACT) t->epoch = v;
+  else timet2mytime(v, &(t->mt));
+}
+
+static time_t get_time(rdb_conn c, struct rdb_time *t) {
+  if (c->schema == RDB_SCHEMA_COMPACT) return (time_t)t->epoch;
+  return mytime2timet(&(t->mt));
+}
+
+static void put_hw(rdb_conn c, struct rdb_hw *h, long long hw) {
+  int i;
+  if (c->schema == RDB_SCHEMA_COMPACT) {
+    for (i = 5; i >= 0; i--) {
+      h->bin[i] = (unsigned char)(hw & 0xff);
+      hw >>= 8;
+    }
+    h->binlen = sizeof(h->bin);
+    h->is_null = (h->bin[0] | h->bin[1] | h->bin[2] | h->bin[3] | h->bin[4] | h->bin[5]) == 0;
+  } else {
+    h->id = hw;
+    h->is_null = 0;
+  }
+}
+
+static long long get_hw(rdb_conn c, struct rdb_hw *h) {
+  long long hw=0;
+  unsigned long i;
+  if (h->is_null) return 0;
+  if (c->schema != RDB_SCHEMA_COMPACT) return h->id;
+  for (i = 0; i < h->binlen && i < sizeof(h->bin); i++) hw = (hw << 8) | h->bin[i];
+  return hw;
+}
+
+/* Point a parameter or result binding at one of the connection's buffers */
+static void bind_field(rdb_conn c, MYSQL_BIND *b, int field) {
+  struct rdb_buffers *buf = &(c->buf);
+  memset((void *)b, 0, sizeof(MYSQL_BIND));
+  switch (field) {
+  case F_VAL:
+    b->buffer_type = MYSQL_TYPE_STRING;
+    b->buffer = (void *)buf->val;
+    b->buffer_length = sizeof(buf->val);
+    b->length = &(buf->vallen);
+    break;
+  case F_IP:
+    b->buffer_type = MYSQL_TYPE_LONG;
+    b->buffer = (void *)&(buf->ip);
+    b->is_unsigned = (c->schema == RDB_SCHEMA_COMPACT);
+    break;
+  case F_HW: bind_hw(c, b, &(buf->hw)); break;
+  case F_CID: b->buffer_type = MYSQL_TYPE_LONG; b->buffer = (void *)&(buf->cid); break;
+  case F_RID: b->buffer_type = MYSQL_TYPE_LONG; b->buffer = (void *)&(buf->rid); break;
+  case F_LID: b->buffer_type = MYSQL_TYPE_LONG; b->buffer = (void *)&(buf->lid); break;
+  case F_T1: bind_time(c, b, &(buf->t1)); break;
+  case F_T2: bind_time(c, b, &(buf->t2)); break;
+  case F_T3: bind_time(c, b, &(buf->t3)); break;
+  case F_R_ID: b->buffer_type = MYSQL_TYPE_LONG; b->buffer = (void *)&(buf->r_id); break;
+  case F_R_HW: bind_hw(c, b, &(buf->r_hw)); break;
+  case F_R_CID: b->buffer_type = MYSQL_TYPE_LONG; b->buffer = (void *)&(buf->r_cid); break;
+  case F_R_RID: b->buffer_type = MYSQL_TYPE_LONG; b->buffer = (void *)&(buf->r_rid); break;
+  case F_R_START: bind_time(c, b, &(buf->r_start)); break;
+  case F_R_END: bind_time(c, b, &(buf->r_end)); break;
+  }
+}
+
+/* Close all statement handles. After a reconnect the client library has already
+   detached them from the connection, so this only frees them locally. */
+static void close_statements(rdb_conn c) {
+  int s;
+  for (s = 0; s < RS_COUNT; s++) {
+    if (c->stmt[s]) {
+      mysql_stmt_close(c->stmt[s]);
+      c->stmt[s] = NULL;
+    }
+  }
+  c->thread_id = 0;
+}
+
+/* Prepare and bind every statement in the registry on the current connection */
+static int prepare_statements(rdb_conn c) {
+  int s, i;
+  close_statements(c);
+  for (s = 0; s < RS_COUNT; s++) {
+    const struct rstmt_def *def = &(rstmt_defs[s]);
+    if (!stmt_in_schema(s, c->schema)) continue;
+    if ((c->stmt[s] = mysql_stmt_init(&(c->db))) == NULL) {
+      syslog(LOG_ERR, "mysql_stmt_init(): %s", mysql_error(&(c->db)));
+      return -1;
+    }
+
+    if (mysql_stmt_prepare(c->stmt[s], def->sql, strlen(def->sql)) != 0) {
+      syslog(LOG_ERR, "mysql_stmt_prepare(): %s", mysql_stmt_error(c->stmt[s]));
+      return -1;
+    }
+
+    for (i = 0; def->params[i] != F_END; i++) bind_field(c, &(c->param[s][i]), def->params[i]);
+    if (i > 0 && mysql_stmt_bind_param(c->stmt[s], c->param[s]) != 0) {
+      syslog(LOG_ERR, "mysql_bind_param(): %s", mysql_stmt_error(c->stmt[s]));
+      return -1;
+    }
+
+    for (i = 0; def->results[i] != F_END; i++) bind_field(c, &(c->result[s][i]), def->results[i]);
+    if (i > 0 && mysql_stmt_bind_result(c->stmt[s], c->result[s]) != 0) {
+      syslog(LOG_ERR, "mysql_bind_result(): %s", mysql_stmt_error(c->stmt[s]));
+      return -1;
+    }
+  }
+  c->thread_id = mysql_thread_id(&(c->db));
+  return 0;
+}
+
+int rdb_check_statements(rdb_conn c) {
+  if (c->thread_id != 0 && c->thread_id == mysql_thread_id(&(c->db))) return 0;
+  if (c->in_trans) {
+    syslog(LOG_ERR, "MySQL connection was lost in the middle of a transaction");
+    return -1;
+  }
+  if (c->thread_id != 0) {
+    syslog(LOG_INFO, "MySQL connection was replaced. Preparing statements again");
+  }
+  return prepare_statements(c);
+}
+
+rdb_conn rdb_connect(const char *host, const char *user, const char *password, const char *database, int schema, int options) {
+  rdb_conn c;
+  my_bool bool_true=1;
+  unsigned long flags=CLIENT_FOUND_ROWS;
+
+  if ((c = (rdb_conn)calloc(1, sizeof(struct rdb_conn_s))) == NULL) {
+    syslog(LOG_ERR, "Out of memory");
+    return NULL;
+  }
+  c->schema = schema;
+  if ((options & RDB_PROCEDURES) &&
+      (c->calls = (char *)malloc(RDB_MAXINSERT + 4 * 2 * RDB_VALSIZE + 256)) == NULL) {
+    syslog(LOG_ERR, "Out of memory");
+    free(c);
+    return NULL;
+  }
+
+  if (!(mysql_init(&(c->db)))) {
+    syslog(LOG_ERR, "mysql_init(): %s", mysql_error(&(c->db)));
+    free(c->calls);
+    free(c);
+    return NULL;
+  }
+
+  /* With CLIENT_FOUND_ROWS, an UPDATE that matches a row but does not change it still
+     counts it, which is what the active lease table needs to tell a stale entry from
+     a repeated ACK */
+  /* A flag rather than mysql_set_server_option(), so that it survives a reconnect */
+  if (options & RDB_PROCEDURES) flags |= CLIENT_MULTI_STATEMENTS;
+#ifdef HAVE_MYSQL_NONBLOCKING
+  /* The blocking calls still work on such a connection, so this one connects as usual */
+  if (options & RDB_NONBLOCK) mysql_options(&(c->db), MYSQL_OPT_NONBLOCK, 0);
+#endif
+  if (!(mysql_real_connect(&(c->db), host, user, password, database, 0, NULL, flags))) {
+    syslog(LOG_ERR, "mysql_real_connect(): %s", mysql_error(&(c->db)));
+    mysql_close(&(c->db));
+    free(c->calls);
+    free(c);
+    return NULL;
+  }
+
+  // For versions before 5.1.6, this has to be called *after* mysql_real_connect(); for
+  // versions before 5.0.3, it doesn't have to be called at all, since it's the default.
+  // Setting the option here seems like the safest solution.
+  mysql_options(&(c->db), MYSQL_OPT_RECONNECT, &bool_true);
+
+  if (prepare_statements(c) != 0) {
+    rdb_close(c);
+    return NULL;
+  }
+
+  return c;
+}
+
+void rdb_close(rdb_conn c) {
+  if (c) {
+    close_statements(c);
+    mysql_close(&(c->db));
+    if (c->pending) free(c->pending);
+    free(c->calls);
+    lstate_free(c->active);
+    free(c);
+  }
+}
+
+/* Is this an error that means our statement handles no longer exist on the server? */
+static int lost_statement(unsigned int err) {
+  return (err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST ||
+	  err == CR_NO_PREPARE_STMT || err == ER_UNKNOWN_STMT_HANDLER);
+}
+
+int rdb_execute(rdb_conn c, int s) {
+  int tries;
+  unsigned int err;
+  for (tries = 0; tries < 2; tries++) {
+    if (rdb_check_statements(c) != 0) return -1;
+    if (mysql_stmt_execute(c->stmt[s]) == 0) return 0;
+    err = mysql_stmt_errno(c->stmt[s]);
+    if (tries == 0 && !c->in_trans && lost_statement(err)) {
+      syslog(LOG_WARNING, "mysql_execute(): %s. Retrying", mysql_stmt_error(c->stmt[s]));
+      /* Let MYSQL_OPT_RECONNECT do its thing, then prepare everything again */
+      mysql_ping(&(c->db));
+      close_statements(c);
+      continue;
+    }
+    syslog(LOG_ERR, "mysql_execute(): %s", mysql_stmt_error(c->stmt[s]));
+    return -1;
+  }
+  return -1;
+}
+
+int rdb_begin(rdb_conn c) {
+  if (rdb_check_statements(c) != 0) return -1;
+  if (mysql_query(&(c->db), "START TRANSACTION") != 0) {
+    syslog(LOG_ERR, "mysql_query(): %s", mysql_error(&(c->db)));
+    return -1;
+  }
+  c->in_trans = 1;
+  c->npending = 0;
+  return 0;
+}
+
+int add_mytime(char *q, size_t size, time_t t) {
+  struct tm tm_tmp;
+  localtime_r(&t, &tm_tmp);
+  return strftime(q, size, "'%Y-%m-%d %H:%M:%S'", &tm_tmp);
+}
+
+/* Write out the pending leases using as few statements as possible */
+static int flush_pending(rdb_conn c) {
+  static const char head[] = "REPLACE INTO leases (ip,lstart,lend,hw,cid,rid) values ";
+  char q[RDB_MAXINSERT + 256];
+  size_t len = 0;
+  int i;
+
+  for (i = 0; i < c->npending; i++) {
+    struct rdb_pending *p = &(c->pending[i]);
+    if (len == 0) {
+      memcpy(q, head, sizeof(head) - 1);
+      len = sizeof(head) - 1;
+    } else {
+      q[len++] = ',';
+    }
+    len += snprintf(q + len, sizeof(q) - len, "(%u,", (unsigned int)p->ip);
+    if (c->schema == RDB_SCHEMA_COMPACT) {
+      len += snprintf(q + len, sizeof(q) - len, "%lld,%lld,", (long long)p->start, (long long)p->end);
+      if (p->hw) len += snprintf(q + len, sizeof(q) - len, "X'%012llx'", p->hw);
+      else len += snprintf(q + len, sizeof(q) - len, "NULL");
+    } else {
+      len += add_mytime(q + len, sizeof(q) - len, p->start);
+      q[len++] = ',';
+      len += add_mytime(q + len, sizeof(q) - len, p->end);
+      len += snprintf(q + len, sizeof(q) - len, ",%lld", p->hw);
+    }
+    len += snprintf(q + len, sizeof(q) - len, ",%d,%d)", p->cid, p->rid);
+
+    if (len >= RDB_MAXINSERT || i == c->npending - 1) {
+      if (mysql_real_query(&(c->db), q, len) != 0) {
+	syslog(LOG_ERR, "mysql_real_query(): %s", mysql_error(&(c->db)));
+	return -1;
+      }
+      len = 0;
+    }
+  }
+  c->npending = 0;
+  return 0;
+}
+
+int rdb_commit(rdb_conn c) {
+  if (flush_pending(c) != 0) return -1;
+  if (mysql_commit(&(c->db)) != 0) {
+    syslog(LOG_ERR, "mysql_commit(): %s", mysql_error(&(c->db)));
+    return -1;
+  }
+  c->in_trans = 0;
+  return 0;
+}
+
+void rdb_rollback(rdb_conn c) {
+  c->npending = 0;
+  c->calllen = 0;
+  c->in_trans = 0;
+  /* Some of what we learned during the transaction never happened */
+  if (c->active) lstate_clear(c->active);
+  if (mysql_rollback(&(c->db)) != 0) {
+    syslog(LOG_WARNING, "mysql_rollback(): %s", mysql_error(&(c->db)));
+  }
+}
+
+/* Get a numeric id from one of the lexical tables, creating a new record if none exists */
+int get_id(rdb_conn c, const unsigned char *val, int getstmt, int setstmt) {
+  MYSQL_STMT *stmt;
+  int id;
+  size_t len = strlen((char *)val);
+
+  if (len >= sizeof(c->buf.val)) len = sizeof(c->buf.val) - 1;
+  memcpy(c->buf.val, val, len);
+  c->buf.val[len] = '\0';
+  c->buf.vallen = len;
+
+  if (rdb_execute(c, getstmt) != 0) return 0;
+  stmt = c->stmt[getstmt];
+
+  if (mysql_stmt_store_result(stmt) != 0) {
+    syslog(LOG_ERR, "mysql_store_result(): %s", mysql_stmt_error(stmt));
+    return 0;
+  }
+
+  if (mysql_stmt_num_rows(stmt) == 1) {
+    mysql_stmt_fetch(stmt);
+    mysql_stmt_free_result(stmt);
+    return c->buf.r_id;
+  }
+
+  mysql_stmt_free_result(stmt);
+
+  if (rdb_execute(c, setstmt) != 0) return 0;
+
+  id=mysql_stmt_insert_id(c->stmt[setstmt]);
+  return id;
+}
+
+int compact_ip(const unsigned char *val) {
+  struct in_addr a;
+  if (val == NULL || inet_pton(AF_INET, (const char *)val, &a) != 1) return 0;
+  return (int)ntohl(a.s_addr);
+}
+
+long long compact_hw(const unsigned char *val) {
+  long long hw=0;
+  int octets=0, digits=0, octet=0;
+  const unsigned char *p;
+
+  if (val == NULL) return 0;
+  /* dhcpd writes "01:02:0a:..." or, in some versions, "1:2:a:..." */
+  for (p = val; ; p++) {
+    int d;
+    if (*p == ':' || *p == '\0') {
+      if (digits == 0 || ++octets > 6) return 0;
+      hw = (hw << 8) | octet;
+      if (*p == '\0') break;
+      digits = octet = 0;
+      continue;
+    }
+    if (*p >= '0' && *p <= '9') d = *p - '0';
+    else if (*p >= 'a' && *p <= 'f') d = *p - 'a' + 10;
+    else if (*p >= 'A' && *p <= 'F') d = *p - 'A' + 10;
+    else return 0;
+    if (++digits > 2) return 0;
+    octet = (octet << 4) | d;
+  }
+  return (octets == 6) ? hw : 0;
+}
+
+/* Add a string argument, quoted and escaped, or NULL */
+static size_t add_string(rdb_conn c, char *q, const unsigned char *val) {
+  size_t len;
+  if (val == NULL) {
+    strcpy(q, "NULL");
+    return 4;
+  }
+  if ((len = strlen((const char *)val)) >= RDB_VALSIZE) len = RDB_VALSIZE - 1;
+  q[0] = '\'';
+  len = mysql_real_escape_string(&(c->db), q + 1, (const char *)val, len) + 1;
+  q[len++] = '\'';
+  q[len] = '\0';
+  return len;
+}
+
+size_t rdb_put_call(rdb_conn c, int rtype, time_t start, time_t end, const unsigned char *ip,
+		    const unsigned char *hw, const unsigned char *cid, const unsigned char *rid) {
+  char *q = c->calls;
+  size_t len = c->calllen;
+  size_t size = RDB_MAXINSERT + 4 * 2 * RDB_VALSIZE + 256;
+
+  len += snprintf(q + len, size - len, "%sCALL " RDB_PROCEDURE "(%d,", len ? ";" : "", rtype);
+  if (c->schema == RDB_SCHEMA_COMPACT) {
+    int cip = compact_ip(ip);
+    long long chw = compact_hw(hw);
+    if (cip == 0) {
+      syslog(LOG_WARNING, "Skipping a record for %s, which is not an IPv4 address", ip);
+      q[c->calllen] = '\0';
+      return c->calllen;
+    }
+    len += snprintf(q + len, size - len, "%lld,%lld,%u,", (long long)start, (long long)end, (unsigned int)cip);
+    if (chw) len += snprintf(q + len, size - len, "X'%012llx',", chw);
+    else len += snprintf(q + len, size - len, "NULL,");
+  } else {
+    len += add_mytime(q + len, size - len, start);
+    q[len++] = ',';
+    len += add_mytime(q + len, size - len, end);
+    q[len++] = ',';
+    len += add_string(c, q + len, ip);
+    q[len++] = ',';
+    len += add_string(c, q + len, hw);
+    q[len++] = ',';
+  }
+  len += add_string(c, q + len, cid);
+  q[len++] = ',';
+  len += add_string(c, q + len, rid);
+  q[len++] = ')';
+  q[len] = '\0';
+  c->calllen = len;
+  return len;
+}
+
+int rdb_add_call(rdb_conn c, int rtype, time_t start, time_t end, const unsigned char *ip,
+		 const unsigned char *hw, const unsigned char *cid, const unsigned char *rid) {
+  if (rdb_put_call(c, rtype, start, end, ip, hw, cid, rid) >= RDB_MAXINSERT) return rdb_flush_calls(c);
+  return 0;
+}
+
+int rdb_flush_calls(rdb_conn c) {
+  MYSQL_RES *res;
+  int r;
+
+  if (c->calllen == 0) return 0;
+  r = mysql_real_query(&(c->db), c->calls, c->calllen);
+  c->calllen = 0;
+  if (r != 0) {
+    syslog(LOG_ERR, "mysql_real_query(): %s", mysql_error(&(c->db)));
+    return -1;
+  }
+  /* Every call has a result, and the first one that failed stops the rest */
+  do {
+    if ((res = mysql_store_result(&(c->db))) != NULL) mysql_free_result(res);
+    if ((r = mysql_next_result(&(c->db))) > 0) {
+      syslog(LOG_ERR, "mysql_next_result(): %s", mysql_error(&(c->db)));
+      return -1;
+    }
+  } while (r == 0);
+  return 0;
+}
+
+/* Replace multiple overlapping leases with a single new one */
+int do_replace_leases(rdb_conn c, int ip, time_t searchtime, time_t start, time_t end, long long hw, int cid, int rid) {
+  c->buf.ip = ip;
+  put_time(c, &(c->buf.t1), searchtime);
+
+  if (c->active) lstate_drop(c->active, ip);
+  if (rdb_execute(c, RS_REMOVE_LEASE) != 0) return -1;
+
+  return do_make_lease(c, ip, start, end, hw, cid, rid);
+}
+
+/* Trace something that happened with the lease for an address */
+static void trace_lease(rdb_conn c, int event, int ip, time_t when) {
+  struct trace_record tr;
+
+  memset(&tr, 0, sizeof(tr));
+  tr.event = event;
+  tr.flags = (c->schema == RDB_SCHEMA_COMPACT) ? TRACE_COMPACT : 0;
+  tr.ip = ip;
+  tr.start = (uint32_t)when;
+  trace_add(&tr);
+}
+
+/* Try to find an active lease for the IP address in question, and return all the data */
+int do_find_lease(rdb_conn c, int ip, time_t start, time_t *thatstart, time_t *thatend,
+		  long long *thathw, int *thatcid, int *thatrid) {
+  MYSQL_STMT *stmt;
+  struct rdb_buffers *buf = &(c->buf);
+  struct lstate_entry *e;
+  my_ulonglong nrows;
+
+  c->found_pending = 0;
+  c->found_id = 0;
+  c->found_cached = 0;
+  if (c->in_trans) {
+    int i;
+    /* The newest pending lease is the one the next event would have found */
+    for (i = c->npending - 1; i >= 0; i--) {
+      struct rdb_pending *p = &(c->pending[i]);
+      if (p->ip == ip && p->start <= start && p->end >= start) {
+	*thatstart = p->start;
+	*thatend = p->end;
+	*thathw = p->hw;
+	*thatcid = p->cid;
+	*thatrid = p->rid;
+	c->found_pending = 1;
+	return 1;
+      }
+    }
+  }
+
+  /* A renewal of a lease we have seen recently needs no SELECT */
+  if (c->active && (e = lstate_get(c->active, ip)) != NULL &&
+      e->start <= start && e->end >= start && time(NULL) - e->verified < LSTATE_MAXAGE) {
+    *thatstart = e->start;
+    *thatend = e->end;
+    *thathw = e->hw;
+    *thatcid = e->cid;
+    *thatrid = e->rid;
+    c->found_id = e->id;
+    c->found_cached = 1;
+    c->lease_hits++;
+    return 1;
+  }
+  if (c->active) c->lease_misses++;
+
+  buf->ip = ip;
+  put_time(c, &(buf->t1), start);
+
+  if (rdb_execute(c, RS_FIND_LEASE) != 0) return -1;
+  stmt = c->stmt[RS_FIND_LEASE];
+
+  if (mysql_stmt_store_result(stmt) != 0) {
+    syslog(LOG_ERR, "mysql_store_result(): %s", mysql_stmt_error(stmt));
+    return -1;
+  }
+
+  if ((nrows = mysql_stmt_num_rows(stmt)) >= 1) {
+    mysql_stmt_fetch(stmt);
+
+    *thatstart = get_time(c, &(buf->r_start));
+    *thatend = get_time(c, &(buf->r_end));
+
+    if (mysql_stmt_num_rows(stmt) > 1) {
+      /* Merging them is left to compaction (gluff -X or -Z), which does it with the rows locked */
+      trace_lease(c, TRACE_MULTIPLE, ip, start);
+      while (mysql_stmt_fetch(stmt)) {
+	*thatstart = min(*thatstart, get_time(c, &(buf->r_start)));
+	*thatend = max(*thatstart, get_time(c, &(buf->r_end)));
+      }
+      //      if (do_replace_leases(c, ip, start, *thatstart, *thatend, *thathw, *thatcid, *thatrid) != 0) return -17;
+    }
+    mysql_stmt_free_result(stmt);
+
+    *thathw = get_hw(c, &(buf->r_hw));
+    *thatcid = buf->r_cid;
+    *thatrid = buf->r_rid;
+
+    /* Only a single matching row is simple enough to remember */
+    if (c->active) {
+      if (nrows == 1) {
+	struct lstate_entry n;
+	n.ip = ip;
+	n.id = buf->r_id;
+	n.start = *thatstart;
+	n.end = *thatend;
+	n.hw = *thathw;
+	n.cid = *thatcid;
+	n.rid = *thatrid;
+	n.verified = time(NULL);
+	lstate_set(c->active, &n);
+	c->found_id = n.id;
+      } else {
+	lstate_drop(c->active, ip);
+      }
+    }
+    return 1;
+  }
+
+  mysql_stmt_free_result(stmt);
+  if (c->active) lstate_drop(c->active, ip);
+  return 0;
+}
+
+/* Change the 'end time' for a lease */
+int do_update_lease(rdb_conn c, int ip, time_t thatstart, time_t thatend, time_t newend, int prolong) {
+  int s = prolong ? RS_PROLONG_LEASE : RS_CUTOFF_LEASE;
+  int i, n=0;
+
+  /* Pending leases get the same treatment as the rows the statement would match */
+  for (i = 0; i < c->npending; i++) {
+    struct rdb_pending *p = &(c->pending[i]);
+    if (p->ip == ip && p->start <= thatstart && p->end >= thatend && (!prolong || p->end <= newend)) {
+      p->end = newend;
+      n++;
+    }
+  }
+
+  if (c->found_pending) {
+    c->found_pending = 0;
+    if (n == 0) syslog(LOG_WARNING, "do_update_lease(): No rows were updated!");
+    return 0;
+  }
+
+  /* We know exactly which row this is, so update it by its id. The old values in the
+     WHERE clause make sure nobody else has changed it since we last saw it. */
+  if (c->found_id && c->active) {
+    struct lstate_entry *e = lstate_get(c->active, ip);
+    int id = c->found_id;
+    c->found_id = 0;
+    if (e && e->id == id) {
+      if (prolong && newend < thatend) {
+	/* The prolong statement would not match this row either */
+	syslog(LOG_WARNING, "do_update_lease(): No rows were updated!");
+	return 0;
+      }
+      c->buf.lid = id;
+      c->buf.ip = ip;
+      put_time(c, &(c->buf.t1), thatstart);
+      put_time(c, &(c->buf.t2), thatend);
+      put_time(c, &(c->buf.t3), newend);
+      if (rdb_execute(c, RS_SETEND_LEASE) != 0) return -1;
+      if (mysql_stmt_affected_rows(c->stmt[RS_SETEND_LEASE]) == 1) {
+	e->end = newend;
+	e->verified = time(NULL);
+	return 0;
+      }
+      lstate_drop(c->active, ip);
+      /* If we just read the row, the difference is in the details, so let the
+	 ordinary statement below do the job */
+      if (c->found_cached) {
+	trace_lease(c, TRACE_STALE, ip, thatstart);
+	c->lease_stale++;
+	return 1;
+      }
+    }
+  }
+
+  c->buf.ip = ip;
+  put_time(c, &(c->buf.t1), thatstart);
+  put_time(c, &(c->buf.t2), thatend);
+  put_time(c, &(c->buf.t3), newend);
+
+  if (rdb_execute(c, s) != 0) return -1;
+
+  if (mysql_stmt_affected_rows(c->stmt[s]) <= 0) {
+    syslog(LOG_WARNING, "do_update_lease(): No rows were updated!");
+  }
+
+  return 0;
+}
+
+/* Insert a new lease into the database */
+int do_make_lease(rdb_conn c, int ip, time_t start, time_t end, long long hw, int cid, int rid) {
+  if (c->in_trans) {
+    struct rdb_pending *p;
+    if (c->npending == c->maxpending) {
+      int n = c->maxpending ? c->maxpending * 2 : 256;
+      if ((p = (struct rdb_pending *)realloc(c->pending, n * sizeof(struct rdb_pending))) == NULL) {
+	syslog(LOG_ERR, "Out of memory");
+	return -1;
+      }
+      c->pending = p;
+      c->maxpending = n;
+    }
+    p = &(c->pending[c->npending++]);
+    p->ip = ip;
+    p->hw = hw;
+    p->cid = cid;
+    p->rid = rid;
+    p->start = start;
+    p->end = end;
+    /* We will not know the row id until after the commit */
+    if (c->active) lstate_drop(c->active, ip);
+    return 0;
+  }
+
+  c->buf.ip = ip;
+  put_hw(c, &(c->buf.hw), hw);
+  c->buf.cid = cid;
+  c->buf.rid = rid;
+  put_time(c, &(c->buf.t1), start);
+  put_time(c, &(c->buf.t2), end);
+
+  if (rdb_execute(c, RS_MAKE_LEASE) != 0) return -1;
+
+  if (c->active) {
+    struct lstate_entry n;
+    n.ip = ip;
+    n.id = (int)mysql_stmt_insert_id(c->stmt[RS_MAKE_LEASE]);
+    n.start = start;
+    n.end = end;
+    n.hw = hw;
+    n.cid = cid;
+    n.rid = rid;
+    n.verified = time(NULL);
+    if (n.id) lstate_set(c->active, &n);
+    else lstate_drop(c->active, ip);
+  }
+  return 0;
+}
@@ -0,0 +1,221 @@
+/*
+ * rdb - the remote (MySQL) side of gluff: connections, prepared statements and
+ *       the lease table operations.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#ifndef RDB_H
+#define RDB_H
+
+#include <time.h>
+#include <mysql/mysql.h>
+
+#include "lstate.h"
+
+/* The layouts of the leases table gluff can write to. The lexical schema (dhcpd_leases.sql)
+   keeps IP and MAC addresses in the ips and hws tables and the times as timestamps. The
+   compact schema (dhcpd_leases_compact.sql) has the IPv4 address as an INT UNSIGNED, the
+   MAC address as a BINARY(6) and the times as UTC epoch seconds, right in the leases table. */
+#define RDB_SCHEMA_LEXICAL 0
+#define RDB_SCHEMA_COMPACT 1
+
+/* Options for rdb_connect(). With RDB_PROCEDURES, each record is applied by a call to the
+   stored procedure RDB_PROCEDURE (see schema.c), and the calls are sent many at a time
+   as one multi-statement query. */
+#define RDB_PROCEDURES 1
+/* With RDB_NONBLOCK, the connection can also be used with the non-blocking calls of the
+   MariaDB client library (see ardb.c), where configure found them */
+#define RDB_NONBLOCK 2
+#define RDB_PROCEDURE "gluff_apply_lease"
+
+/* Remote SQL queries for the MySQL database */
+#define GETCID_RSQL "SELECT id from cids where value=?"
+#define GETRID_RSQL "SELECT id from rids where value=?"
+#define GETIP_RSQL "SELECT id from ips where value=?"
+#define GETHW_RSQL "SELECT id from hws where value=?"
+
+/* With a unique index on value, a value someone else has just inserted gives us their id */
+#define MAKECID_RSQL "INSERT INTO cids (value) values (?) ON DUPLICATE KEY UPDATE id=LAST_INSERT_ID(id)"
+#define MAKERID_RSQL "INSERT INTO rids (value) values (?) ON DUPLICATE KEY UPDATE id=LAST_INSERT_ID(id)"
+#define MAKEIP_RSQL "INSERT INTO ips (value) values (?) ON DUPLICATE KEY UPDATE id=LAST_INSERT_ID(id)"
+#define MAKEHW_RSQL "INSERT INTO hws (value) values (?) ON DUPLICATE KEY UPDATE id=LAST_INSERT_ID(id)"
+
+#define PRELOADCID_RSQL "SELECT id,value from cids"
+#define PRELOADRID_RSQL "SELECT id,value from rids"
+#define PRELOADIP_RSQL "SELECT id,value from ips"
+#define PRELOADHW_RSQL "SELECT id,value from hws"
+
+#define FIND_LEASE_RSQL "SELECT lstart,lend,hw,cid,rid,id from leases where ip=? and lstart<=? and lend>=?"
+#define CUTOFF_LEASE_RSQL "UPDATE leases set lend=? where ip=? and lstart<=? and lend>=?"
+#define PROLONG_LEASE_RSQL "UPDATE leases set lend=? where ip=? and lstart<=? and lend<=? and lend>=?"
+#define REMOVE_LEASE_RSQL "DELETE from leases where ip=? and lstart<=? and lend>=?"
+#define MAKE_LEASE_RSQL "REPLACE INTO leases (ip,lstart,lend,hw,cid,rid) values (?,?,?,?,?,?)"
+#define SETEND_LEASE_RSQL "UPDATE leases set lend=? where id=? and ip=? and lstart=? and lend=?"
+
+/* The statement registry. Every statement is prepared once per connection */
+#define RS_GETCID 0
+#define RS_GETRID 1
+#define RS_GETIP 2
+#define RS_GETHW 3
+#define RS_MAKECID 4
+#define RS_MAKERID 5
+#define RS_MAKEIP 6
+#define RS_MAKEHW 7
+#define RS_FIND_LEASE 8
+#define RS_CUTOFF_LEASE 9
+#define RS_PROLONG_LEASE 10
+#define RS_REMOVE_LEASE 11
+#define RS_MAKE_LEASE 12
+#define RS_SETEND_LEASE 13
+#define RS_COUNT 14
+
+#define RS_MAXPARAMS 6
+#define RS_MAXRESULTS 6
+
+/* Multi-row inserts are flushed when the statement text reaches this size */
+#define RDB_MAXINSERT 65536
+
+/* Longest lexical value we bind. The columns are shorter than this anyway */
+#define RDB_VALSIZE 1024
+
+/* A time, as the lexical schema wants it or as the compact one does */
+struct rdb_time {
+  MYSQL_TIME mt;
+  long long epoch;
+};
+
+/* A hw value: an id in the lexical schema, the MAC address itself in the compact one */
+struct rdb_hw {
+  long long id;
+  unsigned char bin[6];
+  unsigned long binlen;
+  my_bool is_null;
+};
+
+/* The buffers all the statements are bound to */
+struct rdb_buffers {
+  char val[RDB_VALSIZE];
+  unsigned long vallen;
+  int ip;
+  struct rdb_hw hw;
+  int cid;
+  int rid;
+  int lid;
+  struct rdb_time t1;
+  struct rdb_time t2;
+  struct rdb_time t3;
+  int r_id;
+  struct rdb_hw r_hw;
+  int r_cid;
+  int r_rid;
+  struct rdb_time r_start;
+  struct rdb_time r_end;
+};
+
+/* A new lease that is held back until the batch is committed */
+struct rdb_pending {
+  int ip;
+  long long hw;
+  int cid;
+  int rid;
+  time_t start;
+  time_t end;
+};
+
+typedef struct rdb_conn_s {
+  MYSQL db;
+  int schema;			/* RDB_SCHEMA_LEXICAL or RDB_SCHEMA_COMPACT */
+  unsigned long thread_id;	/* connection the statements were prepared on, 0 if none */
+  MYSQL_STMT *stmt[RS_COUNT];
+  MYSQL_BIND param[RS_COUNT][RS_MAXPARAMS];
+  MYSQL_BIND result[RS_COUNT][RS_MAXRESULTS];
+  struct rdb_buffers buf;
+  int in_trans;			/* inside rdb_begin()/rdb_commit() */
+  struct rdb_pending *pending;	/* leases to insert at commit time */
+  int npending;
+  int maxpending;
+  int found_pending;		/* the last do_find_lease() hit a pending lease */
+  lstate active;		/* the active leases we know of, or NULL */
+  int found_id;			/* row id of the lease do_find_lease() found, if we know it */
+  int found_cached;		/* ... and it came from 'active' rather than from MySQL */
+  unsigned long lease_hits;	/* leases found in 'active' */
+  unsigned long lease_misses;	/* leases we had to ask MySQL for */
+  unsigned long lease_stale;	/* 'active' entries that turned out to be out of date */
+  char *calls;			/* with RDB_PROCEDURES, the calls not sent yet */
+  size_t calllen;
+} *rdb_conn;
+
+void mytime2tm(MYSQL_TIME *mtt, struct tm *tmt);
+time_t mytime2timet(MYSQL_TIME *mtt);
+void tm2mytime(struct tm *tmt, MYSQL_TIME *mtt);
+void timet2mytime(time_t t, MYSQL_TIME *mtt);
+
+/* Append a timestamp literal to a statement. Returns its length */
+int add_mytime(char *q, size_t size, time_t t);
+
+/* Connect to the MySQL server and prepare all the statements. Returns NULL on failure */
+rdb_conn rdb_connect(const char *host, const char *user, const char *password, const char *database, int schema, int options);
+void rdb_close(rdb_conn c);
+
+/* Make sure the statements are prepared on the current server connection. After
+   MYSQL_OPT_RECONNECT has quietly replaced the connection, the old statement
+   handles are gone on the server side and everything is prepared again. */
+int rdb_check_statements(rdb_conn c);
+
+/* Run one of the registry statements with whatever is in the buffers */
+int rdb_execute(rdb_conn c, int s);
+
+/* Batch transactions. Between rdb_begin() and rdb_commit(), new leases are collected
+   and written with multi-row statements at commit time, and a lost connection fails
+   the batch instead of being retried. */
+int rdb_begin(rdb_conn c);
+int rdb_commit(rdb_conn c);
+void rdb_rollback(rdb_conn c);
+
+int get_id(rdb_conn c, const unsigned char *val, int getstmt, int setstmt);
+
+/* Add a call to the stored procedure for a queue record, with the values as they are in
+   the queue. The calls are sent when there are enough of them to fill a statement, or
+   by rdb_flush_calls(). In the compact schema, a record without an IPv4 address is
+   skipped. Returns 0, or -1 if sending the calls failed, in which case any calls
+   before the one that failed have been made. */
+int rdb_add_call(rdb_conn c, int rtype, time_t start, time_t end, const unsigned char *ip,
+		 const unsigned char *hw, const unsigned char *cid, const unsigned char *rid);
+int rdb_flush_calls(rdb_conn c);
+
+/* Add a call the way rdb_add_call() does, but never send anything. Returns the length
+   of the calls not sent yet. */
+size_t rdb_put_call(rdb_conn c, int rtype, time_t start, time_t end, const unsigned char *ip,
+		    const unsigned char *hw, const unsigned char *cid, const unsigned char *rid);
+
+/* The values the compact schema stores for the ip and hw strings from the queue. An IPv4
+   address becomes the address as a number (in an int, to be taken as unsigned), and 0 if
+   it isn't one. A six-byte MAC address becomes the six bytes as a number, and anything
+   else 0, which is written as NULL. */
+int compact_ip(const unsigned char *val);
+long long compact_hw(const unsigned char *val);
+
+int do_replace_leases(rdb_conn c, int ip, time_t searchtime, time_t start, time_t end, long long hw, int cid, int rid);
+int do_find_lease(rdb_conn c, int ip, time_t start, time_t *thatstart, time_t *thatend,
+		  long long *thathw, int *thatcid, int *thatrid);
+/* Returns 1 if the lease found by do_find_lease() came from the active lease table and
+   turned out to have been changed behind our back. Nothing is updated then, and the
+   caller should look it up again. */
+int do_update_lease(rdb_conn c, int ip, time_t thatstart, time_t thatend, time_t newend, int prolong);
+int do_make_lease(rdb_conn c, int ip, time_t start, time_t end, long long hw, int cid, int rid);
+
+#endif
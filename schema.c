@@ -0,0 +1,481 @@
+/*
+ * schema - creating and checking the MySQL tables, their indexes and the monthly
+ *          partitions of the leases table.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+/*
+ * The leases table is partitioned by RANGE on the start time of the lease, one
+ * partition per month named after it (p201903 holds the leases that started in
+ * March 2019), with p0 for anything older than the first month and pmax catching
+ * anything beyond the last one. Partitioning needs lstart in the primary key, so
+ * it becomes (id, lstart).
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+#include <mysql/mysql.h>
+#include <mysql/mysqld_error.h>
+
+#include "rdb.h"
+#include "schema.h"
+
+/* Any schema */
+#define SCHEMA_ANY -1
+
+/* Longest ALTER TABLE statement we build for the partitions */
+#define SCHEMA_MAXQUERY 65536
+
+struct table_def {
+  const char *name;
+  int schema;
+  const char *columns;
+};
+
+static const struct table_def table_defs[] = {
+  { "cids", SCHEMA_ANY,
+    "`id` int(11) NOT NULL auto_increment, `value` varchar(63) default NULL, "
+    "PRIMARY KEY (`id`), UNIQUE KEY `value` (`value`)" },
+  { "rids", SCHEMA_ANY,
+    "`id` int(11) NOT NULL auto_increment, `value` varchar(63) default NULL, "
+    "PRIMARY KEY (`id`), UNIQUE KEY `value` (`value`)" },
+  { "ips", RDB_SCHEMA_LEXICAL,
+    "`id` int(11) NOT NULL auto_increment, `value` varchar(63) default NULL, "
+    "PRIMARY KEY (`id`), UNIQUE KEY `value` (`value`)" },
+  { "hws", RDB_SCHEMA_LEXICAL,
+    "`id` int(11) NOT NULL auto_increment, `value` varchar(63) default NULL, "
+    "PRIMARY KEY (`id`), UNIQUE KEY `value` (`value`)" },
+  { "leases", RDB_SCHEMA_LEXICAL,
+    "`id` int(11) NOT NULL auto_increment, `ip` int(11) NOT NULL default '0', "
+    "`lstart` timestamp NOT NULL default '0000-00-00 00:00:00', "
+    "`lend` timestamp NOT NULL default '0000-00-00 00:00:00', "
+    "`hw` int(11) default NULL, `cid` int(11) default NULL, `rid` int(11) default NULL, "
+    "PRIMARY KEY (`id`), KEY `ip_time` (`ip`,`lstart`,`lend`), KEY `lend` (`lend`)" },
+  { "leases", RDB_SCHEMA_COMPACT,
+    "`id` int(11) NOT NULL auto_increment, `ip` int(10) unsigned NOT NULL default '0', "
+    "`lstart` int(10) unsigned NOT NULL default '0', `lend` int(10) unsigned NOT NULL default '0', "
+    "`hw` binary(6) default NULL, `cid` int(11) default NULL, `rid` int(11) default NULL, "
+    "PRIMARY KEY (`id`), KEY `ip_time` (`ip`,`lstart`,`lend`), KEY `lend` (`lend`)" },
+  { NULL, 0, NULL }
+};
+
+/* The indexes the hot queries need: every GETxx_RSQL looks up a value, the lease
+   statements all look for an ip and a time range, and gluffwho reads the leases that
+   have ended lately */
+struct index_def {
+  const char *table;
+  int schema;
+  const char *name;
+  const char *columns;
+  int unique;
+};
+
+static const struct index_def index_defs[] = {
+  { "cids", SCHEMA_ANY, "value", "value", 1 },
+  { "rids", SCHEMA_ANY, "value", "value", 1 },
+  { "ips", RDB_SCHEMA_LEXICAL, "value", "value", 1 },
+  { "hws", RDB_SCHEMA_LEXICAL, "value", "value", 1 },
+  { "leases", SCHEMA_ANY, "ip_time", "ip,lstart,lend", 0 },
+  { "leases", SCHEMA_ANY, "lend", "lend", 0 },
+  { NULL, 0, NULL, NULL, 0 }
+};
+
+static int in_schema(int s, int schema) {
+  return s == SCHEMA_ANY || s == schema;
+}
+
+/* The start time as a number, for the partitioning */
+static const char *start_expr(int schema) {
+  return (schema == RDB_SCHEMA_COMPACT) ? "lstart" : "UNIX_TIMESTAMP(lstart)";
+}
+
+static int run_query(MYSQL *db, const char *q) {
+  if (mysql_query(db, q) != 0) {
+    syslog(LOG_ERR, "mysql_query(): %s", mysql_error(db));
+    return -1;
+  }
+  return 0;
+}
+
+/* Run a query that returns a single number. A NULL comes back as 'dflt' */
+static int query_number(MYSQL *db, const char *q, long long dflt, long long *value) {
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+
+  if (run_query(db, q) != 0) return -1;
+  if ((res = mysql_store_result(db)) == NULL) {
+    syslog(LOG_ERR, "mysql_store_result(): %s", mysql_error(db));
+    return -1;
+  }
+  *value = dflt;
+  if ((row = mysql_fetch_row(res)) != NULL && row[0]) *value = atoll(row[0]);
+  mysql_free_result(res);
+  return 0;
+}
+
+static int table_exists(MYSQL *db, const char *table) {
+  char q[256];
+  long long n;
+  snprintf(q, sizeof(q),
+	   "SELECT COUNT(*) FROM information_schema.tables WHERE table_schema=DATABASE() and table_name='%s'",
+	   table);
+  if (query_number(db, q, 0, &n) != 0) return -1;
+  return n > 0;
+}
+
+/* Does the table have an index (the one called 'name', or any if NULL) that starts
+   with these columns? */
+static int has_index(MYSQL *db, const char *table, const char *name, const char *columns) {
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  char q[256];
+  char cur[256], curname[128];
+  size_t len = strlen(columns);
+  int found=0;
+
+  snprintf(q, sizeof(q),
+	   "SELECT index_name,column_name FROM information_schema.statistics "
+	   "WHERE table_schema=DATABASE() and table_name='%s' order by index_name,seq_in_index",
+	   table);
+  if (run_query(db, q) != 0) return -1;
+  if ((res = mysql_store_result(db)) == NULL) {
+    syslog(LOG_ERR, "mysql_store_result(): %s", mysql_error(db));
+    return -1;
+  }
+
+  cur[0] = curname[0] = '\0';
+  while (!found) {
+    row = mysql_fetch_row(res);
+    if (row == NULL || !row[0] || strcmp(row[0], curname) != 0) {
+      /* The columns of the previous index are all in */
+      if (curname[0] && (!name || strcmp(curname, name) == 0) &&
+	  strncmp(cur, columns, len) == 0 && (cur[len] == '\0' || cur[len] == ',')) {
+	found = 1;
+      }
+      if (row == NULL || !row[0]) break;
+      snprintf(curname, sizeof(curname), "%s", row[0]);
+      cur[0] = '\0';
+    }
+    if (row[1] && strlen(cur) + strlen(row[1]) + 2 < sizeof(cur)) {
+      if (cur[0]) strcat(cur, ",");
+      strcat(cur, row[1]);
+    }
+  }
+  mysql_free_result(res);
+  return found;
+}
+
+int schema_bootstrap(MYSQL *db, int schema) {
+  const struct table_def *t;
+  const struct index_def *i;
+  char q[1024];
+  int r;
+
+  for (t = table_defs; t->name; t++) {
+    if (!in_schema(t->schema, schema)) continue;
+    if ((r = table_exists(db, t->name)) < 0) return -1;
+    if (r) continue;
+    snprintf(q, sizeof(q), "CREATE TABLE `%s` (%s)", t->name, t->columns);
+    if (run_query(db, q) != 0) return -1;
+    syslog(LOG_INFO, "Created table %s", t->name);
+  }
+
+  for (i = index_defs; i->table; i++) {
+    if (!in_schema(i->schema, schema)) continue;
+    if ((r = has_index(db, i->table, NULL, i->columns)) < 0) return -1;
+    if (r) continue;
+    syslog(LOG_INFO, "Adding index %s (%s) to table %s. This may take a while", i->name, i->columns, i->table);
+    snprintf(q, sizeof(q), "ALTER TABLE `%s` ADD %sINDEX `%s` (%s)",
+	     i->table, i->unique ? "UNIQUE " : "", i->name, i->columns);
+    if (mysql_query(db, q) != 0) {
+      if (i->unique && mysql_errno(db) == ER_DUP_ENTRY) {
+	syslog(LOG_WARNING, "Table %s has duplicate values, so index %s can't be unique", i->table, i->name);
+	snprintf(q, sizeof(q), "ALTER TABLE `%s` ADD INDEX `%s` (%s)", i->table, i->name, i->columns);
+	if (run_query(db, q) != 0) return -1;
+      } else {
+	syslog(LOG_ERR, "mysql_query(): %s", mysql_error(db));
+	return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+int schema_check(MYSQL *db, int schema) {
+  const struct index_def *i;
+  int r, missing=0;
+
+  for (i = index_defs; i->table; i++) {
+    if (!in_schema(i->schema, schema)) continue;
+    if ((r = has_index(db, i->table, NULL, i->columns)) < 0) return -1;
+    if (!r) {
+      syslog(LOG_WARNING, "Table %s has no index on (%s), so every lookup scans the whole table. Run gluff with -B once to add it",
+	     i->table, i->columns);
+      missing++;
+    }
+  }
+  return missing;
+}
+
+/* The stored procedure for RDB_PROCEDURES. It does what apply_record() in gluff.c does
+   for one queue record, ids and all, on the server. The leases for the address are
+   locked while it decides what to do: with a named lock, so that two gluffs writing the
+   same address take turns, and with a locking read, so that in a transaction the lease
+   stays locked until the commit. The lexical and compact versions only differ in how
+   they get the ip and hw values. */
+static const char proc_head[] =
+  "CREATE PROCEDURE " RDB_PROCEDURE "(p_rtype INT, p_start %s, p_end %s, p_ip %s, p_hw %s, "
+  "p_cid VARCHAR(63), p_rid VARCHAR(63)) MODIFIES SQL DATA "
+  "BEGIN "
+  "DECLARE v_ip %s; DECLARE v_hw %s; DECLARE v_cid INT DEFAULT 0; DECLARE v_rid INT DEFAULT 0; "
+  "DECLARE v_id INT; DECLARE v_start %s; DECLARE v_end %s; "
+  "DECLARE v_thathw %s; DECLARE v_thatcid INT; DECLARE v_thatrid INT; "
+  "DECLARE v_lock VARCHAR(128); "
+  "DECLARE CONTINUE HANDLER FOR NOT FOUND SET v_id = NULL; "
+  "DECLARE EXIT HANDLER FOR SQLEXCEPTION BEGIN DO RELEASE_LOCK(v_lock); RESIGNAL; END; ";
+
+/* Get or make the id of a value, the way get_id() does */
+#define PROC_ID(var, table, val) \
+  "IF " val " IS NOT NULL THEN " \
+  "SET " var " = (SELECT id FROM " table " WHERE value=" val "); " \
+  "IF " var " IS NULL THEN " \
+  "INSERT INTO " table " (value) VALUES (" val ") ON DUPLICATE KEY UPDATE id=LAST_INSERT_ID(id); " \
+  "SET " var " = LAST_INSERT_ID(); " \
+  "END IF; END IF; "
+
+static const char proc_lexical[] =
+  PROC_ID("v_ip", "ips", "p_ip")
+  PROC_ID("v_hw", "hws", "p_hw");
+
+static const char proc_compact[] =
+  "SET v_ip = p_ip; SET v_hw = p_hw; ";
+
+static const char proc_body[] =
+  PROC_ID("v_cid", "cids", "p_cid")
+  PROC_ID("v_rid", "rids", "p_rid")
+  "SET v_lock = CONCAT('gluff.', DATABASE(), '.', v_ip); "
+  "IF COALESCE(GET_LOCK(v_lock, 10), 0) = 0 THEN "
+  "SIGNAL SQLSTATE '45000' SET MESSAGE_TEXT = 'Timed out waiting for the lock on the address'; "
+  "END IF; "
+  "SET v_id = NULL; "
+  "SELECT id, lstart, lend, hw, COALESCE(cid, 0), COALESCE(rid, 0) "
+  "INTO v_id, v_start, v_end, v_thathw, v_thatcid, v_thatrid "
+  "FROM leases WHERE ip=v_ip AND lstart<=p_start AND lend>=p_start ORDER BY lstart, lend, id LIMIT 1 FOR UPDATE; "
+  "IF v_id IS NOT NULL THEN "
+  "IF NOT (v_thathw <=> v_hw) OR v_thatcid <> v_cid OR v_thatrid <> v_rid THEN "
+  "UPDATE leases SET lend=p_start WHERE ip=v_ip AND lstart<=v_start AND lend>=v_end; "
+  "SET v_id = NULL; "
+  "ELSEIF p_rtype = 1 THEN "
+  "UPDATE leases SET lend=p_end WHERE ip=v_ip AND lstart<=v_start AND lend>=v_end; "
+  "ELSE "
+  "UPDATE leases SET lend=p_end WHERE ip=v_ip AND lstart<=v_start AND lend<=p_end AND lend>=v_end; "
+  "END IF; "
+  "END IF; "
+  "IF v_id IS NULL THEN "
+  "REPLACE INTO leases (ip,lstart,lend,hw,cid,rid) VALUES (v_ip,p_start,p_end,v_hw,v_cid,v_rid); "
+  "END IF; "
+  "DO RELEASE_LOCK(v_lock); "
+  "END";
+
+int schema_procedures(MYSQL *db, int schema) {
+  char q[8192];
+  size_t len;
+  int compact = (schema == RDB_SCHEMA_COMPACT);
+  const char *t = compact ? "INT UNSIGNED" : "TIMESTAMP";
+  const char *ip = compact ? "INT UNSIGNED" : "VARCHAR(63)";
+  const char *hw = compact ? "BINARY(6)" : "VARCHAR(63)";
+  const char *hwid = compact ? "BINARY(6)" : "INT";
+
+  len = snprintf(q, sizeof(q), proc_head, t, t, ip, hw, compact ? ip : "INT", hwid, t, t, hwid);
+  len += snprintf(q + len, sizeof(q) - len, "%s%s", compact ? proc_compact : proc_lexical, proc_body);
+  if (len >= sizeof(q)) {
+    syslog(LOG_ERR, "The stored procedure doesn't fit");
+    return -1;
+  }
+
+  /* Always made again, in case it has changed */
+  if (run_query(db, "DROP PROCEDURE IF EXISTS " RDB_PROCEDURE) != 0 || run_query(db, q) != 0) return -1;
+  syslog(LOG_INFO, "Created stored procedure " RDB_PROCEDURE);
+  return 0;
+}
+
+int schema_has_procedures(MYSQL *db) {
+  long long n;
+  if (query_number(db, "SELECT COUNT(*) FROM information_schema.routines WHERE routine_schema=DATABASE() "
+		   "and routine_name='" RDB_PROCEDURE "'", 0, &n) != 0) return -1;
+  return n > 0;
+}
+
+/* The start of the month 'offset' months from the one 't' is in, local time */
+static time_t month_start(time_t t, int offset) {
+  struct tm tm_tmp;
+  localtime_r(&t, &tm_tmp);
+  tm_tmp.tm_mday = 1;
+  tm_tmp.tm_hour = tm_tmp.tm_min = tm_tmp.tm_sec = 0;
+  tm_tmp.tm_mon += offset;
+  tm_tmp.tm_isdst = -1;
+  return mktime(&tm_tmp);
+}
+
+/* Append "PARTITION pYYYYMM VALUES LESS THAN (...), " for every month boundary after
+   'last', up to and including 'upto'. Returns the new length, or 0 if it doesn't fit. */
+static size_t add_months(char *q, size_t size, size_t len, time_t last, time_t upto) {
+  time_t m, next;
+  struct tm tm_tmp;
+
+  for (m = month_start(last, 0); (next = month_start(m, 1)) <= upto; m = next) {
+    if (next <= last) continue;
+    localtime_r(&m, &tm_tmp);
+    len += snprintf(q + len, size - len, "PARTITION p%04d%02d VALUES LESS THAN (%lld), ",
+		    tm_tmp.tm_year + 1900, tm_tmp.tm_mon + 1, (long long)next);
+    if (len >= size) return 0;
+  }
+  return len;
+}
+
+/* Partition a table that isn't, from the month of the oldest lease onwards */
+static int convert_table(MYSQL *db, int schema, char *q, time_t now) {
+  long long oldest;
+  time_t first;
+  size_t len;
+  int r;
+
+  snprintf(q, SCHEMA_MAXQUERY, "SELECT MIN(%s) FROM leases where %s > 0", start_expr(schema), start_expr(schema));
+  if (query_number(db, q, (long long)now, &oldest) != 0) return -1;
+  first = month_start((time_t)oldest, 0);
+  if ((r = has_index(db, "leases", "PRIMARY", "id,lstart")) < 0) return -1;
+
+  len = snprintf(q, SCHEMA_MAXQUERY, "ALTER TABLE leases%s PARTITION BY RANGE (%s) (PARTITION p0 VALUES LESS THAN (%lld), ",
+		 r ? "" : " DROP PRIMARY KEY, ADD PRIMARY KEY (id,lstart)", start_expr(schema), (long long)first);
+  if ((len = add_months(q, SCHEMA_MAXQUERY, len, first, month_start(now, SCHEMA_MONTHS_AHEAD + 1))) == 0 ||
+      len + 64 >= SCHEMA_MAXQUERY) {
+    syslog(LOG_ERR, "Too many partitions for the leases table");
+    return -1;
+  }
+  snprintf(q + len, SCHEMA_MAXQUERY - len, "PARTITION pmax VALUES LESS THAN MAXVALUE)");
+
+  syslog(LOG_INFO, "Partitioning the leases table by month. This may take a while");
+  if (run_query(db, q) != 0) return -1;
+  syslog(LOG_INFO, "The leases table is now partitioned by month");
+  return 0;
+}
+
+/* Does a partition still have a lease that runs until the cutoff or later? A lease that
+   is renewed without a break keeps its start, so an old partition can still have live
+   rows. Returns 1 if so, 0 if not, or -1 on error. */
+static int partition_live(MYSQL *db, int schema, char *q, const char *name, time_t cutoff) {
+  int compact = (schema == RDB_SCHEMA_COMPACT);
+  long long n;
+
+  snprintf(q, SCHEMA_MAXQUERY, "SELECT COUNT(*) FROM (SELECT 1 FROM leases PARTITION (%s) where lend>=%s%lld%s LIMIT 1) l",
+	   name, compact ? "" : "FROM_UNIXTIME(", (long long)cutoff, compact ? "" : ")");
+  if (query_number(db, q, 0, &n) != 0) return -1;
+  return n > 0;
+}
+
+int schema_partition(MYSQL *db, int schema, int keep, int convert) {
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  char *q, *name, *next, old[4096], drop[4096];
+  size_t len, oldlen=0, droplen=0;
+  time_t now = time(NULL);
+  time_t cutoff = month_start(now, -keep);
+  long long last=0, bound;
+  int parts=0, pmax=0, other=0, r=-1, live;
+
+  if ((q = (char *)malloc(SCHEMA_MAXQUERY)) == NULL) {
+    syslog(LOG_ERR, "Out of memory");
+    return -1;
+  }
+
+  if (run_query(db, "SELECT partition_name,partition_method,partition_description FROM information_schema.partitions "
+		"WHERE table_schema=DATABASE() and table_name='leases' and partition_name IS NOT NULL "
+		"order by partition_ordinal_position") != 0) goto done;
+  if ((res = mysql_store_result(db)) == NULL) {
+    syslog(LOG_ERR, "mysql_store_result(): %s", mysql_error(db));
+    goto done;
+  }
+  while ((row = mysql_fetch_row(res)) != NULL) {
+    parts++;
+    if (!row[0] || !row[1] || !row[2] || strcmp(row[1], "RANGE") != 0) {
+      other = 1;
+      continue;
+    }
+    if (strcmp(row[2], "MAXVALUE") == 0) {
+      pmax = 1;
+      continue;
+    }
+    bound = atoll(row[2]);
+    if (bound > last) last = bound;
+    if (keep > 0 && bound <= (long long)cutoff && oldlen + strlen(row[0]) + 2 < sizeof(old)) {
+      oldlen += snprintf(old + oldlen, sizeof(old) - oldlen, "%s%s", oldlen ? "," : "", row[0]);
+    }
+  }
+  mysql_free_result(res);
+
+  if (parts == 0) {
+    if (convert) r = convert_table(db, schema, q, now);
+    else {
+      syslog(LOG_WARNING, "The leases table is not partitioned. Run gluff with -B to partition it");
+      r = 0;
+    }
+    goto done;
+  }
+  if (other) {
+    syslog(LOG_WARNING, "The leases table is partitioned by something else than month. Leaving it alone");
+    r = 0;
+    goto done;
+  }
+
+  /* Keep SCHEMA_MONTHS_AHEAD months of partitions ahead of us */
+  if (last < (long long)month_start(now, SCHEMA_MONTHS_AHEAD + 1)) {
+    if (pmax) len = snprintf(q, SCHEMA_MAXQUERY, "ALTER TABLE leases REORGANIZE PARTITION pmax INTO (");
+    else len = snprintf(q, SCHEMA_MAXQUERY, "ALTER TABLE leases ADD PARTITION (");
+    if ((len = add_months(q, SCHEMA_MAXQUERY, len, (time_t)last, month_start(now, SCHEMA_MONTHS_AHEAD + 1))) == 0 ||
+	len + 64 >= SCHEMA_MAXQUERY) {
+      syslog(LOG_ERR, "Too many partitions for the leases table");
+      goto done;
+    }
+    if (pmax) snprintf(q + len, SCHEMA_MAXQUERY - len, "PARTITION pmax VALUES LESS THAN MAXVALUE)");
+    else snprintf(q + len - 2, SCHEMA_MAXQUERY - len + 2, ")");
+    if (run_query(db, q) != 0) goto done;
+    syslog(LOG_INFO, "Added partitions to the leases table");
+  }
+
+  /* Only the old partitions with nothing running any more go */
+  for (name = (oldlen > 0) ? old : NULL; name; name = next) {
+    if ((next = strchr(name, ',')) != NULL) *next++ = '\0';
+    if ((live = partition_live(db, schema, q, name, cutoff)) < 0) goto done;
+    if (live) syslog(LOG_INFO, "Keeping partition %s, which has leases that run past the cutoff", name);
+    else droplen += snprintf(drop + droplen, sizeof(drop) - droplen, "%s%s", droplen ? "," : "", name);
+  }
+  if (droplen > 0) {
+    snprintf(q, SCHEMA_MAXQUERY, "ALTER TABLE leases DROP PARTITION %s", drop);
+    if (run_query(db, q) != 0) goto done;
+    syslog(LOG_INFO, "Dropped partitions %s, whose leases all ended more than %d months ago", drop, keep);
+  }
+  r = 0;
+
+ done:
+  free(q);
+  return r;
+}
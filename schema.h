@@ -0,0 +1,51 @@
+/*
+ * schema - creating and checking the MySQL tables, their indexes and the monthly
+ *          partitions of the leases table.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#ifndef SCHEMA_H
+#define SCHEMA_H
+
+#include <mysql/mysql.h>
+
+/* How many months ahead of the current one the leases table has partitions for */
+#define SCHEMA_MONTHS_AHEAD 3
+
+/* Create the tables and indexes of the schema (RDB_SCHEMA_LEXICAL or RDB_SCHEMA_COMPACT)
+   that are missing. A unique index on a value column that already has duplicates is
+   created as an ordinary one. Returns 0 on success, -1 on error. */
+int schema_bootstrap(MYSQL *db, int schema);
+
+/* Create the stored procedure RDB_PROCEDURES needs, replacing any earlier version of it.
+   Returns 0 on success, -1 on error. */
+int schema_procedures(MYSQL *db, int schema);
+
+/* Returns 1 if the stored procedure is there, 0 if it isn't, or -1 on error */
+int schema_has_procedures(MYSQL *db);
+
+/* Log a warning for each index the lease queries need that isn't there. Returns the
+   number of missing indexes, or -1 on error. */
+int schema_check(MYSQL *db, int schema);
+
+/* Make sure the leases table has monthly partitions up to SCHEMA_MONTHS_AHEAD months
+   ahead, and drop the ones for lease starts more than 'keep' whole months back (none
+   if 'keep' is 0). An unpartitioned table is only partitioned if 'convert' is set,
+   since that means rewriting all of it. Returns 0 on success, -1 on error. */
+int schema_partition(MYSQL *db, int schema, int keep, int convert);
+
+#endif
@@ -0,0 +1,140 @@
+/*
+ * stream - the socket dhcpd can push lease events to as they happen, so that they
+ *          reach MySQL without going through the queue first.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "stream.h"
+
+struct stream_s {
+  int lfd;			/* the socket we listen on */
+  int cfd;			/* dhcpd's connection, or -1 */
+};
+
+stream stream_open(const char *path) {
+  struct sockaddr_un addr;
+  stream s;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    syslog(LOG_ERR, "Stream socket name %s is too long", path);
+    return NULL;
+  }
+  if ((s = (stream)calloc(1, sizeof(struct stream_s))) == NULL) {
+    syslog(LOG_ERR, "stream_open(): Out of memory");
+    return NULL;
+  }
+  s->cfd = -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if ((s->lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+      bind(s->lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(s->lfd, 4) != 0) {
+    syslog(LOG_ERR, "Failed to listen on stream socket %s: %m", path);
+    if (s->lfd >= 0) close(s->lfd);
+    free(s);
+    return NULL;
+  }
+  return s;
+}
+
+void stream_close(stream s) {
+  if (s) {
+    if (s->cfd >= 0) close(s->cfd);
+    close(s->lfd);
+    free(s);
+  }
+}
+
+int stream_fds(stream s, struct pollfd *pfd) {
+  pfd[0].fd = s->lfd;
+  pfd[0].events = POLLIN;
+  if (s->cfd < 0) return 1;
+  pfd[1].fd = s->cfd;
+  pfd[1].events = POLLIN;
+  return 2;
+}
+
+/* Read what is waiting on dhcpd's connection. Returns the number of records added,
+   or -1 if we are out of memory */
+static int drain(stream s, ldb_batch b, struct ldb_key *keys, int max) {
+  struct journal_record rec;
+  unsigned char buf[JOURNAL_STRINGS_SIZE];
+  const unsigned char *str[4];
+  ssize_t r=0;
+  int n=0;
+
+  while (b->nrecs < max && (r = recv(s->cfd, &rec, sizeof(rec), 0)) > 0) {
+    if (r != sizeof(rec) || !journal_valid(&rec)) {
+      syslog(LOG_WARNING, "Ignoring a damaged record from the stream");
+      continue;
+    }
+    journal_strings(&rec, buf, str);
+    keys[b->nrecs].start = rec.start;
+    keys[b->nrecs].idx = keys[b->nrecs].rowid = rec.seq;
+    if (ldb_batch_add(b, rec.start, rec.end, rec.rtype, str[0], str[1], str[2], str[3]) != 0) {
+      syslog(LOG_ERR, "stream_receive(): Out of memory");
+      return -1;
+    }
+    n++;
+  }
+  if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+    if (r < 0) syslog(LOG_WARNING, "Lost the stream from dhcpd: %m");
+    else syslog(LOG_INFO, "dhcpd has closed the stream");
+    close(s->cfd);
+    s->cfd = -1;
+  }
+  return n;
+}
+
+int stream_receive(stream s, ldb_batch b, struct ldb_key *keys, int max) {
+  int fd, r, n=0;
+
+  if (s->cfd >= 0 && (n = drain(s, b, keys, max)) < 0) return -1;
+
+  /* A new connection means dhcpd has been restarted. What is left on the old one is in
+     the queue as well, so it can go. */
+  while ((fd = accept(s->lfd, NULL, NULL)) >= 0) {
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (s->cfd >= 0) close(s->cfd);
+    syslog(LOG_INFO, "dhcpd has connected to the stream");
+    s->cfd = fd;
+  }
+
+  if (s->cfd >= 0 && b->nrecs < max) {
+    if ((r = drain(s, b, keys, max)) < 0) return -1;
+    n += r;
+  }
+  return n;
+}
@@ -0,0 +1,55 @@
+/*
+ * stream - the socket dhcpd can push lease events to as they happen, so that they
+ *          reach MySQL without going through the queue first.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <poll.h>
+
+#include "ldb.h"
+
+/* The stream is a SOCK_SEQPACKET Unix socket we listen on. dhcpd connects to it and
+   sends a copy of each event it has put in the queue or journal, as one journal record
+   (see journal.h). The record number is the event's own in the journal, or its idx in
+   the queue. Whatever dhcpd can't send, because we aren't there or our receive buffer
+   is full, is only in the queue. */
+
+/* Most records to take from the socket at a time. The rest wait in the socket, and when
+   that fills up, dhcpd stops sending until there is room again. */
+#define STREAM_BATCH_MAX 1000
+
+typedef struct stream_s *stream;
+
+/* Start listening on a socket, replacing anything that is in its place. Returns NULL on
+   failure */
+stream stream_open(const char *path);
+void stream_close(stream s);
+
+/* Fill in the descriptors to poll for the stream, at most 2. Returns the number used */
+int stream_fds(stream s, struct pollfd *pfd);
+
+/* Take in a new connection from dhcpd, if there is one, and add the records that are
+   waiting to the end of a batch, until it has 'max' records. The key of each record,
+   with the record number for both the idx and the rowid, goes in the same place in
+   'keys', which has room for 'max' of them. Returns the number of records added, or -1
+   if we are out of memory. */
+int stream_receive(stream s, ldb_batch b, struct ldb_key *keys, int max);
+
+#endif
@@ -0,0 +1,301 @@
+/*
+ * trace - a record of what was done with each lease record, kept in memory as
+ *         fixed-size binary records and written to a file for glufftrace to read.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+/*
+ * A writer takes the next sequence number with an atomic add, and so a slot in the
+ * ring, which it marks as being written (seq 0), fills in and then marks with its
+ * number. Whoever reads a slot checks the number before and after copying it, and
+ * leaves it if it changed, as with a seqlock. Nobody ever waits for anyone.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "trace.h"
+
+/* The file format depends on this */
+typedef char trace_record_is_64_bytes[(sizeof(struct trace_record) == 64) ? 1 : -1];
+
+static struct trace_record ring[TRACE_RECORDS];
+static uint64_t head=0;		/* the last sequence number taken */
+static int enabled=0;
+static int echo_records=0;
+static volatile sig_atomic_t dump_wanted=0;
+static unsigned long lost=0;
+
+/* Only the writer thread uses these */
+static const char *trace_path=NULL;
+static int dump_only=0;
+static FILE *trace_file=NULL;
+static size_t trace_bytes=0;
+static uint64_t next_seq=1;
+
+static int64_t now_us(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+void trace_add(struct trace_record *r) {
+  struct trace_record *slot;
+  uint64_t n;
+
+  if (!enabled) return;
+  r->when = now_us();
+  n = __atomic_add_fetch(&head, 1, __ATOMIC_RELAXED);
+  r->seq = n;
+  slot = &(ring[(n - 1) & (TRACE_RECORDS - 1)]);
+  __atomic_store_n(&(slot->seq), 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy((char *)slot + sizeof(slot->seq), (char *)r + sizeof(r->seq), sizeof(*r) - sizeof(r->seq));
+  __atomic_store_n(&(slot->seq), n, __ATOMIC_RELEASE);
+
+  if (echo_records) {
+    char line[TRACE_LINESIZE];
+    trace_format(r, line, sizeof(line));
+    syslog(LOG_DEBUG, "%s", line);
+  }
+}
+
+void trace_request_dump(void) {
+  dump_wanted = 1;
+}
+
+unsigned long trace_lost(void) {
+  return __atomic_load_n(&lost, __ATOMIC_RELAXED);
+}
+
+/* Copy record n from the ring. Returns 0, 1 if it is still being written, or -1 if it
+   has been overwritten. */
+static int get_record(uint64_t n, struct trace_record *r) {
+  struct trace_record *slot = &(ring[(n - 1) & (TRACE_RECORDS - 1)]);
+  uint64_t s = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+
+  if (s != n) return (s == 0 || s < n) ? 1 : -1;
+  memcpy(r, slot, sizeof(*r));
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&(slot->seq), __ATOMIC_RELAXED) != n) return -1;
+  return 0;
+}
+
+static FILE *open_file(const char *path) {
+  struct trace_header h;
+  FILE *f;
+
+  if ((f = fopen(path, "w")) == NULL) {
+    syslog(LOG_ERR, "Failed to open the trace file %s: %s", path, strerror(errno));
+    return NULL;
+  }
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+  h.recsize = sizeof(struct trace_record);
+  h.pid = getpid();
+  h.started = now_us();
+  if (fwrite(&h, sizeof(h), 1, f) != 1) {
+    syslog(LOG_ERR, "Failed to write to the trace file %s: %s", path, strerror(errno));
+    fclose(f);
+    return NULL;
+  }
+  return f;
+}
+
+static void count_lost(unsigned long n) {
+  __atomic_add_fetch(&lost, n, __ATOMIC_RELAXED);
+}
+
+/* Write the records added since last time to the file, and start a new one if it has
+   grown big enough */
+static void flush_records(void) {
+  struct trace_record r;
+  uint64_t h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+  char old[PATH_MAX];
+  int g;
+
+  if (h >= next_seq + TRACE_RECORDS) {
+    count_lost(h - TRACE_RECORDS + 1 - next_seq);
+    next_seq = h - TRACE_RECORDS + 1;
+  }
+  for (; next_seq <= h; next_seq++) {
+    if ((g = get_record(next_seq, &r)) > 0) break;
+    if (g < 0) {
+      count_lost(1);
+      continue;
+    }
+    if (trace_file && fwrite(&r, sizeof(r), 1, trace_file) == 1) trace_bytes += sizeof(r);
+  }
+  if (trace_file == NULL) return;
+  fflush(trace_file);
+
+  if (trace_bytes >= TRACE_ROTATE_BYTES) {
+    fclose(trace_file);
+    snprintf(old, sizeof(old), "%s.1", trace_path);
+    if (rename(trace_path, old) != 0) {
+      syslog(LOG_WARNING, "Failed to move %s to %s: %s", trace_path, old, strerror(errno));
+    }
+    trace_file = open_file(trace_path);
+    trace_bytes = 0;
+  }
+}
+
+/* Write the whole ring to the file, in place of what was there */
+static void dump_records(void) {
+  struct trace_record r;
+  uint64_t h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+  uint64_t n = (h > TRACE_RECORDS) ? h - TRACE_RECORDS + 1 : 1;
+  char tmp[PATH_MAX];
+  unsigned long written=0;
+  FILE *f;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", trace_path);
+  if ((f = open_file(tmp)) == NULL) return;
+  for (; n <= h; n++) {
+    if (get_record(n, &r) != 0) continue;
+    if (fwrite(&r, sizeof(r), 1, f) != 1) break;
+    written++;
+  }
+  if (fclose(f) != 0 || n <= h) {
+    syslog(LOG_ERR, "Failed to write the trace file %s: %s", tmp, strerror(errno));
+    unlink(tmp);
+    return;
+  }
+  if (rename(tmp, trace_path) != 0) {
+    syslog(LOG_ERR, "Failed to move %s to %s: %s", tmp, trace_path, strerror(errno));
+    unlink(tmp);
+    return;
+  }
+  syslog(LOG_INFO, "Wrote %lu trace records to %s", written, trace_path);
+}
+
+static void *trace_thread(void *arg) {
+  while(1) {
+    usleep(TRACE_FLUSH_MS * 1000);
+    if (dump_only) {
+      if (dump_wanted) {
+	dump_wanted = 0;
+	dump_records();
+      }
+    } else {
+      dump_wanted = 0;
+      flush_records();
+    }
+  }
+  return NULL;
+}
+
+int trace_start(const char *path, int on_signal, int echo) {
+  pthread_t thread;
+  int r;
+
+  echo_records = echo;
+  if (path) {
+    trace_path = path;
+    dump_only = on_signal;
+    if (!dump_only && (trace_file = open_file(path)) == NULL) return -1;
+    if ((r = pthread_create(&thread, NULL, trace_thread, NULL)) != 0) {
+      syslog(LOG_ERR, "pthread_create(): %s", strerror(r));
+      return -1;
+    }
+    pthread_detach(thread);
+  }
+  enabled = (path != NULL || echo);
+  return 0;
+}
+
+static const char *event_names[] = { "?", "apply", "multiple", "stale", "read", "calls" };
+static const char *decision_names[] = { "skipped", "prolonged", "released", "replaced", "new" };
+
+/* Write the address, and the MAC address if 'hw', the way the record has them */
+static size_t format_ids(const struct trace_record *r, int hw, char *buf, size_t size) {
+  uint32_t a = (uint32_t)r->ip;
+  uint64_t m = (uint64_t)r->hw;
+  size_t len;
+
+  if (!(r->flags & TRACE_COMPACT)) {
+    if (!hw) return snprintf(buf, size, "ip #%d", (int)r->ip);
+    return snprintf(buf, size, "ip #%d hw #%lld", (int)r->ip, (long long)r->hw);
+  }
+  len = snprintf(buf, size, "ip %u.%u.%u.%u", (a >> 24) & 0xff, (a >> 16) & 0xff, (a >> 8) & 0xff, a & 0xff);
+  if (!hw || len >= size) return len;
+  if (m == 0) return len + snprintf(buf + len, size - len, " hw NULL");
+  return len + snprintf(buf + len, size - len, " hw %02x:%02x:%02x:%02x:%02x:%02x",
+			(unsigned int)(m >> 40) & 0xff, (unsigned int)(m >> 32) & 0xff,
+			(unsigned int)(m >> 24) & 0xff, (unsigned int)(m >> 16) & 0xff,
+			(unsigned int)(m >> 8) & 0xff, (unsigned int)m & 0xff);
+}
+
+static size_t format_time(time_t t, char *buf, size_t size) {
+  struct tm tm;
+  localtime_r(&t, &tm);
+  return strftime(buf, size, "%Y-%m-%d %H:%M:%S", &tm);
+}
+
+size_t trace_format(const struct trace_record *r, char *buf, size_t size) {
+  char t1[32], t2[32], t3[32];
+  time_t when = (time_t)(r->when / 1000000);
+  const char *event = (r->event < sizeof(event_names) / sizeof(event_names[0])) ? event_names[r->event] : "?";
+  size_t len;
+
+  format_time(when, t1, sizeof(t1));
+  len = snprintf(buf, size, "%s.%06d #%llu %s", t1, (int)(r->when % 1000000), (unsigned long long)r->seq, event);
+  if (len >= size) return size - 1;
+
+  switch (r->event) {
+  case TRACE_APPLY:
+    format_time((time_t)r->start, t2, sizeof(t2));
+    format_time((time_t)r->end, t3, sizeof(t3));
+    len += snprintf(buf + len, size - len, " %s%s ", (r->flags & TRACE_RELEASE) ? "release" : "ack",
+		    (r->flags & TRACE_RETRIED) ? " (looked up again)" : "");
+    if (len >= size) return size - 1;
+    len += format_ids(r, 1, buf + len, size - len);
+    if (len >= size) return size - 1;
+    len += snprintf(buf + len, size - len, " cid #%d rid #%d [%s..%s] %s find %uus update %uus make %uus total %uus",
+		    (int)r->u.ids.cid, (int)r->u.ids.rid, t2, t3,
+		    (r->decision < sizeof(decision_names) / sizeof(decision_names[0])) ? decision_names[r->decision] : "?",
+		    r->usec[TRACE_FIND], r->usec[TRACE_UPDATE], r->usec[TRACE_MAKE], r->usec[TRACE_TOTAL]);
+    break;
+  case TRACE_MULTIPLE:
+  case TRACE_STALE:
+    format_time((time_t)r->start, t2, sizeof(t2));
+    len += snprintf(buf + len, size - len, " ");
+    if (len >= size) return size - 1;
+    len += format_ids(r, 0, buf + len, size - len);
+    if (len >= size) return size - 1;
+    len += snprintf(buf + len, size - len, " at %s", t2);
+    break;
+  case TRACE_READ:
+    len += snprintf(buf + len, size - len, " %d records, %d folded, in %uus",
+		    (int)r->u.batch.count, (int)r->u.batch.folded, r->usec[TRACE_TOTAL]);
+    break;
+  case TRACE_CALLS:
+    len += snprintf(buf + len, size - len, " %d records in %uus", (int)r->u.batch.count, r->usec[TRACE_TOTAL]);
+    break;
+  }
+  return (len >= size) ? size - 1 : len;
+}
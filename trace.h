@@ -0,0 +1,125 @@
+/*
+ * trace - a record of what was done with each lease record, kept in memory as
+ *         fixed-size binary records and written to a file for glufftrace to read.
+
+Copyright (c) 2008-2019, Hans Liss <Hans@Liss.pp.se>.
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Records are added from any thread, without locks, to a ring of this many (a power of
+   two). A record that is overwritten before it is written out is lost, and the gap
+   shows in the sequence numbers. */
+#define TRACE_RECORDS 65536
+
+/* With a trace file, how often new records are written to it, in milliseconds */
+#define TRACE_FLUSH_MS 1000
+
+/* The size a trace file is allowed to grow to before it is moved to <file>.1 and a new
+   one is started */
+#define TRACE_ROTATE_BYTES (64 * 1024 * 1024)
+
+/* A trace file starts with a header, and then has the records as they are in memory */
+#define TRACE_MAGIC "GLUFFTR1"
+
+struct trace_header {
+  char magic[8];		/* TRACE_MAGIC, without a terminator */
+  uint32_t recsize;		/* sizeof(struct trace_record) */
+  uint32_t pid;			/* the gluff that wrote it */
+  int64_t started;		/* when the file was started, in microseconds since the epoch */
+};
+
+/* Events */
+#define TRACE_APPLY 1		/* a record was applied; 'decision' says how */
+#define TRACE_MULTIPLE 2	/* more than one lease row covered the start of a record */
+#define TRACE_STALE 3		/* a remembered lease had been changed by someone else */
+#define TRACE_READ 4		/* a batch was read: 'count' records, 'folded' of them folded */
+#define TRACE_CALLS 5		/* 'count' records were applied with the stored procedure */
+
+/* What TRACE_APPLY did */
+#define TRACE_SKIPPED 0		/* nothing, the record had no address */
+#define TRACE_PROLONGED 1	/* the lease found was prolonged */
+#define TRACE_RELEASED 2	/* the lease found was cut off at the end of a release */
+#define TRACE_REPLACED 3	/* the lease found was for someone else, and a new one was made */
+#define TRACE_NEW 4		/* there was no lease, and a new one was made */
+
+/* Flags */
+#define TRACE_RELEASE 1		/* the record was a release rather than an ACK */
+#define TRACE_COMPACT 2		/* 'ip' and 'hw' are the values themselves, as in the compact schema */
+#define TRACE_RETRIED 4		/* the lease had to be looked up again */
+
+/* Stage timings, in microseconds */
+#define TRACE_FIND 0
+#define TRACE_UPDATE 1
+#define TRACE_MAKE 2
+#define TRACE_TOTAL 3
+#define TRACE_TIMINGS 4
+
+/* 64 bytes, the same on every platform gluff builds on */
+struct trace_record {
+  uint64_t seq;			/* numbered from 1, in the order they were added */
+  int64_t when;			/* microseconds since the epoch */
+  uint8_t event;
+  uint8_t decision;
+  uint8_t flags;
+  uint8_t spare;
+  int32_t ip;			/* the ip id, or with TRACE_COMPACT, the IPv4 address */
+  int64_t hw;			/* the hw id, or with TRACE_COMPACT, the MAC address */
+  union {
+    struct {
+      int32_t cid;
+      int32_t rid;
+    } ids;
+    struct {
+      int32_t count;
+      int32_t folded;
+    } batch;
+  } u;
+  uint32_t start;		/* the lease, as epoch seconds */
+  uint32_t end;
+  uint32_t usec[TRACE_TIMINGS];
+};
+
+/* Start tracing. Records are written to 'path', if it is not NULL: as they come, with
+   the file moved aside when it is big enough, or with 'on_signal', only when
+   trace_request_dump() has been called, when the whole ring replaces what was in the
+   file. With 'echo', each record is also logged at LOG_DEBUG. Returns 0, or -1 if the
+   file can't be opened or the thread started. */
+int trace_start(const char *path, int on_signal, int echo);
+
+/* Add a record. 'seq' and 'when' are filled in. Does nothing unless trace_start() has
+   been called. */
+void trace_add(struct trace_record *r);
+
+/* Ask for the ring to be written out. Safe to call from a signal handler. */
+void trace_request_dump(void);
+
+/* The number of records lost because they were overwritten before they were written out */
+unsigned long trace_lost(void);
+
+/* Write a record as a line of text, without a newline, the way glufftrace and -D show
+   it. Returns the length of the line. */
+size_t trace_format(const struct trace_record *r, char *buf, size_t size);
+
+/* Longest line trace_format() writes, with its terminator */
+#define TRACE_LINESIZE 256
+
+#endif